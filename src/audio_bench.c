@@ -0,0 +1,417 @@
+// Mixer benchmark on the null audio platform, so it runs without a sound device.
+//
+//   gcc src/audio_bench.c -o audio_bench -std=c99 -O2 -lm
+//   audio_bench [-voices N] [-seconds S] [-simd scalar|sse2|avx2|neon] [-effects] [-out file.wav] [-golden file.wav] [-check]
+//
+// Plays N looping voices spread over float, 16 bit and ADPCM sources, at the device rate and
+// resampled, and reports the mixing speed and the cost per voice. The sources are synthesized with
+// integer math and every SIMD level mixes bit-identical output, so a render written with -out
+// can be compared against later with -golden on any machine. -check compares each SIMD level's
+// kernels against the scalar ones directly and exits.
+
+#define CUTE_SOUND_PLATFORM_NULL
+#define CUTE_SOUND_IMPLEMENTATION
+#include "cute_sound.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_HZ 44100
+#define BENCH_TICK 1024
+
+static const char *format_names[] = { "float", "int16", "adpcm", "mixed" };
+
+static void put16(uint8_t *p, int v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+static void put32(uint8_t *p, int v) { put16(p, v); put16(p + 2, v >> 16); }
+
+static void write_wav_header(uint8_t *p, int frames, int channels, int rate) {
+    int bytes = frames * channels * 2;
+    memcpy(p, "RIFF", 4); put32(p + 4, 36 + bytes); memcpy(p + 8, "WAVE", 4);
+    memcpy(p + 12, "fmt ", 4); put32(p + 16, 16); put16(p + 20, 1); put16(p + 22, channels);
+    put32(p + 24, rate); put32(p + 28, rate * channels * 2); put16(p + 32, channels * 2); put16(p + 34, 16);
+    memcpy(p + 36, "data", 4); put32(p + 40, bytes);
+}
+
+// A saw, a triangle and some noise under a decaying envelope, the same on every machine.
+static uint8_t *synth_wav(int frames, int channels, int rate, int seed, int *size) {
+    *size = 44 + frames * channels * 2;
+    uint8_t *wav = malloc(*size);
+    write_wav_header(wav, frames, channels, rate);
+    uint32_t noise = 0x9E3779B9u * (uint32_t)(seed + 1);
+    for (int i = 0; i < frames; i++) {
+        for (int c = 0; c < channels; c++) {
+            noise = noise * 1664525u + 1013904223u;
+            int saw = ((i * (37 + seed * 11 + c * 5)) & 1023) - 512;
+            int phase = (i * (13 + seed * 3)) & 2047;
+            int tri = (phase < 1024 ? phase : 2047 - phase) - 512;
+            int envelope = 256 - (i * 256 / frames);
+            int v = (saw * 12 + tri * 16 + (int)(noise >> 24) - 128) * envelope / 256;
+            put16(wav + 44 + (i * channels + c) * 2, v);
+        }
+    }
+    return wav;
+}
+
+static bool write_wav(const char *path, const int16_t *samples, int frames) {
+    FILE *file = fopen(path, "wb");
+    if (!file) { return false; }
+    uint8_t header[44];
+    write_wav_header(header, frames, 2, BENCH_HZ);
+    fwrite(header, 1, 44, file);
+    for (int i = 0; i < frames * 2; i++) {
+        uint8_t v[2];
+        put16(v, samples[i]);
+        fwrite(v, 1, 2, file);
+    }
+    fclose(file);
+    return true;
+}
+
+// Compares against a WAV written by -out, sample for sample.
+static bool compare_golden(const char *path, const int16_t *samples, int frames) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("golden: can't open %s\n", path);
+        return false;
+    }
+    uint8_t header[44];
+    bool ok = fread(header, 1, 44, file) == 44;
+    int bytes = header[40] | header[41] << 8 | header[42] << 16 | header[43] << 24;
+    if (!ok || bytes != frames * 4) {
+        printf("golden: %s has %d samples, rendered %d\n", path, ok ? bytes / 4 : 0, frames);
+        fclose(file);
+        return false;
+    }
+    int mismatches = 0, first = -1, max_diff = 0;
+    for (int i = 0; i < frames * 2; i++) {
+        uint8_t v[2];
+        if (fread(v, 1, 2, file) != 2) { break; }
+        int diff = abs((int16_t)(v[0] | v[1] << 8) - samples[i]);
+        if (!diff) { continue; }
+        if (first < 0) { first = i / 2; }
+        if (diff > max_diff) { max_diff = diff; }
+        mismatches++;
+    }
+    fclose(file);
+    if (mismatches) {
+        printf("golden: MISMATCH, %d values differ, first at sample %d, largest difference %d\n", mismatches, first, max_diff);
+        return false;
+    }
+    printf("golden: match\n");
+    return true;
+}
+
+typedef struct {
+    int voices;
+    int frames;
+    int simd;
+    bool effects;
+} Bench;
+
+// Renders one pass with `format` for every voice, or 3 for a mix of all formats, from a fresh
+// context so no effect state carries over. Returns CPU seconds, or -1 if the SIMD level isn't there.
+static double run(Bench *bench, int format, int16_t *out) {
+    if (cs_init(NULL, BENCH_HZ, BENCH_TICK, NULL) != CUTE_SOUND_ERROR_NONE) { return -1; }
+    if (bench->simd >= 0 && !cs_set_simd((cs_simd_t) bench->simd)) {
+        cs_shutdown();
+        return -1;
+    }
+    bench->simd = (int) cs_get_simd();
+
+    cs_audio_source_t *sources[3][2];
+    for (int f = 0; f < 3; f++) {
+        cs_set_sample_format((cs_sample_format_t) f);
+        int size;
+        // Mono at the device rate mixes straight from the decoded samples, stereo at half rate is resampled.
+        uint8_t *wav = synth_wav(BENCH_HZ / 2 + 7, 1, BENCH_HZ, 0, &size);
+        sources[f][0] = cs_read_mem_wav(wav, size, NULL);
+        free(wav);
+        wav = synth_wav(BENCH_HZ / 3 + 5, 2, BENCH_HZ / 2, 1, &size);
+        sources[f][1] = cs_read_mem_wav(wav, size, NULL);
+        free(wav);
+    }
+    cs_set_sample_format(CUTE_SOUND_SAMPLE_FORMAT_FLOAT);
+
+    cs_set_max_voices(bench->voices);
+    if (bench->effects) {
+        cs_bus_set_filter(CUTE_SOUND_BUS_SFX, CUTE_SOUND_FILTER_LOWPASS, 4000, 0.707f);
+        cs_bus_set_compressor(CUTE_SOUND_BUS_SFX, -18, 4, 5, 100);
+        cs_bus_set_reverb(CUTE_SOUND_BUS_UI, 0.7f, 0.3f);
+        cs_set_limiter(true, -0.3f);
+    }
+
+    cs_sound_params_t params = cs_sound_params_default();
+    params.looped = true;
+    for (int i = 0; i < bench->voices; i++) {
+        cs_audio_source_t *audio = sources[format < 3 ? format : i % 3][(i / 3) & 1];
+        cs_audio_set_bus(audio, i % 4 == 3 ? CUTE_SOUND_BUS_UI : CUTE_SOUND_BUS_SFX);
+        params.volume = 2.0f / (float) bench->voices;
+        params.pan = (float) (i % 9) / 8.0f;
+        params.pitch = i % 4 == 1 ? 0.75f + (float) (i % 5) * 0.125f : 1.0f;
+        params.delay = (float) (i % 16) * 0.01f;
+        cs_play_sound(audio, params);
+    }
+
+    clock_t start = clock();
+    for (int frame = 0; frame < bench->frames; frame += BENCH_TICK) {
+        int count = bench->frames - frame < BENCH_TICK ? bench->frames - frame : BENCH_TICK;
+        cs_update((float) count / BENCH_HZ);
+        cs_render(out + frame * 2, count);
+    }
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    int real = cs_get_real_voice_count();
+    cs_shutdown();
+    for (int f = 0; f < 3; f++) {
+        cs_free_audio_source(sources[f][0]);
+        cs_free_audio_source(sources[f][1]);
+    }
+    if (real != bench->voices) {
+        printf("warning: only %d of %d voices were mixed\n", real, bench->voices);
+    }
+    return seconds;
+}
+
+// -check runs every kernel of each SIMD level the CPU has on the same input as the scalar
+// kernels, at every length around the vector width and at unaligned offsets, and reports each
+// output that isn't bit-identical.
+
+#define CHECK_SIZE 8192
+
+typedef struct {
+    cs_mix_fn *mix;
+    cs_pack_fn *pack;
+    cs_resample_fn *linear;
+    cs_resample_fn *sinc;
+    cs_biquad_fn *biquad;
+    cs_comb_fn *comb;
+    cs_allpass_fn *allpass;
+    cs_dynamics_fn *dynamics;
+    cs_convert_fn *convert;
+    cs_adpcm_fn *adpcm;
+} Kernels;
+
+static const char *check_level;
+static int check_failures;
+
+static void get_kernels(Kernels *k) {
+    k->mix = s_mix_kernel;
+    k->pack = s_pack_kernel;
+    k->linear = s_linear_kernel;
+    k->sinc = s_sinc_kernel;
+    k->biquad = s_biquad_kernel;
+    k->comb = s_comb_kernel;
+    k->allpass = s_allpass_kernel;
+    k->dynamics = s_dynamics_kernel;
+    k->convert = s_convert_kernel;
+    k->adpcm = s_adpcm_kernel;
+}
+
+static void expect_same(const char *kernel, const void *got, const void *want, size_t bytes, int count, int offset) {
+    if (!memcmp(got, want, bytes)) { return; }
+    if (++check_failures <= 20) {
+        printf("%s: %s differs from scalar, count %d, offset %d\n", check_level, kernel, count, offset);
+    }
+}
+
+static float check_random(uint32_t *seed, float range) {
+    *seed = *seed * 1664525u + 1013904223u;
+    return ((float) (*seed >> 8) / 8388608.0f - 1.0f) * range;
+}
+
+static void check_kernels(const Kernels *k, const Kernels *ref) {
+    static float in_a[CHECK_SIZE], in_b[CHECK_SIZE], got[2][CHECK_SIZE], want[2][CHECK_SIZE];
+    static int16_t pcm[CHECK_SIZE], got16[CHECK_SIZE * 2], want16[CHECK_SIZE * 2];
+    static uint8_t blocks[128 * CUTE_SOUND_ADPCM_BLOCK_BYTES];
+    static const int counts4[] = { 0, 4, 8, 12, 16, 20, 24, 28, 32, 36, 60, 64, 68, 1024 };
+    uint32_t seed = 1;
+    for (int i = 0; i < CHECK_SIZE; i++) {
+        // Past full scale now and then, so pack saturates and the dynamics react.
+        float range = i % 61 < 3 ? 50000.0f : 20000.0f;
+        in_a[i] = check_random(&seed, range);
+        in_b[i] = check_random(&seed, range);
+        // A saw with quiet and loud noise, so the ADPCM step index moves both ways.
+        int noise = (int) check_random(&seed, i % 700 < 90 ? 12000.0f : 200.0f);
+        pcm[i] = (int16_t) (((i * 37) & 1023) * 16 - 8192 + noise);
+    }
+
+    for (int c = 0; c < (int) (sizeof(counts4) / sizeof(counts4[0])); c++) {
+        int n = counts4[c];
+        for (int off = 0; off < 4; off++) {
+            float va = 0.6f, vb = -0.35f;
+            memcpy(got[0], in_b, sizeof(in_b)); memcpy(got[1], in_a, sizeof(in_a));
+            memcpy(want[0], in_b, sizeof(in_b)); memcpy(want[1], in_a, sizeof(in_a));
+            k->mix(got[0] + off, got[1] + off, in_a + off + 1, in_b + off + 2, va, vb, n);
+            ref->mix(want[0] + off, want[1] + off, in_a + off + 1, in_b + off + 2, va, vb, n);
+            expect_same("mix", got, want, sizeof(got), n, off);
+
+            memset(got16, 0, sizeof(got16)); memset(want16, 0, sizeof(want16));
+            k->pack(got16 + off, in_a + off, in_b + off, n);
+            ref->pack(want16 + off, in_a + off, in_b + off, n);
+            expect_same("pack", got16, want16, sizeof(got16), n, off);
+            // out aliasing a, the way the mixer calls it
+            memcpy(got[0], in_a, sizeof(in_a));
+            k->pack((int16_t *) (got[0] + off), got[0] + off, in_b + off, n);
+            expect_same("pack in place", got[0] + off, want16 + off, n * 4, n, off);
+
+            for (int f = 0; f < 2; f++) {
+                float columns[32], got_state[4] = { 10, -20, 30, -40 }, want_state[4] = { 10, -20, 30, -40 };
+                cs_biquad_columns(columns, f ? CUTE_SOUND_FILTER_HIGHPASS : CUTE_SOUND_FILTER_LOWPASS, 3000.0f + 5000.0f * f, 0.707f);
+                memcpy(got[0], in_a, sizeof(in_a)); memcpy(want[0], in_a, sizeof(in_a));
+                k->biquad(got[0] + off, n, columns, got_state);
+                ref->biquad(want[0] + off, n, columns, want_state);
+                expect_same("biquad", got[0], want[0], sizeof(got[0]), n, off);
+                expect_same("biquad state", got_state, want_state, sizeof(got_state), n, off);
+            }
+
+            memcpy(got[0], in_b, sizeof(in_b)); memcpy(got[1], in_a, sizeof(in_a));
+            memcpy(want[0], in_b, sizeof(in_b)); memcpy(want[1], in_a, sizeof(in_a));
+            k->comb(got[0] + off, in_a + off + 3, got[1] + off, n, 0.7f);
+            ref->comb(want[0] + off, in_a + off + 3, want[1] + off, n, 0.7f);
+            expect_same("comb", got, want, sizeof(got), n, off);
+
+            memcpy(got[0], in_a, sizeof(in_a)); memcpy(got[1], in_b, sizeof(in_b));
+            memcpy(want[0], in_a, sizeof(in_a)); memcpy(want[1], in_b, sizeof(in_b));
+            k->allpass(got[0] + off, got[1] + off, n, -0.5f);
+            ref->allpass(want[0] + off, want[1] + off, n, -0.5f);
+            expect_same("allpass", got, want, sizeof(got), n, off);
+
+            for (int limit = 0; limit < 2; limit++) {
+                cs_dynamics_t got_d = { 0 }, want_d;
+                cs_dynamics_set(&got_d, limit ? -3.0f : -18.0f, 4.0f, 1.0f, 20.0f);
+                got_d.limit = limit;
+                got_d.gain = 1.0f;
+                want_d = got_d;
+                memcpy(got[0], in_a, sizeof(in_a)); memcpy(got[1], in_b, sizeof(in_b));
+                memcpy(want[0], in_a, sizeof(in_a)); memcpy(want[1], in_b, sizeof(in_b));
+                k->dynamics(got[0] + off, got[1] + off, n, &got_d);
+                ref->dynamics(want[0] + off, want[1] + off, n, &want_d);
+                expect_same(limit ? "limiter" : "compressor", got, want, sizeof(got), n, off);
+                float got_env[2] = { got_d.env, got_d.gain }, want_env[2] = { want_d.env, want_d.gain };
+                expect_same(limit ? "limiter state" : "compressor state", got_env, want_env, sizeof(got_env), n, off);
+            }
+        }
+    }
+
+    // The rest take any count, so every tail length is covered.
+    for (int n = 0; n <= 1024; n += n < 70 ? 1 : 954) {
+        for (int off = 0; off < 4; off++) {
+            memset(got[0], 0, sizeof(got[0])); memset(want[0], 0, sizeof(want[0]));
+            k->convert(got[0] + off, pcm + off, n);
+            ref->convert(want[0] + off, pcm + off, n);
+            expect_same("convert", got[0], want[0], sizeof(got[0]), n, off);
+
+            // Steps below 1, at 1 and above, up to past the last sinc band, at phases that
+            // use the bits the fraction drops.
+            static const double steps[] = { 0.3, 0.75, 1.0, 1.0001, 1.5, 2.0, 2.7, 3.9 };
+            static const uint32_t phases[] = { 0, 0x80000000u, 0x12345678u, 0xffffff80u };
+            for (int s = 0; s < (int) (sizeof(steps) / sizeof(steps[0])); s++) {
+                uint64_t step = (uint64_t) (steps[s] * (double) CUTE_SOUND_UNIT_STEP);
+                uint64_t pos = phases[(s + off) & 3];
+                const float *in = in_a + CUTE_SOUND_SINC_TAPS / 2 - 1 + off;
+                memcpy(got[0], in_b, sizeof(in_b)); memcpy(want[0], in_b, sizeof(in_b));
+                k->linear(got[0] + off, in, pos, step, 0.37f, n);
+                ref->linear(want[0] + off, in, pos, step, 0.37f, n);
+                expect_same("linear", got[0], want[0], sizeof(got[0]), n, s);
+                memcpy(got[0], in_b, sizeof(in_b)); memcpy(want[0], in_b, sizeof(in_b));
+                k->sinc(got[0] + off, in, pos, step, 0.37f, n);
+                ref->sinc(want[0] + off, in, pos, step, 0.37f, n);
+                expect_same("sinc", got[0], want[0], sizeof(got[0]), n, s);
+            }
+        }
+    }
+
+    int block_count = 100;
+    cs_adpcm_encode(blocks, pcm, 1, block_count * CUTE_SOUND_ADPCM_BLOCK_SAMPLES);
+    for (int n = 0; n <= 100; n += n < 18 ? 1 : 41) {
+        for (int first = 0; first < 4 && first + n <= block_count; first++) {
+            memset(got[0], 0, sizeof(got[0])); memset(want[0], 0, sizeof(want[0]));
+            k->adpcm(got[0], blocks + first * CUTE_SOUND_ADPCM_BLOCK_BYTES, n);
+            ref->adpcm(want[0], blocks + first * CUTE_SOUND_ADPCM_BLOCK_BYTES, n);
+            expect_same("adpcm", got[0], want[0], sizeof(got[0]), n, first);
+        }
+    }
+}
+
+static int check(void) {
+    static const char *simd_names[] = { "scalar", "sse2", "avx2", "neon" };
+    // The context supplies the rate the filter and dynamics settings are worked out for.
+    if (cs_init(NULL, BENCH_HZ, BENCH_TICK, NULL) != CUTE_SOUND_ERROR_NONE) { return 1; }
+    Kernels ref, k;
+    cs_set_simd(CUTE_SOUND_SIMD_SCALAR);
+    get_kernels(&ref);
+    for (int simd = CUTE_SOUND_SIMD_SSE2; simd <= CUTE_SOUND_SIMD_NEON; simd++) {
+        check_level = simd_names[simd];
+        if (!cs_set_simd((cs_simd_t) simd)) {
+            printf("%s: not supported here\n", check_level);
+            continue;
+        }
+        get_kernels(&k);
+        int before = check_failures;
+        check_kernels(&k, &ref);
+        if (check_failures == before) { printf("%s: every kernel matches scalar\n", check_level); }
+    }
+    cs_shutdown();
+    if (check_failures) {
+        printf("check: %d MISMATCHES\n", check_failures);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static const char *simd_names[] = { "scalar", "sse2", "avx2", "neon" };
+    Bench bench = { 64, BENCH_HZ * 10, -1, false };
+    const char *simd = NULL, *out_path = NULL, *golden_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        bool more = i + 1 < argc;
+        if (!strcmp(argv[i], "-voices") && more) { bench.voices = atoi(argv[++i]); }
+        else if (!strcmp(argv[i], "-seconds") && more) { bench.frames = (int) (atof(argv[++i]) * BENCH_HZ); }
+        else if (!strcmp(argv[i], "-simd") && more) { simd = argv[++i]; }
+        else if (!strcmp(argv[i], "-effects")) { bench.effects = true; }
+        else if (!strcmp(argv[i], "-out") && more) { out_path = argv[++i]; }
+        else if (!strcmp(argv[i], "-golden") && more) { golden_path = argv[++i]; }
+        else if (!strcmp(argv[i], "-check")) { return check(); }
+        else {
+            printf("usage: %s [-voices N] [-seconds S] [-simd scalar|sse2|avx2|neon] [-effects] [-out file.wav] [-golden file.wav] [-check]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (bench.voices < 1 || bench.frames < 1) { return 2; }
+    if (simd) {
+        for (int i = 0; i < 4; i++) {
+            if (!strcmp(simd, simd_names[i])) { bench.simd = i; }
+        }
+        if (bench.simd < 0) { return 2; }
+    }
+
+    int16_t *out = malloc(sizeof(int16_t) * 2 * bench.frames);
+    for (int format = 0; format < 4; format++) {
+        double seconds = run(&bench, format, out);
+        if (seconds < 0) {
+            printf("%s is not supported here\n", simd);
+            free(out);
+            return 1;
+        }
+        if (!format) {
+            printf("%d voices, %.1f seconds at %d Hz, %s%s\n", bench.voices, (double) bench.frames / BENCH_HZ, BENCH_HZ, simd_names[bench.simd], bench.effects ? ", bus effects" : "");
+            printf("%-6s %10s %12s %16s %14s\n", "format", "cpu s", "x realtime", "voice samples/s", "ns per sample");
+        }
+        if (seconds == 0) { seconds = 1e-9; }
+        double voice_samples = (double) bench.frames * bench.voices;
+        printf("%-6s %10.3f %12.1f %16.3e %14.2f\n", format_names[format], seconds, (double) bench.frames / BENCH_HZ / seconds, voice_samples / seconds, seconds * 1e9 / voice_samples);
+    }
+
+    // The mixed pass is left in `out`, it covers every path.
+    int status = 0;
+    if (out_path && !write_wav(out_path, out, bench.frames)) {
+        printf("can't write %s\n", out_path);
+        status = 1;
+    }
+    if (golden_path && !compare_golden(golden_path, out, bench.frames)) { status = 1; }
+
+    free(out);
+    return status;
+}
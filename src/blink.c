@@ -25,7 +25,7 @@ int main() {
 
     Image *cat = engine_load_image_file("assets/cat.png");
     Sound *jump = engine_load_sound_file("assets/jump.wav");
-    Sound *song = engine_load_sound_file("assets/song.ogg");
+    Sound *song = engine_load_music_file("assets/song.ogg");
 
     char *source = engine_read_file("assets/hello.wren", NULL);
 
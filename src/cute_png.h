@@ -151,6 +151,11 @@ typedef struct cp_saved_png_t
 // Call CUTE_PNG_FREE on .data when done.
 cp_saved_png_t cp_save_png_to_memory(const cp_image_t* img);
 
+// Same as above with a compression level from 0 (store) to 9 (smallest).
+// The plain versions use level 6.
+cp_saved_png_t cp_save_png_to_memory_level(const cp_image_t* img, int level);
+int cp_save_png_level(const char* file_name, const cp_image_t* img, int level);
+
 // Constructs an atlas image in-memory. The atlas pixels are stored in the returned image. free the pixels
 // when done with them. The user must provide an array of cp_atlas_image_t for the `imgs` param. `imgs` holds
 // information about uv coordinates for an associated image in the `pngs` array. Output image has NULL
@@ -172,6 +177,14 @@ void cp_flip_image_horizontal(cp_image_t* img);
 // Reads the w/h of the png without doing any other decompression or parsing.
 void cp_load_png_wh(const void* png_data, int png_length, int* w, int* h);
 
+// Decodes a png straight into caller owned memory, without an intermediate image.
+// `pix` must hold at least cp_png_decode_size(w, h) bytes; the decoded pixels are
+// packed at the start of it and the remainder is scratch space. Pass a non-zero
+// `bgra` to receive B, G, R, A byte order instead of cp_pixel_t's R, G, B, A.
+// Returns 1 for success, 0 for failures.
+int cp_png_decode_size(int w, int h);
+int cp_load_png_mem_to(const void* png_data, int png_length, void* pix, int pix_bytes, int bgra);
+
 // loads indexed (paletted) pngs, but does not depalette the image into RGBA pixels
 // these two functions return cp_indexed_image_t::pix as 0 in event of errors
 // call free on cp_indexed_image_t::pix when done, or call cp_free_indexed_png
@@ -187,6 +200,10 @@ cp_image_t cp_depallete_indexed_image(cp_indexed_image_t* img);
 // Resource: http://www.essentialmath.com/GDC2015/VanVerth_Jim_DoingMathwRGB.pdf
 void cp_premultiply(cp_image_t* img);
 
+// The SSE2 paths are used whenever the compiler targets SSE2. Passing 0 switches to the
+// plain C paths at run time, which the SSE2 ones match byte for byte. Meant for testing.
+void cp_set_simd(int enabled);
+
 struct cp_pixel_t
 {
 	uint8_t r;
@@ -227,6 +244,11 @@ struct cp_atlas_image_t
 #ifndef CUTE_PNG_IMPLEMENTATION_ONCE
 #define CUTE_PNG_IMPLEMENTATION_ONCE
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define CUTE_PNG_SSE2
+#endif
+
 #if !defined(CUTE_PNG_ALLOCA)
 	#define CUTE_PNG_ALLOCA alloca
 
@@ -339,20 +361,22 @@ static cp_pixel_t cp_make_pixel_a(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
 	return p;
 }
 
-static cp_pixel_t cp_make_pixel(uint8_t r, uint8_t g, uint8_t b)
+const char* cp_error_reason;
+static int cp_simd = 1;
+
+void cp_set_simd(int enabled)
 {
-	cp_pixel_t p;
-	p.r = r; p.g = g; p.b = b; p.a = 0xFF;
-	return p;
+	cp_simd = enabled;
 }
 
-const char* cp_error_reason;
 #define CUTE_PNG_FAIL() do { goto cp_err; } while (0)
 #define CUTE_PNG_CHECK(X, Y) do { if (!(X)) { cp_error_reason = Y; CUTE_PNG_FAIL(); } } while (0)
 #define CUTE_PNG_CALL(X) do { if (!(X)) goto cp_err; } while (0)
-#define CUTE_PNG_LOOKUP_BITS 9
-#define CUTE_PNG_LOOKUP_COUNT (1 << CUTE_PNG_LOOKUP_BITS)
-#define CUTE_PNG_LOOKUP_MASK (CUTE_PNG_LOOKUP_COUNT - 1)
+#define CUTE_PNG_LIT_BITS 10
+#define CUTE_PNG_DST_BITS 8
+#define CUTE_PNG_LEN_BITS 7
+#define CUTE_PNG_LIT_TABLE_SIZE 2048
+#define CUTE_PNG_DST_TABLE_SIZE 1024
 #define CUTE_PNG_DEFLATE_MAX_BITLEN 15
 
 // DEFLATE tables from RFC 1951
@@ -369,73 +393,67 @@ uint32_t cp_len_base[29 + 2] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,
 uint8_t cp_dist_extra_bits[30 + 2] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13,  0,0 }; // 3.2.5
 uint32_t cp_dist_base[30 + 2] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 0,0 }; // 3.2.5
 
+// Decode table entries. The low byte holds the number of bits to consume,
+// bits 12-15 the count of extra bits following the code, and the top half
+// the literal, length/distance base, code length symbol, or subtable offset.
+// Codes longer than the root bits of a table resolve through one subtable.
+#define CUTE_PNG_ENTRY_LITERAL 0x100
+#define CUTE_PNG_ENTRY_END     0x200
+#define CUTE_PNG_ENTRY_SUB     0x400
+#define CUTE_PNG_ENTRY_INVALID 0x800
+
 typedef struct cp_state_t
 {
+	const uint8_t* in;
+	const uint8_t* in_end;
 	uint64_t bits;
 	int count;
-	uint32_t* words;
-	int word_count;
-	int word_index;
-	int bits_left;
-
-	int final_word_available;
-	uint32_t final_word;
+	int pad;
+	int overrun;
 
 	char* out;
 	char* out_end;
 	char* begin;
 
-	uint16_t lookup[CUTE_PNG_LOOKUP_COUNT];
-	uint32_t lit[288];
-	uint32_t dst[32];
-	uint32_t len[19];
-	uint32_t nlit;
-	uint32_t ndst;
-	uint32_t nlen;
+	uint32_t lit[CUTE_PNG_LIT_TABLE_SIZE];
+	uint32_t dst[CUTE_PNG_DST_TABLE_SIZE];
+	uint32_t len[1 << CUTE_PNG_LEN_BITS];
 } cp_state_t;
 
-static int cp_would_overflow(cp_state_t* s, int num_bits)
+// Near the end of the input, top up one byte at a time and feed zeros once
+// the input runs out. `pad` tracks how many of the buffered bits are such
+// zeros; consuming any of them means the stream was truncated.
+static void cp_refill_slow(cp_state_t* s)
 {
-	return (s->bits_left + s->count) - num_bits < 0;
-}
-
-static char* cp_ptr(cp_state_t* s)
-{
-	CUTE_PNG_ASSERT(!(s->bits_left & 7));
-	return (char*)(s->words + s->word_index) - (s->count / 8);
+	if (s->count < s->pad) s->overrun = 1;
+	while (s->count < 56)
+	{
+		if (s->in < s->in_end) s->bits |= (uint64_t)*s->in++ << s->count;
+		else s->pad += 8;
+		s->count += 8;
+	}
 }
 
-static uint64_t cp_peak_bits(cp_state_t* s, int num_bits_to_read)
+// Keeps at least 56 bits buffered, which covers a full length/distance pair.
+static void cp_refill(cp_state_t* s)
 {
-	if (s->count < num_bits_to_read)
+	if (s->in + 8 <= s->in_end)
 	{
-		if (s->word_index < s->word_count)
-		{
-			uint32_t word = s->words[s->word_index++];
-			s->bits |= (uint64_t)word << s->count;
-			s->count += 32;
-			CUTE_PNG_ASSERT(s->word_index <= s->word_count);
-		}
-
-		else if (s->final_word_available)
-		{
-			uint32_t word = s->final_word;
-			s->bits |= (uint64_t)word << s->count;
-			s->count += s->bits_left;
-			s->final_word_available = 0;
-		}
+		uint64_t word;
+		CUTE_PNG_MEMCPY(&word, s->in, 8);
+		s->bits |= word << s->count;
+		s->in += (63 - s->count) >> 3;
+		s->count |= 56;
 	}
-
-	return s->bits;
+	else cp_refill_slow(s);
 }
 
 static uint32_t cp_consume_bits(cp_state_t* s, int num_bits_to_read)
 {
 	CUTE_PNG_ASSERT(s->count >= num_bits_to_read);
-	uint32_t bits = s->bits & (((uint64_t)1 << num_bits_to_read) - 1);
+	uint32_t bits = (uint32_t)(s->bits & (((uint64_t)1 << num_bits_to_read) - 1));
 	s->bits >>= num_bits_to_read;
 	s->count -= num_bits_to_read;
-	s->bits_left -= num_bits_to_read;
 	return bits;
 }
 
@@ -443,12 +461,8 @@ static uint32_t cp_read_bits(cp_state_t* s, int num_bits_to_read)
 {
 	CUTE_PNG_ASSERT(num_bits_to_read <= 32);
 	CUTE_PNG_ASSERT(num_bits_to_read >= 0);
-	CUTE_PNG_ASSERT(s->bits_left > 0);
-	CUTE_PNG_ASSERT(s->count <= 64);
-	CUTE_PNG_ASSERT(!cp_would_overflow(s, num_bits_to_read));
-	cp_peak_bits(s, num_bits_to_read);
-	uint32_t bits = cp_consume_bits(s, num_bits_to_read);
-	return bits;
+	cp_refill(s);
+	return cp_consume_bits(s, num_bits_to_read);
 }
 
 static char* cp_read_file_to_memory(const char* path, int* size)
@@ -481,54 +495,121 @@ static uint32_t cp_rev16(uint32_t a)
 	return a;
 }
 
+enum
+{
+	CUTE_PNG_CODES_LIT,
+	CUTE_PNG_CODES_DST,
+	CUTE_PNG_CODES_LEN,
+};
+
+static uint32_t cp_entry(int kind, int sym)
+{
+	switch (kind)
+	{
+	case CUTE_PNG_CODES_LIT:
+		if (sym < 256) return CUTE_PNG_ENTRY_LITERAL | (sym << 16);
+		if (sym == 256) return CUTE_PNG_ENTRY_END;
+		if (sym > 285) return CUTE_PNG_ENTRY_INVALID;
+		return (cp_len_base[sym - 257] << 16) | (cp_len_extra_bits[sym - 257] << 12);
+
+	case CUTE_PNG_CODES_DST:
+		if (sym > 29) return CUTE_PNG_ENTRY_INVALID;
+		return (cp_dist_base[sym] << 16) | (cp_dist_extra_bits[sym] << 12);
+
+	default:
+		return sym << 16;
+	}
+}
+
 // RFC 1951 section 3.2.2
-static int cp_build(cp_state_t* s, uint32_t* tree, uint8_t* lens, int sym_count)
+// Fills `table` with a (1 << root) entry lookup indexed by the next input
+// bits, followed by subtables for longer codes. Incomplete codes are
+// allowed; their unused entries are marked invalid.
+static int cp_build(uint32_t* table, int root, int capacity, const uint8_t* lens, int sym_count, int kind)
 {
-	int n, codes[16], first[16], counts[16] = { 0 };
+	int n, codes[16], next[16], counts[16] = { 0 };
+	uint8_t max_len[1 << CUTE_PNG_LIT_BITS] = { 0 };
+	int size = 1 << root;
 
 	// Frequency count
 	for (n = 0; n < sym_count; n++) counts[lens[n]]++;
+	counts[0] = 0;
+
+	// Reject oversubscribed codes
+	int left = 1;
+	for (n = 1; n <= CUTE_PNG_DEFLATE_MAX_BITLEN; n++)
+	{
+		left = (left << 1) - counts[n];
+		if (left < 0) return 0;
+	}
 
 	// Distribute codes
-	counts[0] = codes[0] = first[0] = 0;
-	for (n = 1; n <= 15; ++n)
+	next[0] = next[1] = 0;
+	for (n = 1; n < CUTE_PNG_DEFLATE_MAX_BITLEN; n++) next[n + 1] = (next[n] + counts[n]) << 1;
+
+	for (n = 0; n < size; n++) table[n] = CUTE_PNG_ENTRY_INVALID;
+
+	// Size one subtable per root prefix shared by long codes
+	CUTE_PNG_MEMCPY(codes, next, sizeof(codes));
+	for (n = 0; n < sym_count; n++)
 	{
-		codes[n] = (codes[n - 1] + counts[n - 1]) << 1;
-		first[n] = first[n - 1] + counts[n - 1];
+		int len = lens[n];
+		if (len <= root) continue;
+		int prefix = (cp_rev16(codes[len]++) >> (16 - len)) & (size - 1);
+		if (max_len[prefix] < len) max_len[prefix] = (uint8_t)len;
 	}
 
-	if (s) CUTE_PNG_MEMSET(s->lookup, 0, sizeof(s->lookup));
-	for (int i = 0; i < sym_count; ++i)
+	int offset = size;
+	for (n = 0; n < size; n++)
 	{
-		int len = lens[i];
+		if (!max_len[n]) continue;
+		int sub = max_len[n] - root;
+		if (offset + (1 << sub) > capacity) return 0;
+		table[n] = (offset << 16) | (sub << 12) | CUTE_PNG_ENTRY_SUB | root;
+		for (int i = 0; i < (1 << sub); i++) table[offset + i] = CUTE_PNG_ENTRY_INVALID;
+		offset += 1 << sub;
+	}
+
+	CUTE_PNG_MEMCPY(codes, next, sizeof(codes));
+	for (n = 0; n < sym_count; n++)
+	{
+		int len = lens[n];
+		if (!len) continue;
+		uint32_t rev = cp_rev16(codes[len]++) >> (16 - len);
+		uint32_t entry = cp_entry(kind, n);
 
-		if (len != 0)
+		if (len <= root)
 		{
-			CUTE_PNG_ASSERT(len < 16);
-			uint32_t code = codes[len]++;
-			uint32_t slot = first[len]++;
-			tree[slot] = (code << (32 - len)) | (i << 4) | len;
+			for (uint32_t j = rev; j < (uint32_t)size; j += 1 << len) table[j] = entry | len;
+		}
 
-			if (s && len <= CUTE_PNG_LOOKUP_BITS)
-			{
-				int j = cp_rev16(code) >> (16 - len);
-				while (j < (1 << CUTE_PNG_LOOKUP_BITS))
-				{
-					s->lookup[j] = (uint16_t)((len << CUTE_PNG_LOOKUP_BITS) | i);
-					j += (1 << len);
-				}
-			}
+		else
+		{
+			uint32_t sub = table[rev & (size - 1)];
+			uint32_t* t = table + (sub >> 16);
+			int sub_size = 1 << ((sub >> 12) & 0xF);
+			for (int j = rev >> root; j < sub_size; j += 1 << (len - root)) t[j] = entry | (len - root);
 		}
 	}
 
-	int max_index = first[15];
-	return max_index;
+	return 1;
 }
 
-static int cp_stored(cp_state_t* s)
+static uint32_t cp_decode(cp_state_t* s, const uint32_t* table, int root)
 {
-	char* p;
+	cp_refill(s);
+	uint32_t entry = table[s->bits & ((1 << root) - 1)];
+	if (entry & CUTE_PNG_ENTRY_SUB)
+	{
+		cp_consume_bits(s, root);
+		entry = table[(entry >> 16) + (s->bits & ((1 << ((entry >> 12) & 0xF)) - 1))];
+	}
+	cp_consume_bits(s, entry & 0xFF);
+	return entry;
+}
 
+static int cp_stored(cp_state_t* s)
+{
 	// 3.2.3
 	// skip any remaining bits in current partially processed byte
 	cp_read_bits(s, s->count & 7);
@@ -538,10 +619,19 @@ static int cp_stored(cp_state_t* s)
 	uint16_t LEN = (uint16_t)cp_read_bits(s, 16);
 	uint16_t NLEN = (uint16_t)cp_read_bits(s, 16);
 	CUTE_PNG_CHECK(LEN == (uint16_t)(~NLEN), "Failed to find LEN and NLEN as complements within stored (uncompressed) stream.");
-	CUTE_PNG_CHECK(s->bits_left / 8 <= (int)LEN, "Stored block extends beyond end of input stream.");
-	p = cp_ptr(s);
-	CUTE_PNG_MEMCPY(s->out, p, LEN);
+	CUTE_PNG_CHECK(s->count >= s->pad, "Stored block extends beyond end of input stream.");
+
+	// hand the whole bytes still sitting in the bit buffer back to the input
+	s->in -= (s->count - s->pad) / 8;
+	s->bits = 0;
+	s->count = 0;
+	s->pad = 0;
+
+	CUTE_PNG_CHECK(LEN <= s->in_end - s->in, "Stored block extends beyond end of input stream.");
+	CUTE_PNG_CHECK(LEN <= s->out_end - s->out, "Attempted to overwrite out buffer while outputting a stored block.");
+	CUTE_PNG_MEMCPY(s->out, s->in, LEN);
 	s->out += LEN;
+	s->in += LEN;
 	return 1;
 
 cp_err:
@@ -551,32 +641,11 @@ cp_err:
 // 3.2.6
 static int cp_fixed(cp_state_t* s)
 {
-	s->nlit = cp_build(s, s->lit, cp_fixed_table, 288);
-	s->ndst = cp_build(0, s->dst, cp_fixed_table + 288, 32);
+	cp_build(s->lit, CUTE_PNG_LIT_BITS, CUTE_PNG_LIT_TABLE_SIZE, cp_fixed_table, 288, CUTE_PNG_CODES_LIT);
+	cp_build(s->dst, CUTE_PNG_DST_BITS, CUTE_PNG_DST_TABLE_SIZE, cp_fixed_table + 288, 32, CUTE_PNG_CODES_DST);
 	return 1;
 }
 
-static int cp_decode(cp_state_t* s, uint32_t* tree, int hi)
-{
-	uint64_t bits = cp_peak_bits(s, 16);
-	uint32_t search = (cp_rev16((uint32_t)bits) << 16) | 0xFFFF;
-	int lo = 0;
-	while (lo < hi)
-	{
-		int guess = (lo + hi) >> 1;
-		if (search < tree[guess]) hi = guess;
-		else lo = guess + 1;
-	}
-
-	uint32_t key = tree[lo - 1];
-	uint32_t len = (32 - (key & 0xF));
-	CUTE_PNG_ASSERT((search >> len) == (key >> len));
-
-	int code = cp_consume_bits(s, key & 0xF);
-	(void)code;
-	return (key >> 4) & 0xFFF;
-}
-
 // 3.2.7
 static int cp_dynamic(cp_state_t* s)
 {
@@ -585,69 +654,161 @@ static int cp_dynamic(cp_state_t* s)
 	int nlit = 257 + cp_read_bits(s, 5);
 	int ndst = 1 + cp_read_bits(s, 5);
 	int nlen = 4 + cp_read_bits(s, 4);
+	CUTE_PNG_CHECK(nlit <= 286 && ndst <= 30, "Too many length or distance codes in dynamic block header.");
 
 	for (int i = 0 ; i < nlen; ++i)
 		lenlens[cp_permutation_order[i]] = (uint8_t)cp_read_bits(s, 3);
 
 	// Build the tree for decoding code lengths
-	s->nlen = cp_build(0, s->len, lenlens, 19);
+	CUTE_PNG_CHECK(cp_build(s->len, CUTE_PNG_LEN_BITS, 1 << CUTE_PNG_LEN_BITS, lenlens, 19, CUTE_PNG_CODES_LEN), "Invalid code length code lengths.");
 	uint8_t lens[288 + 32];
 
 	for (int n = 0; n < nlit + ndst;)
 	{
-		int sym = cp_decode(s, s->len, s->nlen);
+		uint32_t entry = cp_decode(s, s->len, CUTE_PNG_LEN_BITS);
+		CUTE_PNG_CHECK(!(entry & CUTE_PNG_ENTRY_INVALID), "Invalid code length code.");
+		int sym = entry >> 16;
+		int rep = 0;
+		uint8_t val = 0;
+
 		switch (sym)
 		{
-		case 16: for (int i =  3 + cp_read_bits(s, 2); i; --i, ++n) lens[n] = lens[n - 1]; break;
-		case 17: for (int i =  3 + cp_read_bits(s, 3); i; --i, ++n) lens[n] = 0; break;
-		case 18: for (int i = 11 + cp_read_bits(s, 7); i; --i, ++n) lens[n] = 0; break;
-		default: lens[n++] = (uint8_t)sym; break;
+		case 16: CUTE_PNG_CHECK(n > 0, "Repeated code length without a previous length."); val = lens[n - 1]; rep = 3 + cp_read_bits(s, 2); break;
+		case 17: rep = 3 + cp_read_bits(s, 3); break;
+		case 18: rep = 11 + cp_read_bits(s, 7); break;
+		default: lens[n++] = (uint8_t)sym; continue;
 		}
+
+		CUTE_PNG_CHECK(n + rep <= nlit + ndst, "Repeated code lengths overrun the code length table.");
+		CUTE_PNG_MEMSET(lens + n, val, rep);
+		n += rep;
 	}
 
-	s->nlit = cp_build(s, s->lit, lens, nlit);
-	s->ndst = cp_build(0, s->dst, lens + nlit, ndst);
+	CUTE_PNG_CHECK(lens[256], "Dynamic block is missing an end-of-block code.");
+	CUTE_PNG_CHECK(cp_build(s->lit, CUTE_PNG_LIT_BITS, CUTE_PNG_LIT_TABLE_SIZE, lens, nlit, CUTE_PNG_CODES_LIT), "Invalid literal/length code lengths.");
+	CUTE_PNG_CHECK(cp_build(s->dst, CUTE_PNG_DST_BITS, CUTE_PNG_DST_TABLE_SIZE, lens + nlit, ndst, CUTE_PNG_CODES_DST), "Invalid distance code lengths.");
 	return 1;
+
+cp_err:
+	return 0;
 }
 
 // 3.2.3
+// The hot loop keeps the bit buffer and output cursor in locals, since every
+// store through `out` could otherwise alias the state.
 static int cp_block(cp_state_t* s)
 {
+	const uint8_t* in = s->in;
+	const uint8_t* in_end = s->in_end;
+	uint64_t bits = s->bits;
+	int count = s->count;
+	char* out = s->out;
+	char* out_end = s->out_end;
+	char* begin = s->begin;
+	const uint32_t* lit = s->lit;
+	const uint32_t* dst = s->dst;
+	uint32_t entry;
+
+#define CUTE_PNG_CONSUME(N) do { bits >>= (N); count -= (N); } while (0)
+#define CUTE_PNG_LOOKUP(T, ROOT) \
+	do { \
+		entry = T[bits & ((1 << (ROOT)) - 1)]; \
+		if (entry & CUTE_PNG_ENTRY_SUB) \
+		{ \
+			CUTE_PNG_CONSUME(ROOT); \
+			entry = T[(entry >> 16) + (bits & ((1 << ((entry >> 12) & 0xF)) - 1))]; \
+		} \
+		CUTE_PNG_CONSUME(entry & 0xFF); \
+	} while (0)
+
 	while (1)
 	{
-		int symbol = cp_decode(s, s->lit, s->nlit);
+		if (in + 8 <= in_end)
+		{
+			uint64_t word;
+			CUTE_PNG_MEMCPY(&word, in, 8);
+			bits |= word << count;
+			in += (63 - count) >> 3;
+			count |= 56;
+		}
 
-		if (symbol < 256)
+		else
 		{
-			CUTE_PNG_CHECK(s->out + 1 <= s->out_end, "Attempted to overwrite out buffer while outputting a symbol.");
-			*s->out = (char)symbol;
-			s->out += 1;
+			s->in = in; s->bits = bits; s->count = count;
+			cp_refill_slow(s);
+			in = s->in; bits = s->bits; count = s->count;
+			CUTE_PNG_CHECK(!s->overrun, "Read past the end of the input stream.");
 		}
 
-		else if (symbol > 256)
+		// 56 buffered bits cover a 15 bit length code with 5 extra bits
+		// plus a 15 bit distance code with 13 extra bits
+		CUTE_PNG_LOOKUP(lit, CUTE_PNG_LIT_BITS);
+
+		if (entry & CUTE_PNG_ENTRY_LITERAL)
+		{
+			CUTE_PNG_CHECK(out < out_end, "Attempted to overwrite out buffer while outputting a symbol.");
+			*out++ = (char)(entry >> 16);
+			continue;
+		}
+
+		if (entry & (CUTE_PNG_ENTRY_END | CUTE_PNG_ENTRY_INVALID))
+		{
+			CUTE_PNG_CHECK(!(entry & CUTE_PNG_ENTRY_INVALID), "Invalid literal/length code.");
+			break;
+		}
+
+		int extra = (entry >> 12) & 0xF;
+		int length = (entry >> 16) + (int)(bits & ((1 << extra) - 1));
+		CUTE_PNG_CONSUME(extra);
+
+		CUTE_PNG_LOOKUP(dst, CUTE_PNG_DST_BITS);
+		CUTE_PNG_CHECK(!(entry & CUTE_PNG_ENTRY_INVALID), "Invalid distance code.");
+		extra = (entry >> 12) & 0xF;
+		int distance = (entry >> 16) + (int)(bits & ((1 << extra) - 1));
+		CUTE_PNG_CONSUME(extra);
+
+		CUTE_PNG_CHECK(distance <= out - begin, "Attempted to write before out buffer (invalid backwards distance).");
+		CUTE_PNG_CHECK(length <= out_end - out, "Attempted to overwrite out buffer while outputting a string.");
+		char* to = out;
+		char* end = out + length;
+
+		if (distance == 1) // very common in images
+		{
+			CUTE_PNG_MEMSET(to, to[-1], length);
+		}
+
+		else if (end + 8 <= out_end)
 		{
-			symbol -= 257;
-			int length = cp_read_bits(s, cp_len_extra_bits[symbol]) + cp_len_base[symbol];
-			int distance_symbol = cp_decode(s, s->dst, s->ndst);
-			int backwards_distance = cp_read_bits(s, cp_dist_extra_bits[distance_symbol]) + cp_dist_base[distance_symbol];
-			CUTE_PNG_CHECK(s->out - backwards_distance >= s->begin, "Attempted to write before out buffer (invalid backwards distance).");
-			CUTE_PNG_CHECK(s->out + length <= s->out_end, "Attempted to overwrite out buffer while outputting a string.");
-			char* src = s->out - backwards_distance;
-			char* dst = s->out;
-			s->out += length;
-
-			switch (backwards_distance)
+			// Copy 8 bytes at a time, possibly running a few bytes past `end`.
+			// Short overlapping distances repeat with a period of `distance`,
+			// so widen them to a multiple of it that is at least 8 bytes.
+			if (distance < 8)
+			{
+				int wide = distance * ((8 + distance - 1) / distance);
+				char* seed = out + (wide - distance);
+				while (to < seed && to < end) { *to = to[-distance]; ++to; }
+				distance = wide;
+			}
+
+			while (to < end)
 			{
-			case 1: // very common in images
-				CUTE_PNG_MEMSET(dst, *src, length);
-				break;
-			default: while (length--) *dst++ = *src++;
+				uint64_t word;
+				CUTE_PNG_MEMCPY(&word, to - distance, 8);
+				CUTE_PNG_MEMCPY(to, &word, 8);
+				to += 8;
 			}
 		}
 
-		else break;
+		else while (to < end) { *to = to[-distance]; ++to; }
+
+		out = end;
 	}
 
+#undef CUTE_PNG_LOOKUP
+#undef CUTE_PNG_CONSUME
+
+	s->in = in; s->bits = bits; s->count = count;
+	s->out = out;
 	return 1;
 
 cp_err:
@@ -658,32 +819,14 @@ cp_err:
 int cp_inflate(void* in, int in_bytes, void* out, int out_bytes)
 {
 	cp_state_t* s = (cp_state_t*)CUTE_PNG_CALLOC(1, sizeof(cp_state_t));
-	s->bits = 0;
-	s->count = 0;
-	s->word_index = 0;
-	s->bits_left = in_bytes * 8;
-
-	// s->words is the in-pointer rounded up to a multiple of 4
-	int first_bytes = (int) ((( (size_t) in + 3) & ~3) - (size_t) in);
-	s->words = (uint32_t*)((char*)in + first_bytes);
-	s->word_count = (in_bytes - first_bytes) / 4;
-	int last_bytes = ((in_bytes - first_bytes) & 3);
-
-	for (int i = 0; i < first_bytes; ++i)
-		s->bits |= (uint64_t)(((uint8_t*)in)[i]) << (i * 8);
-
-	s->final_word_available = last_bytes ? 1 : 0;
-	s->final_word = 0;
-	for(int i = 0; i < last_bytes; i++) 
-		s->final_word |= ((uint8_t*)in)[in_bytes - last_bytes+i] << (i * 8);
-
-	s->count = first_bytes * 8;
+	CUTE_PNG_CHECK(s, "Unable to allocate inflate state.");
+	s->in = (const uint8_t*)in;
+	s->in_end = s->in + in_bytes;
 
 	s->out = (char*)out;
 	s->out_end = s->out + out_bytes;
 	s->begin = (char*)out;
 
-	int count = 0;
 	int bfinal;
 	do
 	{
@@ -694,11 +837,11 @@ int cp_inflate(void* in, int in_bytes, void* out, int out_bytes)
 		{
 		case 0: CUTE_PNG_CALL(cp_stored(s)); break;
 		case 1: cp_fixed(s); CUTE_PNG_CALL(cp_block(s)); break;
-		case 2: cp_dynamic(s); CUTE_PNG_CALL(cp_block(s)); break;
+		case 2: CUTE_PNG_CALL(cp_dynamic(s)); CUTE_PNG_CALL(cp_block(s)); break;
 		case 3: CUTE_PNG_CHECK(0, "Detected unknown block type within input stream.");
 		}
 
-		++count;
+		CUTE_PNG_CHECK(!s->overrun && s->count >= s->pad, "Read past the end of the input stream.");
 	}
 	while (!bfinal);
 
@@ -719,217 +862,864 @@ static uint8_t cp_paeth(uint8_t a, uint8_t b, uint8_t c)
 	return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
 }
 
-typedef struct cp_save_png_data_t
+// PNG encoder. Rows are filtered with whichever of the five filters gives the
+// smallest sum of absolute differences, then compressed with a hash chain
+// LZ77 into fixed, dynamic or stored blocks, whichever comes out smallest.
+// Levels 1-3 take the first acceptable match, 4-9 evaluate one step ahead;
+// higher levels search longer chains. Level 0 stores.
+#define CUTE_PNG_DEFAULT_LEVEL 6
+#define CUTE_PNG_WINDOW_SIZE   (1 << 15)
+#define CUTE_PNG_WINDOW_MASK   (CUTE_PNG_WINDOW_SIZE - 1)
+#define CUTE_PNG_HASH_BITS     15
+#define CUTE_PNG_MIN_MATCH     3
+#define CUTE_PNG_MAX_MATCH     258
+#define CUTE_PNG_BLOCK_TOKENS  (1 << 14)
+
+static const uint16_t cp_max_chain[10] = { 0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096 };
+static const uint16_t cp_nice_length[10] = { 0, 16, 32, 64, 32, 64, 128, 258, 258, 258 };
+
+typedef struct cp_writer_t
+{
+	uint8_t* data;
+	int size;
+	int cap;
+	uint64_t bits;
+	int count;
+	int oom;
+} cp_writer_t;
+
+static int cp_reserve(cp_writer_t* w, int64_t n)
 {
-	uint32_t crc;
-	uint32_t adler;
-	uint32_t bits;
-	uint32_t prev;
-	uint32_t runlen;
-	int buflen;
-	int bufcap;
-	char* buffer;
-} cp_save_png_data_t;
+	if (w->oom) return 0;
+	if (w->size + n > w->cap)
+	{
+		int64_t cap = (int64_t)w->cap * 2;
+		if (cap < w->size + n) cap = w->size + n;
+		if (cap > INT_MAX) { w->oom = 1; return 0; }
+		uint8_t* data = (uint8_t*)CUTE_PNG_REALLOC(w->data, (size_t)cap);
+		if (!data) { w->oom = 1; return 0; }
+		w->data = data;
+		w->cap = (int)cap;
+	}
+	return 1;
+}
 
-uint32_t CP_CRC_TABLE[] = {
-	0, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
-	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
-};
+// The caller reserves room up front so the bit writer never checks capacity.
+static void cp_put_bits(cp_writer_t* w, uint32_t v, int n)
+{
+	w->bits |= (uint64_t)v << w->count;
+	w->count += n;
+	if (w->count >= 32)
+	{
+		uint8_t* p = w->data + w->size;
+		p[0] = (uint8_t)w->bits;
+		p[1] = (uint8_t)(w->bits >> 8);
+		p[2] = (uint8_t)(w->bits >> 16);
+		p[3] = (uint8_t)(w->bits >> 24);
+		w->size += 4;
+		w->bits >>= 32;
+		w->count -= 32;
+	}
+}
 
-static void cp_put8(cp_save_png_data_t* s, uint32_t a)
+static void cp_align_bits(cp_writer_t* w)
 {
-	if (s->buflen >= s->bufcap)
+	while (w->count > 0)
 	{
-		s->bufcap *= 2;
-		s->buffer = (char*)CUTE_PNG_REALLOC(s->buffer, s->bufcap);
+		w->data[w->size++] = (uint8_t)w->bits;
+		w->bits >>= 8;
+		w->count -= 8;
 	}
-	s->buffer[s->buflen++] = a;
-	s->crc = (s->crc >> 4) ^ CP_CRC_TABLE[(s->crc & 15) ^ (a & 15)];
-	s->crc = (s->crc >> 4) ^ CP_CRC_TABLE[(s->crc & 15) ^ (a >> 4)];
+	w->bits = 0;
+	w->count = 0;
 }
 
-static void cp_update_adler(cp_save_png_data_t* s, uint32_t v)
+static void cp_put32(cp_writer_t* w, uint32_t v)
 {
-	uint32_t s1 = s->adler & 0xFFFF;
-	uint32_t s2 = (s->adler >> 16) & 0xFFFF;
-	s1 = (s1 + v) % 65521;
-	s2 = (s2 + s1) % 65521;
-	s->adler = (s2 << 16) + s1;
+	if (!cp_reserve(w, 4)) return;
+	uint8_t* p = w->data + w->size;
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+	w->size += 4;
 }
 
-static void cp_put32(cp_save_png_data_t* s, uint32_t v)
+static void cp_put_bytes(cp_writer_t* w, const void* data, int n)
 {
-	cp_put8(s, (v >> 24) & 0xFF);
-	cp_put8(s, (v >> 16) & 0xFF);
-	cp_put8(s, (v >> 8) & 0xFF);
-	cp_put8(s, v & 0xFF);
+	if (!cp_reserve(w, n)) return;
+	CUTE_PNG_MEMCPY(w->data + w->size, data, n);
+	w->size += n;
 }
 
-static void cp_put_bits(cp_save_png_data_t* s, uint32_t data, uint32_t bitcount)
+static void cp_crc32_init(uint32_t table[8][256])
 {
-	while (bitcount--)
+	for (uint32_t n = 0; n < 256; ++n)
 	{
-		uint32_t prev = s->bits;
-		s->bits = (s->bits >> 1) | ((data & 1) << 7);
-		data >>= 1;
+		uint32_t c = n;
+		for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0xEDB88320 & (0 - (c & 1)));
+		table[0][n] = c;
+	}
+	for (int n = 0; n < 256; ++n)
+		for (int k = 1; k < 8; ++k)
+			table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xFF];
+}
+
+// Slicing-by-8: eight table lookups per 8 input bytes instead of a serial
+// dependency per byte.
+static uint32_t cp_crc32(const uint32_t table[8][256], uint32_t crc, const uint8_t* p, size_t n)
+{
+	crc = ~crc;
+	for (; n >= 8; p += 8, n -= 8)
+	{
+		uint32_t a = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+		uint32_t b = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+		crc = table[7][a & 0xFF] ^ table[6][(a >> 8) & 0xFF] ^ table[5][(a >> 16) & 0xFF] ^ table[4][a >> 24] ^
+		      table[3][b & 0xFF] ^ table[2][(b >> 8) & 0xFF] ^ table[1][(b >> 16) & 0xFF] ^ table[0][b >> 24];
+	}
+	while (n--) crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t cp_adler32(uint32_t adler, const uint8_t* p, size_t n)
+{
+	uint32_t s1 = adler & 0xFFFF;
+	uint32_t s2 = adler >> 16;
 
-		if (prev & 1)
+	while (n)
+	{
+		// 5552 is the most bytes that can be summed before s2 overflows.
+		size_t k = n < 5552 ? n : 5552;
+		n -= k;
+
+#ifdef CUTE_PNG_SSE2
+		// Per 16 byte block: s2 += 16 * s1 + sum((16 - i) * p[i]), s1 += sum(p[i]).
+		// The 16 * s1 terms are deferred by summing s1 at the start of each block.
+		size_t blocks = cp_simd ? k / 16 : 0;
+		if (blocks)
 		{
-			cp_put8(s, s->bits);
-			s->bits = 0x80;
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+			const __m128i w_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+			__m128i v_s1 = zero;
+			__m128i v_ps = zero;
+			__m128i v_s2 = zero;
+			for (size_t i = 0; i < blocks; ++i)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(p + i * 16));
+				v_ps = _mm_add_epi64(v_ps, v_s1);
+				v_s1 = _mm_add_epi64(v_s1, _mm_sad_epu8(v, zero));
+				v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), w_lo));
+				v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), w_hi));
+			}
+			uint64_t t[2];
+			uint32_t u[4];
+			_mm_storeu_si128((__m128i*)t, v_ps);
+			uint64_t ps = t[0] + t[1];
+			_mm_storeu_si128((__m128i*)t, v_s1);
+			uint64_t sum = t[0] + t[1];
+			_mm_storeu_si128((__m128i*)u, v_s2);
+			uint64_t weighted = (uint64_t)u[0] + u[1] + u[2] + u[3];
+			s2 = (uint32_t)((s2 + 16 * (uint64_t)blocks * s1 + 16 * ps + weighted) % 65521);
+			s1 = (uint32_t)((s1 + sum) % 65521);
+			p += blocks * 16;
+			k -= blocks * 16;
 		}
+#endif
+
+		while (k--)
+		{
+			s1 += *p++;
+			s2 += s1;
+		}
+		s1 %= 65521;
+		s2 %= 65521;
+	}
+
+	return (s2 << 16) | s1;
+}
+
+typedef struct cp_huff_t
+{
+	uint16_t code[288]; // bit reversed, ready to write LSB first
+	uint8_t len[288];
+} cp_huff_t;
+
+// Moffat and Katajainen's in-place minimum redundancy code. `a` holds the
+// frequencies in ascending order and receives the code lengths. A lone symbol
+// gets length 1.
+static void cp_minimum_redundancy(int* a, int n)
+{
+	int root, leaf, next, avbl, used, dpth;
+	if (n < 2) { if (n) a[0] = 1; return; }
+	a[0] += a[1];
+	root = 0;
+	leaf = 2;
+	for (next = 1; next < n - 1; next++)
+	{
+		if (leaf >= n || a[root] < a[leaf]) { a[next] = a[root]; a[root++] = next; }
+		else a[next] = a[leaf++];
+		if (leaf >= n || (root < next && a[root] < a[leaf])) { a[next] += a[root]; a[root++] = next; }
+		else a[next] += a[leaf++];
+	}
+	a[n - 2] = 0;
+	for (next = n - 3; next >= 0; next--) a[next] = a[a[next]] + 1;
+	avbl = 1;
+	used = dpth = 0;
+	root = n - 2;
+	next = n - 1;
+	while (avbl > 0)
+	{
+		while (root >= 0 && a[root] == dpth) { used++; root--; }
+		while (avbl > used) { a[next--] = dpth; avbl--; }
+		avbl = 2 * used;
+		dpth++;
+		used = 0;
 	}
 }
 
-static void cp_put_bitsr(cp_save_png_data_t* s, uint32_t data, uint32_t bitcount)
+// Builds code lengths no longer than `max_len`. At least two symbols always
+// get a code so the result is a complete prefix code.
+static void cp_build_lengths(uint32_t* freq, int n, int max_len, uint8_t* lens)
 {
-	while (bitcount--)
-		cp_put_bits(s, data >> bitcount, 1);
+	int syms[288];
+	int a[288];
+	int num[CUTE_PNG_DEFLATE_MAX_BITLEN + 2] = { 0 };
+	int used = 0;
+
+	for (int i = 0; i < n; ++i) if (freq[i]) used++;
+	for (int i = 0; used < 2; ++i) if (!freq[i]) { freq[i] = 1; used++; }
+
+	used = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		lens[i] = 0;
+		if (!freq[i]) continue;
+		int j = used++;
+		for (; j > 0 && freq[syms[j - 1]] > freq[i]; --j) syms[j] = syms[j - 1];
+		syms[j] = i;
+	}
+
+	for (int i = 0; i < used; ++i) a[i] = (int)freq[syms[i]];
+	cp_minimum_redundancy(a, used);
+
+	for (int i = 0; i < used; ++i) num[a[i] < max_len ? a[i] : max_len]++;
+	uint32_t total = 0;
+	for (int i = 1; i <= max_len; ++i) total += (uint32_t)num[i] << (max_len - i);
+	while (total != (1u << max_len))
+	{
+		num[max_len]--;
+		for (int i = max_len - 1; i > 0; --i)
+		{
+			if (num[i]) { num[i]--; num[i + 1] += 2; break; }
+		}
+		total--;
+	}
+
+	for (int i = max_len, j = 0; i > 0; --i)
+		for (int k = num[i]; k > 0; --k)
+			lens[syms[j++]] = (uint8_t)i;
 }
 
-static void cp_begin_chunk(cp_save_png_data_t* s, const char* id, uint32_t len)
+static void cp_build_codes(cp_huff_t* h, int n)
 {
-	cp_put32(s, len);
-	s->crc = 0xFFFFFFFF;
-	cp_put8(s, (unsigned char)id[0]);
-	cp_put8(s, (unsigned char)id[1]);
-	cp_put8(s, (unsigned char)id[2]);
-	cp_put8(s, (unsigned char)id[3]);
+	int count[CUTE_PNG_DEFLATE_MAX_BITLEN + 1] = { 0 };
+	int next[CUTE_PNG_DEFLATE_MAX_BITLEN + 1];
+	int code = 0;
+
+	for (int i = 0; i < n; ++i) count[h->len[i]]++;
+	count[0] = 0;
+	for (int i = 1; i <= CUTE_PNG_DEFLATE_MAX_BITLEN; ++i)
+	{
+		code = (code + count[i - 1]) << 1;
+		next[i] = code;
+	}
+
+	for (int i = 0; i < n; ++i)
+	{
+		int len = h->len[i];
+		if (!len) continue;
+		int c = next[len]++, r = 0;
+		for (int j = 0; j < len; ++j) r |= ((c >> j) & 1) << (len - 1 - j);
+		h->code[i] = (uint16_t)r;
+	}
 }
 
-static void cp_encode_literal(cp_save_png_data_t* s, uint32_t v)
+typedef struct cp_deflate_t
+{
+	cp_writer_t* w;
+	const uint8_t* in;
+	int in_len;
+	int emitted;
+	int block_start;
+	int max_chain;
+	int nice_len;
+	int32_t* head;
+	int32_t* prev;
+	uint32_t* tokens; // literal, or distance << 9 | length
+	int token_count;
+	uint32_t lit_freq[288];
+	uint32_t dist_freq[32];
+	uint8_t len_sym[CUTE_PNG_MAX_MATCH + 1];
+	uint8_t dist_sym[512];
+	cp_huff_t fixed_lit;
+	cp_huff_t fixed_dist;
+} cp_deflate_t;
+
+static int cp_dist_symbol(cp_deflate_t* d, int dist)
+{
+	return dist <= 256 ? d->dist_sym[dist - 1] : d->dist_sym[256 + ((dist - 1) >> 7)];
+}
+
+static void cp_put_stored(cp_deflate_t* d, int final)
 {
-	// Encode a literal/length using the built-in tables.
-	// Could do better with a custom table but whatever.
-	     if (v < 144) cp_put_bitsr(s, 0x030 + v -   0, 8);
-	else if (v < 256) cp_put_bitsr(s, 0x190 + v - 144, 9);
-	else if (v < 280) cp_put_bitsr(s, 0x000 + v - 256, 7);
-	else              cp_put_bitsr(s, 0x0c0 + v - 280, 8);
+	int start = d->block_start, len = d->emitted - d->block_start;
+	do
+	{
+		int n = len < 65535 ? len : 65535;
+		if (!cp_reserve(d->w, n + 16)) return;
+		cp_put_bits(d->w, final && n == len, 1);
+		cp_put_bits(d->w, 0, 2);
+		cp_align_bits(d->w);
+		uint8_t* p = d->w->data + d->w->size;
+		p[0] = (uint8_t)n;
+		p[1] = (uint8_t)(n >> 8);
+		p[2] = (uint8_t)~n;
+		p[3] = (uint8_t)(~n >> 8);
+		CUTE_PNG_MEMCPY(p + 4, d->in + start, n);
+		d->w->size += n + 4;
+		start += n;
+		len -= n;
+	} while (len > 0);
 }
 
-static void cp_encode_len(cp_save_png_data_t* s, uint32_t code, uint32_t bits, uint32_t len)
+static void cp_put_tokens(cp_deflate_t* d, const cp_huff_t* lit, const cp_huff_t* dist)
 {
-	cp_encode_literal(s, code + (len >> bits));
-	cp_put_bits(s, len, bits);
-	cp_put_bits(s, 0, 5);
+	cp_writer_t* w = d->w;
+	for (int i = 0; i < d->token_count; ++i)
+	{
+		uint32_t t = d->tokens[i];
+		if (t < 256)
+		{
+			cp_put_bits(w, lit->code[t], lit->len[t]);
+			continue;
+		}
+		int len = t & 511, s = d->len_sym[len];
+		cp_put_bits(w, lit->code[257 + s], lit->len[257 + s]);
+		cp_put_bits(w, len - cp_len_base[s], cp_len_extra_bits[s]);
+		int dst = t >> 9, ds = cp_dist_symbol(d, dst);
+		cp_put_bits(w, dist->code[ds], dist->len[ds]);
+		cp_put_bits(w, dst - cp_dist_base[ds], cp_dist_extra_bits[ds]);
+	}
+	cp_put_bits(w, lit->code[256], lit->len[256]);
 }
 
-static void cp_end_run(cp_save_png_data_t* s)
+static void cp_flush_block(cp_deflate_t* d, int final)
 {
-	s->runlen--;
-	cp_encode_literal(s, s->prev);
+	cp_huff_t lit, dist, cl;
+	uint32_t cl_freq[19] = { 0 };
+	uint16_t rle[288 + 32];
+	uint8_t lens[288 + 32];
+	int rle_count = 0;
+
+	d->lit_freq[256] = 1;
+	cp_build_lengths(d->lit_freq, 286, CUTE_PNG_DEFLATE_MAX_BITLEN, lit.len);
+	cp_build_lengths(d->dist_freq, 30, CUTE_PNG_DEFLATE_MAX_BITLEN, dist.len);
+
+	int hlit = 286, hdist = 30, hclen = 19;
+	while (hlit > 257 && !lit.len[hlit - 1]) hlit--;
+	while (hdist > 1 && !dist.len[hdist - 1]) hdist--;
+	CUTE_PNG_MEMCPY(lens, lit.len, hlit);
+	CUTE_PNG_MEMCPY(lens + hlit, dist.len, hdist);
 
-	if (s->runlen >= 67) cp_encode_len(s, 277, 4, s->runlen - 67);
-	else if (s->runlen >= 35) cp_encode_len(s, 273, 3, s->runlen - 35);
-	else if (s->runlen >= 19) cp_encode_len(s, 269, 2, s->runlen - 19);
-	else if (s->runlen >= 11) cp_encode_len(s, 265, 1, s->runlen - 11);
-	else if (s->runlen >= 3) cp_encode_len(s, 257, 0, s->runlen - 3);
-	else while (s->runlen--) cp_encode_literal(s, s->prev);
+	// Run length code the code lengths with symbols 16 (repeat), 17 and 18 (zeros).
+	for (int i = 0, total = hlit + hdist; i < total;)
+	{
+		int v = lens[i], run = 1;
+		while (i + run < total && lens[i + run] == v) run++;
+		i += run;
+		if (v == 0)
+		{
+			for (; run >= 11; run -= run < 138 ? run : 138) rle[rle_count++] = 18 | ((run < 138 ? run : 138) - 11) << 8;
+			if (run >= 3) { rle[rle_count++] = 17 | (run - 3) << 8; run = 0; }
+		}
+		else
+		{
+			rle[rle_count++] = (uint16_t)v;
+			for (run--; run >= 3; run -= run < 6 ? run : 6) rle[rle_count++] = 16 | ((run < 6 ? run : 6) - 3) << 8;
+		}
+		while (run-- > 0) rle[rle_count++] = (uint16_t)v;
+	}
+	for (int i = 0; i < rle_count; ++i) cl_freq[rle[i] & 0xFF]++;
+	cp_build_lengths(cl_freq, 19, 7, cl.len);
+	while (hclen > 4 && !cl.len[cp_permutation_order[hclen - 1]]) hclen--;
+
+	// Cost of each block type in bits, to pick the smallest.
+	uint64_t extra = 0, dyn = 17 + 3 * hclen, fixed = 3, stored;
+	for (int i = 0; i < 29; ++i) extra += (uint64_t)d->lit_freq[257 + i] * cp_len_extra_bits[i];
+	for (int i = 0; i < 30; ++i) extra += (uint64_t)d->dist_freq[i] * cp_dist_extra_bits[i];
+	for (int i = 0; i < 19; ++i) dyn += (uint64_t)cl_freq[i] * cl.len[i];
+	dyn += cl_freq[16] * 2 + cl_freq[17] * 3 + cl_freq[18] * 7;
+	for (int i = 0; i < 286; ++i)
+	{
+		dyn += (uint64_t)d->lit_freq[i] * lit.len[i];
+		fixed += (uint64_t)d->lit_freq[i] * d->fixed_lit.len[i];
+	}
+	for (int i = 0; i < 30; ++i)
+	{
+		dyn += (uint64_t)d->dist_freq[i] * dist.len[i];
+		fixed += (uint64_t)d->dist_freq[i] * 5;
+	}
+	int raw = d->emitted - d->block_start;
+	stored = ((uint64_t)raw + (raw / 65535 + 1) * 5) * 8 + 7;
+
+	if (stored <= dyn + extra && stored <= fixed + extra)
+	{
+		cp_put_stored(d, final);
+	}
+	else if (cp_reserve(d->w, (int64_t)d->token_count * 6 + 400))
+	{
+		if (fixed <= dyn)
+		{
+			cp_put_bits(d->w, final, 1);
+			cp_put_bits(d->w, 1, 2);
+			cp_put_tokens(d, &d->fixed_lit, &d->fixed_dist);
+		}
+		else
+		{
+			cp_build_codes(&lit, 286);
+			cp_build_codes(&dist, 30);
+			cp_build_codes(&cl, 19);
+			cp_put_bits(d->w, final, 1);
+			cp_put_bits(d->w, 2, 2);
+			cp_put_bits(d->w, hlit - 257, 5);
+			cp_put_bits(d->w, hdist - 1, 5);
+			cp_put_bits(d->w, hclen - 4, 4);
+			for (int i = 0; i < hclen; ++i) cp_put_bits(d->w, cl.len[cp_permutation_order[i]], 3);
+			for (int i = 0; i < rle_count; ++i)
+			{
+				int s = rle[i] & 0xFF;
+				cp_put_bits(d->w, cl.code[s], cl.len[s]);
+				if (s == 16) cp_put_bits(d->w, rle[i] >> 8, 2);
+				else if (s == 17) cp_put_bits(d->w, rle[i] >> 8, 3);
+				else if (s == 18) cp_put_bits(d->w, rle[i] >> 8, 7);
+			}
+			cp_put_tokens(d, &lit, &dist);
+		}
+	}
+
+	CUTE_PNG_MEMSET(d->lit_freq, 0, sizeof(d->lit_freq));
+	CUTE_PNG_MEMSET(d->dist_freq, 0, sizeof(d->dist_freq));
+	d->token_count = 0;
+	d->block_start = d->emitted;
 }
 
-static void cp_encode_byte(cp_save_png_data_t *s, uint8_t v)
+static void cp_emit_literal(cp_deflate_t* d, int c)
 {
-	cp_update_adler(s, v);
+	d->tokens[d->token_count++] = c;
+	d->lit_freq[c]++;
+	d->emitted++;
+	if (d->token_count == CUTE_PNG_BLOCK_TOKENS) cp_flush_block(d, 0);
+}
 
-	// Simple RLE compression. We could do better by doing a search
-	// to find matches, but this works pretty well TBH.
-	if (s->prev == v && s->runlen < 115) s->runlen++;
+static void cp_emit_match(cp_deflate_t* d, int len, int dist)
+{
+	d->tokens[d->token_count++] = (uint32_t)dist << 9 | len;
+	d->lit_freq[257 + d->len_sym[len]]++;
+	d->dist_freq[cp_dist_symbol(d, dist)]++;
+	d->emitted += len;
+	if (d->token_count == CUTE_PNG_BLOCK_TOKENS) cp_flush_block(d, 0);
+}
 
+static int cp_ctz64(uint64_t v)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(v);
+#else
+	int n = 0;
+	while (!(v & 0xFF)) { v >>= 8; n += 8; }
+	while (!(v & 1)) { v >>= 1; n++; }
+	return n;
+#endif
+}
+
+static int cp_match_length(const uint8_t* a, const uint8_t* b, int limit)
+{
+	int len = 0;
+	for (; len + 8 <= limit; len += 8)
+	{
+		uint64_t x, y;
+		CUTE_PNG_MEMCPY(&x, a + len, 8);
+		CUTE_PNG_MEMCPY(&y, b + len, 8);
+		if (x != y) return len + (cp_ctz64(x ^ y) >> 3);
+	}
+	while (len < limit && a[len] == b[len]) len++;
+	return len;
+}
+
+static void cp_insert(cp_deflate_t* d, int pos)
+{
+	const uint8_t* p = d->in + pos;
+	uint32_t h = ((p[0] | (p[1] << 8) | (p[2] << 16)) * 0x9E3779B1u) >> (32 - CUTE_PNG_HASH_BITS);
+	d->prev[pos & CUTE_PNG_WINDOW_MASK] = d->head[h];
+	d->head[h] = pos;
+}
+
+// Returns the longest match at `pos` that beats `best`, or `best` if none does.
+// `pos` must already be inserted.
+static int cp_find_match(cp_deflate_t* d, int pos, int best, int* dist)
+{
+	const uint8_t* cur = d->in + pos;
+	int limit = d->in_len - pos;
+	int chain = d->max_chain;
+	int cand = d->prev[pos & CUTE_PNG_WINDOW_MASK];
+	if (limit > CUTE_PNG_MAX_MATCH) limit = CUTE_PNG_MAX_MATCH;
+
+	while (cand >= 0 && pos - cand < CUTE_PNG_WINDOW_SIZE && chain-- > 0 && best < limit)
+	{
+		const uint8_t* m = d->in + cand;
+		if (m[best] == cur[best] && m[0] == cur[0] && m[1] == cur[1])
+		{
+			int len = cp_match_length(m, cur, limit);
+			if (len > best)
+			{
+				best = len;
+				*dist = pos - cand;
+				if (len >= d->nice_len) break;
+			}
+		}
+		int next = d->prev[cand & CUTE_PNG_WINDOW_MASK];
+		if (next >= cand) break;
+		cand = next;
+	}
+	return best;
+}
+
+static void cp_deflate(cp_writer_t* w, const uint8_t* in, int in_len, int level)
+{
+	cp_deflate_t* d = (cp_deflate_t*)CUTE_PNG_ALLOC(sizeof(cp_deflate_t));
+	if (!d) { w->oom = 1; return; }
+	CUTE_PNG_MEMSET(d, 0, sizeof(*d));
+	d->w = w;
+	d->in = in;
+	d->in_len = in_len;
+	d->max_chain = cp_max_chain[level];
+	d->nice_len = cp_nice_length[level];
+
+	if (level == 0)
+	{
+		d->emitted = in_len;
+		cp_put_stored(d, 1);
+		CUTE_PNG_FREE(d);
+		return;
+	}
+
+	d->head = (int32_t*)CUTE_PNG_ALLOC(sizeof(int32_t) << CUTE_PNG_HASH_BITS);
+	d->prev = (int32_t*)CUTE_PNG_ALLOC(sizeof(int32_t) * CUTE_PNG_WINDOW_SIZE);
+	d->tokens = (uint32_t*)CUTE_PNG_ALLOC(sizeof(uint32_t) * CUTE_PNG_BLOCK_TOKENS);
+	if (!d->head || !d->prev || !d->tokens)
+	{
+		w->oom = 1;
+		goto done;
+	}
+	CUTE_PNG_MEMSET(d->head, 0xFF, sizeof(int32_t) << CUTE_PNG_HASH_BITS);
+
+	for (int s = 0; s < 29; ++s)
+		for (uint32_t l = cp_len_base[s]; l < cp_len_base[s] + (1u << cp_len_extra_bits[s]) && l <= CUTE_PNG_MAX_MATCH; ++l)
+			d->len_sym[l] = (uint8_t)s;
+	d->len_sym[CUTE_PNG_MAX_MATCH] = 28;
+	for (int s = 0; s < 30; ++s)
+		for (uint32_t v = cp_dist_base[s]; v < cp_dist_base[s] + (1u << cp_dist_extra_bits[s]); ++v)
+			if (v <= 256) d->dist_sym[v - 1] = (uint8_t)s;
+			else d->dist_sym[256 + ((v - 1) >> 7)] = (uint8_t)s;
+
+	CUTE_PNG_MEMCPY(d->fixed_lit.len, cp_fixed_table, 288);
+	CUTE_PNG_MEMCPY(d->fixed_dist.len, cp_fixed_table + 288, 32);
+	cp_build_codes(&d->fixed_lit, 288);
+	cp_build_codes(&d->fixed_dist, 32);
+
+	int pos = 0;
+	if (level < 4)
+	{
+		while (pos < in_len)
+		{
+			int len = 0, dist = 0;
+			if (pos + CUTE_PNG_MIN_MATCH <= in_len)
+			{
+				cp_insert(d, pos);
+				len = cp_find_match(d, pos, CUTE_PNG_MIN_MATCH - 1, &dist);
+			}
+			if (len >= CUTE_PNG_MIN_MATCH && !(len == CUTE_PNG_MIN_MATCH && dist > 4096))
+			{
+				cp_emit_match(d, len, dist);
+				int end = pos + len;
+				if (len <= d->nice_len)
+					for (pos++; pos < end && pos + CUTE_PNG_MIN_MATCH <= in_len; ++pos) cp_insert(d, pos);
+				pos = end;
+			}
+			else
+			{
+				cp_emit_literal(d, in[pos++]);
+			}
+		}
+	}
 	else
 	{
-		if (s->runlen) cp_end_run(s);
+		// A match found at pos - 1 is only taken if pos doesn't start a longer one.
+		int prev_len = 0, prev_dist = 0, pending = 0;
+		while (pos < in_len)
+		{
+			int len = 0, dist = 0;
+			if (pos + CUTE_PNG_MIN_MATCH <= in_len)
+			{
+				int best = prev_len > CUTE_PNG_MIN_MATCH - 1 ? prev_len : CUTE_PNG_MIN_MATCH - 1;
+				cp_insert(d, pos);
+				if (prev_len < d->nice_len) len = cp_find_match(d, pos, best, &dist);
+				if (len <= best || (len == CUTE_PNG_MIN_MATCH && dist > 4096)) len = 0;
+			}
+			if (prev_len >= CUTE_PNG_MIN_MATCH && len <= prev_len)
+			{
+				cp_emit_match(d, prev_len, prev_dist);
+				int end = pos - 1 + prev_len;
+				for (pos++; pos < end && pos + CUTE_PNG_MIN_MATCH <= in_len; ++pos) cp_insert(d, pos);
+				pos = end;
+				prev_len = 0;
+				pending = 0;
+			}
+			else
+			{
+				if (pending) cp_emit_literal(d, in[pos - 1]);
+				pending = 1;
+				prev_len = len;
+				prev_dist = dist;
+				pos++;
+			}
+		}
+		if (pending) cp_emit_literal(d, in[pos - 1]);
+	}
+	cp_flush_block(d, 1);
+
+done:
+	CUTE_PNG_FREE(d->head);
+	CUTE_PNG_FREE(d->prev);
+	CUTE_PNG_FREE(d->tokens);
+	CUTE_PNG_FREE(d);
+}
 
-		s->prev = v;
-		s->runlen = 1;
+#ifdef CUTE_PNG_SSE2
+// Encoding has every input byte up front, so unlike decoding all four
+// predictors vectorize across the whole row. Returns the sum of |v| for the
+// filtered bytes, treating them as signed.
+static uint32_t cp_filter_row_sse2(int f, const uint8_t* cur, const uint8_t* prev, int bpp, int x, int len, uint8_t* out)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = zero;
+	for (; x + 16 <= len; x += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(cur + x));
+		__m128i a = _mm_loadu_si128((const __m128i*)(cur + x - bpp));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prev + x));
+		__m128i p;
+		if (f == 1) p = a;
+		else if (f == 2) p = b;
+		else if (f == 3) p = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+		else
+		{
+			__m128i c = _mm_loadu_si128((const __m128i*)(prev + x - bpp));
+			__m128i r[2];
+			for (int h = 0; h < 2; ++h)
+			{
+				__m128i a16 = h ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+				__m128i b16 = h ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+				__m128i c16 = h ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+				__m128i pa = _mm_sub_epi16(b16, c16);
+				__m128i pb = _mm_sub_epi16(a16, c16);
+				__m128i pc = _mm_add_epi16(pa, pb);
+				pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+				pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+				pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+				__m128i use_a = _mm_and_si128(_mm_cmpgt_epi16(_mm_add_epi16(pb, _mm_set1_epi16(1)), pa), _mm_cmpgt_epi16(_mm_add_epi16(pc, _mm_set1_epi16(1)), pa));
+				__m128i use_b = _mm_cmpgt_epi16(_mm_add_epi16(pc, _mm_set1_epi16(1)), pb);
+				__m128i bc = _mm_or_si128(_mm_and_si128(use_b, b16), _mm_andnot_si128(use_b, c16));
+				r[h] = _mm_or_si128(_mm_and_si128(use_a, a16), _mm_andnot_si128(use_a, bc));
+			}
+			p = _mm_packus_epi16(r[0], r[1]);
+		}
+		v = _mm_sub_epi8(v, p);
+		_mm_storeu_si128((__m128i*)(out + x), v);
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero));
 	}
+	uint64_t t[2];
+	_mm_storeu_si128((__m128i*)t, sum);
+	return (uint32_t)(t[0] + t[1]);
 }
+#endif
 
-static void cp_save_header(cp_save_png_data_t* s, cp_image_t* img)
+// Filters one row with filter `f` (1-4) into `out` and returns its score.
+static uint32_t cp_filter_row(int f, const uint8_t* cur, const uint8_t* prev, int bpp, int len, uint8_t* out)
 {
-	const unsigned char* hdr = (const unsigned char*)"\211PNG\r\n\032\n";
-	for (int i = 0; i < 8; ++i) {
-		cp_put8(s, *hdr++);
+	uint32_t sum = 0;
+	int x = 0;
+	for (; x < bpp && x < len; ++x)
+	{
+		out[x] = f == 1 ? cur[x] : f == 3 ? cur[x] - (prev[x] >> 1) : cur[x] - prev[x];
+		sum += out[x] < 128 ? out[x] : 256 - out[x];
 	}
-	cp_begin_chunk(s, "IHDR", 13);
-	cp_put32(s, img->w);
-	cp_put32(s, img->h);
-	cp_put8(s, 8); // bit depth
-	cp_put8(s, 6); // RGBA
-	cp_put8(s, 0); // compression (deflate)
-	cp_put8(s, 0); // filter (standard)
-	cp_put8(s, 0); // interlace off
-	cp_put32(s, ~s->crc);
+#ifdef CUTE_PNG_SSE2
+	if (cp_simd)
+	{
+		sum += cp_filter_row_sse2(f, cur, prev, bpp, x, len, out);
+		x += (len - x) & ~15;
+	}
+#endif
+	for (; x < len; ++x)
+	{
+		uint8_t a = cur[x - bpp], b = prev[x], c = prev[x - bpp];
+		out[x] = cur[x] - (f == 1 ? a : f == 2 ? b : f == 3 ? (a + b) >> 1 : cp_paeth(a, b, c));
+		sum += out[x] < 128 ? out[x] : 256 - out[x];
+	}
+	return sum;
 }
 
-static void cp_save_data(cp_save_png_data_t* s, cp_image_t* img, long dataPos, long* dataSize)
+// Writes each row as a filter byte followed by the filtered bytes, choosing
+// the filter with the smallest sum of absolute values.
+static void cp_filter_rows(const cp_image_t* img, int bpp, int level, uint8_t* out, uint8_t* scratch)
 {
-	cp_begin_chunk(s, "IDAT", 0);
-	cp_put8(s, 0x08); // zlib compression method
-	cp_put8(s, 0x1D); // zlib compression flags
-	cp_put_bits(s, 3, 3); // zlib last block + fixed dictionary
+	int len = img->w * bpp;
+	uint8_t* prev = scratch;
+	uint8_t* cur = scratch + len;
+	uint8_t* trial = scratch + len * 2;
+	CUTE_PNG_MEMSET(prev, 0, len);
 
 	for (int y = 0; y < img->h; ++y)
 	{
-		cp_pixel_t *row = &img->pix[y * img->w];
-		cp_pixel_t prev = cp_make_pixel_a(0, 0, 0, 0);
+		const cp_pixel_t* row = img->pix + y * img->w;
+		if (bpp == 4) CUTE_PNG_MEMCPY(cur, row, len);
+		else for (int x = 0; x < img->w; ++x)
+		{
+			cur[x * 3 + 0] = row[x].r;
+			cur[x * 3 + 1] = row[x].g;
+			cur[x * 3 + 2] = row[x].b;
+		}
 
-		cp_encode_byte(s, 1); // sub filter
-		for (int x = 0; x < img->w; ++x)
+		*out++ = 0;
+		CUTE_PNG_MEMCPY(out, cur, len);
+		if (level > 0)
 		{
-			cp_encode_byte(s, row[x].r - prev.r);
-			cp_encode_byte(s, row[x].g - prev.g);
-			cp_encode_byte(s, row[x].b - prev.b);
-			cp_encode_byte(s, row[x].a - prev.a);
-			prev = row[x];
+			uint32_t best = 0;
+			for (int x = 0; x < len; ++x) best += cur[x] < 128 ? cur[x] : 256 - cur[x];
+			for (int f = 1; f < 5; ++f)
+			{
+				uint32_t score = cp_filter_row(f, cur, prev, bpp, len, trial);
+				if (score < best)
+				{
+					best = score;
+					out[-1] = (uint8_t)f;
+					CUTE_PNG_MEMCPY(out, trial, len);
+				}
+			}
 		}
+		out += len;
+
+		uint8_t* t = prev;
+		prev = cur;
+		cur = t;
 	}
+}
 
-	cp_end_run(s);
-	cp_encode_literal(s, 256); // terminator
-	while (s->bits != 0x80) cp_put_bits(s, 0, 1);
-	cp_put32(s, s->adler);
-	*dataSize = (s->buflen - dataPos) - 8;
-	cp_put32(s, ~s->crc);
+static void cp_put_chunk(cp_writer_t* w, const uint32_t crc_table[8][256], const char* id, const void* data, int len)
+{
+	cp_put32(w, len);
+	int start = w->size;
+	cp_put_bytes(w, id, 4);
+	if (len) cp_put_bytes(w, data, len);
+	if (w->oom) return;
+	cp_put32(w, cp_crc32(crc_table, 0, w->data + start, w->size - start));
 }
 
-cp_saved_png_t cp_save_png_to_memory(const cp_image_t* img)
+cp_saved_png_t cp_save_png_to_memory_level(const cp_image_t* img, int level)
 {
 	cp_saved_png_t result = { 0 };
-	cp_save_png_data_t s = { 0 };
-	long dataPos, dataSize, fileSize;
-	if (!img) return result;
-
-	s.adler = 1;
-	s.bits = 0x80;
-	s.prev = 0xFFFF;
-	s.bufcap = 1024;
-	s.buffer = (char*)CUTE_PNG_ALLOC(1024);
-
-	cp_save_header(&s, (cp_image_t*)img);
-	dataPos = s.buflen;
-	cp_save_data(&s, (cp_image_t*)img, dataPos, &dataSize);
-
-	// End chunk.
-	cp_begin_chunk(&s, "IEND", 0);
-	cp_put32(&s, ~s.crc);
-
-	// Write back payload size.
-	fileSize = s.buflen;
-	s.buflen = dataPos;
-	cp_put32(&s, dataSize);
-
-	result.size = fileSize;
-	result.data = s.buffer;
+	cp_writer_t w = { 0 };
+	uint32_t crc_table[8][256];
+	uint8_t ihdr[13];
+	uint8_t *raw = 0, *scratch = 0;
+	if (!img || img->w <= 0 || img->h <= 0) return result;
+	if (level < 0) level = 0;
+	if (level > 9) level = 9;
+
+	// Images without transparency are written as RGB.
+	int opaque = 1;
+	for (int i = 0, n = img->w * img->h; i < n && opaque; ++i) opaque = img->pix[i].a == 255;
+	int bpp = opaque ? 3 : 4;
+	int64_t row = (int64_t)img->w * bpp + 1;
+	int64_t raw_size = row * img->h;
+	if (raw_size > INT_MAX / 2) return result;
+
+	raw = (uint8_t*)CUTE_PNG_ALLOC((size_t)raw_size);
+	scratch = (uint8_t*)CUTE_PNG_ALLOC((size_t)row * 3);
+	if (!raw || !scratch || !cp_reserve(&w, raw_size / 4 + 1024)) goto done;
+	cp_filter_rows(img, bpp, level, raw, scratch);
+	cp_crc32_init(crc_table);
+
+	cp_put_bytes(&w, "\211PNG\r\n\032\n", 8);
+	for (int i = 0; i < 4; ++i)
+	{
+		ihdr[i] = (uint8_t)(img->w >> (24 - i * 8));
+		ihdr[i + 4] = (uint8_t)(img->h >> (24 - i * 8));
+	}
+	ihdr[8] = 8; // bit depth
+	ihdr[9] = opaque ? 2 : 6; // RGB or RGBA
+	ihdr[10] = 0; // compression (deflate)
+	ihdr[11] = 0; // filter (standard)
+	ihdr[12] = 0; // interlace off
+	cp_put_chunk(&w, crc_table, "IHDR", ihdr, 13);
+
+	int idat = w.size;
+	cp_put32(&w, 0);
+	cp_put_bytes(&w, "IDAT", 4);
+	uint8_t zlib[2] = { 0x78, (uint8_t)((level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6) };
+	zlib[1] += 31 - (zlib[0] * 256 + zlib[1]) % 31;
+	cp_put_bytes(&w, zlib, 2);
+	cp_deflate(&w, raw, (int)raw_size, level);
+	if (!cp_reserve(&w, 8)) goto done;
+	cp_align_bits(&w);
+	cp_put32(&w, cp_adler32(1, raw, (size_t)raw_size));
+	if (w.oom) goto done;
+
+	int idat_len = w.size - idat - 8;
+	w.data[idat + 0] = (uint8_t)(idat_len >> 24);
+	w.data[idat + 1] = (uint8_t)(idat_len >> 16);
+	w.data[idat + 2] = (uint8_t)(idat_len >> 8);
+	w.data[idat + 3] = (uint8_t)idat_len;
+	cp_put32(&w, cp_crc32(crc_table, 0, w.data + idat + 4, idat_len + 4));
+	cp_put_chunk(&w, crc_table, "IEND", 0, 0);
+
+done:
+	CUTE_PNG_FREE(raw);
+	CUTE_PNG_FREE(scratch);
+	if (w.oom || !raw || !scratch)
+	{
+		CUTE_PNG_FREE(w.data);
+		return result;
+	}
+	result.size = w.size;
+	result.data = w.data;
 	return result;
 }
 
-int cp_save_png(const char* file_name, const cp_image_t* img)
+cp_saved_png_t cp_save_png_to_memory(const cp_image_t* img)
+{
+	return cp_save_png_to_memory_level(img, CUTE_PNG_DEFAULT_LEVEL);
+}
+
+int cp_save_png_level(const char* file_name, const cp_image_t* img, int level)
 {
 	cp_saved_png_t s;
 	long err;
 	CUTE_PNG_FILE* fp = CUTE_PNG_FOPEN(file_name, "wb");
 	if (!fp) return 1;
-	s = cp_save_png_to_memory(img);
+	s = cp_save_png_to_memory_level(img, level);
 	CUTE_PNG_FWRITE(s.data, s.size, 1, fp);
 	err = CUTE_PNG_FERROR(fp);
 	CUTE_PNG_FCLOSE(fp);
@@ -937,6 +1727,11 @@ int cp_save_png(const char* file_name, const cp_image_t* img)
 	return !err;
 }
 
+int cp_save_png(const char* file_name, const cp_image_t* img)
+{
+	return cp_save_png_level(file_name, img, CUTE_PNG_DEFAULT_LEVEL);
+}
+
 typedef struct cp_raw_png_t
 {
 	const uint8_t* p;
@@ -1025,50 +1820,218 @@ static int cp_unfilter(int w, int h, int bpp, uint8_t* raw)
 	return 1;
 }
 
-static void cp_convert(int bpp, int w, int h, uint8_t* src, cp_pixel_t* dst)
+// http://www.libpng.org/pub/png/spec/1.2/PNG-Chunks.html#C.tRNS
+static uint8_t cp_get_alpha_for_indexed_image(int index, const uint8_t* trns, uint32_t trns_len)
+{
+	if (!trns) return 255;
+	else if ((uint32_t)index >= trns_len) return 255;
+	else return trns[index];
+}
+
+#ifdef CUTE_PNG_SSE2
+static __m128i cp_load4(const uint8_t* p)
+{
+	int32_t v;
+	CUTE_PNG_MEMCPY(&v, p, 4);
+	return _mm_cvtsi32_si128(v);
+}
+
+static __m128i cp_load3(const uint8_t* p)
+{
+	return _mm_cvtsi32_si128(p[0] | (p[1] << 8) | (p[2] << 16));
+}
+
+static void cp_store_pixel(uint8_t* p, __m128i v, int bpp)
 {
-	for (int y = 0; y < h; y++)
+	int32_t t = _mm_cvtsi128_si32(v);
+	if (bpp == 4) CUTE_PNG_MEMCPY(p, &t, 4);
+	else { p[0] = (uint8_t)t; p[1] = (uint8_t)(t >> 8); p[2] = (uint8_t)(t >> 16); }
+}
+#endif
+
+// Undoes the filter of one row from `raw` (filter byte first) into `row`,
+// given the already unfiltered previous row `prev` (all zeros for row 0).
+static int cp_unfilter_row(int len, int bpp, const uint8_t* raw, const uint8_t* prev, uint8_t* row)
+{
+	int filter = *raw++;
+	int x = 0;
+
+	switch (filter)
 	{
-		// skip filter byte
-		src++;
+	case 0: CUTE_PNG_MEMCPY(row, raw, len); return 1;
+	case 2:
+#ifdef CUTE_PNG_SSE2
+		for (; cp_simd && x + 16 <= len; x += 16)
+		{
+			__m128i r = _mm_loadu_si128((const __m128i*)(raw + x));
+			__m128i b = _mm_loadu_si128((const __m128i*)(prev + x));
+			_mm_storeu_si128((__m128i*)(row + x), _mm_add_epi8(r, b));
+		}
+#endif
+		for (; x < len; x++) row[x] = raw[x] + prev[x];
+		return 1;
+	case 1: case 3: case 4: break;
+	default: return 0;
+	}
 
-		for (int x = 0; x < w; x++, src += bpp)
+#ifdef CUTE_PNG_SSE2
+	// Sub, Average and Paeth depend on the pixel to the left, so these work a
+	// whole pixel per step, in the style of libpng's SSE2 filters.
+	if (cp_simd && (bpp == 3 || bpp == 4))
+	{
+#define CUTE_PNG_LOAD_PIXEL(P) (bpp == 4 ? cp_load4(P) : cp_load3(P))
+		__m128i zero = _mm_setzero_si128();
+		__m128i a = zero, c = zero;
+
+		switch (filter)
 		{
-			switch (bpp)
+		case 1:
+			for (; x < len; x += bpp)
 			{
-				case 1: *dst++ = cp_make_pixel(src[0], src[0], src[0]); break;
-				case 2: *dst++ = cp_make_pixel_a(src[0], src[0], src[0], src[1]); break;
-				case 3: *dst++ = cp_make_pixel(src[0], src[1], src[2]); break;
-				case 4: *dst++ = cp_make_pixel_a(src[0], src[1], src[2], src[3]); break;
+				a = _mm_add_epi8(a, CUTE_PNG_LOAD_PIXEL(raw + x));
+				cp_store_pixel(row + x, a, bpp);
 			}
+			break;
+
+		case 3:
+			for (; x < len; x += bpp)
+			{
+				__m128i b = CUTE_PNG_LOAD_PIXEL(prev + x);
+				// _mm_avg_epu8 rounds up, the filter rounds down
+				__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+				a = _mm_add_epi8(avg, CUTE_PNG_LOAD_PIXEL(raw + x));
+				cp_store_pixel(row + x, a, bpp);
+			}
+			break;
+
+		case 4:
+			for (; x < len; x += bpp)
+			{
+				__m128i b = _mm_unpacklo_epi8(CUTE_PNG_LOAD_PIXEL(prev + x), zero);
+				__m128i a16 = _mm_unpacklo_epi8(a, zero);
+				__m128i pa = _mm_sub_epi16(b, c);
+				__m128i pb = _mm_sub_epi16(a16, c);
+				__m128i pc = _mm_add_epi16(pa, pb);
+				pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+				pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+				pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+				__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+				__m128i use_a = _mm_cmpeq_epi16(smallest, pa);
+				__m128i use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(smallest, pb));
+				__m128i use_c = _mm_andnot_si128(_mm_or_si128(use_a, use_b), _mm_set1_epi16(-1));
+				__m128i pred = _mm_or_si128(_mm_or_si128(_mm_and_si128(use_a, a16), _mm_and_si128(use_b, b)), _mm_and_si128(use_c, c));
+				c = b;
+				a = _mm_add_epi8(_mm_packus_epi16(pred, pred), CUTE_PNG_LOAD_PIXEL(raw + x));
+				cp_store_pixel(row + x, a, bpp);
+			}
+			break;
 		}
+#undef CUTE_PNG_LOAD_PIXEL
+		return 1;
 	}
-}
+#endif
 
-// http://www.libpng.org/pub/png/spec/1.2/PNG-Chunks.html#C.tRNS
-static uint8_t cp_get_alpha_for_indexed_image(int index, const uint8_t* trns, uint32_t trns_len)
-{
-	if (!trns) return 255;
-	else if ((uint32_t)index >= trns_len) return 255;
-	else return trns[index];
+	switch (filter)
+	{
+	case 1:
+		for (; x < bpp; x++) row[x] = raw[x];
+		for (; x < len; x++) row[x] = raw[x] + row[x - bpp];
+		break;
+	case 3:
+		for (; x < bpp; x++) row[x] = raw[x] + prev[x] / 2;
+		for (; x < len; x++) row[x] = raw[x] + (row[x - bpp] + prev[x]) / 2;
+		break;
+	case 4:
+		for (; x < bpp; x++) row[x] = raw[x] + prev[x];
+		for (; x < len; x++) row[x] = raw[x] + cp_paeth(row[x - bpp], prev[x], prev[x - bpp]);
+		break;
+	}
+
+	return 1;
 }
 
-static void cp_depalette(int w, int h, uint8_t* src, cp_pixel_t* dst, const uint8_t* plte, const uint8_t* trns, uint32_t trns_len)
+// Expands one unfiltered row to 32-bit pixels, with red and blue swapped
+// when `bgra` is set. `palette` holds ready made pixels for indexed rows.
+static void cp_convert_row(int bpp, int w, const uint8_t* src, uint8_t* dst, int bgra, const uint32_t* palette)
 {
-	for (int y = 0; y < h; ++y)
+	int x = 0;
+	int ri = bgra ? 2 : 0;
+	int bi = bgra ? 0 : 2;
+
+	if (palette)
 	{
-		// skip filter byte
-		++src;
+		for (; x < w; x++, dst += 4) CUTE_PNG_MEMCPY(dst, palette + src[x], 4);
+		return;
+	}
 
-		for (int x = 0; x < w; ++x, ++src)
+	switch (bpp)
+	{
+	case 1:
+#ifdef CUTE_PNG_SSE2
+		for (; cp_simd && x + 16 <= w; x += 16, src += 16, dst += 64)
 		{
-			int c = *src;
-			uint8_t r = plte[c * 3];
-			uint8_t g = plte[c * 3 + 1];
-			uint8_t b = plte[c * 3 + 2];
-			uint8_t a = cp_get_alpha_for_indexed_image(c, trns, trns_len);
-			*dst++ = cp_make_pixel_a(r, g, b, a);
+			__m128i alpha = _mm_set1_epi32((int)0xFF000000);
+			__m128i g = _mm_loadu_si128((const __m128i*)src);
+			__m128i lo = _mm_unpacklo_epi8(g, g);
+			__m128i hi = _mm_unpackhi_epi8(g, g);
+			_mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_unpacklo_epi16(lo, lo), alpha));
+			_mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(_mm_unpackhi_epi16(lo, lo), alpha));
+			_mm_storeu_si128((__m128i*)(dst + 32), _mm_or_si128(_mm_unpacklo_epi16(hi, hi), alpha));
+			_mm_storeu_si128((__m128i*)(dst + 48), _mm_or_si128(_mm_unpackhi_epi16(hi, hi), alpha));
 		}
+#endif
+		for (; x < w; x++, src += 1, dst += 4) { dst[0] = dst[1] = dst[2] = src[0]; dst[3] = 0xFF; }
+		break;
+
+	case 2:
+#ifdef CUTE_PNG_SSE2
+		for (; cp_simd && x + 8 <= w; x += 8, src += 16, dst += 32)
+		{
+			// 16-bit lanes hold grey | alpha << 8; pair them with grey | grey << 8
+			__m128i ga = _mm_loadu_si128((const __m128i*)src);
+			__m128i g = _mm_and_si128(ga, _mm_set1_epi16(0xFF));
+			__m128i gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+			_mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi16(gg, ga));
+			_mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi16(gg, ga));
+		}
+#endif
+		for (; x < w; x++, src += 2, dst += 4) { dst[0] = dst[1] = dst[2] = src[0]; dst[3] = src[1]; }
+		break;
+
+	case 3:
+#ifdef CUTE_PNG_SSE2
+		// one unaligned 32-bit load per pixel; the last pixel of the row is
+		// left to the byte loop so the load never runs past the row
+		for (; cp_simd && x + 1 < w; x++, src += 3, dst += 4)
+		{
+			uint32_t v;
+			CUTE_PNG_MEMCPY(&v, src, 4);
+			v = bgra ? (v & 0xFF00) | ((v >> 16) & 0xFF) | ((v & 0xFF) << 16) : v & 0xFFFFFF;
+			v |= 0xFF000000;
+			CUTE_PNG_MEMCPY(dst, &v, 4);
+		}
+#endif
+		for (; x < w; x++, src += 3, dst += 4) { dst[ri] = src[0]; dst[1] = src[1]; dst[bi] = src[2]; dst[3] = 0xFF; }
+		break;
+
+	case 4:
+		if (!bgra)
+		{
+			CUTE_PNG_MEMCPY(dst, src, w * 4);
+			break;
+		}
+#ifdef CUTE_PNG_SSE2
+		for (; cp_simd && x + 4 <= w; x += 4, src += 16, dst += 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)src);
+			__m128i ga = _mm_and_si128(v, _mm_set1_epi32((int)0xFF00FF00));
+			__m128i rb = _mm_and_si128(v, _mm_set1_epi32(0x00FF00FF));
+			rb = _mm_or_si128(_mm_srli_epi32(rb, 16), _mm_slli_epi32(rb, 16));
+			_mm_storeu_si128((__m128i*)dst, _mm_or_si128(ga, rb));
+		}
+#endif
+		for (; x < w; x++, src += 4, dst += 4) { dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0]; dst[3] = src[3]; }
+		break;
 	}
 }
 
@@ -1077,26 +2040,29 @@ static uint32_t cp_get_chunk_byte_length(const uint8_t* chunk)
 	return cp_make32(chunk - 8);
 }
 
-static int cp_out_size(cp_image_t* img, int bpp)
+int cp_png_decode_size(int w, int h)
 {
-	return (img->w + 1) * img->h * bpp;
+	// every row of raw data is one filter byte larger than its pixels when
+	// bpp is 4, so the inflated stream needs `h` bytes of headroom
+	return w * h * (int)sizeof(cp_pixel_t) + h;
 }
 
-cp_image_t cp_load_png_mem(const void* png_data, int png_length)
+int cp_load_png_mem_to(const void* png_data, int png_length, void* pix, int pix_bytes, int bgra)
 {
 	const char* sig = "\211PNG\r\n\032\n";
 	const uint8_t* ihdr, *first, *plte, *trns;
-	int bit_depth, color_type, bpp, w, h, pix_bytes;
+	int bit_depth, color_type, bpp, w, h, raw_bytes, stride;
 	int compression, filter, interlace;
 	int datalen, offset;
-	uint8_t* out;
-	cp_image_t img = { 0 };
+	uint8_t* raw;
 	uint8_t* data = 0;
+	uint8_t* rows = 0;
+	uint32_t palette[256];
 	cp_raw_png_t png;
 	png.p = (uint8_t*)png_data;
 	png.end = (uint8_t*)png_data + png_length;
 
-	CUTE_PNG_CHECK(!CUTE_PNG_MEMCMP(png.p, sig, 8), "incorrect file signature (is this a png file?)");
+	CUTE_PNG_CHECK(png_length >= 8 && !CUTE_PNG_MEMCMP(png.p, sig, 8), "incorrect file signature (is this a png file?)");
 	png.p += 8;
 
 	ihdr = cp_chunk(&png, "IHDR", 13);
@@ -1115,17 +2081,12 @@ cp_image_t cp_load_png_mem(const void* png_data, int png_length)
 		default: CUTE_PNG_CHECK(0, "unknown color type");
 	}
 
-	// +1 for filter byte (which is dumb! just stick this at file header...)
-	w = cp_make32(ihdr) + 1;
+	w = cp_make32(ihdr);
 	h = cp_make32(ihdr + 4);
 	CUTE_PNG_CHECK(w >= 1, "invalid IHDR chunk found, image width was less than 1");
 	CUTE_PNG_CHECK(h >= 1, "invalid IHDR chunk found, image height was less than 1");
-        CUTE_PNG_CHECK((int64_t) w * h * sizeof(cp_pixel_t) < INT_MAX, "image too large");
-	pix_bytes = w * h * sizeof(cp_pixel_t);
-	img.w = w - 1;
-	img.h = h;
-	img.pix = (cp_pixel_t*)CUTE_PNG_ALLOC(pix_bytes);
-	CUTE_PNG_CHECK(img.pix, "unable to allocate raw image space");
+	CUTE_PNG_CHECK(((int64_t)w * sizeof(cp_pixel_t) + 1) * h < INT_MAX, "image too large");
+	CUTE_PNG_CHECK(pix_bytes >= cp_png_decode_size(w, h), "output buffer is too small for the image");
 
 	compression = ihdr[10];
 	filter = ihdr[11];
@@ -1145,6 +2106,25 @@ cp_image_t cp_load_png_mem(const void* png_data, int png_length)
 	if (!trns) png.p = first;
 	else first = png.p;
 
+	if (color_type == 3)
+	{
+		CUTE_PNG_CHECK(plte, "color type of indexed requires a PLTE chunk");
+		uint32_t plte_len = cp_get_chunk_byte_length(plte) / 3;
+		uint32_t trns_len = trns ? cp_get_chunk_byte_length(trns) : 0;
+		for (int i = 0; i < 256; ++i)
+		{
+			uint8_t c[4] = { 0, 0, 0, 0xFF };
+			if ((uint32_t)i < plte_len)
+			{
+				c[bgra ? 2 : 0] = plte[i * 3];
+				c[1] = plte[i * 3 + 1];
+				c[bgra ? 0 : 2] = plte[i * 3 + 2];
+				c[3] = cp_get_alpha_for_indexed_image(i, trns, trns_len);
+			}
+			CUTE_PNG_MEMCPY(palette + i, c, 4);
+		}
+	}
+
 	// Compute length of the DEFLATE stream through IDAT chunk data sizes
 	datalen = 0;
 	for (const uint8_t* idat = cp_find(&png, "IDAT", 0); idat; idat = cp_chunk(&png, "IDAT", 0))
@@ -1170,30 +2150,55 @@ cp_image_t cp_load_png_mem(const void* png_data, int png_length)
 	CUTE_PNG_CHECK((data[0] & 0xf0) <= 0x70, "innapropriate window size detected");
 	CUTE_PNG_CHECK(!(data[1] & 0x20), "preset dictionary is present and not supported");
 
-	// check for integer overflow
-	CUTE_PNG_CHECK(cp_out_size(&img, 4) >= 1, "invalid image size found");
-	CUTE_PNG_CHECK(cp_out_size(&img, bpp) >= 1, "invalid image size found");
-
-	out = (uint8_t*)img.pix + cp_out_size(&img, 4) - cp_out_size(&img, bpp);
-	CUTE_PNG_CHECK(cp_inflate(data + 2, datalen - 6, out, pix_bytes), "DEFLATE algorithm failed");
-	CUTE_PNG_CHECK(cp_unfilter(img.w, img.h, bpp, out), "invalid filter byte found");
-
-	if (color_type == 3)
+	// Inflate the filtered rows into the tail of `pix`, then unfilter and
+	// convert them front to back in a single pass. Each converted row ends
+	// before the next raw row starts, so the output never overtakes the input.
+	// Unfiltered rows alternate between two small scratch rows.
+	stride = w * bpp;
+	raw_bytes = (stride + 1) * h;
+	raw = (uint8_t*)pix + pix_bytes - raw_bytes;
+	CUTE_PNG_CHECK(cp_inflate(data + 2, datalen - 6, raw, raw_bytes), "DEFLATE algorithm failed");
+
+	rows = (uint8_t*)CUTE_PNG_CALLOC(2, stride);
+	CUTE_PNG_CHECK(rows, "unable to allocate scratch rows");
+	for (int y = 0; y < h; ++y)
 	{
-		CUTE_PNG_CHECK(plte, "color type of indexed requires a PLTE chunk");
-		uint32_t trns_len = trns ? cp_get_chunk_byte_length(trns) : 0;
-		cp_depalette(img.w, img.h, out, img.pix, plte, trns, trns_len);
+		uint8_t* row = rows + (y & 1) * stride;
+		uint8_t* prev = rows + (~y & 1) * stride;
+		if (!y) CUTE_PNG_MEMSET(prev, 0, stride);
+		CUTE_PNG_CHECK(cp_unfilter_row(stride, bpp, raw + y * (stride + 1), prev, row), "invalid filter byte found");
+		cp_convert_row(bpp, w, row, (uint8_t*)pix + y * w * sizeof(cp_pixel_t), bgra, color_type == 3 ? palette : 0);
 	}
-	else cp_convert(bpp, img.w, img.h, out, img.pix);
 
+	CUTE_PNG_FREE(rows);
 	CUTE_PNG_FREE(data);
-	return img;
+	return 1;
 
 cp_err:
+	CUTE_PNG_FREE(rows);
 	CUTE_PNG_FREE(data);
+	return 0;
+}
+
+cp_image_t cp_load_png_mem(const void* png_data, int png_length)
+{
+	cp_image_t img = { 0 };
+	int w, h, pix_bytes;
+
+	cp_load_png_wh(png_data, png_length, &w, &h);
+	CUTE_PNG_CHECK(w >= 1 && h >= 1, "invalid IHDR chunk found, image size was less than 1");
+	CUTE_PNG_CHECK(((int64_t)w * sizeof(cp_pixel_t) + 1) * h < INT_MAX, "image too large");
+	pix_bytes = cp_png_decode_size(w, h);
+	img.w = w;
+	img.h = h;
+	img.pix = (cp_pixel_t*)CUTE_PNG_ALLOC(pix_bytes);
+	CUTE_PNG_CHECK(img.pix, "unable to allocate raw image space");
+	CUTE_PNG_CALL(cp_load_png_mem_to(png_data, png_length, img.pix, pix_bytes, 0));
+	return img;
+
+cp_err:
 	CUTE_PNG_FREE(img.pix);
 	img.pix = 0;
-
 	return img;
 }
 
@@ -23,10 +23,10 @@
 			#define CUTE_SOUND_PLATFORM_WINDOWS
 			#define CUTE_SOUND_PLATFORM_APPLE
 			#define CUTE_SOUND_PLATFORM_SDL
+			#define CUTE_SOUND_PLATFORM_NULL
 
-		For Windows cute_sound uses DirectSound. Due to the use of SSE intrinsics, MinGW
-		builds must be made with the compiler option: -march=native, or optionally SSE
-		can be disabled with CUTE_SOUND_SCALAR_MODE. More on this mode written below.
+		For Windows cute_sound uses DirectSound. The mixer has SSE2, AVX2 and NEON kernels
+		and picks one at runtime based on the CPU, so no special compiler options are needed.
 
 		For Apple machines cute_sound uses CoreAudio.
 
@@ -41,6 +41,11 @@
 			#define CUTE_SOUND_IMPLEMENTATION
 			#include <cute_sound.h>
 
+		The null platform has no audio device and never mixes on its own. Call cs_render
+		to mix the output into a buffer instead, as fast as the CPU allows. Its output only
+		depends on the calls made, which makes it suitable for benchmarks and for comparing
+		against golden renders on machines without sound hardware.
+
 		If you want to use cute_sound with SDL_RWops, you must enable it by putting this
 		before you #include cute_sound.h:
 
@@ -119,10 +124,10 @@
 			2. load sounds from disk into memory (call cs_load_wav, or cs_load_ogg with stb_vorbis.c)
 			3. play sounds (cs_play_sound), or music (cs_music_play)
 
-	DISABLE SSE SIMD ACCELERATION
+	DISABLE SIMD ACCELERATION
 
-		If for whatever reason you don't want to use SSE intrinsics and instead would prefer
-		plain C (for example if your platform does not support SSE) then define
+		If for whatever reason you don't want to use SIMD intrinsics and instead would prefer
+		plain C (for example if your compiler lacks the intrinsic headers) then define
 		CUTE_SOUND_SCALAR_MODE before including cute_sound.h while also defining the
 		symbol definitions. Here's an example:
 
@@ -136,6 +141,8 @@
 		macros before including this file to override them.
 
 			CUTE_SOUND_MINIMUM_BUFFERED_SAMPLES
+			CUTE_SOUND_COMMAND_QUEUE_SIZE
+			CUTE_SOUND_MAX_VOICES
 			CUTE_SOUND_ASSERT
 			CUTE_SOUND_ALLOC
 			CUTE_SOUND_FREE
@@ -172,30 +179,11 @@
 		    large chunks of memory, and not very often (if at all).
 
 		Q : Does this library support audio streaming? Something like System::createStream in FMOD.
-		A : No. Typically music files aren't that large (in the megabytes). Compare this to a typical
-		    DXT texture of 1024x1024, at 0.5MB of memory. Now say an average music file for a game is three
-		    minutes long. Loading this file into memory and storing it as raw 16bit samples with two channels,
-		    would be:
-
-		        num_samples = 3 * 60 * 44100 * 2
-		        num_bits = num_samples * 16
-		        num_bytes = num_bits / 8
-		        num_megabytes = num_bytes / (1024 * 1024)
-		        or 30.3mb
-
-		    So say the user has 2gb of spare RAM. That means we could fit 67 different three minute length
-		    music files in there simultaneously. That is a ridiculous amount of spare memory. 30mb is nothing
-		    nowadays. Just load your music file into memory all at once and then play it.
-
-		Q : But I really need streaming of audio files from disk to save memory! Also loading my audio
-		    files (like .OGG) takes a long time (multiple seconds).
-		A : It is recommended to either A) load up your music files before they are needed, perhaps during
-		    a loading screen, or B) stream in the entire audio into memory on another thread. cs_read_mem_ogg is
-		    a great candidate function to throw onto a job pool. Streaming is more a remnant of older machines
-		    (like in the 90's or early 2000's) where decoding speed and RAM were real nasty bottlenecks. For
-		    more modern machines, these aren't really concerns, even with mobile devices. If even after reading
-		    this Q/A section you still want to stream your audio, you can try mini_al as an alternative:
-		    https://github.com/dr-soft/mini_al
+		A : Yes, for OGG files. cs_load_ogg_stream and cs_read_mem_ogg_stream keep the compressed file
+		    in memory and decode it while playing. A three minute stereo track fully decoded to floats
+		    takes about 60mb, while a playing stream only needs its compressed file plus a ring buffer
+		    of a few thousand samples. Opening a stream only parses the OGG headers, so it is also much
+		    faster than decoding the whole file up front.
 */
 
 #if !defined(CUTE_SOUND_H)
@@ -255,7 +243,8 @@ const char* cs_error_as_string(cs_error_t error);
 
 /**
  * Pass in NULL for `os_handle`, except for the DirectSound backend this should be hwnd.
- * play_frequency_in_Hz depends on your audio file, 44100 seems to be fine.
+ * play_frequency_in_Hz is the device rate, 44100 seems to be fine. Audio sources at other rates
+ * are resampled while mixing: music with a windowed sinc, sounds with linear interpolation.
  * buffered_samples is clamped to be at least 1024.
  */
 cs_error_t cs_init(void* os_handle, unsigned play_frequency_in_Hz, int buffered_samples, void* user_allocator_context /* = NULL */);
@@ -272,6 +261,9 @@ void cs_set_global_pause(bool true_for_paused);
 /**
  * Spawns a mixing thread dedicated to mixing audio in the background.
  * If you don't call this function mixing will happen on the main-thread when you call `cs_update`.
+ * The rest of the API should be called from one thread, and never waits on the mixer. Changes
+ * are queued and applied at the start of the next mix, and getters report the state as of the
+ * last mix.
  */
 void cs_spawn_mix_thread();
 
@@ -281,6 +273,42 @@ void cs_spawn_mix_thread();
  */
 void cs_mix_thread_sleep_delay(int milliseconds);
 
+#ifdef CUTE_SOUND_PLATFORM_NULL
+
+/**
+ * Null platform only. Mixes the next `sample_count` samples into `out` as interleaved 16 bit
+ * stereo, two values per sample, and returns `sample_count`. cs_update still applies queued
+ * changes and advances fades, but mixes nothing, so call it between renders just like in a game
+ * loop. The output only depends on the calls made, in order, including the sizes passed here.
+ */
+int cs_render(int16_t* out, int sample_count);
+
+#endif // CUTE_SOUND_PLATFORM_NULL
+
+/**
+ * At most `max_voices` sounds are mixed at once, 64 by default. Past that the voices with the
+ * lowest priority, and then the quietest, go virtual: they keep playing silently and cost next
+ * to nothing, and come back when enough real voices finish. Music is always mixed.
+ */
+void cs_set_max_voices(int max_voices);
+int cs_get_real_voice_count();
+int cs_get_virtual_voice_count();
+
+typedef enum cs_simd_t
+{
+	CUTE_SOUND_SIMD_SCALAR,
+	CUTE_SOUND_SIMD_SSE2,
+	CUTE_SOUND_SIMD_AVX2,
+	CUTE_SOUND_SIMD_NEON,
+} cs_simd_t;
+
+/**
+ * cs_init picks the widest instruction set the CPU supports for mixing. cs_set_simd forces
+ * a different one, for testing and benchmarks. Returns false if the CPU doesn't support it.
+ */
+bool cs_set_simd(cs_simd_t simd);
+cs_simd_t cs_get_simd();
+
 /**
  * Sometimes useful for dynamic library shenanigans.
  */
@@ -296,6 +324,46 @@ cs_audio_source_t* cs_load_wav(const char* path, cs_error_t* err /* = NULL */);
 cs_audio_source_t* cs_read_mem_wav(const void* memory, size_t size, cs_error_t* err /* = NULL */);
 void cs_free_audio_source(cs_audio_source_t* audio);
 
+typedef enum cs_sample_format_t
+{
+	CUTE_SOUND_SAMPLE_FORMAT_FLOAT,
+	CUTE_SOUND_SAMPLE_FORMAT_INT16,
+	CUTE_SOUND_SAMPLE_FORMAT_ADPCM,
+} cs_sample_format_t;
+
+/**
+ * How sounds loaded from here on keep their samples in memory, shared by the WAV and OGG
+ * loaders. Float (the default) mixes fastest. 16 bit samples take half the memory and sound the
+ * same. IMA-ADPCM takes about a seventh of the memory, is lossy, and costs a decode per mix.
+ * The other formats are decoded into floats while mixing, so their voices always take the
+ * resampling path. Streamed music is unaffected.
+ */
+void cs_set_sample_format(cs_sample_format_t format);
+
+/**
+ * Caps how many instances of `audio` can play at once, 0 (the default) for no cap. Going over
+ * stops the instance with the lowest priority and volume, oldest first, unless the new one
+ * is lower still. Priority goes from 0 (the default) to 15 and also decides which voices go
+ * virtual first, see cs_set_max_voices. Set these before playing the audio.
+ */
+void cs_audio_set_max_instances(cs_audio_source_t* audio, int max_instances);
+void cs_audio_set_priority(cs_audio_source_t* audio, int priority);
+
+typedef enum cs_falloff_t
+{
+	CUTE_SOUND_FALLOFF_LINEAR,
+	CUTE_SOUND_FALLOFF_INVERSE,
+	CUTE_SOUND_FALLOFF_INVERSE_SQUARE,
+} cs_falloff_t;
+
+/**
+ * How positional instances of `audio` fade with distance from the listener, see cs_sound_params_t.
+ * They play at full volume up to `min_distance` and fade out along `falloff` to silence at
+ * `max_distance`, where they stop being mixed at all. The inverse curves need a `min_distance`
+ * above 0. Defaults to linear from 1 to 1000.
+ */
+void cs_audio_set_falloff(cs_audio_source_t* audio, cs_falloff_t falloff, float min_distance, float max_distance);
+
 // If stb_vorbis was included *before* cute_sound go ahead and create
 // some functions for dealing with OGG files.
 #ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
@@ -303,6 +371,12 @@ void cs_free_audio_source(cs_audio_source_t* audio);
 	cs_audio_source_t* cs_load_ogg(const char* path, cs_error_t* err /* = NULL */);
 	cs_audio_source_t* cs_read_mem_ogg(const void* memory, size_t size, cs_error_t* err /* = NULL */);
 
+	// Streamed sources keep only the compressed file in memory. Every playing instance
+	// decodes ahead into its own small ring buffer on the mixing thread, so memory use
+	// no longer grows with the length of the track. Best suited for music.
+	cs_audio_source_t* cs_load_ogg_stream(const char* path, cs_error_t* err /* = NULL */);
+	cs_audio_source_t* cs_read_mem_ogg_stream(const void* memory, size_t size, cs_error_t* err /* = NULL */);
+
 #endif
 
 // SDL_RWops specific functions
@@ -328,6 +402,7 @@ void cs_music_stop(float fade_out_time /* = 0 */);
 void cs_music_pause();
 void cs_music_resume();
 void cs_music_set_volume(float volume_0_to_1);
+void cs_music_set_pitch(float pitch);
 void cs_music_set_loop(bool true_to_loop);
 void cs_music_switch_to(cs_audio_source_t* audio, float fade_out_time /* = 0 */, float fade_in_time /* = 0 */);
 void cs_music_crossfade(cs_audio_source_t* audio, float cross_fade_time /* = 0 */);
@@ -346,6 +421,13 @@ typedef struct cs_sound_params_t
 	float volume /* = 1.0f */;
 	float pan    /* = 0.5f */; // Can be from 0 to 1.
 	float delay  /* = 0 */;
+	float pitch  /* = 1.0f */; // Playback rate, 2 plays an octave up at twice the speed.
+
+	// Positional sounds ignore `pan`, and are panned and faded by the mixer from where they
+	// sit relative to the listener instead.
+	bool positional /* = false */;
+	float x      /* = 0 */;
+	float y      /* = 0 */;
 } cs_sound_params_t;
 
 cs_sound_params_t cs_sound_params_default();
@@ -356,15 +438,68 @@ bool cs_sound_is_active(cs_playing_sound_t sound);
 bool cs_sound_get_is_paused(cs_playing_sound_t sound);
 bool cs_sound_get_is_looped(cs_playing_sound_t sound);
 float cs_sound_get_volume(cs_playing_sound_t sound);
+float cs_sound_get_pitch(cs_playing_sound_t sound);
 uint64_t cs_sound_get_sample_index(cs_playing_sound_t sound);
 void cs_sound_set_is_paused(cs_playing_sound_t sound, bool true_for_paused);
 void cs_sound_set_is_looped(cs_playing_sound_t sound, bool true_for_looped);
 void cs_sound_set_volume(cs_playing_sound_t sound, float volume_0_to_1);
+void cs_sound_set_pitch(cs_playing_sound_t sound, float pitch);
+void cs_sound_set_position(cs_playing_sound_t sound, float x, float y);
 cs_error_t cs_sound_set_sample_index(cs_playing_sound_t sound, uint64_t sample_index);
 
 void cs_set_playing_sounds_volume(float volume_0_to_1);
 void cs_stop_all_playing_sounds();
 
+/**
+ * Where positional sounds are heard from, at 0, 0 by default. Sounds to the side pan with
+ * constant power, and sounds closer than their min distance pan toward the center.
+ */
+void cs_set_listener_position(float x, float y);
+
+// -------------------------------------------------------------------------------------------------
+// Buses.
+
+typedef enum cs_bus_t
+{
+	CUTE_SOUND_BUS_SFX,
+	CUTE_SOUND_BUS_MUSIC,
+	CUTE_SOUND_BUS_UI,
+	CUTE_SOUND_BUS_VOICE,
+
+	CUTE_SOUND_BUS_COUNT,
+} cs_bus_t;
+
+typedef enum cs_filter_t
+{
+	CUTE_SOUND_FILTER_NONE,
+	CUTE_SOUND_FILTER_LOWPASS,
+	CUTE_SOUND_FILTER_HIGHPASS,
+} cs_filter_t;
+
+/**
+ * Sounds play through the SFX bus unless cs_audio_set_bus picks another one, and music always
+ * plays through the music bus. Set the bus before playing the audio.
+ */
+void cs_audio_set_bus(cs_audio_source_t* audio, cs_bus_t bus);
+void cs_bus_set_volume(cs_bus_t bus, float volume_0_to_1);
+float cs_bus_get_volume(cs_bus_t bus);
+
+/**
+ * Buses with effects are mixed on their own and run through their effects once per mix, filter
+ * first, then the compressor, then the reverb, so an effect costs the same however many sounds
+ * play through it. `q` of 0.707 gives a flat filter, higher values ring at the cutoff.
+ * A `wet_0_to_1` of 0 turns the reverb off, and a `ratio` of 1 or less the compressor.
+ */
+void cs_bus_set_filter(cs_bus_t bus, cs_filter_t filter, float cutoff_in_Hz, float q /* = 0.707f */);
+void cs_bus_set_reverb(cs_bus_t bus, float room_size_0_to_1, float wet_0_to_1);
+void cs_bus_set_compressor(cs_bus_t bus, float threshold_in_db, float ratio, float attack_in_milliseconds, float release_in_milliseconds);
+
+/**
+ * Keeps the final mix under `ceiling_in_db` (e.g. -0.3f) by turning it down instead of letting
+ * it clip. Off by default.
+ */
+void cs_set_limiter(bool true_to_enable, float ceiling_in_db);
+
 // -------------------------------------------------------------------------------------------------
 // Global context.
 
@@ -385,6 +520,17 @@ void cs_set_global_user_allocator_context(void* user_allocator_context);
 #	define CUTE_SOUND_MINIMUM_BUFFERED_SAMPLES 1024
 #endif
 
+// Slots in the command queue to the mixer, must be a power of two. Commands that don't fit
+// wait on the game thread until the mixer catches up, so this only needs to cover a typical frame.
+#ifndef CUTE_SOUND_COMMAND_QUEUE_SIZE
+#	define CUTE_SOUND_COMMAND_QUEUE_SIZE 1024
+#endif
+
+// Default for cs_set_max_voices.
+#ifndef CUTE_SOUND_MAX_VOICES
+#	define CUTE_SOUND_MAX_VOICES 64
+#endif
+
 #if !defined(CUTE_SOUND_ASSERT)
 #	include <assert.h>
 #	define CUTE_SOUND_ASSERT assert
@@ -459,6 +605,7 @@ void cs_set_global_user_allocator_context(void* user_allocator_context);
 #define CUTE_SOUND_WINDOWS 1
 #define CUTE_SOUND_APPLE   2
 #define CUTE_SOUND_SDL     3
+#define CUTE_SOUND_NULL    4
 
 // Use CUTE_SOUND_FORCE_SDL as a way to force CUTE_SOUND_PLATFORM_SDL.
 #ifdef CUTE_SOUND_FORCE_SDL
@@ -473,6 +620,8 @@ void cs_set_global_user_allocator_context(void* user_allocator_context);
 		#define CUTE_SOUND_PLATFORM CUTE_SOUND_APPLE
 	#elif defined(CUTE_SOUND_PLATFORM_SDL)
 		#define CUTE_SOUND_PLATFORM CUTE_SOUND_SDL
+	#elif defined(CUTE_SOUND_PLATFORM_NULL)
+		#define CUTE_SOUND_PLATFORM CUTE_SOUND_NULL
 	#else
 		// Detect the platform automatically.
 		#if defined(_WIN32)
@@ -535,248 +684,934 @@ void cs_set_global_user_allocator_context(void* user_allocator_context);
 		#include <alloca.h>
 	#endif
 
+#elif CUTE_SOUND_PLATFORM == CUTE_SOUND_NULL
+
+	// No device, see cs_render.
+
 #else
 
-	#error Unsupported platform - please choose one of CUTE_SOUND_WINDOWS, CUTE_SOUND_APPLE, CUTE_SOUND_SDL.
+	#error Unsupported platform - please choose one of CUTE_SOUND_WINDOWS, CUTE_SOUND_APPLE, CUTE_SOUND_SDL, CUTE_SOUND_NULL.
 
 #endif
 
-#ifdef CUTE_SOUND_SCALAR_MODE
+#include <math.h>
 
-	#include <limits.h>
+// SIMD kernels are compiled for every instruction set the target architecture may have
+// and picked at runtime in cs_init, so no special compiler flags are needed.
+#ifndef CUTE_SOUND_SCALAR_MODE
+	#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+		#define CUTE_SOUND_X86
+		#include <immintrin.h>
+		#ifdef _MSC_VER
+			#include <intrin.h>
+		#endif
+	#elif defined(__aarch64__) || defined(_M_ARM64)
+		#define CUTE_SOUND_NEON
+		#include <arm_neon.h>
+	#endif
+#endif
 
-	#define CUTE_SOUND_SATURATE16(X) (int16_t)((X) > SHRT_MAX ? SHRT_MAX : ((X) < SHRT_MIN ? SHRT_MIN : (X)))
+#if defined(__GNUC__) || defined(__clang__)
+	#define CUTE_SOUND_TARGET(X) __attribute__((target(X)))
+#else
+	#define CUTE_SOUND_TARGET(X)
+#endif
 
-	typedef struct cs__m128
-	{
-		float a, b, c, d;
-	} cs__m128;
+// Acquire loads and release stores for the lock-free queues between the game and mixing threads.
+#if defined(__GNUC__) || defined(__clang__)
+	static unsigned cs_atomic_load(volatile unsigned* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+	static void cs_atomic_store(volatile unsigned* p, unsigned value) { __atomic_store_n(p, value, __ATOMIC_RELEASE); }
+#elif defined(_MSC_VER)
+	#include <intrin.h>
+	static unsigned cs_atomic_load(volatile unsigned* p) { return (unsigned)_InterlockedOr((volatile long*)p, 0); }
+	static void cs_atomic_store(volatile unsigned* p, unsigned value) { _InterlockedExchange((volatile long*)p, (long)value); }
+#else
+	static unsigned cs_atomic_load(volatile unsigned* p) { return *p; }
+	static void cs_atomic_store(volatile unsigned* p, unsigned value) { *p = value; }
+#endif
 
-	typedef struct cs__m128i
-	{
-		int32_t a, b, c, d;
-	} cs__m128i;
+#define CUTE_SOUND_ALIGN(X, Y) ((((size_t)X) + ((Y) - 1)) & ~((Y) - 1))
+#define CUTE_SOUND_TRUNC(X, Y) ((size_t)(X) & ~((Y) - 1))
 
-	cs__m128 cs_mm_set_ps(float e3, float e2, float e1, float e0)
-	{
-		cs__m128 a;
-		a.a = e0;
-		a.b = e1;
-		a.c = e2;
-		a.d = e3;
-		return a;
+// -------------------------------------------------------------------------------------------------
+// Mixing kernels.
+//
+// `mix` adds `count` samples of a voice into the two mixer channels, scaled by a volume per
+// channel. `pack` saturates the mixer channels into interleaved 16 bit samples, and `out` may
+// alias `a`. `count` is always a multiple of 4.
+
+typedef void (cs_mix_fn)(float* a, float* b, const float* src_a, const float* src_b, float va, float vb, int count);
+typedef void (cs_pack_fn)(int16_t* out, const float* a, const float* b, int count);
+
+static void cs_mix_scalar(float* a, float* b, const float* src_a, const float* src_b, float va, float vb, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		a[i] += src_a[i] * va;
+		b[i] += src_b[i] * vb;
 	}
+}
 
-	cs__m128 cs_mm_set1_ps(float e)
-	{
-		cs__m128 a;
-		a.a = e;
-		a.b = e;
-		a.c = e;
-		a.d = e;
-		return a;
+static int16_t cs_saturate16(float x)
+{
+	if (x > 32767.0f) x = 32767.0f;
+	if (x < -32768.0f) x = -32768.0f;
+	return (int16_t)lrintf(x);
+}
+
+static void cs_pack_scalar(int16_t* out, const float* a, const float* b, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		int16_t l = cs_saturate16(a[i]);
+		int16_t r = cs_saturate16(b[i]);
+		out[i * 2] = l;
+		out[i * 2 + 1] = r;
 	}
+}
 
-	cs__m128 cs_mm_load_ps(float const* mem_addr)
-	{
-		cs__m128 a;
-		a.a = mem_addr[0];
-		a.b = mem_addr[1];
-		a.c = mem_addr[2];
-		a.d = mem_addr[3];
-		return a;
+#ifdef CUTE_SOUND_X86
+
+CUTE_SOUND_TARGET("sse2")
+static void cs_mix_sse2(float* a, float* b, const float* src_a, const float* src_b, float va, float vb, int count)
+{
+	__m128 vA = _mm_set1_ps(va);
+	__m128 vB = _mm_set1_ps(vb);
+	for (int i = 0; i < count; i += 4) {
+		_mm_storeu_ps(a + i, _mm_add_ps(_mm_loadu_ps(a + i), _mm_mul_ps(_mm_loadu_ps(src_a + i), vA)));
+		_mm_storeu_ps(b + i, _mm_add_ps(_mm_loadu_ps(b + i), _mm_mul_ps(_mm_loadu_ps(src_b + i), vB)));
 	}
+}
 
-	cs__m128 cs_mm_add_ps(cs__m128 a, cs__m128 b)
-	{
-		cs__m128 c;
-		c.a = a.a + b.a;
-		c.b = a.b + b.b;
-		c.c = a.c + b.c;
-		c.d = a.d + b.d;
-		return c;
+// Clamping before the conversion keeps loud samples from wrapping to INT_MIN.
+CUTE_SOUND_TARGET("sse2")
+static void cs_pack_sse2(int16_t* out, const float* a, const float* b, int count)
+{
+	__m128 lo = _mm_set1_ps(-32768.0f);
+	__m128 hi = _mm_set1_ps(32767.0f);
+	for (int i = 0; i < count; i += 4) {
+		__m128i A = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(a + i), lo), hi));
+		__m128i B = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(b + i), lo), hi));
+		_mm_storeu_si128((__m128i*)(out + i * 2), _mm_packs_epi32(_mm_unpacklo_epi32(A, B), _mm_unpackhi_epi32(A, B)));
 	}
+}
 
-	cs__m128 cs_mm_mul_ps(cs__m128 a, cs__m128 b)
-	{
-		cs__m128 c;
-		c.a = a.a * b.a;
-		c.b = a.b * b.b;
-		c.c = a.c * b.c;
-		c.d = a.d * b.d;
-		return c;
+CUTE_SOUND_TARGET("avx2")
+static void cs_mix_avx2(float* a, float* b, const float* src_a, const float* src_b, float va, float vb, int count)
+{
+	__m256 vA = _mm256_set1_ps(va);
+	__m256 vB = _mm256_set1_ps(vb);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_ps(a + i, _mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_mul_ps(_mm256_loadu_ps(src_a + i), vA)));
+		_mm256_storeu_ps(b + i, _mm256_add_ps(_mm256_loadu_ps(b + i), _mm256_mul_ps(_mm256_loadu_ps(src_b + i), vB)));
 	}
+	if (i < count) cs_mix_sse2(a + i, b + i, src_a + i, src_b + i, va, vb, count - i);
+}
 
-	cs__m128i cs_mm_cvtps_epi32(cs__m128 a)
-	{
-		cs__m128i b;
-		b.a = a.a;
-		b.b = a.b;
-		b.c = a.c;
-		b.d = a.d;
-		return b;
+// The unpacks and packs work within 128 bit lanes, which keeps the samples in order.
+CUTE_SOUND_TARGET("avx2")
+static void cs_pack_avx2(int16_t* out, const float* a, const float* b, int count)
+{
+	__m256 lo = _mm256_set1_ps(-32768.0f);
+	__m256 hi = _mm256_set1_ps(32767.0f);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i A = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(a + i), lo), hi));
+		__m256i B = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(b + i), lo), hi));
+		_mm256_storeu_si256((__m256i*)(out + i * 2), _mm256_packs_epi32(_mm256_unpacklo_epi32(A, B), _mm256_unpackhi_epi32(A, B)));
 	}
+	if (i < count) cs_pack_sse2(out + i * 2, a + i, b + i, count - i);
+}
 
-	cs__m128i cs_mm_unpacklo_epi32(cs__m128i a, cs__m128i b)
-	{
-		cs__m128i c;
-		c.a = a.a;
-		c.b = b.a;
-		c.c = a.b;
-		c.d = b.b;
-		return c;
+static void cs_cpu_features(bool* sse2, bool* avx2)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	*sse2 = (info[3] >> 26) & 1;
+	// AVX state must also be enabled by the OS.
+	bool avx = ((info[2] >> 27) & 1) && ((info[2] >> 28) & 1) && (_xgetbv(0) & 6) == 6;
+	*avx2 = false;
+	if (avx && max_leaf >= 7) {
+		__cpuidex(info, 7, 0);
+		*avx2 = (info[1] >> 5) & 1;
 	}
+#else
+	__builtin_cpu_init();
+	*sse2 = __builtin_cpu_supports("sse2");
+	*avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
 
-	cs__m128i cs_mm_unpackhi_epi32(cs__m128i a, cs__m128i b)
-	{
-		cs__m128i c;
-		c.a = a.c;
-		c.b = b.c;
-		c.c = a.d;
-		c.d = b.d;
-		return c;
+#endif // CUTE_SOUND_X86
+
+#ifdef CUTE_SOUND_NEON
+
+static void cs_mix_neon(float* a, float* b, const float* src_a, const float* src_b, float va, float vb, int count)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		vst1q_f32(a + i, vmlaq_n_f32(vld1q_f32(a + i), vld1q_f32(src_a + i), va));
+		vst1q_f32(a + i + 4, vmlaq_n_f32(vld1q_f32(a + i + 4), vld1q_f32(src_a + i + 4), va));
+		vst1q_f32(b + i, vmlaq_n_f32(vld1q_f32(b + i), vld1q_f32(src_b + i), vb));
+		vst1q_f32(b + i + 4, vmlaq_n_f32(vld1q_f32(b + i + 4), vld1q_f32(src_b + i + 4), vb));
+	}
+	for (; i < count; i += 4) {
+		vst1q_f32(a + i, vmlaq_n_f32(vld1q_f32(a + i), vld1q_f32(src_a + i), va));
+		vst1q_f32(b + i, vmlaq_n_f32(vld1q_f32(b + i), vld1q_f32(src_b + i), vb));
 	}
+}
 
-	cs__m128i cs_mm_packs_epi32(cs__m128i a, cs__m128i b)
-	{
-		union {
-			int16_t c[8];
-			cs__m128i m;
-		} dst;
-		dst.c[0] = CUTE_SOUND_SATURATE16(a.a);
-		dst.c[1] = CUTE_SOUND_SATURATE16(a.b);
-		dst.c[2] = CUTE_SOUND_SATURATE16(a.c);
-		dst.c[3] = CUTE_SOUND_SATURATE16(a.d);
-		dst.c[4] = CUTE_SOUND_SATURATE16(b.a);
-		dst.c[5] = CUTE_SOUND_SATURATE16(b.b);
-		dst.c[6] = CUTE_SOUND_SATURATE16(b.c);
-		dst.c[7] = CUTE_SOUND_SATURATE16(b.d);
-		return dst.m;
-	}
-
-#else // CUTE_SOUND_SCALAR_MODE
-
-	#include <xmmintrin.h>
-	#include <emmintrin.h>
-
-	#define cs__m128 __m128
-	#define cs__m128i __m128i
-
-	#define cs_mm_set_ps _mm_set_ps
-	#define cs_mm_set1_ps _mm_set1_ps
-	#define cs_mm_load_ps _mm_load_ps
-	#define cs_mm_add_ps _mm_add_ps
-	#define cs_mm_mul_ps _mm_mul_ps
-	#define cs_mm_cvtps_epi32 _mm_cvtps_epi32
-	#define cs_mm_unpacklo_epi32 _mm_unpacklo_epi32
-	#define cs_mm_unpackhi_epi32 _mm_unpackhi_epi32
-	#define cs_mm_packs_epi32 _mm_packs_epi32
-
-#endif // CUTE_SOUND_SCALAR_MODE
+// The float to int conversion saturates on ARM, so no clamping is needed.
+static void cs_pack_neon(int16_t* out, const float* a, const float* b, int count)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		int16x8x2_t s;
+		s.val[0] = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(a + i))), vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(a + i + 4))));
+		s.val[1] = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(b + i))), vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(b + i + 4))));
+		vst2q_s16(out + i * 2, s);
+	}
+	for (; i < count; i += 4) {
+		int16x4x2_t s;
+		s.val[0] = vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(a + i)));
+		s.val[1] = vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(b + i)));
+		vst2_s16(out + i * 2, s);
+	}
+}
 
-#define CUTE_SOUND_ALIGN(X, Y) ((((size_t)X) + ((Y) - 1)) & ~((Y) - 1))
-#define CUTE_SOUND_TRUNC(X, Y) ((size_t)(X) & ~((Y) - 1))
+#endif // CUTE_SOUND_NEON
 
 // -------------------------------------------------------------------------------------------------
-// hashtable.h implementation by Mattias Gustavsson
-// See: http://www.mattiasgustavsson.com/ and https://github.com/mattiasgustavsson/libs/blob/master/hashtable.h
-// begin hashtable.h
+// Resampling kernels.
+//
+// Sources that don't play at the device rate are read at a fractional position in 32.32 fixed
+// point. `resample` adds `count` interpolated samples times `volume` into `out`, where output i
+// sits at position `pos + i * step` relative to `in`. `in` must hold CUTE_SOUND_SINC_TAPS / 2 - 1
+// samples of history before it and CUTE_SOUND_SINC_TAPS / 2 after the last position.
+//
+// Music goes through an 8 tap Blackman windowed sinc, interpolated between table phases, and
+// everything else is linearly interpolated. When downsampling the sinc's cutoff is lowered to
+// 1 / step in quarter octave bands so the dropped highs don't fold back as aliasing; past the
+// last band, a step above about 3.4, the taps are too few and some aliasing gets through. The
+// fraction is cut down to bits a float holds exactly and every kernel sums in the same order, so
+// all instruction sets produce identical output.
+
+#define CUTE_SOUND_SINC_TAPS 8
+#define CUTE_SOUND_RESAMPLE_SCRATCH 1024
+#define CUTE_SOUND_SINC_PHASES 256
+#define CUTE_SOUND_SINC_BANDS 8
+#define CUTE_SOUND_UNIT_STEP ((uint64_t)1 << 32)
+
+typedef void (cs_resample_fn)(float* out, const float* in, uint64_t pos, uint64_t step, float volume, int count);
+
+static float s_sinc_table[CUTE_SOUND_SINC_BANDS][(CUTE_SOUND_SINC_PHASES + 1) * CUTE_SOUND_SINC_TAPS];
+static uint64_t s_sinc_band_step[CUTE_SOUND_SINC_BANDS]; // largest step each band's cutoff is low enough for
+
+static void cs_init_sinc_table()
+{
+	const float pi = 3.14159265358979f;
+	for (int b = 0; b < CUTE_SOUND_SINC_BANDS; ++b) {
+		// Band b cuts off at 2^(-b/4) of the source's Nyquist frequency.
+		double cutoff = pow(2.0, -b / 4.0);
+		float fc = (float)cutoff;
+		s_sinc_band_step[b] = (uint64_t)((double)CUTE_SOUND_UNIT_STEP / cutoff);
+		for (int p = 0; p <= CUTE_SOUND_SINC_PHASES; ++p) {
+			float* row = s_sinc_table[b] + p * CUTE_SOUND_SINC_TAPS;
+			float frac = (float)p / CUTE_SOUND_SINC_PHASES;
+			float sum = 0;
+			for (int k = 0; k < CUTE_SOUND_SINC_TAPS; ++k) {
+				float x = (float)(k - (CUTE_SOUND_SINC_TAPS / 2 - 1)) - frac;
+				float sinc = x == 0 ? 1.0f : sinf(pi * fc * x) / (pi * fc * x);
+				float w = 0.42f + 0.5f * cosf(pi * x / (CUTE_SOUND_SINC_TAPS / 2)) + 0.08f * cosf(2.0f * pi * x / (CUTE_SOUND_SINC_TAPS / 2));
+				row[k] = fabsf(x) >= CUTE_SOUND_SINC_TAPS / 2 ? 0 : sinc * w;
+				sum += row[k];
+			}
+			// Unity gain at every phase, so DC passes through unchanged.
+			for (int k = 0; k < CUTE_SOUND_SINC_TAPS; ++k) row[k] /= sum;
+		}
+	}
+}
 
-#ifndef HASHTABLE_MEMSET
-	#define HASHTABLE_MEMSET(ptr, val, n) CUTE_SOUND_MEMSET(ptr, val, n)
-#endif
+// The table with the highest cutoff that still sits below the output's Nyquist frequency.
+static const float* cs_sinc_table(uint64_t step)
+{
+	int b = 0;
+	while (b < CUTE_SOUND_SINC_BANDS - 1 && step > s_sinc_band_step[b]) ++b;
+	return s_sinc_table[b];
+}
 
-#ifndef HASHTABLE_MEMCPY
-	#define HASHTABLE_MEMCPY(dst, src, n) CUTE_SOUND_MEMCPY(dst, src, n)
-#endif
+static float cs_linear_t(uint64_t pos)
+{
+	return (float)((uint32_t)pos >> 8) * (1.0f / 16777216.0f);
+}
 
-#ifndef HASHTABLE_MALLOC
-	#define HASHTABLE_MALLOC(ctx, size) CUTE_SOUND_ALLOC(size, ctx)
-#endif
+static float cs_sinc_t(uint64_t pos)
+{
+	return (float)(((uint32_t)pos >> 8) & 0xFFFF) * (1.0f / 65536.0f);
+}
 
-#ifndef HASHTABLE_FREE
-	#define HASHTABLE_FREE(ctx, ptr) CUTE_SOUND_FREE(ptr, ctx)
-#endif
+static const float* cs_sinc_row(const float* table, uint64_t pos)
+{
+	return table + ((uint32_t)pos >> 24) * CUTE_SOUND_SINC_TAPS;
+}
 
-/*
-------------------------------------------------------------------------------
-          Licensing information can be found at the end of the file.
-------------------------------------------------------------------------------
-hashtable.h - v1.1 - Cache efficient hash table implementation for C/C++.
-Do this:
-    #define HASHTABLE_IMPLEMENTATION
-before you include this file in *one* C/C++ file to create the implementation.
-*/
+static void cs_resample_linear_scalar(float* out, const float* in, uint64_t pos, uint64_t step, float volume, int count)
+{
+	for (int i = 0; i < count; ++i, pos += step) {
+		const float* s = in + (pos >> 32);
+		float t = cs_linear_t(pos);
+		out[i] += (s[0] + (s[1] - s[0]) * t) * volume;
+	}
+}
 
-#ifndef hashtable_h
-#define hashtable_h
+static float cs_sinc_scalar(const float* table, const float* in, uint64_t pos)
+{
+	const float* s = in + (pos >> 32) - (CUTE_SOUND_SINC_TAPS / 2 - 1);
+	const float* c0 = cs_sinc_row(table, pos);
+	const float* c1 = c0 + CUTE_SOUND_SINC_TAPS;
+	float t = cs_sinc_t(pos);
+	float p[4];
+	for (int k = 0; k < 4; ++k) {
+		float lo = (c0[k] + (c1[k] - c0[k]) * t) * s[k];
+		float hi = (c0[k + 4] + (c1[k + 4] - c0[k + 4]) * t) * s[k + 4];
+		p[k] = lo + hi;
+	}
+	return ((p[0] + p[1]) + p[2]) + p[3];
+}
 
-#ifndef HASHTABLE_U64
-    #define HASHTABLE_U64 unsigned long long
-#endif
+static void cs_resample_sinc_scalar(float* out, const float* in, uint64_t pos, uint64_t step, float volume, int count)
+{
+	const float* table = cs_sinc_table(step);
+	for (int i = 0; i < count; ++i, pos += step) {
+		out[i] += cs_sinc_scalar(table, in, pos) * volume;
+	}
+}
 
-typedef struct hashtable_t hashtable_t;
+#ifdef CUTE_SOUND_X86
 
-void hashtable_init( hashtable_t* table, int item_size, int initial_capacity, void* memctx );
-void hashtable_term( hashtable_t* table );
+// SSE2 has no gather, so the two neighbours are collected per lane and interpolated four at a time.
+CUTE_SOUND_TARGET("sse2")
+static void cs_resample_linear_sse2(float* out, const float* in, uint64_t pos, uint64_t step, float volume, int count)
+{
+	__m128 v = _mm_set1_ps(volume);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		float a[4], b[4], t[4];
+		for (int j = 0; j < 4; ++j, pos += step) {
+			const float* s = in + (pos >> 32);
+			a[j] = s[0];
+			b[j] = s[1];
+			t[j] = cs_linear_t(pos);
+		}
+		__m128 A = _mm_loadu_ps(a);
+		__m128 x = _mm_add_ps(A, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b), A), _mm_loadu_ps(t)));
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(x, v)));
+	}
+	cs_resample_linear_scalar(out + i, in, pos, step, volume, count - i);
+}
 
-void* hashtable_insert( hashtable_t* table, HASHTABLE_U64 key, void const* item );
-void hashtable_remove( hashtable_t* table, HASHTABLE_U64 key );
-void hashtable_clear( hashtable_t* table );
+// Four outputs at a time: one dot product per lane, then a transpose to finish all four sums at once.
+CUTE_SOUND_TARGET("sse2")
+static void cs_resample_sinc_sse2(float* out, const float* in, uint64_t pos, uint64_t step, float volume, int count)
+{
+	const float* table = cs_sinc_table(step);
+	__m128 v = _mm_set1_ps(volume);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 acc[4];
+		for (int j = 0; j < 4; ++j, pos += step) {
+			const float* s = in + (pos >> 32) - (CUTE_SOUND_SINC_TAPS / 2 - 1);
+			const float* c0 = cs_sinc_row(table, pos);
+			__m128 t = _mm_set1_ps(cs_sinc_t(pos));
+			__m128 lo = _mm_loadu_ps(c0);
+			__m128 hi = _mm_loadu_ps(c0 + 4);
+			lo = _mm_add_ps(lo, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(c0 + CUTE_SOUND_SINC_TAPS), lo), t));
+			hi = _mm_add_ps(hi, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(c0 + CUTE_SOUND_SINC_TAPS + 4), hi), t));
+			acc[j] = _mm_add_ps(_mm_mul_ps(lo, _mm_loadu_ps(s)), _mm_mul_ps(hi, _mm_loadu_ps(s + 4)));
+		}
+		_MM_TRANSPOSE4_PS(acc[0], acc[1], acc[2], acc[3]);
+		__m128 x = _mm_add_ps(_mm_add_ps(_mm_add_ps(acc[0], acc[1]), acc[2]), acc[3]);
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(x, v)));
+	}
+	cs_resample_sinc_scalar(out + i, in, pos, step, volume, count - i);
+}
 
-void* hashtable_find( hashtable_t const* table, HASHTABLE_U64 key );
+CUTE_SOUND_TARGET("avx2")
+static void cs_resample_linear_avx2(float* out, const float* in, uint64_t pos, uint64_t step, float volume, int count)
+{
+	__m256 v = _mm256_set1_ps(volume);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		int index[8];
+		float t[8];
+		for (int j = 0; j < 8; ++j, pos += step) {
+			index[j] = (int)(pos >> 32);
+			t[j] = cs_linear_t(pos);
+		}
+		__m256i I = _mm256_loadu_si256((const __m256i*)index);
+		__m256 A = _mm256_i32gather_ps(in, I, 4);
+		__m256 B = _mm256_i32gather_ps(in + 1, I, 4);
+		__m256 x = _mm256_add_ps(A, _mm256_mul_ps(_mm256_sub_ps(B, A), _mm256_loadu_ps(t)));
+		_mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(x, v)));
+	}
+	// Compilers may turn the tail into a jump without clearing the upper halves, which would slow
+	// down all SSE code after it, so clear them here.
+	_mm256_zeroupper();
+	cs_resample_linear_sse2(out + i, in, pos, step, volume, count - i);
+}
 
-int hashtable_count( hashtable_t const* table );
-void* hashtable_items( hashtable_t const* table );
-HASHTABLE_U64 const* hashtable_keys( hashtable_t const* table );
+// All 8 taps fit one register, folding its halves gives the same partial sums as the SSE2 kernel.
+CUTE_SOUND_TARGET("avx2")
+static void cs_resample_sinc_avx2(float* out, const float* in, uint64_t pos, uint64_t step, float volume, int count)
+{
+	const float* table = cs_sinc_table(step);
+	__m128 v = _mm_set1_ps(volume);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 acc[4];
+		for (int j = 0; j < 4; ++j, pos += step) {
+			const float* s = in + (pos >> 32) - (CUTE_SOUND_SINC_TAPS / 2 - 1);
+			const float* c0 = cs_sinc_row(table, pos);
+			__m256 c = _mm256_loadu_ps(c0);
+			c = _mm256_add_ps(c, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(c0 + CUTE_SOUND_SINC_TAPS), c), _mm256_set1_ps(cs_sinc_t(pos))));
+			__m256 x = _mm256_mul_ps(c, _mm256_loadu_ps(s));
+			acc[j] = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+		}
+		_MM_TRANSPOSE4_PS(acc[0], acc[1], acc[2], acc[3]);
+		__m128 x = _mm_add_ps(_mm_add_ps(_mm_add_ps(acc[0], acc[1]), acc[2]), acc[3]);
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(x, v)));
+	}
+	_mm256_zeroupper();
+	cs_resample_sinc_scalar(out + i, in, pos, step, volume, count - i);
+}
 
-void hashtable_swap( hashtable_t* table, int index_a, int index_b );
+#endif // CUTE_SOUND_X86
 
+// -------------------------------------------------------------------------------------------------
+// Effect kernels.
+//
+// `biquad` runs one channel through a biquad filter four samples at a time. The filter is unrolled
+// into a block form: each output of the block is a weighted sum of the four inputs and the state
+// (x[-1], x[-2], y[-1], y[-2]), with the weights in `columns`, 4 per input. `comb` and `allpass`
+// run a stretch of a delay line that doesn't wrap, see s_reverb. `dynamics` scales both channels
+// by a gain picked per block of 4 samples from the block's peak. `count` is always a multiple of 4,
+// and every kernel sums in the same order so all instruction sets produce identical output.
+
+typedef struct cs_dynamics_t
+{
+	bool limit;       // Brickwall limiter instead of a compressor.
+	float threshold;  // In mixer units, 32767 is full scale.
+	float exponent;   // 1 / ratio - 1.
+	float attack;     // Envelope coefficients per block.
+	float release;
+	float env;
+	float gain;
+} cs_dynamics_t;
+
+typedef void (cs_biquad_fn)(float* samples, int count, const float* columns, float* state);
+typedef void (cs_comb_fn)(float* out, const float* in, float* line, int count, float feedback);
+typedef void (cs_allpass_fn)(float* samples, float* line, int count, float feedback);
+typedef void (cs_dynamics_fn)(float* a, float* b, int count, cs_dynamics_t* d);
+
+static void cs_biquad_scalar(float* samples, int count, const float* columns, float* state)
+{
+	for (int i = 0; i < count; i += 4) {
+		float in[8] = { samples[i], samples[i + 1], samples[i + 2], samples[i + 3], state[0], state[1], state[2], state[3] };
+		float y[4];
+		for (int k = 0; k < 4; ++k) {
+			float acc = columns[k] * in[0];
+			for (int j = 1; j < 8; ++j) acc += columns[j * 4 + k] * in[j];
+			y[k] = acc;
+		}
+		state[0] = in[3];
+		state[1] = in[2];
+		state[2] = y[3];
+		state[3] = y[2];
+		for (int k = 0; k < 4; ++k) samples[i + k] = y[k];
+	}
+}
 
-#endif /* hashtable_h */
+// The delay lines are at least 4 samples long, so four samples never read what they write.
+static void cs_comb_scalar(float* out, const float* in, float* line, int count, float feedback)
+{
+	for (int i = 0; i < count; ++i) {
+		float y = line[i];
+		line[i] = in[i] + y * feedback;
+		out[i] += y;
+	}
+}
 
-/*
-----------------------
-    IMPLEMENTATION
-----------------------
-*/
+static void cs_allpass_scalar(float* samples, float* line, int count, float feedback)
+{
+	for (int i = 0; i < count; ++i) {
+		float y = line[i];
+		line[i] = samples[i] + y * feedback;
+		samples[i] = y - samples[i];
+	}
+}
 
-#ifndef hashtable_t_h
-#define hashtable_t_h
+// Compressors follow the peak with an envelope. The limiter drops straight to the gain that
+// keeps the block under the ceiling, and recovers at the release rate.
+static float cs_dynamics_gain(cs_dynamics_t* d, float peak)
+{
+	if (d->limit) {
+		float gain = d->gain + (1.0f - d->gain) * d->release;
+		if (peak * gain > d->threshold) gain = d->threshold / peak;
+		d->gain = gain;
+		return gain;
+	}
+	d->env += (peak - d->env) * (peak > d->env ? d->attack : d->release);
+	if (d->env < 1e-6f) d->env = 0;
+	if (d->env <= d->threshold) return 1.0f;
+	return powf(d->env / d->threshold, d->exponent);
+}
 
-#ifndef HASHTABLE_U32
-    #define HASHTABLE_U32 unsigned int
-#endif
+static void cs_dynamics_scalar(float* a, float* b, int count, cs_dynamics_t* d)
+{
+	for (int i = 0; i < count; i += 4) {
+		float peak = 0;
+		for (int j = i; j < i + 4; ++j) {
+			if (fabsf(a[j]) > peak) peak = fabsf(a[j]);
+			if (fabsf(b[j]) > peak) peak = fabsf(b[j]);
+		}
+		float gain = cs_dynamics_gain(d, peak);
+		for (int j = i; j < i + 4; ++j) {
+			a[j] *= gain;
+			b[j] *= gain;
+		}
+	}
+}
 
-struct hashtable_internal_slot_t
-    {
-    HASHTABLE_U32 key_hash;
-    int item_index;
-    int base_count;
-    };
+#ifdef CUTE_SOUND_X86
 
-struct hashtable_t
-    {
-    void* memctx;
-    int count;
-    int item_size;
+// These serve the AVX2 level as well, the biquad and dynamics work in blocks of 4 samples anyway.
+CUTE_SOUND_TARGET("sse2")
+static void cs_biquad_sse2(float* samples, int count, const float* columns, float* state)
+{
+	__m128 c[8];
+	for (int j = 0; j < 8; ++j) c[j] = _mm_loadu_ps(columns + j * 4);
+	__m128 s = _mm_loadu_ps(state);
+	for (int i = 0; i < count; i += 4) {
+		__m128 x = _mm_loadu_ps(samples + i);
+		__m128 acc = _mm_mul_ps(c[0], _mm_shuffle_ps(x, x, _MM_SHUFFLE(0, 0, 0, 0)));
+		acc = _mm_add_ps(acc, _mm_mul_ps(c[1], _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 1, 1, 1))));
+		acc = _mm_add_ps(acc, _mm_mul_ps(c[2], _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 2, 2, 2))));
+		acc = _mm_add_ps(acc, _mm_mul_ps(c[3], _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3))));
+		acc = _mm_add_ps(acc, _mm_mul_ps(c[4], _mm_shuffle_ps(s, s, _MM_SHUFFLE(0, 0, 0, 0))));
+		acc = _mm_add_ps(acc, _mm_mul_ps(c[5], _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1))));
+		acc = _mm_add_ps(acc, _mm_mul_ps(c[6], _mm_shuffle_ps(s, s, _MM_SHUFFLE(2, 2, 2, 2))));
+		acc = _mm_add_ps(acc, _mm_mul_ps(c[7], _mm_shuffle_ps(s, s, _MM_SHUFFLE(3, 3, 3, 3))));
+		s = _mm_shuffle_ps(x, acc, _MM_SHUFFLE(2, 3, 2, 3));
+		_mm_storeu_ps(samples + i, acc);
+	}
+	_mm_storeu_ps(state, s);
+}
 
-    struct hashtable_internal_slot_t* slots;
-    int slot_capacity;
+CUTE_SOUND_TARGET("sse2")
+static void cs_comb_sse2(float* out, const float* in, float* line, int count, float feedback)
+{
+	__m128 f = _mm_set1_ps(feedback);
+	for (int i = 0; i < count; i += 4) {
+		__m128 y = _mm_loadu_ps(line + i);
+		_mm_storeu_ps(line + i, _mm_add_ps(_mm_loadu_ps(in + i), _mm_mul_ps(y, f)));
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), y));
+	}
+}
 
-    HASHTABLE_U64* items_key;
-    int* items_slot;
-    void* items_data;
-    int item_capacity;
+CUTE_SOUND_TARGET("sse2")
+static void cs_allpass_sse2(float* samples, float* line, int count, float feedback)
+{
+	__m128 f = _mm_set1_ps(feedback);
+	for (int i = 0; i < count; i += 4) {
+		__m128 x = _mm_loadu_ps(samples + i);
+		__m128 y = _mm_loadu_ps(line + i);
+		_mm_storeu_ps(line + i, _mm_add_ps(x, _mm_mul_ps(y, f)));
+		_mm_storeu_ps(samples + i, _mm_sub_ps(y, x));
+	}
+}
 
-    void* swap_temp;
-    };
+CUTE_SOUND_TARGET("sse2")
+static void cs_dynamics_sse2(float* a, float* b, int count, cs_dynamics_t* d)
+{
+	__m128 sign = _mm_set1_ps(-0.0f);
+	for (int i = 0; i < count; i += 4) {
+		__m128 A = _mm_loadu_ps(a + i);
+		__m128 B = _mm_loadu_ps(b + i);
+		__m128 peak = _mm_max_ps(_mm_andnot_ps(sign, A), _mm_andnot_ps(sign, B));
+		peak = _mm_max_ps(peak, _mm_shuffle_ps(peak, peak, _MM_SHUFFLE(1, 0, 3, 2)));
+		peak = _mm_max_ps(peak, _mm_shuffle_ps(peak, peak, _MM_SHUFFLE(2, 3, 0, 1)));
+		__m128 gain = _mm_set1_ps(cs_dynamics_gain(d, _mm_cvtss_f32(peak)));
+		_mm_storeu_ps(a + i, _mm_mul_ps(A, gain));
+		_mm_storeu_ps(b + i, _mm_mul_ps(B, gain));
+	}
+}
 
-#endif /* hashtable_t_h */
+#endif // CUTE_SOUND_X86
 
-// end hashtable.h
+// -------------------------------------------------------------------------------------------------
+// Decoding kernels.
+//
+// Sources stored as 16 bit or IMA-ADPCM samples are decoded into the scratch buffers while mixing.
+// `convert` turns `count` 16 bit samples into floats. `adpcm` decodes `block_count` whole blocks of
+// one channel. Each block starts with the decoder state, the predictor and step index, so blocks
+// decode independently of each other and the SIMD kernels decode four at once, one per lane.
+// Decoding is integer math throughout, so all instruction sets produce identical output.
+
+#define CUTE_SOUND_ADPCM_BLOCK_SAMPLES 64
+#define CUTE_SOUND_ADPCM_BLOCK_BYTES (4 + CUTE_SOUND_ADPCM_BLOCK_SAMPLES / 2)
+
+typedef void (cs_convert_fn)(float* out, const int16_t* in, int count);
+typedef void (cs_adpcm_fn)(float* out, const uint8_t* blocks, int block_count);
+
+static const int s_adpcm_steps[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80,
+	88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544,
+	598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749,
+	3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+	12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+// Decodes one nibble, shared by the encoder so both sides track the same state.
+static int cs_adpcm_step(int* predictor, int* index, int nibble)
+{
+	int step = s_adpcm_steps[*index];
+	int diff = step >> 3;
+	if (nibble & 4) diff += step;
+	if (nibble & 2) diff += step >> 1;
+	if (nibble & 1) diff += step >> 2;
+	int p = *predictor + (nibble & 8 ? -diff : diff);
+	*predictor = p < -32768 ? -32768 : (p > 32767 ? 32767 : p);
+	int i = *index + ((nibble & 7) < 4 ? -1 : ((nibble & 7) - 3) * 2);
+	*index = i < 0 ? 0 : (i > 88 ? 88 : i);
+	return *predictor;
+}
 
-#define HASHTABLE_IMPLEMENTATION
+static void cs_adpcm_header(const uint8_t* block, int* predictor, int* index)
+{
+	*predictor = (int16_t)(block[0] | (block[1] << 8));
+	*index = block[2];
+}
+
+static void cs_convert_scalar(float* out, const int16_t* in, int count)
+{
+	for (int i = 0; i < count; ++i) out[i] = (float)in[i];
+}
+
+static void cs_adpcm_scalar(float* out, const uint8_t* blocks, int block_count)
+{
+	for (int b = 0; b < block_count; ++b) {
+		const uint8_t* block = blocks + b * CUTE_SOUND_ADPCM_BLOCK_BYTES;
+		int predictor, index;
+		cs_adpcm_header(block, &predictor, &index);
+		for (int k = 0; k < CUTE_SOUND_ADPCM_BLOCK_SAMPLES; ++k) {
+			int nibble = (block[4 + k / 2] >> ((k & 1) * 4)) & 15;
+			*out++ = (float)cs_adpcm_step(&predictor, &index, nibble);
+		}
+	}
+}
+
+#ifdef CUTE_SOUND_X86
+
+CUTE_SOUND_TARGET("sse2")
+static void cs_convert_sse2(float* out, const int16_t* in, int count)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+		_mm_storeu_ps(out + i, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)));
+		_mm_storeu_ps(out + i + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)));
+	}
+	cs_convert_scalar(out + i, in + i, count - i);
+}
+
+// cs_adpcm_step for one nibble in each lane. SSE2 has no 32 bit min and max, so the predictor
+// saturates through a 16 bit pack, and the step index, which stays within 16 bits, is clamped
+// with the 16 bit min and max.
+CUTE_SOUND_TARGET("sse2")
+static __m128i cs_adpcm_lanes_sse2(__m128i nibble, __m128i step, __m128i* predictor, __m128i* index)
+{
+	__m128i one = _mm_set1_epi32(1);
+	__m128i two = _mm_set1_epi32(2);
+	__m128i four = _mm_set1_epi32(4);
+	__m128i eight = _mm_set1_epi32(8);
+	__m128i diff = _mm_srai_epi32(step, 3);
+	diff = _mm_add_epi32(diff, _mm_and_si128(step, _mm_cmpeq_epi32(_mm_and_si128(nibble, four), four)));
+	diff = _mm_add_epi32(diff, _mm_and_si128(_mm_srai_epi32(step, 1), _mm_cmpeq_epi32(_mm_and_si128(nibble, two), two)));
+	diff = _mm_add_epi32(diff, _mm_and_si128(_mm_srai_epi32(step, 2), _mm_cmpeq_epi32(_mm_and_si128(nibble, one), one)));
+	__m128i negate = _mm_cmpeq_epi32(_mm_and_si128(nibble, eight), eight);
+	__m128i p = _mm_add_epi32(*predictor, _mm_sub_epi32(_mm_xor_si128(diff, negate), negate));
+	p = _mm_packs_epi32(p, p);
+	p = _mm_srai_epi32(_mm_unpacklo_epi16(p, p), 16);
+	*predictor = p;
+
+	__m128i low = _mm_and_si128(nibble, _mm_set1_epi32(7));
+	__m128i big = _mm_cmpgt_epi32(low, _mm_set1_epi32(3));
+	__m128i delta = _mm_or_si128(_mm_and_si128(big, _mm_sub_epi32(_mm_add_epi32(low, low), _mm_set1_epi32(6))), _mm_andnot_si128(big, _mm_set1_epi32(-1)));
+	__m128i i = _mm_add_epi32(*index, delta);
+	*index = _mm_min_epi16(_mm_max_epi16(i, _mm_setzero_si128()), _mm_set1_epi32(88));
+	return p;
+}
+
+// Eight samples of four blocks at a time, transposed back into each block's samples.
+#define CUTE_SOUND_ADPCM_GROUP(STEP)                                                                     \
+	for (; b + 4 <= block_count; b += 4) {                                                           \
+		const uint8_t* block[4];                                                                     \
+		int predictor[4], index[4];                                                                  \
+		for (int j = 0; j < 4; ++j) {                                                                \
+			block[j] = blocks + (b + j) * CUTE_SOUND_ADPCM_BLOCK_BYTES;                              \
+			cs_adpcm_header(block[j], predictor + j, index + j);                                     \
+		}                                                                                            \
+		__m128i p = _mm_loadu_si128((const __m128i*)predictor);                                      \
+		__m128i idx = _mm_loadu_si128((const __m128i*)index);                                        \
+		float* dst = out + b * CUTE_SOUND_ADPCM_BLOCK_SAMPLES;                                       \
+		for (int k = 0; k < CUTE_SOUND_ADPCM_BLOCK_SAMPLES; k += 8) {                                \
+			uint32_t word[4];                                                                        \
+			for (int j = 0; j < 4; ++j) CUTE_SOUND_MEMCPY(word + j, block[j] + 4 + k / 2, 4);        \
+			__m128i nibbles = _mm_loadu_si128((const __m128i*)word);                                 \
+			__m128 s[8];                                                                             \
+			for (int q = 0; q < 8; ++q) {                                                            \
+				__m128i nibble = _mm_and_si128(_mm_srl_epi32(nibbles, _mm_cvtsi32_si128(q * 4)), _mm_set1_epi32(15)); \
+				s[q] = _mm_cvtepi32_ps(cs_adpcm_lanes_sse2(nibble, STEP, &p, &idx));                 \
+			}                                                                                        \
+			_MM_TRANSPOSE4_PS(s[0], s[1], s[2], s[3]);                                               \
+			_MM_TRANSPOSE4_PS(s[4], s[5], s[6], s[7]);                                               \
+			for (int j = 0; j < 4; ++j) {                                                            \
+				_mm_storeu_ps(dst + j * CUTE_SOUND_ADPCM_BLOCK_SAMPLES + k, s[j]);                   \
+				_mm_storeu_ps(dst + j * CUTE_SOUND_ADPCM_BLOCK_SAMPLES + k + 4, s[j + 4]);           \
+			}                                                                                        \
+		}                                                                                            \
+	}
+
+CUTE_SOUND_TARGET("sse2")
+static __m128i cs_adpcm_steps_sse2(__m128i index)
+{
+	int i[4];
+	_mm_storeu_si128((__m128i*)i, index);
+	return _mm_setr_epi32(s_adpcm_steps[i[0]], s_adpcm_steps[i[1]], s_adpcm_steps[i[2]], s_adpcm_steps[i[3]]);
+}
+
+CUTE_SOUND_TARGET("sse2")
+static void cs_adpcm_sse2(float* out, const uint8_t* blocks, int block_count)
+{
+	int b = 0;
+	CUTE_SOUND_ADPCM_GROUP(cs_adpcm_steps_sse2(idx))
+	cs_adpcm_scalar(out + b * CUTE_SOUND_ADPCM_BLOCK_SAMPLES, blocks + b * CUTE_SOUND_ADPCM_BLOCK_BYTES, block_count - b);
+}
+
+CUTE_SOUND_TARGET("avx2")
+static void cs_convert_avx2(float* out, const int16_t* in, int count)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+		_mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(x));
+	}
+	cs_convert_scalar(out + i, in + i, count - i);
+}
+
+// Same as the SSE2 kernel, but with a gather for the step table.
+CUTE_SOUND_TARGET("avx2")
+static void cs_adpcm_avx2(float* out, const uint8_t* blocks, int block_count)
+{
+	int b = 0;
+	CUTE_SOUND_ADPCM_GROUP(_mm_i32gather_epi32(s_adpcm_steps, idx, 4))
+	cs_adpcm_scalar(out + b * CUTE_SOUND_ADPCM_BLOCK_SAMPLES, blocks + b * CUTE_SOUND_ADPCM_BLOCK_BYTES, block_count - b);
+}
+
+#endif // CUTE_SOUND_X86
+
+#ifdef CUTE_SOUND_NEON
+
+static void cs_convert_neon(float* out, const int16_t* in, int count)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		int16x8_t x = vld1q_s16(in + i);
+		vst1q_f32(out + i, vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))));
+		vst1q_f32(out + i + 4, vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))));
+	}
+	cs_convert_scalar(out + i, in + i, count - i);
+}
+
+#endif // CUTE_SOUND_NEON
+
+static cs_simd_t s_simd = CUTE_SOUND_SIMD_SCALAR;
+static cs_mix_fn* s_mix_kernel = cs_mix_scalar;
+static cs_pack_fn* s_pack_kernel = cs_pack_scalar;
+static cs_resample_fn* s_linear_kernel = cs_resample_linear_scalar;
+static cs_resample_fn* s_sinc_kernel = cs_resample_sinc_scalar;
+static cs_biquad_fn* s_biquad_kernel = cs_biquad_scalar;
+static cs_comb_fn* s_comb_kernel = cs_comb_scalar;
+static cs_allpass_fn* s_allpass_kernel = cs_allpass_scalar;
+static cs_dynamics_fn* s_dynamics_kernel = cs_dynamics_scalar;
+static cs_convert_fn* s_convert_kernel = cs_convert_scalar;
+static cs_adpcm_fn* s_adpcm_kernel = cs_adpcm_scalar;
+
+// The NEON level keeps the scalar resamplers and ADPCM decoder, which NEON has no gather to
+// speed up, and the scalar effects.
+bool cs_set_simd(cs_simd_t simd)
+{
+	cs_mix_fn* mix = NULL;
+	cs_pack_fn* pack = NULL;
+	cs_resample_fn* linear = cs_resample_linear_scalar;
+	cs_resample_fn* sinc = cs_resample_sinc_scalar;
+	cs_biquad_fn* biquad = cs_biquad_scalar;
+	cs_comb_fn* comb = cs_comb_scalar;
+	cs_allpass_fn* allpass = cs_allpass_scalar;
+	cs_dynamics_fn* dynamics = cs_dynamics_scalar;
+	cs_convert_fn* convert = cs_convert_scalar;
+	cs_adpcm_fn* adpcm = cs_adpcm_scalar;
+	switch (simd) {
+	case CUTE_SOUND_SIMD_SCALAR: mix = cs_mix_scalar; pack = cs_pack_scalar; break;
+#ifdef CUTE_SOUND_X86
+	case CUTE_SOUND_SIMD_SSE2:
+	case CUTE_SOUND_SIMD_AVX2:
+	{
+		bool sse2, avx2;
+		cs_cpu_features(&sse2, &avx2);
+		if (simd == CUTE_SOUND_SIMD_SSE2 && sse2) {
+			mix = cs_mix_sse2; pack = cs_pack_sse2;
+			linear = cs_resample_linear_sse2; sinc = cs_resample_sinc_sse2;
+			convert = cs_convert_sse2; adpcm = cs_adpcm_sse2;
+		}
+		if (simd == CUTE_SOUND_SIMD_AVX2 && avx2) {
+			mix = cs_mix_avx2; pack = cs_pack_avx2;
+			linear = cs_resample_linear_avx2; sinc = cs_resample_sinc_avx2;
+			convert = cs_convert_avx2; adpcm = cs_adpcm_avx2;
+		}
+		if (mix) {
+			biquad = cs_biquad_sse2; comb = cs_comb_sse2;
+			allpass = cs_allpass_sse2; dynamics = cs_dynamics_sse2;
+		}
+	}	break;
+#endif
+#ifdef CUTE_SOUND_NEON
+	case CUTE_SOUND_SIMD_NEON: mix = cs_mix_neon; pack = cs_pack_neon; convert = cs_convert_neon; break;
+#endif
+	default: break;
+	}
+	if (!mix) return false;
+	s_mix_kernel = mix;
+	s_pack_kernel = pack;
+	s_linear_kernel = linear;
+	s_sinc_kernel = sinc;
+	s_biquad_kernel = biquad;
+	s_comb_kernel = comb;
+	s_allpass_kernel = allpass;
+	s_dynamics_kernel = dynamics;
+	s_convert_kernel = convert;
+	s_adpcm_kernel = adpcm;
+	s_simd = simd;
+	return true;
+}
+
+cs_simd_t cs_get_simd()
+{
+	return s_simd;
+}
+
+// -------------------------------------------------------------------------------------------------
+// hashtable.h implementation by Mattias Gustavsson
+// See: http://www.mattiasgustavsson.com/ and https://github.com/mattiasgustavsson/libs/blob/master/hashtable.h
+// begin hashtable.h
+
+#ifndef HASHTABLE_MEMSET
+	#define HASHTABLE_MEMSET(ptr, val, n) CUTE_SOUND_MEMSET(ptr, val, n)
+#endif
+
+#ifndef HASHTABLE_MEMCPY
+	#define HASHTABLE_MEMCPY(dst, src, n) CUTE_SOUND_MEMCPY(dst, src, n)
+#endif
+
+#ifndef HASHTABLE_MALLOC
+	#define HASHTABLE_MALLOC(ctx, size) CUTE_SOUND_ALLOC(size, ctx)
+#endif
+
+#ifndef HASHTABLE_FREE
+	#define HASHTABLE_FREE(ctx, ptr) CUTE_SOUND_FREE(ptr, ctx)
+#endif
+
+/*
+------------------------------------------------------------------------------
+          Licensing information can be found at the end of the file.
+------------------------------------------------------------------------------
+hashtable.h - v1.1 - Cache efficient hash table implementation for C/C++.
+Do this:
+    #define HASHTABLE_IMPLEMENTATION
+before you include this file in *one* C/C++ file to create the implementation.
+*/
+
+#ifndef hashtable_h
+#define hashtable_h
+
+#ifndef HASHTABLE_U64
+    #define HASHTABLE_U64 unsigned long long
+#endif
+
+typedef struct hashtable_t hashtable_t;
+
+void hashtable_init( hashtable_t* table, int item_size, int initial_capacity, void* memctx );
+void hashtable_term( hashtable_t* table );
+
+void* hashtable_insert( hashtable_t* table, HASHTABLE_U64 key, void const* item );
+void hashtable_remove( hashtable_t* table, HASHTABLE_U64 key );
+void hashtable_clear( hashtable_t* table );
+
+void* hashtable_find( hashtable_t const* table, HASHTABLE_U64 key );
+
+int hashtable_count( hashtable_t const* table );
+void* hashtable_items( hashtable_t const* table );
+HASHTABLE_U64 const* hashtable_keys( hashtable_t const* table );
+
+void hashtable_swap( hashtable_t* table, int index_a, int index_b );
+
+
+#endif /* hashtable_h */
+
+/*
+----------------------
+    IMPLEMENTATION
+----------------------
+*/
+
+#ifndef hashtable_t_h
+#define hashtable_t_h
+
+#ifndef HASHTABLE_U32
+    #define HASHTABLE_U32 unsigned int
+#endif
+
+struct hashtable_internal_slot_t
+    {
+    HASHTABLE_U32 key_hash;
+    int item_index;
+    int base_count;
+    };
+
+struct hashtable_t
+    {
+    void* memctx;
+    int count;
+    int item_size;
+
+    struct hashtable_internal_slot_t* slots;
+    int slot_capacity;
+
+    HASHTABLE_U64* items_key;
+    int* items_slot;
+    void* items_data;
+    int item_capacity;
+
+    void* swap_temp;
+    };
+
+#endif /* hashtable_t_h */
+
+// end hashtable.h
+
+#define HASHTABLE_IMPLEMENTATION
 
 #ifdef HASHTABLE_IMPLEMENTATION
 #ifndef HASHTABLE_IMPLEMENTATION_ONCE
@@ -1287,12 +2122,31 @@ typedef struct cs_audio_source_t
 	// Number of instances currently referencing this audio. Must be zero
 	// in order to safely delete the audio. References are automatically
 	// updated whenever playing instances are inserted into the context.
+	// Owned by the mixer, along with `free_requested`.
 	int playing_count;
 
-	// The actual raw audio samples in memory.
+	// Set by cs_free_audio_source while instances still play, the last one frees the audio.
+	bool free_requested;
+
+	// The actual raw audio samples in memory, stored as `format`.
 	void* channels[2];
+	cs_sample_format_t format;
+
+	// Compressed file for streamed sources, which have no channels.
+	void* stream_data;
+	int stream_size;
+
+	int max_instances;
+	int priority;
+	int bus;
+	cs_falloff_t falloff;
+	float min_distance;
+	float max_distance;
+	cs_list_t instances; // Playing instances, oldest first. Owned by the mixer.
 } cs_audio_source_t;
 
+typedef struct cs_stream_t cs_stream_t;
+
 typedef struct cs_sound_inst_t
 {
 	uint64_t id;
@@ -1303,9 +2157,30 @@ typedef struct cs_sound_inst_t
 	float volume;
 	float pan0;
 	float pan1;
+	float pitch;
 	uint64_t sample_index;
+	uint32_t sample_frac; // Fraction of a sample past sample_index, for voices that are resampled.
 	cs_audio_source_t* audio;
+	cs_stream_t* stream;
 	cs_list_node_t node;
+	cs_list_node_t audio_node;
+	int voice_bin; // Rank for picking real voices, see cs_voice_bin.
+	bool positional;
+	float x;
+	float y;
+	float attenuation; // Distance fade of positional voices, worked out each mix.
+	bool culled; // Out of earshot, see s_spatialize.
+	volatile unsigned position; // sample_index as of the last mix, published for the game thread.
+
+	// Only touched by the game thread. `id` is the generation in the high bits and the slot
+	// in the low bits, so handles to a finished instance stop matching once it is reused.
+	uint32_t slot;
+	uint32_t generation;
+	unsigned reuse_after; // Command count the mixer must reach before this instance can be reused.
+	bool set_paused; // What the game last asked for, so the getters never read the mixer's copy.
+	bool set_looped;
+	float set_volume;
+	float set_pitch;
 } cs_sound_inst_t;
 
 typedef enum cs_music_state_t
@@ -1320,8 +2195,81 @@ typedef enum cs_music_state_t
 	CUTE_SOUND_MUSIC_STATE_PAUSED
 } cs_music_state_t;
 
+typedef enum cs_command_type_t
+{
+	CUTE_SOUND_COMMAND_PLAY,
+	CUTE_SOUND_COMMAND_STOP,
+	CUTE_SOUND_COMMAND_SET_PAUSED,
+	CUTE_SOUND_COMMAND_SET_LOOPED,
+	CUTE_SOUND_COMMAND_SET_VOLUME,
+	CUTE_SOUND_COMMAND_SET_PITCH,
+	CUTE_SOUND_COMMAND_SET_SAMPLE_INDEX,
+	CUTE_SOUND_COMMAND_STOP_ALL_SOUNDS,
+	CUTE_SOUND_COMMAND_FREE_AUDIO_SOURCE,
+	CUTE_SOUND_COMMAND_SET_BUS_VOLUME,
+	CUTE_SOUND_COMMAND_SET_BUS_FILTER,
+	CUTE_SOUND_COMMAND_SET_BUS_REVERB,
+	CUTE_SOUND_COMMAND_SET_BUS_COMPRESSOR,
+	CUTE_SOUND_COMMAND_SET_LIMITER,
+	CUTE_SOUND_COMMAND_SET_POSITION,
+	CUTE_SOUND_COMMAND_SET_LISTENER,
+} cs_command_type_t;
+
+typedef struct cs_command_t
+{
+	cs_command_type_t type;
+	cs_sound_inst_t* inst;
+	uint64_t id; // Instance commands are dropped if the instance has finished since.
+	bool flag;
+	float value;
+	uint64_t sample_index;
+	cs_audio_source_t* audio;
+	int bus;
+	int mode;
+	float params[4];
+	float* memory; // Mixer buffers and delay lines for the bus, see s_bus_memory.
+} cs_command_t;
+
 #define CUTE_SOUND_PAGE_INSTANCE_COUNT 1024
 
+// 16 priorities by 16 loudness steps, plus a top bin for music and streams.
+#define CUTE_SOUND_VOICE_BINS (16 * 16 + 1)
+
+// Freeverb style reverb: four combs then two allpasses per channel.
+#define CUTE_SOUND_REVERB_COMBS 4
+#define CUTE_SOUND_REVERB_ALLPASSES 2
+
+typedef struct cs_delay_line_t
+{
+	float* samples;
+	int length; // A multiple of 4, as is `pos`.
+	int pos;
+} cs_delay_line_t;
+
+typedef struct cs_reverb_t
+{
+	float feedback;
+	float wet; // 0 when off.
+	cs_delay_line_t combs[2][CUTE_SOUND_REVERB_COMBS];
+	cs_delay_line_t allpasses[2][CUTE_SOUND_REVERB_ALLPASSES];
+} cs_reverb_t;
+
+typedef struct cs_bus_state_t
+{
+	float volume; // Set straight from the game thread, like the global volume.
+
+	// Everything else belongs to the mixer. Buses without effects mix straight into the output.
+	bool effects;
+	float* floatA;
+	float* floatB;
+	cs_filter_t filter;
+	float filter_columns[32]; // See cs_biquad_fn.
+	float filter_state[2][4];
+	bool compress;
+	cs_dynamics_t compressor;
+	cs_reverb_t reverb;
+} cs_bus_state_t;
+
 typedef struct cs_inst_page_t
 {
 	struct cs_inst_page_t* next;
@@ -1334,6 +2282,7 @@ typedef struct cs_context_t
 	float global_volume /* = 1.0f */;
 	bool global_pause /* = false */;
 	float music_volume /* = 1.0f */;
+	float music_pitch /* = 1.0f */;
 	float sound_volume /* = 1.0f */;
 
 	bool music_paused /* = false */;
@@ -1346,22 +2295,51 @@ typedef struct cs_context_t
 	cs_sound_inst_t* music_playing /* = NULL */;
 	cs_sound_inst_t* music_next /* = NULL */;
 
-	int audio_sources_to_free_capacity /* = 0 */;
-	int audio_sources_to_free_size /* = 0 */;
-	cs_audio_source_t** audio_sources_to_free /* = NULL */;
-	uint64_t instance_id_gen /* = 1 */;
-	hashtable_t instance_map; // <uint64_t, cs_audio_source_t*>
 	cs_inst_page_t* pages /* = NULL */;
+	cs_inst_page_t** page_table; // Pages by index, to look up instances by slot.
+	int page_count;
+	int page_capacity;
 	cs_list_t playing_sounds;
 	cs_list_t free_sounds;
 
+	// Commands from the game thread to the mixer. Only the game thread writes `command_write`
+	// and only the mixer writes `command_read`, so neither ever waits on the other.
+	cs_command_t* commands;
+	volatile unsigned command_read;
+	volatile unsigned command_write;
+	unsigned commands_issued; // Every command queued so far, including the backlog.
+	cs_command_t* backlog; // Commands waiting on the game thread for room in the queue.
+	int backlog_first;
+	int backlog_count;
+	int backlog_capacity;
+
+	// Instances the mixer is done with, handed back to the game thread to reuse.
+	cs_sound_inst_t** retired;
+	volatile unsigned retired_read;
+	volatile unsigned retired_write;
+	cs_list_t retiring; // Retired instances waiting on the mixer for room in the queue.
+
+	int max_voices;
+	int real_voice_count;
+	int virtual_voice_count;
+	int voice_bins[CUTE_SOUND_VOICE_BINS]; // Voices per bin, counted each mix.
+
+	cs_bus_state_t buses[CUTE_SOUND_BUS_COUNT];
+	float* bus_memory[CUTE_SOUND_BUS_COUNT]; // Owned by the game thread, lent to the mixer.
+	float bus_volume[CUTE_SOUND_BUS_COUNT]; // Game thread copy, the mixer's is in `buses`.
+	bool limit;
+	cs_dynamics_t limiter;
+	float listener_x;
+	float listener_y;
+
 	unsigned latency_samples;
 	int Hz;
 	int bps;
 	int wide_count;
-	cs__m128* floatA;
-	cs__m128* floatB;
-	cs__m128i* samples;
+	float* floatA;
+	float* floatB;
+	int16_t* samples;
+	float* resample[2]; // Source samples gathered for resampled voices, CUTE_SOUND_RESAMPLE_SCRATCH each.
 	bool separate_thread;
 	bool running;
 	int sleep_milliseconds;
@@ -1404,6 +2382,12 @@ typedef struct cs_context_t
 	SDL_Thread* thread;
 	SDL_mutex* mutex;
 
+#elif CUTE_SOUND_PLATFORM == CUTE_SOUND_NULL
+
+	// Where cs_render wants the next mix, cs_mix mixes nothing while render_count is 0.
+	int16_t* render_out;
+	int render_count;
+
 #endif
 } cs_context_t;
 
@@ -1441,6 +2425,393 @@ static void cs_free16(void* p, void* mem_ctx)
 	CUTE_SOUND_FREE((char*)p - (((size_t)*((char*)p - 1)) & 0xFF), NULL);
 }
 
+static cs_audio_source_t* s_new_audio()
+{
+	cs_audio_source_t* audio = (cs_audio_source_t*)CUTE_SOUND_ALLOC(sizeof(cs_audio_source_t), s_mem_ctx);
+	CUTE_SOUND_MEMSET(audio, 0, sizeof(*audio));
+	cs_list_init(&audio->instances);
+	audio->falloff = CUTE_SOUND_FALLOFF_LINEAR;
+	audio->min_distance = 1.0f;
+	audio->max_distance = 1000.0f;
+	return audio;
+}
+
+static void cs_free_audio_memory(cs_audio_source_t* audio)
+{
+	cs_free16(audio->channels[0], s_mem_ctx);
+	CUTE_SOUND_FREE(audio->stream_data, s_mem_ctx);
+	CUTE_SOUND_FREE(audio, s_mem_ctx);
+}
+
+// -------------------------------------------------------------------------------------------------
+// Streamed sources.
+
+#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+
+struct cs_stream_t
+{
+	stb_vorbis* vorbis;
+	int channel_count;
+	int capacity; // In samples, a power of two.
+	unsigned read;
+	unsigned count;
+	int lead; // Samples kept behind the playhead as history for resampling.
+	bool done;
+	float* channels[2];
+};
+
+static cs_stream_t* cs_stream_open(cs_audio_source_t* audio)
+{
+	int error;
+	stb_vorbis* vorbis = stb_vorbis_open_memory((const unsigned char*)audio->stream_data, audio->stream_size, &error, NULL);
+	if (!vorbis) return NULL;
+
+	// Room for two full mixes, so the decoder can run a whole mix ahead.
+	int capacity = CUTE_SOUND_MINIMUM_BUFFERED_SAMPLES;
+	while (capacity < (int)s_ctx->latency_samples * 2 || capacity < CUTE_SOUND_RESAMPLE_SCRATCH * 2) capacity *= 2;
+
+	cs_stream_t* stream = (cs_stream_t*)CUTE_SOUND_ALLOC(sizeof(cs_stream_t), s_mem_ctx);
+	CUTE_SOUND_MEMSET(stream, 0, sizeof(*stream));
+	stream->vorbis = vorbis;
+	stream->channel_count = audio->channel_count;
+	stream->capacity = capacity;
+	stream->channels[0] = (float*)cs_malloc16(sizeof(float) * capacity * audio->channel_count, s_mem_ctx);
+	stream->channels[1] = audio->channel_count == 2 ? stream->channels[0] + capacity : NULL;
+	return stream;
+}
+
+static void cs_stream_close(cs_stream_t* stream)
+{
+	if (!stream) return;
+	stb_vorbis_close(stream->vorbis);
+	cs_free16(stream->channels[0], s_mem_ctx);
+	CUTE_SOUND_FREE(stream, s_mem_ctx);
+}
+
+static void cs_stream_seek(cs_stream_t* stream, unsigned sample_index)
+{
+	stb_vorbis_seek(stream->vorbis, sample_index);
+	stream->read = 0;
+	stream->count = 0;
+	stream->lead = 0;
+	stream->done = false;
+}
+
+// Decodes until `sample_count` samples are buffered, the ring is full or the stream ends.
+// Looped streams seek back to the start and keep decoding, so loops have no gap.
+static unsigned cs_stream_fill(cs_stream_t* stream, unsigned sample_count, bool looped)
+{
+	unsigned capacity = (unsigned)stream->capacity;
+	bool restarted = false;
+	if (sample_count > capacity) sample_count = capacity;
+
+	while (stream->count < sample_count && !stream->done) {
+		unsigned write = (stream->read + stream->count) & (capacity - 1);
+		unsigned span = capacity - write;
+		if (span > capacity - stream->count) span = capacity - stream->count;
+
+		float* out[2] = { stream->channels[0] + write, stream->channels[1] ? stream->channels[1] + write : NULL };
+		int n = stb_vorbis_get_samples_float(stream->vorbis, stream->channel_count, out, (int)span);
+		if (n > 0) {
+			// stb_vorbis decodes to [-1, 1], the mixer works in 16 bit range.
+			for (int c = 0; c < stream->channel_count; ++c) {
+				for (int i = 0; i < n; ++i) out[c][i] *= 32768.0f;
+			}
+			stream->count += n;
+			restarted = false;
+		} else if (looped && !restarted) {
+			stb_vorbis_seek_start(stream->vorbis);
+			restarted = true;
+		} else {
+			// Pad the last SIMD lane with silence.
+			while (stream->count & 3) {
+				write = (stream->read + stream->count++) & (capacity - 1);
+				for (int c = 0; c < stream->channel_count; ++c) stream->channels[c][write] = 0;
+			}
+			stream->done = true;
+		}
+	}
+
+	return stream->count;
+}
+
+// Copies ring samples [first, first + count) of one channel, relative to the read position.
+// Samples that aren't buffered read as silence.
+static void cs_stream_fetch(cs_stream_t* stream, int channel, float* dst, int first, int count)
+{
+	const float* src = stream->channels[channel];
+	unsigned mask = (unsigned)stream->capacity - 1;
+	for (int i = 0; i < count; ++i) {
+		int index = first + i;
+		dst[i] = index >= 0 && index < (int)stream->count ? src[(stream->read + index) & mask] : 0;
+	}
+}
+
+// Returns false once a stream that doesn't loop has played all of its samples.
+static bool cs_stream_mix(cs_sound_inst_t* playing, float* floatA, float* floatB, int samples_to_write, float vA, float vB)
+{
+	cs_stream_t* stream = playing->stream;
+	int mix_count = (int)cs_stream_fill(stream, (unsigned)CUTE_SOUND_ALIGN(samples_to_write, 4), playing->looped);
+	if (mix_count > samples_to_write) mix_count = samples_to_write;
+
+	// Mix in up to two spans, split where the ring wraps around.
+	int mix_wide = (int)CUTE_SOUND_ALIGN(mix_count, 4) / 4;
+	const float* cA = stream->channels[0];
+	const float* cB = stream->channels[1] ? stream->channels[1] : cA;
+	int first = stream->capacity - (int)stream->read;
+	if (first > mix_wide * 4) first = mix_wide * 4;
+	s_mix_kernel(floatA, floatB, cA + stream->read, cB + stream->read, vA, vB, first);
+	if (first < mix_wide * 4) s_mix_kernel(floatA + first, floatB + first, cA, cB, vA, vB, mix_wide * 4 - first);
+
+	stream->read = (stream->read + mix_wide * 4) & (stream->capacity - 1);
+	stream->count -= mix_wide * 4;
+	playing->sample_index += mix_count;
+	if (playing->audio->sample_count) playing->sample_index %= playing->audio->sample_count;
+	return !(stream->done && stream->count == 0);
+}
+
+#endif // STB_VORBIS_INCLUDE_STB_VORBIS_H
+
+// -------------------------------------------------------------------------------------------------
+// Resampled voices.
+
+// Decodes samples [first, first + count) of one channel, all within the sound, into floats.
+static void cs_decode(float* dst, const cs_audio_source_t* audio, int channel, int first, int count)
+{
+	switch (audio->format) {
+	case CUTE_SOUND_SAMPLE_FORMAT_FLOAT:
+		CUTE_SOUND_MEMCPY(dst, (const float*)audio->channels[channel] + first, sizeof(float) * count);
+		break;
+
+	case CUTE_SOUND_SAMPLE_FORMAT_INT16:
+		s_convert_kernel(dst, (const int16_t*)audio->channels[channel] + first, count);
+		break;
+
+	case CUTE_SOUND_SAMPLE_FORMAT_ADPCM:
+	{
+		// Whole blocks decode in place, partial ones at either end go through a block on the stack.
+		const uint8_t* blocks = (const uint8_t*)audio->channels[channel];
+		while (count > 0) {
+			int block = first / CUTE_SOUND_ADPCM_BLOCK_SAMPLES;
+			int offset = first % CUTE_SOUND_ADPCM_BLOCK_SAMPLES;
+			int whole = offset ? 0 : count / CUTE_SOUND_ADPCM_BLOCK_SAMPLES;
+			int n;
+			if (whole) {
+				s_adpcm_kernel(dst, blocks + block * CUTE_SOUND_ADPCM_BLOCK_BYTES, whole);
+				n = whole * CUTE_SOUND_ADPCM_BLOCK_SAMPLES;
+			} else {
+				float decoded[CUTE_SOUND_ADPCM_BLOCK_SAMPLES];
+				s_adpcm_kernel(decoded, blocks + block * CUTE_SOUND_ADPCM_BLOCK_BYTES, 1);
+				n = CUTE_SOUND_ADPCM_BLOCK_SAMPLES - offset;
+				if (n > count) n = count;
+				CUTE_SOUND_MEMCPY(dst, decoded + offset, sizeof(float) * n);
+			}
+			dst += n;
+			first += n;
+			count -= n;
+		}
+	}	break;
+	}
+}
+
+// Copies samples [first, first + count) of one channel as floats, wrapping around for looped
+// sounds and reading silence outside of the sound otherwise.
+static void cs_fetch(float* dst, const cs_audio_source_t* audio, int channel, int64_t first, int count, bool looped)
+{
+	int sample_count = audio->sample_count;
+	while (count > 0) {
+		int64_t index = first;
+		if (looped) {
+			index %= sample_count;
+			if (index < 0) index += sample_count;
+		}
+		int n = count;
+		if (index < 0) {
+			if (-index < n) n = (int)-index;
+			CUTE_SOUND_MEMSET(dst, 0, sizeof(float) * n);
+		} else if (index >= sample_count) {
+			CUTE_SOUND_MEMSET(dst, 0, sizeof(float) * n);
+		} else {
+			if (sample_count - index < n) n = (int)(sample_count - index);
+			cs_decode(dst, audio, channel, (int)index, n);
+		}
+		dst += n;
+		first += n;
+		count -= n;
+	}
+}
+
+// Position step per output sample in 32.32 fixed point, from the source rate and the pitch.
+static uint64_t cs_voice_step(cs_sound_inst_t* playing)
+{
+	int rate = playing->audio->sample_rate ? playing->audio->sample_rate : s_ctx->Hz;
+	double step = (double)rate / (double)s_ctx->Hz * (double)playing->pitch * (double)CUTE_SOUND_UNIT_STEP;
+	// Every chunk must fit at least a few outputs into the scratch buffers.
+	double max_step = (double)(CUTE_SOUND_RESAMPLE_SCRATCH / 16) * (double)CUTE_SOUND_UNIT_STEP;
+	if (step > max_step) step = max_step;
+	if (!(step >= 1.0)) step = 1.0; // also catches NaN
+	return (uint64_t)(step + 0.5);
+}
+
+// Mixes a voice that doesn't play at the device rate, or sits between two samples, in chunks that
+// fit the scratch buffers. Music is interpolated with the windowed sinc, everything else linearly.
+// Returns false once a sound that doesn't loop has played all of its samples.
+static bool cs_mix_resampled(cs_sound_inst_t* playing, float* floatA, float* floatB, int samples_to_write, float vA, float vB, uint64_t step)
+{
+	cs_audio_source_t* audio = playing->audio;
+	cs_resample_fn* kernel = playing->is_music ? s_sinc_kernel : s_linear_kernel;
+	int history = CUTE_SOUND_SINC_TAPS / 2 - 1;
+	int written = 0;
+	bool done = false;
+
+	while (written < samples_to_write && !done) {
+		int count = samples_to_write - written;
+		uint64_t max_count = (((uint64_t)(CUTE_SOUND_RESAMPLE_SCRATCH - CUTE_SOUND_SINC_TAPS - 1) << 32) / step) & ~(uint64_t)3;
+		if ((uint64_t)count > max_count) count = (int)max_count;
+
+		// Samples left from the playhead, once the end of the sound is in sight.
+		bool ending = false;
+		int64_t left = 0;
+#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+		cs_stream_t* stream = playing->stream;
+		if (stream) {
+			uint64_t reach = (playing->sample_frac + (uint64_t)count * step) >> 32;
+			cs_stream_fill(stream, (unsigned)(stream->lead + reach + CUTE_SOUND_SINC_TAPS), playing->looped);
+			ending = stream->done;
+			left = (int64_t)stream->count - stream->lead;
+		} else
+#endif
+		if (!playing->looped) {
+			ending = true;
+			left = (int64_t)audio->sample_count - (int64_t)playing->sample_index;
+		}
+
+		if (ending) {
+			// Cut the chunk at the last output that still lands on a sample.
+			uint64_t end = left > 0 ? (((uint64_t)left << 32) - playing->sample_frac + step - 1) / step : 0;
+			if (end <= (uint64_t)count) {
+				count = (int)end;
+				done = true;
+			}
+		}
+
+		if (count > 0) {
+			uint64_t reach = (playing->sample_frac + (uint64_t)(count - 1) * step) >> 32;
+			int in_count = (int)reach + CUTE_SOUND_SINC_TAPS;
+			for (int c = 0; c < audio->channel_count; ++c) {
+#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+				if (playing->stream) {
+					cs_stream_fetch(playing->stream, c, s_ctx->resample[c], playing->stream->lead - history, in_count);
+					continue;
+				}
+#endif
+				cs_fetch(s_ctx->resample[c], audio, c, (int64_t)playing->sample_index - history, in_count, playing->looped);
+			}
+
+			const float* inA = s_ctx->resample[0] + history;
+			const float* inB = audio->channel_count == 2 ? s_ctx->resample[1] + history : inA;
+			if (step == CUTE_SOUND_UNIT_STEP && !playing->sample_frac) {
+				// Decoded voices at the device rate need no interpolation. Rounding the count up
+				// only reaches silence past the end of the sound or the padding of the mix buffers,
+				// like the direct path does.
+				s_mix_kernel(floatA + written, floatB + written, inA, inB, vA, vB, (int)CUTE_SOUND_ALIGN(count, 4));
+			} else {
+				kernel(floatA + written, inA, playing->sample_frac, step, vA, count);
+				kernel(floatB + written, inB, playing->sample_frac, step, vB, count);
+			}
+		}
+
+		uint64_t advance = playing->sample_frac + (uint64_t)count * step;
+		playing->sample_frac = (uint32_t)advance;
+		playing->sample_index += advance >> 32;
+		if (audio->sample_count && playing->looped) playing->sample_index %= audio->sample_count;
+#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+		if (playing->stream) {
+			// Consume everything but the history the next chunk needs.
+			cs_stream_t* stream = playing->stream;
+			stream->lead += (int)(advance >> 32);
+			int consume = stream->lead - history;
+			if (consume > (int)stream->count) consume = (int)stream->count;
+			if (consume > 0) {
+				stream->read = (stream->read + consume) & (stream->capacity - 1);
+				stream->count -= consume;
+				stream->lead -= consume;
+			}
+		}
+#endif
+		written += count;
+	}
+
+	return !done;
+}
+
+// Virtual voices only move their playhead. Returns false once a sound that doesn't loop has ended.
+static bool cs_skip(cs_sound_inst_t* playing, int samples_to_write, uint64_t step)
+{
+	uint64_t end = (uint64_t)playing->audio->sample_count << 32;
+	uint64_t pos = ((playing->sample_index << 32) | playing->sample_frac) + (uint64_t)samples_to_write * step;
+	if (pos >= end) {
+		if (!playing->looped || !end) return false;
+		pos %= end;
+	}
+	playing->sample_index = pos >> 32;
+	playing->sample_frac = (uint32_t)pos;
+	return true;
+}
+
+// Voices in higher bins are mixed first when there are more than cs_set_max_voices allows.
+static int cs_voice_bin(cs_sound_inst_t* playing)
+{
+	// Streams can't skip ahead cheaply, so they are always mixed along with music.
+	if (playing->is_music || playing->stream) return CUTE_SOUND_VOICE_BINS - 1;
+	int loudness = 0;
+	float gain = playing->volume * playing->attenuation * s_ctx->sound_volume * s_ctx->buses[playing->audio->bus].volume;
+	if (gain > 0) {
+		// Steps of 3dB down from full volume.
+		loudness = 15 + (int)floorf(log2f(gain) * 2.0f);
+		if (loudness < 0) loudness = 0;
+		if (loudness > 15) loudness = 15;
+	}
+	return playing->audio->priority * 16 + loudness;
+}
+
+static float cs_falloff(cs_audio_source_t* audio, float distance)
+{
+	float lo = audio->min_distance;
+	float hi = audio->max_distance;
+	if (distance >= hi) return 0;
+	if (distance <= lo) return 1.0f;
+	// The inverse curves are shifted and scaled to reach 0 at max_distance, so culling doesn't pop.
+	float floor = lo / hi;
+	switch (audio->falloff) {
+	case CUTE_SOUND_FALLOFF_INVERSE: return (lo / distance - floor) / (1.0f - floor);
+	case CUTE_SOUND_FALLOFF_INVERSE_SQUARE: return ((lo * lo) / (distance * distance) - floor * floor) / (1.0f - floor * floor);
+	default: return (hi - distance) / (hi - lo);
+	}
+}
+
+// Pans and fades a positional voice from where it sits relative to the listener. Voices out of
+// earshot are culled, and only move their playhead like virtual voices.
+static void s_spatialize(cs_sound_inst_t* playing)
+{
+	cs_audio_source_t* audio = playing->audio;
+	float dx = playing->x - s_ctx->listener_x;
+	float dy = playing->y - s_ctx->listener_y;
+	float distance = sqrtf(dx * dx + dy * dy);
+	float gain = cs_falloff(audio, distance);
+	playing->attenuation = gain;
+	// Streams can't skip ahead cheaply, so they keep mixing at zero volume instead.
+	playing->culled = gain == 0 && !playing->stream;
+	if (playing->culled) return;
+
+	// Constant power pan, narrowing toward the center inside min_distance.
+	float radius = distance > audio->min_distance ? distance : audio->min_distance;
+	float pan = radius > 0 ? 0.5f + 0.5f * dx / radius : 0.5f;
+	float angle = pan * (3.14159265358979f / 2.0f);
+	playing->pan0 = gain * cosf(angle);
+	playing->pan1 = gain * sinf(angle);
+}
+
 #if CUTE_SOUND_PLATFORM == CUTE_SOUND_SDL || CUTE_SOUND_PLATFORM == CUTE_SOUND_APPLE
 
 	static int cs_samples_written()
@@ -1592,13 +2963,476 @@ static void cs_free16(void* p, void* mem_ctx)
 
 #endif
 
+// -------------------------------------------------------------------------------------------------
+// Buses.
+//
+// Buses with effects get their own mixer buffers and reverb delay lines in one block, which the
+// game thread allocates the first time an effect is set and lends to the mixer with the command.
+
+static const int s_comb_tuning[CUTE_SOUND_REVERB_COMBS] = { 1116, 1188, 1277, 1356 };
+static const int s_allpass_tuning[CUTE_SOUND_REVERB_ALLPASSES] = { 556, 441 };
+#define CUTE_SOUND_REVERB_SPREAD 23 // Extra delay on the right channel, for width.
+#define CUTE_SOUND_REVERB_INPUT 0.03f
+#define CUTE_SOUND_REVERB_WET 3.0f
+
+// Tunings are in samples at 44100 Hz.
+static int cs_delay_length(int tuning, int channel)
+{
+	int length = (int)((int64_t)(tuning + channel * CUTE_SOUND_REVERB_SPREAD) * s_ctx->Hz / 44100);
+	return (int)CUTE_SOUND_ALIGN(length < 4 ? 4 : length, 4);
+}
+
+static size_t s_bus_memory_size()
+{
+	size_t count = (size_t)8 * s_ctx->wide_count;
+	for (int c = 0; c < 2; ++c) {
+		for (int i = 0; i < CUTE_SOUND_REVERB_COMBS; ++i) count += cs_delay_length(s_comb_tuning[i], c);
+		for (int i = 0; i < CUTE_SOUND_REVERB_ALLPASSES; ++i) count += cs_delay_length(s_allpass_tuning[i], c);
+	}
+	return count * sizeof(float);
+}
+
+// Game side.
+static float* s_bus_memory(cs_bus_t bus)
+{
+	if (!s_ctx->bus_memory[bus]) {
+		size_t size = s_bus_memory_size();
+		s_ctx->bus_memory[bus] = (float*)cs_malloc16(size, s_mem_ctx);
+		CUTE_SOUND_MEMSET(s_ctx->bus_memory[bus], 0, size);
+	}
+	return s_ctx->bus_memory[bus];
+}
+
+// Mixer side.
+static void s_bus_attach(cs_bus_state_t* bus, float* memory)
+{
+	if (bus->floatA) return;
+	bus->floatA = memory;
+	bus->floatB = memory + 4 * s_ctx->wide_count;
+	memory = bus->floatB + 4 * s_ctx->wide_count;
+	for (int c = 0; c < 2; ++c) {
+		for (int i = 0; i < CUTE_SOUND_REVERB_COMBS; ++i) {
+			cs_delay_line_t* line = &bus->reverb.combs[c][i];
+			line->samples = memory;
+			line->length = cs_delay_length(s_comb_tuning[i], c);
+			line->pos = 0;
+			memory += line->length;
+		}
+		for (int i = 0; i < CUTE_SOUND_REVERB_ALLPASSES; ++i) {
+			cs_delay_line_t* line = &bus->reverb.allpasses[c][i];
+			line->samples = memory;
+			line->length = cs_delay_length(s_allpass_tuning[i], c);
+			line->pos = 0;
+			memory += line->length;
+		}
+	}
+}
+
+// RBJ cookbook coefficients, unrolled into the block form of cs_biquad_fn by running an impulse
+// on each input through four steps of the filter.
+static void cs_biquad_columns(float* columns, cs_filter_t filter, float cutoff_in_Hz, float q)
+{
+	double w = 2.0 * 3.14159265358979 * cutoff_in_Hz / s_ctx->Hz;
+	double alpha = sin(w) / (2.0 * q);
+	double cosw = cos(w);
+	double a0 = 1.0 + alpha;
+	double b[3], a[3] = { 1.0, -2.0 * cosw / a0, (1.0 - alpha) / a0 };
+	if (filter == CUTE_SOUND_FILTER_HIGHPASS) {
+		b[0] = (1.0 + cosw) / 2.0 / a0; b[1] = -(1.0 + cosw) / a0; b[2] = b[0];
+	} else {
+		b[0] = (1.0 - cosw) / 2.0 / a0; b[1] = (1.0 - cosw) / a0; b[2] = b[0];
+	}
+	for (int j = 0; j < 8; ++j) {
+		// Two samples of history then the block, for x and y.
+		double x[6] = { 0 };
+		double y[6] = { 0 };
+		if (j < 4) x[2 + j] = 1.0;
+		else if (j < 6) x[1 - (j - 4)] = 1.0;
+		else y[1 - (j - 6)] = 1.0;
+		for (int n = 2; n < 6; ++n) {
+			y[n] = b[0] * x[n] + b[1] * x[n - 1] + b[2] * x[n - 2] - a[1] * y[n - 1] - a[2] * y[n - 2];
+			columns[j * 4 + n - 2] = (float)y[n];
+		}
+	}
+}
+
+static void cs_dynamics_set(cs_dynamics_t* d, float threshold_in_db, float ratio, float attack_in_milliseconds, float release_in_milliseconds)
+{
+	float blocks_per_millisecond = s_ctx->Hz / 4000.0f;
+	float attack = attack_in_milliseconds * blocks_per_millisecond;
+	float release = release_in_milliseconds * blocks_per_millisecond;
+	d->threshold = 32767.0f * powf(10.0f, threshold_in_db / 20.0f);
+	d->exponent = ratio > 1 ? 1.0f / ratio - 1.0f : 0;
+	d->attack = attack > 1 ? 1.0f - expf(-1.0f / attack) : 1.0f;
+	d->release = release > 1 ? 1.0f - expf(-1.0f / release) : 1.0f;
+}
+
+static void s_delay_comb(cs_delay_line_t* line, float* out, const float* in, int count, float feedback)
+{
+	while (count) {
+		int n = line->length - line->pos;
+		if (n > count) n = count;
+		s_comb_kernel(out, in, line->samples + line->pos, n, feedback);
+		line->pos += n;
+		if (line->pos == line->length) line->pos = 0;
+		out += n;
+		in += n;
+		count -= n;
+	}
+}
+
+static void s_delay_allpass(cs_delay_line_t* line, float* samples, int count)
+{
+	while (count) {
+		int n = line->length - line->pos;
+		if (n > count) n = count;
+		s_allpass_kernel(samples, line->samples + line->pos, n, 0.5f);
+		line->pos += n;
+		if (line->pos == line->length) line->pos = 0;
+		samples += n;
+		count -= n;
+	}
+}
+
+// Both channels feed a mono input into per channel combs, in chunks that fit the resampling scratch.
+static void s_reverb(cs_reverb_t* r, float* a, float* b, int count)
+{
+	const int chunk = CUTE_SOUND_RESAMPLE_SCRATCH / 2;
+	float* in = s_ctx->resample[0];
+	float* wet[2] = { s_ctx->resample[0] + chunk, s_ctx->resample[1] };
+	for (int first = 0; first < count; first += chunk) {
+		int n = count - first < chunk ? count - first : chunk;
+		// The offset keeps the tail from decaying into denormals.
+		for (int i = 0; i < n; ++i) in[i] = (a[first + i] + b[first + i]) * CUTE_SOUND_REVERB_INPUT + 1e-18f;
+		for (int c = 0; c < 2; ++c) {
+			CUTE_SOUND_MEMSET(wet[c], 0, sizeof(float) * n);
+			for (int i = 0; i < CUTE_SOUND_REVERB_COMBS; ++i) s_delay_comb(&r->combs[c][i], wet[c], in, n, r->feedback);
+			for (int i = 0; i < CUTE_SOUND_REVERB_ALLPASSES; ++i) s_delay_allpass(&r->allpasses[c][i], wet[c], n);
+		}
+		s_mix_kernel(a + first, b + first, wet[0], wet[1], r->wet, r->wet, n);
+	}
+}
+
+static void s_bus_effects(cs_bus_state_t* bus, int count)
+{
+	if (bus->filter != CUTE_SOUND_FILTER_NONE) {
+		s_biquad_kernel(bus->floatA, count, bus->filter_columns, bus->filter_state[0]);
+		s_biquad_kernel(bus->floatB, count, bus->filter_columns, bus->filter_state[1]);
+		// Flush the decaying state before it turns into denormals.
+		for (int c = 0; c < 2; ++c) {
+			for (int i = 0; i < 4; ++i) {
+				if (fabsf(bus->filter_state[c][i]) < 1e-10f) bus->filter_state[c][i] = 0;
+			}
+		}
+	}
+	if (bus->compress) s_dynamics_kernel(bus->floatA, bus->floatB, count, &bus->compressor);
+	if (bus->reverb.wet > 0) s_reverb(&bus->reverb, bus->floatA, bus->floatB, count);
+}
+
+static void s_apply_bus_command(const cs_command_t* cmd)
+{
+	cs_bus_state_t* bus = s_ctx->buses + cmd->bus;
+	s_bus_attach(bus, cmd->memory);
+	switch (cmd->type) {
+	case CUTE_SOUND_COMMAND_SET_BUS_FILTER:
+		if (bus->filter == CUTE_SOUND_FILTER_NONE) CUTE_SOUND_MEMSET(bus->filter_state, 0, sizeof(bus->filter_state));
+		bus->filter = (cs_filter_t)cmd->mode;
+		cs_biquad_columns(bus->filter_columns, bus->filter, cmd->params[0], cmd->params[1]);
+		break;
+
+	case CUTE_SOUND_COMMAND_SET_BUS_REVERB:
+		// Start from silence rather than the tail left over from when the reverb was last on.
+		if (bus->reverb.wet == 0) {
+			for (int c = 0; c < 2; ++c) {
+				for (int i = 0; i < CUTE_SOUND_REVERB_COMBS; ++i) CUTE_SOUND_MEMSET(bus->reverb.combs[c][i].samples, 0, sizeof(float) * bus->reverb.combs[c][i].length);
+				for (int i = 0; i < CUTE_SOUND_REVERB_ALLPASSES; ++i) CUTE_SOUND_MEMSET(bus->reverb.allpasses[c][i].samples, 0, sizeof(float) * bus->reverb.allpasses[c][i].length);
+			}
+		}
+		bus->reverb.feedback = 0.7f + 0.28f * cmd->params[0];
+		bus->reverb.wet = cmd->params[1] * CUTE_SOUND_REVERB_WET;
+		break;
+
+	case CUTE_SOUND_COMMAND_SET_BUS_COMPRESSOR:
+		bus->compress = cmd->params[1] > 1;
+		cs_dynamics_set(&bus->compressor, cmd->params[0], cmd->params[1], cmd->params[2], cmd->params[3]);
+		break;
+
+	default:
+		break;
+	}
+	bus->effects = bus->filter != CUTE_SOUND_FILTER_NONE || bus->compress || bus->reverb.wet > 0;
+}
+
+// -------------------------------------------------------------------------------------------------
+// Command queue.
+//
+// The game thread never touches an instance after handing it to the mixer with a play command.
+// Every later change is queued as a command and applied at the start of the next mix, and
+// finished instances come back through a second queue before the game thread reuses them.
+// The getters read what the game last set, the play position the mixer publishes after each
+// mix, and count an instance as active until it comes back.
+// Both queues are single-producer/single-consumer rings, so neither thread ever takes a lock.
+
+#define CUTE_SOUND_QUEUE_MASK (CUTE_SOUND_COMMAND_QUEUE_SIZE - 1)
+
+static bool s_try_push_command(const cs_command_t* cmd)
+{
+	unsigned write = s_ctx->command_write;
+	if (write - cs_atomic_load(&s_ctx->command_read) == CUTE_SOUND_COMMAND_QUEUE_SIZE) return false;
+	s_ctx->commands[write & CUTE_SOUND_QUEUE_MASK] = *cmd;
+	cs_atomic_store(&s_ctx->command_write, write + 1);
+	return true;
+}
+
+static void s_flush_backlog()
+{
+	while (s_ctx->backlog_first < s_ctx->backlog_count && s_try_push_command(s_ctx->backlog + s_ctx->backlog_first)) {
+		s_ctx->backlog_first++;
+	}
+	if (s_ctx->backlog_first == s_ctx->backlog_count) s_ctx->backlog_first = s_ctx->backlog_count = 0;
+}
+
+static void s_push_command(cs_command_t cmd)
+{
+	// Commands keep their order, so nothing skips ahead of the backlog.
+	s_flush_backlog();
+	s_ctx->commands_issued++;
+	if (!s_ctx->backlog_count && s_try_push_command(&cmd)) return;
+	if (s_ctx->backlog_count == s_ctx->backlog_capacity) {
+		int count = s_ctx->backlog_count - s_ctx->backlog_first;
+		int new_capacity = s_ctx->backlog_capacity ? s_ctx->backlog_capacity * 2 : 64;
+		cs_command_t* new_backlog = (cs_command_t*)CUTE_SOUND_ALLOC(sizeof(cs_command_t) * new_capacity, s_mem_ctx);
+		if (count) CUTE_SOUND_MEMCPY(new_backlog, s_ctx->backlog + s_ctx->backlog_first, sizeof(cs_command_t) * count);
+		CUTE_SOUND_FREE(s_ctx->backlog, s_mem_ctx);
+		s_ctx->backlog = new_backlog;
+		s_ctx->backlog_first = 0;
+		s_ctx->backlog_count = count;
+		s_ctx->backlog_capacity = new_capacity;
+	}
+	s_ctx->backlog[s_ctx->backlog_count++] = cmd;
+}
+
+static void s_push_inst_command(cs_command_type_t type, cs_sound_inst_t* inst, bool flag, float value)
+{
+	if (!inst) return;
+	cs_command_t cmd;
+	CUTE_SOUND_MEMSET(&cmd, 0, sizeof(cmd));
+	cmd.type = type;
+	cmd.inst = inst;
+	cmd.id = inst->id;
+	cmd.flag = flag;
+	cmd.value = value;
+	s_push_command(cmd);
+}
+
+static void s_stop(cs_sound_inst_t* inst) { s_push_inst_command(CUTE_SOUND_COMMAND_STOP, inst, false, 0); }
+static void s_set_paused(cs_sound_inst_t* inst, bool paused) { if (inst) inst->set_paused = paused; s_push_inst_command(CUTE_SOUND_COMMAND_SET_PAUSED, inst, paused, 0); }
+static void s_set_looped(cs_sound_inst_t* inst, bool looped) { if (inst) inst->set_looped = looped; s_push_inst_command(CUTE_SOUND_COMMAND_SET_LOOPED, inst, looped, 0); }
+static void s_set_volume(cs_sound_inst_t* inst, float volume) { if (inst) inst->set_volume = volume; s_push_inst_command(CUTE_SOUND_COMMAND_SET_VOLUME, inst, false, volume); }
+static void s_set_pitch(cs_sound_inst_t* inst, float pitch) { if (inst) inst->set_pitch = pitch; s_push_inst_command(CUTE_SOUND_COMMAND_SET_PITCH, inst, false, pitch); }
+
+// Drops the mixer's reference to `audio`, freeing it if cs_free_audio_source was waiting on it.
+static void s_release_audio(cs_audio_source_t* audio)
+{
+	audio->playing_count -= 1;
+	CUTE_SOUND_ASSERT(audio->playing_count >= 0);
+	if (!audio->playing_count && audio->free_requested) cs_free_audio_memory(audio);
+}
+
+// Makes room for `inst` under its audio's instance limit, by stopping the instance with the
+// lowest bin, oldest first. If `inst` ranks lower still it is the one stopped.
+static void s_limit_instances(cs_sound_inst_t* inst)
+{
+	cs_audio_source_t* audio = inst->audio;
+	cs_sound_inst_t* victim = NULL;
+	int victim_bin = 0;
+	int count = 0;
+	cs_list_node_t* node = cs_list_begin(&audio->instances);
+	cs_list_node_t* end_node = cs_list_end(&audio->instances);
+	for (; node != end_node; node = node->next) {
+		cs_sound_inst_t* other = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, audio_node, node);
+		if (!other->active) continue;
+		++count;
+		if (other == inst) continue;
+		int bin = cs_voice_bin(other);
+		if (!victim || bin < victim_bin) {
+			victim = other;
+			victim_bin = bin;
+		}
+	}
+	if (count <= audio->max_instances) return;
+	if (cs_voice_bin(inst) < victim_bin) victim = inst;
+	victim->active = false;
+}
+
+static void s_apply_command(const cs_command_t* cmd)
+{
+	cs_sound_inst_t* inst = cmd->inst;
+	switch (cmd->type) {
+	case CUTE_SOUND_COMMAND_PLAY:
+		cs_list_push_back(&s_ctx->playing_sounds, &inst->node);
+		cs_list_push_back(&inst->audio->instances, &inst->audio_node);
+		inst->audio->playing_count += 1;
+		if (inst->audio->max_instances) s_limit_instances(inst);
+		return;
+
+	case CUTE_SOUND_COMMAND_STOP_ALL_SOUNDS:
+	{
+		// Set all playing sounds (that aren't music) active to false, cs_mix cleans them up.
+		cs_list_node_t* playing_node = cs_list_begin(&s_ctx->playing_sounds);
+		cs_list_node_t* end_node = cs_list_end(&s_ctx->playing_sounds);
+		for (; playing_node != end_node; playing_node = playing_node->next) {
+			cs_sound_inst_t* playing = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, node, playing_node);
+			if (!playing->is_music) playing->active = false;
+		}
+	}	return;
+
+	case CUTE_SOUND_COMMAND_FREE_AUDIO_SOURCE:
+		if (cmd->audio->playing_count == 0) cs_free_audio_memory(cmd->audio);
+		else cmd->audio->free_requested = true;
+		return;
+
+	case CUTE_SOUND_COMMAND_SET_BUS_VOLUME:
+		s_ctx->buses[cmd->bus].volume = cmd->value;
+		return;
+
+	case CUTE_SOUND_COMMAND_SET_BUS_FILTER:
+	case CUTE_SOUND_COMMAND_SET_BUS_REVERB:
+	case CUTE_SOUND_COMMAND_SET_BUS_COMPRESSOR:
+		s_apply_bus_command(cmd);
+		return;
+
+	case CUTE_SOUND_COMMAND_SET_LIMITER:
+		s_ctx->limit = cmd->flag;
+		cs_dynamics_set(&s_ctx->limiter, cmd->params[0], 1.0f, 0, 50.0f);
+		return;
+
+	case CUTE_SOUND_COMMAND_SET_LISTENER:
+		s_ctx->listener_x = cmd->params[0];
+		s_ctx->listener_y = cmd->params[1];
+		return;
+
+	default:
+		break;
+	}
+
+	if (inst->id != cmd->id || !inst->active) return;
+	switch (cmd->type) {
+	case CUTE_SOUND_COMMAND_STOP: inst->active = false; break;
+	case CUTE_SOUND_COMMAND_SET_PAUSED: inst->paused = cmd->flag; break;
+	case CUTE_SOUND_COMMAND_SET_LOOPED: inst->looped = cmd->flag; break;
+	case CUTE_SOUND_COMMAND_SET_VOLUME: inst->volume = cmd->value; break;
+	case CUTE_SOUND_COMMAND_SET_PITCH: inst->pitch = cmd->value; break;
+	case CUTE_SOUND_COMMAND_SET_POSITION: inst->x = cmd->params[0]; inst->y = cmd->params[1]; break;
+
+	case CUTE_SOUND_COMMAND_SET_SAMPLE_INDEX:
+#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+		if (inst->stream) cs_stream_seek(inst->stream, (unsigned)cmd->sample_index);
+#endif
+		inst->sample_index = cmd->sample_index;
+		cs_atomic_store(&inst->position, (unsigned)inst->sample_index);
+		inst->sample_frac = 0;
+		break;
+
+	default:
+		break;
+	}
+}
+
+// Mixer side: applies everything queued so far, then hands finished instances back.
+static void s_do_commands()
+{
+	unsigned read = s_ctx->command_read;
+	unsigned write = cs_atomic_load(&s_ctx->command_write);
+	for (; read != write; ++read) {
+		s_apply_command(s_ctx->commands + (read & CUTE_SOUND_QUEUE_MASK));
+	}
+	cs_atomic_store(&s_ctx->command_read, read);
+
+	unsigned retired_write = s_ctx->retired_write;
+	unsigned retired_read = cs_atomic_load(&s_ctx->retired_read);
+	while (!cs_list_empty(&s_ctx->retiring) && retired_write - retired_read < CUTE_SOUND_COMMAND_QUEUE_SIZE) {
+		cs_sound_inst_t* inst = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, node, cs_list_pop_front(&s_ctx->retiring));
+		s_ctx->retired[retired_write++ & CUTE_SOUND_QUEUE_MASK] = inst;
+	}
+	cs_atomic_store(&s_ctx->retired_write, retired_write);
+}
+
+// Music that ends on its own has to be dropped from the music state machine.
+static void s_music_retired(cs_sound_inst_t* inst)
+{
+	if (inst == s_ctx->music_next) {
+		s_ctx->music_next = NULL;
+		if (s_ctx->music_state == CUTE_SOUND_MUSIC_STATE_SWITCH_TO_1) {
+			// The old track is already silent.
+			s_ctx->music_playing = NULL;
+			s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_NONE;
+		} else if (s_ctx->music_state == CUTE_SOUND_MUSIC_STATE_SWITCH_TO_0 || s_ctx->music_state == CUTE_SOUND_MUSIC_STATE_CROSSFADE) {
+			s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_FADE_OUT;
+		}
+	} else if (inst == s_ctx->music_playing) {
+		s_ctx->music_playing = NULL;
+		switch (s_ctx->music_state) {
+		case CUTE_SOUND_MUSIC_STATE_SWITCH_TO_0:
+			s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_SWITCH_TO_1;
+			s_ctx->t = 0;
+			s_ctx->fade = s_ctx->fade_switch_1;
+			s_ctx->fade_switch_1 = 0;
+			s_set_paused(s_ctx->music_next, false);
+			break;
+
+		case CUTE_SOUND_MUSIC_STATE_CROSSFADE:
+			s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_FADE_IN;
+			s_ctx->music_playing = s_ctx->music_next;
+			s_ctx->music_next = NULL;
+			break;
+
+		case CUTE_SOUND_MUSIC_STATE_SWITCH_TO_1:
+			break;
+
+		default:
+			if (!s_ctx->music_next) s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_NONE;
+		}
+	}
+}
+
+// Game side: takes back instances the mixer has finished with.
+static void s_reclaim()
+{
+	unsigned read = s_ctx->retired_read;
+	unsigned write = cs_atomic_load(&s_ctx->retired_write);
+	for (; read != write; ++read) {
+		cs_sound_inst_t* inst = s_ctx->retired[read & CUTE_SOUND_QUEUE_MASK];
+		s_music_retired(inst);
+		inst->generation++;
+		// Commands already issued may still name this instance, so it waits for the mixer to pass them.
+		inst->reuse_after = s_ctx->commands_issued;
+		cs_list_push_back(&s_ctx->free_sounds, &inst->node);
+	}
+	cs_atomic_store(&s_ctx->retired_read, read);
+}
+
 static void s_add_page()
 {
 	cs_inst_page_t* page = (cs_inst_page_t*)CUTE_SOUND_ALLOC(sizeof(cs_inst_page_t), user_allocator_context);
+	if (s_ctx->page_count == s_ctx->page_capacity) {
+		int new_capacity = s_ctx->page_capacity ? s_ctx->page_capacity * 2 : 8;
+		cs_inst_page_t** new_table = (cs_inst_page_t**)CUTE_SOUND_ALLOC(sizeof(cs_inst_page_t*) * new_capacity, s_mem_ctx);
+		if (s_ctx->page_count) CUTE_SOUND_MEMCPY(new_table, s_ctx->page_table, sizeof(cs_inst_page_t*) * s_ctx->page_count);
+		CUTE_SOUND_FREE(s_ctx->page_table, s_mem_ctx);
+		s_ctx->page_table = new_table;
+		s_ctx->page_capacity = new_capacity;
+	}
 	for (int i = 0; i < CUTE_SOUND_PAGE_INSTANCE_COUNT; ++i) {
-		cs_list_init_node(&page->instances[i].node);
-		cs_list_push_back(&s_ctx->free_sounds, &page->instances[i].node);
+		cs_sound_inst_t* inst = page->instances + i;
+		inst->slot = (uint32_t)(s_ctx->page_count * CUTE_SOUND_PAGE_INSTANCE_COUNT + i);
+		inst->generation = 1;
+		// No command can name a fresh instance yet, so it is free to use right away.
+		inst->reuse_after = cs_atomic_load(&s_ctx->command_read);
+		cs_list_init_node(&inst->node);
+		cs_list_push_front(&s_ctx->free_sounds, &inst->node);
 	}
+	s_ctx->page_table[s_ctx->page_count++] = page;
 	page->next = s_ctx->pages;
 	s_ctx->pages = page;
 }
@@ -1711,6 +3545,7 @@ cs_error_t cs_init(void* os_handle, unsigned play_frequency_in_Hz, int buffered_
 	s_ctx->global_volume = 1.0f;
 	s_ctx->global_pause = false;
 	s_ctx->music_volume = 1.0f;
+	s_ctx->music_pitch = 1.0f;
 	s_ctx->sound_volume = 1.0f;
 	s_ctx->music_looped = true;
 	s_ctx->music_paused = false;
@@ -1721,23 +3556,57 @@ cs_error_t cs_init(void* os_handle, unsigned play_frequency_in_Hz, int buffered_
 	s_ctx->music_state_to_resume_from_paused = CUTE_SOUND_MUSIC_STATE_NONE;
 	s_ctx->music_playing = NULL;
 	s_ctx->music_next = NULL;
-	s_ctx->audio_sources_to_free_capacity = 32;
-	s_ctx->audio_sources_to_free_size = 0;
-	s_ctx->audio_sources_to_free = (cs_audio_source_t**)CUTE_SOUND_ALLOC(sizeof(cs_audio_source_t*) * s_ctx->audio_sources_to_free_capacity, s_mem_ctx);
-	s_ctx->instance_id_gen = 1;
-	hashtable_init(&s_ctx->instance_map, sizeof(cs_audio_source_t*), 1024, user_allocator_context);
+	s_mem_ctx = user_allocator_context;
+	s_ctx->commands = (cs_command_t*)CUTE_SOUND_ALLOC(sizeof(cs_command_t) * CUTE_SOUND_COMMAND_QUEUE_SIZE, s_mem_ctx);
+	s_ctx->command_read = 0;
+	s_ctx->command_write = 0;
+	s_ctx->commands_issued = 0;
+	s_ctx->backlog = NULL;
+	s_ctx->backlog_first = 0;
+	s_ctx->backlog_count = 0;
+	s_ctx->backlog_capacity = 0;
+	s_ctx->retired = (cs_sound_inst_t**)CUTE_SOUND_ALLOC(sizeof(cs_sound_inst_t*) * CUTE_SOUND_COMMAND_QUEUE_SIZE, s_mem_ctx);
+	s_ctx->retired_read = 0;
+	s_ctx->retired_write = 0;
+	cs_list_init(&s_ctx->retiring);
+	s_ctx->max_voices = CUTE_SOUND_MAX_VOICES;
+	s_ctx->real_voice_count = 0;
+	s_ctx->virtual_voice_count = 0;
+	CUTE_SOUND_MEMSET(s_ctx->buses, 0, sizeof(s_ctx->buses));
+	for (int i = 0; i < CUTE_SOUND_BUS_COUNT; ++i) {
+		s_ctx->buses[i].volume = 1.0f;
+		s_ctx->bus_memory[i] = NULL;
+		s_ctx->bus_volume[i] = 1.0f;
+	}
+	s_ctx->limit = false;
+	CUTE_SOUND_MEMSET(&s_ctx->limiter, 0, sizeof(s_ctx->limiter));
+	s_ctx->limiter.limit = true;
+	s_ctx->limiter.gain = 1.0f;
+	s_ctx->listener_x = 0;
+	s_ctx->listener_y = 0;
 	s_ctx->pages = NULL;
+	s_ctx->page_table = NULL;
+	s_ctx->page_count = 0;
+	s_ctx->page_capacity = 0;
 	cs_list_init(&s_ctx->playing_sounds);
 	cs_list_init(&s_ctx->free_sounds);
 	s_add_page();
-	s_mem_ctx = user_allocator_context;
 	s_ctx->latency_samples = buffered_samples;
 	s_ctx->Hz = play_frequency_in_Hz;
 	s_ctx->bps = bps;
 	s_ctx->wide_count = wide_count;
-	s_ctx->floatA = (cs__m128*)cs_malloc16(sizeof(cs__m128) * wide_count, s_mem_ctx);
-	s_ctx->floatB = (cs__m128*)cs_malloc16(sizeof(cs__m128) * wide_count, s_mem_ctx);
-	s_ctx->samples = (cs__m128i*)cs_malloc16(sizeof(cs__m128i) * wide_count, s_mem_ctx);
+
+	s_ctx->resample[0] = (float*)cs_malloc16(sizeof(float) * CUTE_SOUND_RESAMPLE_SCRATCH * 2, s_mem_ctx);
+	s_ctx->resample[1] = s_ctx->resample[0] + CUTE_SOUND_RESAMPLE_SCRATCH;
+	cs_init_sinc_table();
+
+	// Use the widest mixing kernels this CPU supports.
+	if (!cs_set_simd(CUTE_SOUND_SIMD_AVX2) && !cs_set_simd(CUTE_SOUND_SIMD_SSE2) && !cs_set_simd(CUTE_SOUND_SIMD_NEON)) {
+		cs_set_simd(CUTE_SOUND_SIMD_SCALAR);
+	}
+	s_ctx->floatA = (float*)cs_malloc16(sizeof(float) * 4 * wide_count, s_mem_ctx);
+	s_ctx->floatB = (float*)cs_malloc16(sizeof(float) * 4 * wide_count, s_mem_ctx);
+	s_ctx->samples = (int16_t*)cs_malloc16(sizeof(int16_t) * 8 * wide_count, s_mem_ctx);
 	s_ctx->running = true;
 	s_ctx->separate_thread = false;
 	s_ctx->sleep_milliseconds = 0;
@@ -1785,6 +3654,11 @@ cs_error_t cs_init(void* os_handle, unsigned play_frequency_in_Hz, int buffered_
 	SDL_PauseAudioDevice(s_ctx->dev, 0);
 	s_ctx->mutex = SDL_CreateMutex();
 
+#elif CUTE_SOUND_PLATFORM == CUTE_SOUND_NULL
+
+	s_ctx->render_out = NULL;
+	s_ctx->render_count = 0;
+
 #endif
 
 	return CUTE_SOUND_ERROR_NONE;
@@ -1817,14 +3691,24 @@ void cs_shutdown()
 
 #endif
 
+	// Apply whatever the mixer never got to, so queued sounds and frees are cleaned up below.
+	do {
+		s_flush_backlog();
+		s_do_commands();
+	} while (s_ctx->backlog_count);
+
 	if (!cs_list_empty(&s_ctx->playing_sounds)) {
 		cs_list_node_t* playing_node = cs_list_begin(&s_ctx->playing_sounds);
 		cs_list_node_t* end_node = cs_list_end(&s_ctx->playing_sounds);
 		do {
 			cs_list_node_t* next_node = playing_node->next;
 			cs_sound_inst_t* playing = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, node, playing_node);
-			cs_audio_source_t* audio = playing->audio;
-			if (audio) audio->playing_count = 0;
+#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+			cs_stream_close(playing->stream);
+			playing->stream = NULL;
+#endif
+			cs_list_remove(&playing->audio_node);
+			s_release_audio(playing->audio);
 			playing_node = next_node;
 		} while (playing_node != end_node);
 	}
@@ -1833,20 +3717,18 @@ void cs_shutdown()
 	while (page) {
 		cs_inst_page_t* next = page->next;
 		CUTE_SOUND_FREE(page, s_mem_ctx);
-		page = next;
-	}
-
-	for (int i = 0; i < s_ctx->audio_sources_to_free_size; ++i) {
-		cs_audio_source_t* audio = s_ctx->audio_sources_to_free[i];
-		cs_free16(audio->channels[0], s_mem_ctx);
-		CUTE_SOUND_FREE(audio, s_mem_ctx);
+		page = next;
 	}
-	CUTE_SOUND_FREE(s_ctx->audio_sources_to_free, s_mem_ctx);
+	CUTE_SOUND_FREE(s_ctx->page_table, s_mem_ctx);
+	CUTE_SOUND_FREE(s_ctx->commands, s_mem_ctx);
+	CUTE_SOUND_FREE(s_ctx->backlog, s_mem_ctx);
+	CUTE_SOUND_FREE(s_ctx->retired, s_mem_ctx);
 
 	cs_free16(s_ctx->floatA, s_mem_ctx);
 	cs_free16(s_ctx->floatB, s_mem_ctx);
 	cs_free16(s_ctx->samples, s_mem_ctx);
-	hashtable_term(&s_ctx->instance_map);
+	cs_free16(s_ctx->resample[0], s_mem_ctx);
+	for (int i = 0; i < CUTE_SOUND_BUS_COUNT; ++i) cs_free16(s_ctx->bus_memory[i], s_mem_ctx);
 	void* mem_ctx = s_mem_ctx;
 	(void)mem_ctx;
 	CUTE_SOUND_FREE(s_ctx, mem_ctx);
@@ -1858,6 +3740,8 @@ static float s_smoothstep(float x) { return x * x * (3.0f - 2.0f * x); }
 void cs_update(float dt)
 {
 	if (!s_ctx->separate_thread) cs_mix();
+	s_flush_backlog();
+	s_reclaim();
 
 	switch (s_ctx->music_state) {
 	case CUTE_SOUND_MUSIC_STATE_FADE_OUT:
@@ -1865,10 +3749,10 @@ void cs_update(float dt)
 		s_ctx->t += dt;
 		if (s_ctx->t >= s_ctx->fade) {
 			s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_NONE;
-			s_ctx->music_playing->active = false;
+			s_stop(s_ctx->music_playing);
 			s_ctx->music_playing = NULL;
 		} else {
-			s_ctx->music_playing->volume = s_smoothstep(((s_ctx->fade - s_ctx->t) / s_ctx->fade));;
+			s_set_volume(s_ctx->music_playing, s_smoothstep(((s_ctx->fade - s_ctx->t) / s_ctx->fade)));
 		}
 	}	break;
 
@@ -1879,7 +3763,7 @@ void cs_update(float dt)
 			s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_PLAYING;
 			s_ctx->t = s_ctx->fade;
 		}
-		s_ctx->music_playing->volume = s_smoothstep(1.0f - ((s_ctx->fade - s_ctx->t) / s_ctx->fade));
+		s_set_volume(s_ctx->music_playing, s_smoothstep(1.0f - ((s_ctx->fade - s_ctx->t) / s_ctx->fade)));
 	}	break;
 
 	case CUTE_SOUND_MUSIC_STATE_SWITCH_TO_0:
@@ -1887,14 +3771,13 @@ void cs_update(float dt)
 		s_ctx->t += dt;
 		if (s_ctx->t >= s_ctx->fade) {
 			s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_SWITCH_TO_1;
-			s_ctx->music_playing->active = false;
-			s_ctx->music_playing->volume = 0;
+			s_stop(s_ctx->music_playing);
 			s_ctx->t = 0;
 			s_ctx->fade = s_ctx->fade_switch_1;
 			s_ctx->fade_switch_1 = 0;
-			s_ctx->music_next->paused = false;
+			s_set_paused(s_ctx->music_next, false);
 		} else {
-			s_ctx->music_playing->volume = s_smoothstep(((s_ctx->fade - s_ctx->t) / s_ctx->fade));;
+			s_set_volume(s_ctx->music_playing, s_smoothstep(((s_ctx->fade - s_ctx->t) / s_ctx->fade)));
 		}
 	}	break;
 
@@ -1904,13 +3787,13 @@ void cs_update(float dt)
 		if (s_ctx->t >= s_ctx->fade) {
 			s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_PLAYING;
 			s_ctx->t = s_ctx->fade;
-			s_ctx->music_next->volume = 1.0f;
+			s_set_volume(s_ctx->music_next, 1.0f);
 			s_ctx->music_playing = s_ctx->music_next;
 			s_ctx->music_next = NULL;
 		} else {
 			float t = s_smoothstep(1.0f - ((s_ctx->fade - s_ctx->t) / s_ctx->fade));
 			float volume = t;
-			s_ctx->music_next->volume = volume;
+			s_set_volume(s_ctx->music_next, volume);
 		}
 	}	break;
 
@@ -1919,8 +3802,8 @@ void cs_update(float dt)
 		s_ctx->t += dt;
 		if (s_ctx->t >= s_ctx->fade) {
 			s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_PLAYING;
-			s_ctx->music_playing->active = false;
-			s_ctx->music_next->volume = 1.0f;
+			s_stop(s_ctx->music_playing);
+			s_set_volume(s_ctx->music_next, 1.0f);
 			s_ctx->music_playing = s_ctx->music_next;
 			s_ctx->music_next = NULL;
 		} else {
@@ -1928,8 +3811,8 @@ void cs_update(float dt)
 			float t1 = s_smoothstep(1.0f - ((s_ctx->fade - s_ctx->t) / s_ctx->fade));
 			float v0 = t0;
 			float v1 = t1;
-			s_ctx->music_playing->volume = v0;
-			s_ctx->music_next->volume = v1;
+			s_set_volume(s_ctx->music_playing, v0);
+			s_set_volume(s_ctx->music_next, v1);
 		}
 	}	break;
 
@@ -2099,14 +3982,14 @@ void cs_dsound_dont_run_too_fast()
 
 void cs_mix()
 {
-	cs__m128i* samples;
-	cs__m128* floatA;
-	cs__m128* floatB;
-	cs__m128 zero;
+	int16_t* samples;
+	float* floatA;
+	float* floatB;
 	int wide_count;
 	int samples_to_write;
 
 	cs_lock();
+	s_do_commands();
 
 #if CUTE_SOUND_PLATFORM == CUTE_SOUND_WINDOWS
 
@@ -2124,6 +4007,11 @@ void cs_mix()
 	if (!samples_to_write) goto unlock;
 	bytes_to_write = samples_to_write * s_ctx->bps;
 
+#elif CUTE_SOUND_PLATFORM == CUTE_SOUND_NULL
+
+	samples_to_write = s_ctx->render_count;
+	if (!samples_to_write) goto unlock;
+
 #endif
 
 	// Clear mixer buffers.
@@ -2131,11 +4019,47 @@ void cs_mix()
 
 	floatA = s_ctx->floatA;
 	floatB = s_ctx->floatB;
-	zero = cs_mm_set1_ps(0.0f);
+	CUTE_SOUND_MEMSET(floatA, 0, sizeof(float) * 4 * wide_count);
+	CUTE_SOUND_MEMSET(floatB, 0, sizeof(float) * 4 * wide_count);
+	for (int i = 0; i < CUTE_SOUND_BUS_COUNT; ++i) {
+		cs_bus_state_t* bus = s_ctx->buses + i;
+		if (!bus->effects) continue;
+		CUTE_SOUND_MEMSET(bus->floatA, 0, sizeof(float) * 4 * wide_count);
+		CUTE_SOUND_MEMSET(bus->floatB, 0, sizeof(float) * 4 * wide_count);
+	}
+
+	// With more voices than max_voices, mix them by bin from the top. Voices below `cutoff_bin`
+	// go virtual, and so do voices in it past the first `cutoff_quota`.
+	int cutoff_bin = -1;
+	int cutoff_quota = 0;
+	s_ctx->real_voice_count = 0;
+	s_ctx->virtual_voice_count = 0;
+	if (!s_ctx->global_pause && !cs_list_empty(&s_ctx->playing_sounds)) {
+		int voice_count = 0;
+		cs_list_node_t* playing_node = cs_list_begin(&s_ctx->playing_sounds);
+		cs_list_node_t* end_node = cs_list_end(&s_ctx->playing_sounds);
+		for (; playing_node != end_node; playing_node = playing_node->next) {
+			cs_sound_inst_t* playing = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, node, playing_node);
+			if (!playing->active || playing->paused || !playing->audio) continue;
+			if (playing->positional) s_spatialize(playing);
+			voice_count += !playing->culled;
+		}
 
-	for (int i = 0; i < wide_count; ++i) {
-		floatA[i] = zero;
-		floatB[i] = zero;
+		if (voice_count > s_ctx->max_voices) {
+			CUTE_SOUND_MEMSET(s_ctx->voice_bins, 0, sizeof(s_ctx->voice_bins));
+			for (playing_node = cs_list_begin(&s_ctx->playing_sounds); playing_node != end_node; playing_node = playing_node->next) {
+				cs_sound_inst_t* playing = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, node, playing_node);
+				if (!playing->active || playing->paused || !playing->audio || playing->culled) continue;
+				playing->voice_bin = cs_voice_bin(playing);
+				s_ctx->voice_bins[playing->voice_bin]++;
+			}
+			int real = 0;
+			cutoff_bin = CUTE_SOUND_VOICE_BINS - 1;
+			while (real + s_ctx->voice_bins[cutoff_bin] < s_ctx->max_voices) {
+				real += s_ctx->voice_bins[cutoff_bin--];
+			}
+			cutoff_quota = s_ctx->max_voices - real;
+		}
 	}
 
 	// Mix all playing sounds into the mixer buffers.
@@ -2151,19 +4075,26 @@ void cs_mix()
 			if (!audio) goto remove;
 			if (playing->paused) goto get_next_playing_sound;
 
+			// The top bin is always mixed, even past max_voices. Culled voices never are.
 			{
-				cs__m128* cA = (cs__m128*)audio->channels[0];
-				cs__m128* cB = (cs__m128*)audio->channels[1];
+				bool real = !playing->culled;
+				if (real && cutoff_bin >= 0 && playing->voice_bin != CUTE_SOUND_VOICE_BINS - 1) {
+					real = playing->voice_bin > cutoff_bin || (playing->voice_bin == cutoff_bin && cutoff_quota-- > 0);
+				}
+				if (!real) {
+					s_ctx->virtual_voice_count++;
+					if (cs_skip(playing, samples_to_write, cs_voice_step(playing))) goto get_next_playing_sound;
+					goto remove;
+				}
+			}
+			s_ctx->real_voice_count++;
 
-				// Attempted to play a sound with no audio.
-				// Make sure the audio file was loaded properly.
-				CUTE_SOUND_ASSERT(cA);
+			{
+				float* cA = audio->channels[0];
+				float* cB = audio->channels[1] ? audio->channels[1] : cA;
 
-				int mix_count = samples_to_write;
-				int offset = (int)playing->sample_index;
-				int remaining = audio->sample_count - offset;
-				if (remaining < mix_count) mix_count = remaining;
-				CUTE_SOUND_ASSERT(remaining > 0);
+				// Streams that failed to open have nothing to play.
+				if (!cA && !playing->stream) goto remove;
 
 				float gpan0 = 1.0f - s_ctx->global_pan;
 				float gpan1 = s_ctx->global_pan;
@@ -2176,8 +4107,40 @@ void cs_mix()
 					vA0 *= s_ctx->music_volume;
 					vB0 *= s_ctx->music_volume;
 				}
-				cs__m128 vA = cs_mm_set1_ps(vA0);
-				cs__m128 vB = cs_mm_set1_ps(vB0);
+
+				// Buses with effects are mixed on their own, and processed after all voices.
+				cs_bus_state_t* bus = s_ctx->buses + (playing->is_music ? CUTE_SOUND_BUS_MUSIC : audio->bus);
+				float* busA = bus->effects ? bus->floatA : floatA;
+				float* busB = bus->effects ? bus->floatB : floatB;
+				vA0 *= bus->volume;
+				vB0 *= bus->volume;
+
+				// Voices off the device rate, not on a SIMD boundary, or stored compressed, take the
+				// resampling path.
+				uint64_t step = cs_voice_step(playing);
+				bool direct = step == CUTE_SOUND_UNIT_STEP && !playing->sample_frac;
+#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+				if (playing->stream) direct = direct && !playing->stream->lead && !(playing->stream->read & 3);
+				else
+#endif
+				direct = direct && !(playing->sample_index & 3) && audio->format == CUTE_SOUND_SAMPLE_FORMAT_FLOAT;
+				if (!direct) {
+					if (cs_mix_resampled(playing, busA, busB, samples_to_write, vA0, vB0, step)) goto get_next_playing_sound;
+					goto remove;
+				}
+
+#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+				if (playing->stream) {
+					if (cs_stream_mix(playing, busA, busB, samples_to_write, vA0, vB0)) goto get_next_playing_sound;
+					goto remove;
+				}
+#endif
+
+				int mix_count = samples_to_write;
+				int offset = (int)playing->sample_index;
+				int remaining = audio->sample_count - offset;
+				if (remaining < mix_count) mix_count = remaining;
+				CUTE_SOUND_ASSERT(remaining > 0);
 
 				// Skip sound if it's delay is longer than mix_count and
 				// handle various delay cases.
@@ -2197,40 +4160,13 @@ void cs_mix()
 				}
 				CUTE_SOUND_ASSERT(!(delay_offset & 3));
 
-				// SIMD offets.
+				// SIMD offets. Delayed sounds start mixing delay_offset samples into the buffers.
 				int mix_wide = (int)CUTE_SOUND_ALIGN(mix_count, 4) / 4;
 				int offset_wide = (int)CUTE_SOUND_TRUNC(offset, 4) / 4;
 				int delay_wide = (int)CUTE_SOUND_ALIGN(delay_offset, 4) / 4;
-				int sample_count = (mix_wide - 2 * delay_wide) * 4;
-				(void)sample_count;
-
-				// apply volume, load samples into float buffers
-				switch (audio->channel_count) {
-				case 1:
-					for (int i = delay_wide; i < mix_wide - delay_wide; ++i)
-					{
-						cs__m128 A = cA[i + offset_wide];
-						cs__m128 B = cs_mm_mul_ps(A, vB);
-						A = cs_mm_mul_ps(A, vA);
-						floatA[i] = cs_mm_add_ps(floatA[i], A);
-						floatB[i] = cs_mm_add_ps(floatB[i], B);
-					}
-					break;
-
-				case 2:
-				{
-					for (int i = delay_wide; i < mix_wide - delay_wide; ++i)
-					{
-						cs__m128 A = cA[i + offset_wide];
-						cs__m128 B = cB[i + offset_wide];
-
-						A = cs_mm_mul_ps(A, vA);
-						B = cs_mm_mul_ps(B, vB);
-						floatA[i] = cs_mm_add_ps(floatA[i], A);
-						floatB[i] = cs_mm_add_ps(floatB[i], B);
-					}
-				}	break;
-				}
+
+				// apply volume, mix samples into float buffers
+				s_mix_kernel(busA + delay_wide * 4, busB + delay_wide * 4, cA + offset_wide * 4, cB + offset_wide * 4, vA0, vB0, mix_wide * 4);
 
 				// playing list logic
 				playing->sample_index += mix_count;
@@ -2246,42 +4182,45 @@ void cs_mix()
 			}
 
 		get_next_playing_sound:
+			cs_atomic_store(&playing->position, (unsigned)playing->sample_index);
 			playing_node = next_node;
 			continue;
 
 		remove:
 			playing->sample_index = 0;
 			playing->active = false;
+#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+			cs_stream_close(playing->stream);
+			playing->stream = NULL;
+#endif
 
 			if (playing->audio) {
-				if (s_ctx->running) {
-					playing->audio->playing_count -= 1;
-				} else {
-					playing->audio->playing_count = 0;
-				}
-				CUTE_SOUND_ASSERT(playing->audio->playing_count >= 0);
+				cs_list_remove(&playing->audio_node);
+				s_release_audio(playing->audio);
 			}
 
+			// Handed back to the game thread at the start of the next mix.
 			cs_list_remove(playing_node);
-			cs_list_push_front(&s_ctx->free_sounds, playing_node);
-			hashtable_remove(&s_ctx->instance_map, playing->id);
+			cs_list_push_back(&s_ctx->retiring, playing_node);
 			playing_node = next_node;
 			continue;
 		} while (playing_node != end_node);
 	}
 
+	for (int i = 0; i < CUTE_SOUND_BUS_COUNT; ++i) {
+		cs_bus_state_t* bus = s_ctx->buses + i;
+		if (!bus->effects) continue;
+		s_bus_effects(bus, wide_count * 4);
+		s_mix_kernel(floatA, floatB, bus->floatA, bus->floatB, 1.0f, 1.0f, wide_count * 4);
+	}
+	if (s_ctx->limit) s_dynamics_kernel(floatA, floatB, wide_count * 4, &s_ctx->limiter);
+
 	// load all floats into 16 bit packed interleaved samples
 #if CUTE_SOUND_PLATFORM == CUTE_SOUND_WINDOWS
 
 	samples = s_ctx->samples;
-	for (int i = 0; i < wide_count; ++i) {
-		cs__m128i a = cs_mm_cvtps_epi32(floatA[i]);
-		cs__m128i b = cs_mm_cvtps_epi32(floatB[i]);
-		cs__m128i a0b0a1b1 = cs_mm_unpacklo_epi32(a, b);
-		cs__m128i a2b2a3b3 = cs_mm_unpackhi_epi32(a, b);
-		samples[i] = cs_mm_packs_epi32(a0b0a1b1, a2b2a3b3);
-	}
-	cs_dsound_memcpy_to_driver((int16_t*)samples, byte_to_lock, bytes_to_write);
+	s_pack_kernel(samples, floatA, floatB, wide_count * 4);
+	cs_dsound_memcpy_to_driver(samples, byte_to_lock, bytes_to_write);
 	cs_dsound_dont_run_too_fast();
 
 #elif CUTE_SOUND_PLATFORM == CUTE_SOUND_APPLE || CUTE_SOUND_PLATFORM == CUTE_SOUND_SDL
@@ -2290,30 +4229,33 @@ void cs_mix()
 	// reusing floatA to store output is a good way to temporarly store
 	// the final samples. Then a single ring buffer push can be used
 	// afterwards. Pretty hacky, but whatever :)
-	samples = (cs__m128i*)floatA;
-	for (int i = 0; i < wide_count; ++i) {
-		cs__m128i a = cs_mm_cvtps_epi32(floatA[i]);
-		cs__m128i b = cs_mm_cvtps_epi32(floatB[i]);
-		cs__m128i a0b0a1b1 = cs_mm_unpacklo_epi32(a, b);
-		cs__m128i a2b2a3b3 = cs_mm_unpackhi_epi32(a, b);
-		samples[i] = cs_mm_packs_epi32(a0b0a1b1, a2b2a3b3);
-	}
+	samples = (int16_t*)floatA;
+	s_pack_kernel(samples, floatA, floatB, wide_count * 4);
 
 	cs_push_bytes(samples, bytes_to_write);
 
+#elif CUTE_SOUND_PLATFORM == CUTE_SOUND_NULL
+
+	// The pack kernel writes whole groups of 4, which may not fit the caller's buffer.
+	samples = s_ctx->samples;
+	s_pack_kernel(samples, floatA, floatB, wide_count * 4);
+	CUTE_SOUND_MEMCPY(s_ctx->render_out, samples, samples_to_write * s_ctx->bps);
+	s_ctx->render_count = 0;
+
 #endif
 
-	// Free up any queue'd free's for audio sources at zero refcount.
-	for (int i = 0; i < s_ctx->audio_sources_to_free_size;) {
-		cs_audio_source_t* audio = s_ctx->audio_sources_to_free[i];
-		if (audio->playing_count == 0) {
-			cs_free16(audio->channels[0], s_mem_ctx);
-			CUTE_SOUND_FREE(audio, s_mem_ctx);
-			s_ctx->audio_sources_to_free[i] = s_ctx->audio_sources_to_free[--s_ctx->audio_sources_to_free_size];
-		} else {
-			++i;
-		}
+#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+	// Decode ahead now that the output is written, so the next mix only reads from the rings.
+	if (!cs_list_empty(&s_ctx->playing_sounds)) {
+		cs_list_node_t* playing_node = cs_list_begin(&s_ctx->playing_sounds);
+		cs_list_node_t* end_node = cs_list_end(&s_ctx->playing_sounds);
+		do {
+			cs_sound_inst_t* playing = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, node, playing_node);
+			if (playing->stream) cs_stream_fill(playing->stream, (unsigned)playing->stream->capacity, playing->looped);
+			playing_node = playing_node->next;
+		} while (playing_node != end_node);
 	}
+#endif
 
 	unlock:
 	cs_unlock();
@@ -2322,6 +4264,10 @@ void cs_mix()
 void cs_spawn_mix_thread()
 {
 	if (s_ctx->separate_thread) return;
+#if CUTE_SOUND_PLATFORM == CUTE_SOUND_NULL
+	// The null platform only mixes in cs_render.
+	return;
+#endif
 	s_ctx->separate_thread = true;
 #if CUTE_SOUND_PLATFORM == CUTE_SOUND_WINDOWS
 	CreateThread(0, 0, cs_ctx_thread, s_ctx, 0, 0);
@@ -2332,11 +4278,46 @@ void cs_spawn_mix_thread()
 #endif
 }
 
+#if CUTE_SOUND_PLATFORM == CUTE_SOUND_NULL
+
+int cs_render(int16_t* out, int sample_count)
+{
+	// The mix buffers hold up to buffered_samples.
+	int written = 0;
+	while (written < sample_count) {
+		int count = sample_count - written;
+		if (count > (int)s_ctx->latency_samples) count = (int)s_ctx->latency_samples;
+		s_ctx->render_out = out + written * 2;
+		s_ctx->render_count = count;
+		cs_mix();
+		written += count;
+	}
+	return written;
+}
+
+#endif
+
 void cs_mix_thread_sleep_delay(int milliseconds)
 {
 	s_ctx->sleep_milliseconds = milliseconds;
 }
 
+void cs_set_max_voices(int max_voices)
+{
+	if (max_voices < 1) max_voices = 1;
+	s_ctx->max_voices = max_voices;
+}
+
+int cs_get_real_voice_count()
+{
+	return s_ctx->real_voice_count;
+}
+
+int cs_get_virtual_voice_count()
+{
+	return s_ctx->virtual_voice_count;
+}
+
 void* cs_get_context_ptr()
 {
 	return (void*)s_ctx;
@@ -2383,24 +4364,89 @@ static char* cs_next(char* data)
 	return data + 8 + size;
 }
 
-static void cs_last_element(cs__m128* a, int i, int j, int16_t* samples, int offset)
+static cs_sample_format_t s_sample_format = CUTE_SOUND_SAMPLE_FORMAT_FLOAT;
+
+void cs_set_sample_format(cs_sample_format_t format)
 {
-	switch (offset) {
-	case 1:
-		a[i] = cs_mm_set_ps(samples[j], 0.0f, 0.0f, 0.0f);
-		break;
+	s_sample_format = format;
+}
 
-	case 2:
-		a[i] = cs_mm_set_ps(samples[j], samples[j + 1], 0.0f, 0.0f);
-		break;
+// Encodes one channel of `sample_count` samples, `stride` apart, into IMA-ADPCM blocks. Each block
+// header holds the predictor and step index before its first sample, and the last block is padded
+// with silence.
+static void cs_adpcm_encode(uint8_t* blocks, const int16_t* samples, int stride, int sample_count)
+{
+	int predictor = 0, index = 0;
+	int block_count = (sample_count + CUTE_SOUND_ADPCM_BLOCK_SAMPLES - 1) / CUTE_SOUND_ADPCM_BLOCK_SAMPLES;
+	for (int b = 0; b < block_count; ++b) {
+		uint8_t* block = blocks + b * CUTE_SOUND_ADPCM_BLOCK_BYTES;
+		block[0] = (uint8_t)(predictor & 0xFF);
+		block[1] = (uint8_t)((predictor >> 8) & 0xFF);
+		block[2] = (uint8_t)index;
+		block[3] = 0;
+		CUTE_SOUND_MEMSET(block + 4, 0, CUTE_SOUND_ADPCM_BLOCK_SAMPLES / 2);
+		for (int k = 0; k < CUTE_SOUND_ADPCM_BLOCK_SAMPLES; ++k) {
+			int i = b * CUTE_SOUND_ADPCM_BLOCK_SAMPLES + k;
+			int diff = (i < sample_count ? samples[i * stride] : 0) - predictor;
+			int step = s_adpcm_steps[index];
+			int nibble = 0;
+			if (diff < 0) {
+				nibble = 8;
+				diff = -diff;
+			}
+			if (diff >= step) { nibble |= 4; diff -= step; }
+			if (diff >= step >> 1) { nibble |= 2; diff -= step >> 1; }
+			if (diff >= step >> 2) nibble |= 1;
+			cs_adpcm_step(&predictor, &index, nibble);
+			block[4 + k / 2] |= (uint8_t)(nibble << ((k & 1) * 4));
+		}
+	}
+}
 
-	case 3:
-		a[i] = cs_mm_set_ps(samples[j], samples[j + 1], samples[j + 2], 0.0f);
-		break;
+// Deinterleaves 16 bit samples into planar channels stored in the current sample format. Float
+// and 16 bit channels are padded with silence to a multiple of 4, so the mixing kernels never need
+// a tail loop. The channels share one allocation.
+static void cs_deinterleave(cs_audio_source_t* audio, const int16_t* samples, int sample_count, int channel_count)
+{
+	int padded = (int)CUTE_SOUND_ALIGN(sample_count, 4);
+	audio->format = s_sample_format;
+	switch (s_sample_format) {
+	case CUTE_SOUND_SAMPLE_FORMAT_FLOAT:
+	{
+		float* a = (float*)cs_malloc16(sizeof(float) * padded * channel_count, s_mem_ctx);
+		CUTE_SOUND_MEMSET(a, 0, sizeof(float) * padded * channel_count);
+		for (int c = 0; c < channel_count; ++c) {
+			float* channel = a + padded * c;
+			for (int i = 0; i < sample_count; ++i) {
+				channel[i] = (float)samples[i * channel_count + c];
+			}
+			audio->channels[c] = channel;
+		}
+	}	break;
 
-	case 0:
-		a[i] = cs_mm_set_ps(samples[j], samples[j + 1], samples[j + 2], samples[j + 3]);
-		break;
+	case CUTE_SOUND_SAMPLE_FORMAT_INT16:
+	{
+		int16_t* a = (int16_t*)cs_malloc16(sizeof(int16_t) * padded * channel_count, s_mem_ctx);
+		CUTE_SOUND_MEMSET(a, 0, sizeof(int16_t) * padded * channel_count);
+		for (int c = 0; c < channel_count; ++c) {
+			int16_t* channel = a + padded * c;
+			for (int i = 0; i < sample_count; ++i) {
+				channel[i] = samples[i * channel_count + c];
+			}
+			audio->channels[c] = channel;
+		}
+	}	break;
+
+	case CUTE_SOUND_SAMPLE_FORMAT_ADPCM:
+	{
+		int size = (sample_count + CUTE_SOUND_ADPCM_BLOCK_SAMPLES - 1) / CUTE_SOUND_ADPCM_BLOCK_SAMPLES * CUTE_SOUND_ADPCM_BLOCK_BYTES;
+		uint8_t* a = (uint8_t*)cs_malloc16(size * channel_count, s_mem_ctx);
+		for (int c = 0; c < channel_count; ++c) {
+			uint8_t* channel = a + size * c;
+			cs_adpcm_encode(channel, samples + c, channel_count, sample_count);
+			audio->channels[c] = channel;
+		}
+	}	break;
 	}
 }
 
@@ -2462,8 +4508,7 @@ cs_audio_source_t* cs_read_mem_wav(const void* memory, size_t size, cs_error_t*
 		data = cs_next(data);
 	}
 
-	audio = (cs_audio_source_t*)CUTE_SOUND_ALLOC(sizeof(cs_audio_source_t), s_mem_ctx);
-	CUTE_SOUND_MEMSET(audio, 0, sizeof(*audio));
+	audio = s_new_audio();
 	audio->sample_rate = (int)fmt.nSamplesPerSec;
 
 	{
@@ -2472,64 +4517,7 @@ cs_audio_source_t* cs_read_mem_wav(const void* memory, size_t size, cs_error_t*
 		audio->sample_count = sample_count;
 		audio->channel_count = fmt.nChannels;
 
-		int wide_count = (int)CUTE_SOUND_ALIGN(sample_count, 4);
-		wide_count /= 4;
-		int wide_offset = sample_count & 3;
-		int16_t* samples = (int16_t*)(data + 8);
-		float* sample = (float*)CUTE_SOUND_ALLOC(sizeof(float) * 4 + 16, s_mem_ctx);
-		sample = (float*)CUTE_SOUND_ALIGN(sample, 16);
-
-		switch (audio->channel_count) {
-		case 1:
-		{
-			audio->channels[0] = cs_malloc16(wide_count * sizeof(cs__m128), NULL);
-			audio->channels[1] = 0;
-			cs__m128* a = (cs__m128*)audio->channels[0];
-
-			for (int i = 0, j = 0; i < wide_count - 1; ++i, j += 4)
-			{
-				sample[0] = (float)samples[j];
-				sample[1] = (float)samples[j + 1];
-				sample[2] = (float)samples[j + 2];
-				sample[3] = (float)samples[j + 3];
-				a[i] = cs_mm_load_ps(sample);
-			}
-
-			cs_last_element(a, wide_count - 1, (wide_count - 1) * 4, samples, wide_offset);
-		}	break;
-
-		case 2:
-		{
-			cs__m128* a = (cs__m128*)cs_malloc16(wide_count * sizeof(cs__m128) * 2, NULL);
-			cs__m128* b = a + wide_count;
-
-			for (int i = 0, j = 0; i < wide_count - 1; ++i, j += 8)
-			{
-				sample[0] = (float)samples[j];
-				sample[1] = (float)samples[j + 2];
-				sample[2] = (float)samples[j + 4];
-				sample[3] = (float)samples[j + 6];
-				a[i] = cs_mm_load_ps(sample);
-
-				sample[0] = (float)samples[j + 1];
-				sample[1] = (float)samples[j + 3];
-				sample[2] = (float)samples[j + 5];
-				sample[3] = (float)samples[j + 7];
-				b[i] = cs_mm_load_ps(sample);
-			}
-
-			cs_last_element(a, wide_count - 1, (wide_count - 1) * 4, samples, wide_offset);
-			cs_last_element(b, wide_count - 1, (wide_count - 1) * 4 + 4, samples, wide_offset);
-			audio->channels[0] = a;
-			audio->channels[1] = b;
-		}	break;
-
-		default:
-			if (err) *err = CUTE_SOUND_ERROR_WAV_ONLY_MONO_OR_STEREO_IS_SUPPORTED;
-			CUTE_SOUND_ASSERT(false);
-		}
-
-		CUTE_SOUND_FREE(sample, s_mem_ctx);
+		cs_deinterleave(audio, (int16_t*)(data + 8), sample_count, audio->channel_count);
 	}
 
 	if (err) *err = CUTE_SOUND_ERROR_NONE;
@@ -2539,29 +4527,39 @@ cs_audio_source_t* cs_read_mem_wav(const void* memory, size_t size, cs_error_t*
 void cs_free_audio_source(cs_audio_source_t* audio)
 {
 	if (s_ctx) {
-		cs_lock();
-		if (audio->playing_count == 0) {
-			cs_free16(audio->channels[0], s_mem_ctx);
-			CUTE_SOUND_FREE(audio, s_mem_ctx);
-		} else {
-			if (s_ctx->audio_sources_to_free_size == s_ctx->audio_sources_to_free_capacity) {
-				int new_capacity = s_ctx->audio_sources_to_free_capacity * 2;
-				cs_audio_source_t** new_sources = (cs_audio_source_t**)CUTE_SOUND_ALLOC(new_capacity, s_mem_ctx);
-				CUTE_SOUND_MEMCPY(new_sources, s_ctx->audio_sources_to_free, sizeof(cs_audio_source_t*) * s_ctx->audio_sources_to_free_size);
-				CUTE_SOUND_FREE(s_ctx->audio_sources_to_free, s_mem_ctx);
-				s_ctx->audio_sources_to_free = new_sources;
-				s_ctx->audio_sources_to_free_capacity = new_capacity;
-			}
-			s_ctx->audio_sources_to_free[s_ctx->audio_sources_to_free_size++] = audio;
-		}
-		cs_unlock();
+		// The mixer frees it once no instance plays it anymore.
+		cs_command_t cmd;
+		CUTE_SOUND_MEMSET(&cmd, 0, sizeof(cmd));
+		cmd.type = CUTE_SOUND_COMMAND_FREE_AUDIO_SOURCE;
+		cmd.audio = audio;
+		s_push_command(cmd);
 	} else {
 		CUTE_SOUND_ASSERT(audio->playing_count == 0);
-		cs_free16(audio->channels[0], NULL);
-		CUTE_SOUND_FREE(audio, s_mem_ctx);
+		cs_free_audio_memory(audio);
 	}
 }
 
+void cs_audio_set_max_instances(cs_audio_source_t* audio, int max_instances)
+{
+	audio->max_instances = max_instances < 0 ? 0 : max_instances;
+}
+
+void cs_audio_set_priority(cs_audio_source_t* audio, int priority)
+{
+	if (priority < 0) priority = 0;
+	if (priority > 15) priority = 15;
+	audio->priority = priority;
+}
+
+void cs_audio_set_falloff(cs_audio_source_t* audio, cs_falloff_t falloff, float min_distance, float max_distance)
+{
+	if (min_distance < 0) min_distance = 0;
+	if (max_distance < min_distance) max_distance = min_distance;
+	audio->falloff = falloff;
+	audio->min_distance = min_distance;
+	audio->max_distance = max_distance;
+}
+
 #if CUTE_SOUND_PLATFORM == CUTE_SOUND_SDL && defined(SDL_rwops_h_) && defined(CUTE_SOUND_SDL_RWOPS)
 
 	// Load an SDL_RWops object's data into memory.
@@ -2616,73 +4614,19 @@ cs_audio_source_t* cs_read_mem_ogg(const void* memory, size_t length, cs_error_t
 	int sample_rate;
 	int sample_count = stb_vorbis_decode_memory((const unsigned char*)memory, (int)length, &channel_count, &sample_rate, &samples);
 	if (sample_count <= 0) { if (err) *err = CUTE_SOUND_ERROR_STB_VORBIS_DECODE_FAILED; return NULL; }
-	audio = (cs_audio_source_t*)CUTE_SOUND_ALLOC(sizeof(cs_audio_source_t), s_mem_ctx);
-	CUTE_SOUND_MEMSET(audio, 0, sizeof(*audio));
-
-	{
-		int wide_count = (int)CUTE_SOUND_ALIGN(sample_count, 4) / 4;
-		int wide_offset = sample_count & 3;
-		float* sample = (float*)CUTE_SOUND_ALLOC(sizeof(float) * 4 + 16, s_mem_ctx);
-		sample = (float*)CUTE_SOUND_ALIGN(sample, 16);
-		cs__m128* a = NULL;
-		cs__m128* b = NULL;
-
-		switch (channel_count)
-		{
-		case 1:
-		{
-			a = (cs__m128*)cs_malloc16(wide_count * sizeof(cs__m128), NULL);
-			b = 0;
-
-			for (int i = 0, j = 0; i < wide_count - 1; ++i, j += 4)
-			{
-				sample[0] = (float)samples[j];
-				sample[1] = (float)samples[j + 1];
-				sample[2] = (float)samples[j + 2];
-				sample[3] = (float)samples[j + 3];
-				a[i] = cs_mm_load_ps(sample);
-			}
-
-			cs_last_element(a, wide_count - 1, (wide_count - 1) * 4, samples, wide_offset);
-		}	break;
-
-		case 2:
-			a = (cs__m128*)cs_malloc16(wide_count * sizeof(cs__m128) * 2, NULL);
-			b = a + wide_count;
-
-			for (int i = 0, j = 0; i < wide_count - 1; ++i, j += 8)
-			{
-				sample[0] = (float)samples[j];
-				sample[1] = (float)samples[j + 2];
-				sample[2] = (float)samples[j + 4];
-				sample[3] = (float)samples[j + 6];
-				a[i] = cs_mm_load_ps(sample);
-
-				sample[0] = (float)samples[j + 1];
-				sample[1] = (float)samples[j + 3];
-				sample[2] = (float)samples[j + 5];
-				sample[3] = (float)samples[j + 7];
-				b[i] = cs_mm_load_ps(sample);
-			}
-
-			cs_last_element(a, wide_count - 1, (wide_count - 1) * 4, samples, wide_offset);
-			cs_last_element(b, wide_count - 1, (wide_count - 1) * 4 + 4, samples, wide_offset);
-			break;
-
-		default:
-			if (err) *err = CUTE_SOUND_ERROR_OGG_UNSUPPORTED_CHANNEL_COUNT;
-			CUTE_SOUND_ASSERT(false);
-		}
-
-		audio->sample_rate = sample_rate;
-		audio->sample_count = sample_count;
-		audio->channel_count = channel_count;
-		audio->channels[0] = a;
-		audio->channels[1] = b;
-		audio->playing_count = 0;
+	if (!(channel_count == 1 || channel_count == 2)) {
 		CUTE_SOUND_FREE(samples, s_mem_ctx);
+		if (err) *err = CUTE_SOUND_ERROR_OGG_UNSUPPORTED_CHANNEL_COUNT;
+		return NULL;
 	}
 
+	audio = s_new_audio();
+	audio->sample_rate = sample_rate;
+	audio->sample_count = sample_count;
+	audio->channel_count = channel_count;
+	cs_deinterleave(audio, samples, sample_count, channel_count);
+	CUTE_SOUND_FREE(samples, s_mem_ctx);
+
 	if (err) *err = CUTE_SOUND_ERROR_NONE;
 	return audio;
 }
@@ -2697,6 +4641,51 @@ cs_audio_source_t* cs_load_ogg(const char* path, cs_error_t* err)
 	return audio;
 }
 
+// Takes ownership of `memory`, which must come from CUTE_SOUND_ALLOC.
+static cs_audio_source_t* s_ogg_stream(void* memory, int length, cs_error_t* err)
+{
+	int error;
+	stb_vorbis* vorbis = stb_vorbis_open_memory((const unsigned char*)memory, length, &error, NULL);
+	if (!vorbis) {
+		CUTE_SOUND_FREE(memory, s_mem_ctx);
+		if (err) *err = CUTE_SOUND_ERROR_STB_VORBIS_DECODE_FAILED;
+		return NULL;
+	}
+
+	stb_vorbis_info info = stb_vorbis_get_info(vorbis);
+	unsigned sample_count = stb_vorbis_stream_length_in_samples(vorbis);
+	stb_vorbis_close(vorbis);
+	if (!(info.channels == 1 || info.channels == 2)) {
+		CUTE_SOUND_FREE(memory, s_mem_ctx);
+		if (err) *err = CUTE_SOUND_ERROR_OGG_UNSUPPORTED_CHANNEL_COUNT;
+		return NULL;
+	}
+
+	cs_audio_source_t* audio = s_new_audio();
+	audio->sample_rate = (int)info.sample_rate;
+	audio->sample_count = (int)sample_count;
+	audio->channel_count = info.channels;
+	audio->stream_data = memory;
+	audio->stream_size = length;
+	if (err) *err = CUTE_SOUND_ERROR_NONE;
+	return audio;
+}
+
+cs_audio_source_t* cs_read_mem_ogg_stream(const void* memory, size_t length, cs_error_t* err)
+{
+	void* copy = CUTE_SOUND_ALLOC(length, s_mem_ctx);
+	CUTE_SOUND_MEMCPY(copy, memory, length);
+	return s_ogg_stream(copy, (int)length, err);
+}
+
+cs_audio_source_t* cs_load_ogg_stream(const char* path, cs_error_t* err)
+{
+	int length;
+	void* memory = cs_read_file_to_memory(path, &length, s_mem_ctx);
+	if (!memory) { if (err) *err = CUTE_SOUND_ERROR_FILE_NOT_FOUND; return NULL; }
+	return s_ogg_stream(memory, length, err);
+}
+
 #if CUTE_SOUND_PLATFORM == CUTE_SOUND_SDL && defined(SDL_rwops_h_) && defined(CUTE_SOUND_SDL_RWOPS)
 
 	cs_audio_source_t* cs_load_ogg_rw(SDL_RWops* rw, cs_error_t* err)
@@ -2715,31 +4704,58 @@ cs_audio_source_t* cs_load_ogg(const char* path, cs_error_t* err)
 // -------------------------------------------------------------------------------------------------
 // Music sounds.
 
+static cs_sound_inst_t* s_alloc_inst()
+{
+	// Reclaimed instances queue up at the back in order, so if the first one still has commands
+	// in flight the rest do too and only a new page helps. New pages go in front and are usable
+	// at once.
+	if (!cs_list_empty(&s_ctx->free_sounds)) {
+		cs_sound_inst_t* inst = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, node, cs_list_front(&s_ctx->free_sounds));
+		if ((int)(cs_atomic_load(&s_ctx->command_read) - inst->reuse_after) < 0) s_add_page();
+	} else {
+		s_add_page();
+	}
+	cs_sound_inst_t* inst = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, node, cs_list_pop_front(&s_ctx->free_sounds));
+	inst->id = ((uint64_t)inst->generation << 32) | inst->slot;
+	return inst;
+}
+
 static void s_insert(cs_sound_inst_t* inst)
 {
-	cs_lock();
-	cs_list_push_back(&s_ctx->playing_sounds, &inst->node);
-	inst->audio->playing_count += 1;
+	inst->stream = NULL;
+	inst->sample_frac = 0;
+	inst->attenuation = 1.0f;
+	inst->culled = false;
+#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
+	if (inst->audio->stream_data) inst->stream = cs_stream_open(inst->audio);
+#endif
 	inst->active = true;
-	inst->id = s_ctx->instance_id_gen++;
-	hashtable_insert(&s_ctx->instance_map, inst->id, inst);
-	// s_on_make_playing(inst);
-	cs_unlock();
+	inst->set_paused = inst->paused;
+	inst->set_looped = inst->looped;
+	inst->set_volume = inst->volume;
+	inst->set_pitch = inst->pitch;
+	inst->position = (unsigned)inst->sample_index;
+
+	// The mixer owns the instance from here on.
+	cs_command_t cmd;
+	CUTE_SOUND_MEMSET(&cmd, 0, sizeof(cmd));
+	cmd.type = CUTE_SOUND_COMMAND_PLAY;
+	cmd.inst = inst;
+	cmd.id = inst->id;
+	s_push_command(cmd);
 }
 
 static cs_sound_inst_t* s_inst_music(cs_audio_source_t* src, float volume)
 {
-	if (cs_list_empty(&s_ctx->free_sounds)) {
-		s_add_page();
-	}
-	CUTE_SOUND_ASSERT(!cs_list_empty(&s_ctx->free_sounds));
-	cs_sound_inst_t* inst = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, node, cs_list_pop_back(&s_ctx->free_sounds));
+	cs_sound_inst_t* inst = s_alloc_inst();
 	inst->is_music = true;
 	inst->looped = s_ctx->music_looped;
 	if (!s_ctx->music_paused) inst->paused = false;
 	inst->volume = volume;
+	inst->pitch = s_ctx->music_pitch;
 	inst->pan0 = 0.5f;
 	inst->pan1 = 0.5f;
+	inst->positional = false;
 	inst->audio = src;
 	inst->sample_index = 0;
 	cs_list_init_node(&inst->node);
@@ -2749,11 +4765,7 @@ static cs_sound_inst_t* s_inst_music(cs_audio_source_t* src, float volume)
 
 static cs_sound_inst_t* s_inst(cs_audio_source_t* src, cs_sound_params_t params)
 {
-	if (cs_list_empty(&s_ctx->free_sounds)) {
-		s_add_page();
-	}
-	CUTE_SOUND_ASSERT(!cs_list_empty(&s_ctx->free_sounds));
-	cs_sound_inst_t* inst = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, node, cs_list_pop_back(&s_ctx->free_sounds));
+	cs_sound_inst_t* inst = s_alloc_inst();
 	float pan = params.pan;
 	if (pan > 1.0f) pan = 1.0f;
 	else if (pan < 0.0f) pan = 0.0f;
@@ -2763,8 +4775,12 @@ static cs_sound_inst_t* s_inst(cs_audio_source_t* src, cs_sound_params_t params)
 	inst->paused = params.paused;
 	inst->looped = params.looped;
 	inst->volume = params.volume;
+	inst->pitch = params.pitch >= 0 ? params.pitch : 0;
 	inst->pan0 = panl;
 	inst->pan1 = panr;
+	inst->positional = params.positional;
+	inst->x = params.x;
+	inst->y = params.y;
 	inst->audio = src;
 	inst->sample_index = 0;
 	cs_list_init_node(&inst->node);
@@ -2774,9 +4790,8 @@ static cs_sound_inst_t* s_inst(cs_audio_source_t* src, cs_sound_params_t params)
 
 void cs_music_play(cs_audio_source_t* audio_source, float fade_in_time)
 {
-	if (s_ctx->music_state != CUTE_SOUND_MUSIC_STATE_PLAYING) {
-		cs_music_stop(0);
-	}
+	s_reclaim();
+	cs_music_stop(0);
 
 	if (fade_in_time < 0) fade_in_time = 0;
 	if (fade_in_time) {
@@ -2799,14 +4814,8 @@ void cs_music_stop(float fade_out_time)
 
 	if (fade_out_time == 0) {
 		// Immediately turn off all music if no fade out time.
-		if (s_ctx->music_playing) {
-			s_ctx->music_playing->active = false;
-			s_ctx->music_playing->paused = false;
-		}
-		if (s_ctx->music_next) {
-			s_ctx->music_next->active = false;
-			s_ctx->music_next->paused = false;
-		}
+		s_stop(s_ctx->music_playing);
+		s_stop(s_ctx->music_next);
 		s_ctx->music_playing = NULL;
 		s_ctx->music_next = NULL;
 		s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_NONE;
@@ -2836,6 +4845,7 @@ void cs_music_stop(float fade_out_time)
 			s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_FADE_OUT;
 			s_ctx->t = s_smoothstep(((s_ctx->fade - s_ctx->t) / s_ctx->fade));
 			s_ctx->fade = fade_out_time;
+			s_stop(s_ctx->music_next);
 			s_ctx->music_next = NULL;
 		}	break;
 
@@ -2847,6 +4857,7 @@ void cs_music_stop(float fade_out_time)
 			s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_FADE_OUT;
 			s_ctx->t = s_smoothstep(((s_ctx->fade - s_ctx->t) / s_ctx->fade));
 			s_ctx->fade = fade_out_time;
+			s_stop(s_ctx->music_playing);
 			s_ctx->music_playing = s_ctx->music_next;
 			s_ctx->music_next = NULL;
 		}	break;
@@ -2861,22 +4872,30 @@ void cs_music_set_volume(float volume_0_to_1)
 {
 	if (volume_0_to_1 < 0) volume_0_to_1 = 0;
 	s_ctx->music_volume = volume_0_to_1;
-	if (s_ctx->music_playing) s_ctx->music_playing->volume = volume_0_to_1;
-	if (s_ctx->music_next) s_ctx->music_next->volume = volume_0_to_1;
+	s_set_volume(s_ctx->music_playing, volume_0_to_1);
+	s_set_volume(s_ctx->music_next, volume_0_to_1);
+}
+
+void cs_music_set_pitch(float pitch)
+{
+	if (!(pitch >= 0)) pitch = 0;
+	s_ctx->music_pitch = pitch;
+	s_set_pitch(s_ctx->music_playing, pitch);
+	s_set_pitch(s_ctx->music_next, pitch);
 }
 
 void cs_music_set_loop(bool true_to_loop)
 {
 	s_ctx->music_looped = true_to_loop;
-	if (s_ctx->music_playing) s_ctx->music_playing->looped = true_to_loop;
-	if (s_ctx->music_next) s_ctx->music_next->looped = true_to_loop;
+	s_set_looped(s_ctx->music_playing, true_to_loop);
+	s_set_looped(s_ctx->music_next, true_to_loop);
 }
 
 void cs_music_pause()
 {
 	if (s_ctx->music_state == CUTE_SOUND_MUSIC_STATE_PAUSED) return;
-	if (s_ctx->music_playing) s_ctx->music_playing->paused = true;
-	if (s_ctx->music_next) s_ctx->music_next->paused = true;
+	s_set_paused(s_ctx->music_playing, true);
+	s_set_paused(s_ctx->music_next, true);
 	s_ctx->music_paused = true;
 	s_ctx->music_state_to_resume_from_paused = s_ctx->music_state;
 	s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_PAUSED;
@@ -2885,8 +4904,8 @@ void cs_music_pause()
 void cs_music_resume()
 {
 	if (s_ctx->music_state != CUTE_SOUND_MUSIC_STATE_PAUSED) return;
-	if (s_ctx->music_playing) s_ctx->music_playing->paused = false;
-	if (s_ctx->music_next) s_ctx->music_next->paused = false;
+	s_set_paused(s_ctx->music_playing, false);
+	s_set_paused(s_ctx->music_next, false);
 	s_ctx->music_state = s_ctx->music_state_to_resume_from_paused;
 }
 
@@ -2894,6 +4913,7 @@ void cs_music_switch_to(cs_audio_source_t* audio_source, float fade_out_time, fl
 {
 	if (fade_in_time < 0) fade_in_time = 0;
 	if (fade_out_time < 0) fade_out_time = 0;
+	s_reclaim();
 
 	switch (s_ctx->music_state) {
 	case CUTE_SOUND_MUSIC_STATE_NONE:
@@ -2937,7 +4957,7 @@ void cs_music_switch_to(cs_audio_source_t* audio_source, float fade_out_time, fl
 	{
 		CUTE_SOUND_ASSERT(s_ctx->music_next != NULL);
 		cs_sound_inst_t* inst = s_inst_music(audio_source, fade_in_time == 0 ? 1.0f : 0);
-		s_ctx->music_next->active = false;
+		s_stop(s_ctx->music_next);
 		s_ctx->music_next = inst;
 		s_ctx->fade_switch_1 = fade_in_time;
 	}	break;
@@ -2947,6 +4967,7 @@ void cs_music_switch_to(cs_audio_source_t* audio_source, float fade_out_time, fl
 	{
 		CUTE_SOUND_ASSERT(s_ctx->music_next != NULL);
 		cs_sound_inst_t* inst = s_inst_music(audio_source, fade_in_time == 0 ? 1.0f : 0);
+		s_stop(s_ctx->music_playing);
 		s_ctx->music_playing = s_ctx->music_next;
 		s_ctx->music_next = inst;
 
@@ -2966,10 +4987,12 @@ void cs_music_switch_to(cs_audio_source_t* audio_source, float fade_out_time, fl
 void cs_music_crossfade(cs_audio_source_t* audio_source, float cross_fade_time)
 {
 	if (cross_fade_time < 0) cross_fade_time = 0;
+	s_reclaim();
 
 	switch (s_ctx->music_state) {
 	case CUTE_SOUND_MUSIC_STATE_NONE:
 		cs_music_play(audio_source, cross_fade_time);
+		break;
 
 	case CUTE_SOUND_MUSIC_STATE_PLAYING:
 	{
@@ -2977,7 +5000,7 @@ void cs_music_crossfade(cs_audio_source_t* audio_source, float cross_fade_time)
 		s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_CROSSFADE;
 
 		cs_sound_inst_t* inst = s_inst_music(audio_source, cross_fade_time == 0 ? 1.0f : 0);
-		inst->paused = false;
+		s_set_paused(inst, false);
 		s_ctx->music_next = inst;
 
 		s_ctx->fade = cross_fade_time;
@@ -2993,7 +5016,7 @@ void cs_music_crossfade(cs_audio_source_t* audio_source, float cross_fade_time)
 		s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_CROSSFADE;
 
 		cs_sound_inst_t* inst = s_inst_music(audio_source, cross_fade_time == 0 ? 1.0f : 0);
-		inst->paused = false;
+		s_set_paused(inst, false);
 		s_ctx->music_next = inst;
 
 		s_ctx->fade = cross_fade_time;
@@ -3002,10 +5025,10 @@ void cs_music_crossfade(cs_audio_source_t* audio_source, float cross_fade_time)
 	case CUTE_SOUND_MUSIC_STATE_SWITCH_TO_0:
 	{
 		s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_CROSSFADE;
-		s_ctx->music_next->active = false;
+		s_stop(s_ctx->music_next);
 
 		cs_sound_inst_t* inst = s_inst_music(audio_source, cross_fade_time == 0 ? 1.0f : 0);
-		inst->paused = false;
+		s_set_paused(inst, false);
 		s_ctx->music_next = inst;
 
 		s_ctx->fade = cross_fade_time;
@@ -3015,11 +5038,11 @@ void cs_music_crossfade(cs_audio_source_t* audio_source, float cross_fade_time)
 	case CUTE_SOUND_MUSIC_STATE_CROSSFADE:
 	{
 		s_ctx->music_state = CUTE_SOUND_MUSIC_STATE_CROSSFADE;
-		s_ctx->music_playing->active = false;
+		s_stop(s_ctx->music_playing);
 		s_ctx->music_playing = s_ctx->music_next;
 
 		cs_sound_inst_t* inst = s_inst_music(audio_source, cross_fade_time == 0 ? 1.0f : 0);
-		inst->paused = false;
+		s_set_paused(inst, false);
 		s_ctx->music_next = inst;
 
 		s_ctx->fade = cross_fade_time;
@@ -3031,17 +5054,28 @@ void cs_music_crossfade(cs_audio_source_t* audio_source, float cross_fade_time)
 	}
 }
 
+static void s_set_sample_index(cs_sound_inst_t* inst, uint64_t sample_index)
+{
+	cs_command_t cmd;
+	CUTE_SOUND_MEMSET(&cmd, 0, sizeof(cmd));
+	cmd.type = CUTE_SOUND_COMMAND_SET_SAMPLE_INDEX;
+	cmd.inst = inst;
+	cmd.id = inst->id;
+	cmd.sample_index = sample_index;
+	s_push_command(cmd);
+}
+
 uint64_t cs_music_get_sample_index()
 {
-	if (s_ctx->music_playing) return 0;
-	else return s_ctx->music_playing->sample_index;
+	if (!s_ctx->music_playing) return 0;
+	else return (uint64_t)(int)cs_atomic_load(&s_ctx->music_playing->position);
 }
 
 cs_error_t cs_music_set_sample_index(uint64_t sample_index)
 {
-	if (s_ctx->music_playing) return CUTE_SOUND_ERROR_INVALID_SOUND;
+	if (!s_ctx->music_playing) return CUTE_SOUND_ERROR_INVALID_SOUND;
 	if (sample_index > s_ctx->music_playing->audio->sample_count) return CUTE_SOUND_ERROR_TRIED_TO_SET_SAMPLE_INDEX_BEYOND_THE_AUDIO_SOURCES_SAMPLE_COUNT;
-	s_ctx->music_playing->sample_index = sample_index;
+	s_set_sample_index(s_ctx->music_playing, sample_index);
 	return CUTE_SOUND_ERROR_NONE;
 }
 
@@ -3056,16 +5090,25 @@ cs_sound_params_t cs_sound_params_default()
 	params.volume = 1.0f;
 	params.pan = 0.5f;
 	params.delay = 0.0f;
+	params.pitch = 1.0f;
+	params.positional = false;
+	params.x = 0;
+	params.y = 0;
 	return params;
 }
 
 static cs_sound_inst_t* s_get_inst(cs_playing_sound_t sound)
 {
-	return (cs_sound_inst_t*)hashtable_find(&s_ctx->instance_map, sound.id);
+	uint32_t slot = (uint32_t)sound.id;
+	uint32_t page = slot / CUTE_SOUND_PAGE_INSTANCE_COUNT;
+	if (page >= (uint32_t)s_ctx->page_count) return NULL;
+	cs_sound_inst_t* inst = s_ctx->page_table[page]->instances + slot % CUTE_SOUND_PAGE_INSTANCE_COUNT;
+	return inst->id == sound.id && inst->generation == (uint32_t)(sound.id >> 32) ? inst : NULL;
 }
 
 cs_playing_sound_t cs_play_sound(cs_audio_source_t* audio, cs_sound_params_t params)
 {
+	s_reclaim();
 	cs_sound_inst_t* inst = s_inst(audio, params);
 	cs_playing_sound_t sound = { inst->id };
 	return sound;
@@ -3073,51 +5116,59 @@ cs_playing_sound_t cs_play_sound(cs_audio_source_t* audio, cs_sound_params_t par
 
 bool cs_sound_is_active(cs_playing_sound_t sound)
 {
-	cs_sound_inst_t* inst = s_get_inst(sound);
-	if (!inst) return false;
-	return inst->active;
+	// Finished instances come back with a new generation, so the handle stops matching.
+	s_reclaim();
+	return s_get_inst(sound) != NULL;
 }
 
 bool cs_sound_get_is_paused(cs_playing_sound_t sound)
 {
 	cs_sound_inst_t* inst = s_get_inst(sound);
 	if (!inst) return false;
-	return inst->paused;
+	return inst->set_paused;
 }
 
 bool cs_sound_get_is_looped(cs_playing_sound_t sound)
 {
 	cs_sound_inst_t* inst = s_get_inst(sound);
 	if (!inst) return false;
-	return inst->looped;
+	return inst->set_looped;
 }
 
 float cs_sound_get_volume(cs_playing_sound_t sound)
 {
 	cs_sound_inst_t* inst = s_get_inst(sound);
 	if (!inst) return 0;
-	return inst->volume;
+	return inst->set_volume;
+}
+
+float cs_sound_get_pitch(cs_playing_sound_t sound)
+{
+	cs_sound_inst_t* inst = s_get_inst(sound);
+	if (!inst) return 0;
+	return inst->set_pitch;
 }
 
 uint64_t cs_sound_get_sample_index(cs_playing_sound_t sound)
 {
 	cs_sound_inst_t* inst = s_get_inst(sound);
 	if (!inst) return 0;
-	return inst->sample_index;
+	// Sign extended, so a delayed sound still reads as negative like sample_index.
+	return (uint64_t)(int)cs_atomic_load(&inst->position);
 }
 
 void cs_sound_set_is_paused(cs_playing_sound_t sound, bool true_for_paused)
 {
 	cs_sound_inst_t* inst = s_get_inst(sound);
 	if (!inst) return;
-	inst->paused = true_for_paused;
+	s_set_paused(inst, true_for_paused);
 }
 
 void cs_sound_set_is_looped(cs_playing_sound_t sound, bool true_for_looped)
 {
 	cs_sound_inst_t* inst = s_get_inst(sound);
 	if (!inst) return;
-	inst->looped = true_for_looped;
+	s_set_looped(inst, true_for_looped);
 }
 
 void cs_sound_set_volume(cs_playing_sound_t sound, float volume_0_to_1)
@@ -3125,7 +5176,29 @@ void cs_sound_set_volume(cs_playing_sound_t sound, float volume_0_to_1)
 	if (volume_0_to_1 < 0) volume_0_to_1 = 0;
 	cs_sound_inst_t* inst = s_get_inst(sound);
 	if (!inst) return;
-	inst->volume = volume_0_to_1;
+	s_set_volume(inst, volume_0_to_1);
+}
+
+void cs_sound_set_pitch(cs_playing_sound_t sound, float pitch)
+{
+	if (!(pitch >= 0)) pitch = 0;
+	cs_sound_inst_t* inst = s_get_inst(sound);
+	if (!inst) return;
+	s_set_pitch(inst, pitch);
+}
+
+void cs_sound_set_position(cs_playing_sound_t sound, float x, float y)
+{
+	cs_sound_inst_t* inst = s_get_inst(sound);
+	if (!inst) return;
+	cs_command_t cmd;
+	CUTE_SOUND_MEMSET(&cmd, 0, sizeof(cmd));
+	cmd.type = CUTE_SOUND_COMMAND_SET_POSITION;
+	cmd.inst = inst;
+	cmd.id = inst->id;
+	cmd.params[0] = x;
+	cmd.params[1] = y;
+	s_push_command(cmd);
 }
 
 cs_error_t cs_sound_set_sample_index(cs_playing_sound_t sound, uint64_t sample_index)
@@ -3133,7 +5206,7 @@ cs_error_t cs_sound_set_sample_index(cs_playing_sound_t sound, uint64_t sample_i
 	cs_sound_inst_t* inst = s_get_inst(sound);
 	if (!inst) return CUTE_SOUND_ERROR_INVALID_SOUND;
 	if (sample_index > inst->audio->sample_count) return CUTE_SOUND_ERROR_TRIED_TO_SET_SAMPLE_INDEX_BEYOND_THE_AUDIO_SOURCES_SAMPLE_COUNT;
-	inst->sample_index = sample_index;
+	s_set_sample_index(inst, sample_index);
 	return CUTE_SOUND_ERROR_NONE;
 }
 
@@ -3145,26 +5218,107 @@ void cs_set_playing_sounds_volume(float volume_0_to_1)
 
 void cs_stop_all_playing_sounds()
 {
-	cs_lock();
+	cs_command_t cmd;
+	CUTE_SOUND_MEMSET(&cmd, 0, sizeof(cmd));
+	cmd.type = CUTE_SOUND_COMMAND_STOP_ALL_SOUNDS;
+	s_push_command(cmd);
+}
 
-	// Set all playing sounds (that aren't music) active to false.
-	if (cs_list_empty(&s_ctx->playing_sounds)) {
-		cs_unlock();
-		return;
-	}
-	cs_list_node_t* playing_sound = cs_list_begin(&s_ctx->playing_sounds);
-	cs_list_node_t* end = cs_list_end(&s_ctx->playing_sounds);
+void cs_set_listener_position(float x, float y)
+{
+	cs_command_t cmd;
+	CUTE_SOUND_MEMSET(&cmd, 0, sizeof(cmd));
+	cmd.type = CUTE_SOUND_COMMAND_SET_LISTENER;
+	cmd.params[0] = x;
+	cmd.params[1] = y;
+	s_push_command(cmd);
+}
 
-	do {
-		cs_sound_inst_t* inst = CUTE_SOUND_LIST_HOST(cs_sound_inst_t, node, playing_sound);
-		cs_list_node_t* next = playing_sound->next;
-		if (inst != s_ctx->music_playing && inst != s_ctx->music_next) {
-			inst->active = false; // Let cs_mix handle cleaning this up.
-		}
-		playing_sound = next;
-	} while (playing_sound != end);
+// -------------------------------------------------------------------------------------------------
+// Buses.
 
-	cs_unlock();
+void cs_audio_set_bus(cs_audio_source_t* audio, cs_bus_t bus)
+{
+	if ((unsigned)bus >= CUTE_SOUND_BUS_COUNT) return;
+	audio->bus = bus;
+}
+
+void cs_bus_set_volume(cs_bus_t bus, float volume_0_to_1)
+{
+	if ((unsigned)bus >= CUTE_SOUND_BUS_COUNT) return;
+	if (volume_0_to_1 < 0) volume_0_to_1 = 0;
+	s_ctx->bus_volume[bus] = volume_0_to_1;
+	cs_command_t cmd;
+	CUTE_SOUND_MEMSET(&cmd, 0, sizeof(cmd));
+	cmd.type = CUTE_SOUND_COMMAND_SET_BUS_VOLUME;
+	cmd.bus = bus;
+	cmd.value = volume_0_to_1;
+	s_push_command(cmd);
+}
+
+float cs_bus_get_volume(cs_bus_t bus)
+{
+	if ((unsigned)bus >= CUTE_SOUND_BUS_COUNT) return 0;
+	return s_ctx->bus_volume[bus];
+}
+
+static cs_command_t s_bus_command(cs_command_type_t type, cs_bus_t bus)
+{
+	cs_command_t cmd;
+	CUTE_SOUND_MEMSET(&cmd, 0, sizeof(cmd));
+	cmd.type = type;
+	cmd.bus = bus;
+	cmd.memory = s_bus_memory(bus);
+	return cmd;
+}
+
+void cs_bus_set_filter(cs_bus_t bus, cs_filter_t filter, float cutoff_in_Hz, float q)
+{
+	if ((unsigned)bus >= CUTE_SOUND_BUS_COUNT) return;
+	float nyquist = s_ctx->Hz * 0.5f;
+	if (cutoff_in_Hz < 10.0f) cutoff_in_Hz = 10.0f;
+	if (cutoff_in_Hz > nyquist * 0.9f) cutoff_in_Hz = nyquist * 0.9f;
+	if (q < 0.1f) q = 0.1f;
+	cs_command_t cmd = s_bus_command(CUTE_SOUND_COMMAND_SET_BUS_FILTER, bus);
+	cmd.mode = filter;
+	cmd.params[0] = cutoff_in_Hz;
+	cmd.params[1] = q;
+	s_push_command(cmd);
+}
+
+void cs_bus_set_reverb(cs_bus_t bus, float room_size_0_to_1, float wet_0_to_1)
+{
+	if ((unsigned)bus >= CUTE_SOUND_BUS_COUNT) return;
+	if (room_size_0_to_1 < 0) room_size_0_to_1 = 0;
+	if (room_size_0_to_1 > 1) room_size_0_to_1 = 1;
+	if (wet_0_to_1 < 0) wet_0_to_1 = 0;
+	if (wet_0_to_1 > 1) wet_0_to_1 = 1;
+	cs_command_t cmd = s_bus_command(CUTE_SOUND_COMMAND_SET_BUS_REVERB, bus);
+	cmd.params[0] = room_size_0_to_1;
+	cmd.params[1] = wet_0_to_1;
+	s_push_command(cmd);
+}
+
+void cs_bus_set_compressor(cs_bus_t bus, float threshold_in_db, float ratio, float attack_in_milliseconds, float release_in_milliseconds)
+{
+	if ((unsigned)bus >= CUTE_SOUND_BUS_COUNT) return;
+	cs_command_t cmd = s_bus_command(CUTE_SOUND_COMMAND_SET_BUS_COMPRESSOR, bus);
+	cmd.params[0] = threshold_in_db;
+	cmd.params[1] = ratio;
+	cmd.params[2] = attack_in_milliseconds;
+	cmd.params[3] = release_in_milliseconds;
+	s_push_command(cmd);
+}
+
+void cs_set_limiter(bool true_to_enable, float ceiling_in_db)
+{
+	if (ceiling_in_db > 0) ceiling_in_db = 0;
+	cs_command_t cmd;
+	CUTE_SOUND_MEMSET(&cmd, 0, sizeof(cmd));
+	cmd.type = CUTE_SOUND_COMMAND_SET_LIMITER;
+	cmd.flag = true_to_enable;
+	cmd.params[0] = ceiling_in_db;
+	s_push_command(cmd);
 }
 
 void* cs_get_global_context()
@@ -11,9 +11,10 @@
 #include "stb_vorbis.c"
 
 #define CUTE_SOUND_IMPLEMENTATION
-#define CUTE_SOUND_SCALAR_MODE
 #include "cute_sound.h"
 
+#include "engine_pixel.h"
+
 enum {
     ENGINE_INPUT_DOWN = (1 << 0),
     ENGINE_INPUT_PRESSED = (1 << 1),
@@ -57,7 +58,7 @@ static inline Color engine_blend_pixel(Color dst, Color src) {
     Color res;
     res.w = (dst.w & 0xff00ff) + ((((src.w & 0xff00ff) - (dst.w & 0xff00ff)) * src.a) >> 8);
     res.g = dst.g + (((src.g - dst.g) * src.a) >> 8);
-    res.a = dst.a;
+    res.a = dst.a + (((0xff - dst.a) * src.a + 0xff) >> 8);
     return res;
 }
 
@@ -67,6 +68,7 @@ static inline Color engine_blend_pixel2(Color dst, Color src, Color clr) {
     dst.r = ((src.r * clr.r * src.a) >> 16) + ((dst.r * ia) >> 8);
     dst.g = ((src.g * clr.g * src.a) >> 16) + ((dst.g * ia) >> 8);
     dst.b = ((src.b * clr.b * src.a) >> 16) + ((dst.b * ia) >> 8);
+    dst.a = dst.a + (((0xff - dst.a) * src.a + 0xff) >> 8);
     return dst;
 }
 
@@ -80,7 +82,7 @@ static inline Color engine_blend_pixel3(Color dst, Color src, Color clr, Color a
 
 static bool engine_check_column(Image *img, int x, int y, int h) {
     while (h > 0) {
-        if (img->pixels[x + y * img->w].a) {
+        if (img->pixels[x + y * img->stride].a) {
             return true;
         }
         y++; h--;
@@ -136,8 +138,448 @@ static Rect engine_get_adjusted_window_rect(Engine *engine) {
     return engine_rect((engine->width - w) / 2, (engine->height - h) / 2, w, h);
 }
 
+static bool engine_audio;
+
+typedef struct EngineJob {
+    void (*fn)(void *udata, int index);
+    void *udata;
+    int index;
+    struct EngineJob *next;
+} EngineJob;
+
+// Process wide worker pool, started on first use. Jobs run in FIFO order;
+// threads that wait on jobs help out instead of idling.
+static struct {
+    volatile LONG state; // 0 = stopped, 1 = starting, 2 = running
+    volatile bool quit;
+    CRITICAL_SECTION lock;
+    HANDLE semaphore;
+    HANDLE threads[64];
+    int thread_count;
+    EngineJob *head, *tail;
+} engine_pool;
+
+static bool engine_run_job(void) {
+    EnterCriticalSection(&engine_pool.lock);
+    EngineJob *job = engine_pool.head;
+    if (job) {
+        engine_pool.head = job->next;
+        if (!engine_pool.head) { engine_pool.tail = NULL; }
+    }
+    LeaveCriticalSection(&engine_pool.lock);
+
+    if (!job) { return false; }
+    job->fn(job->udata, job->index);
+    free(job);
+    return true;
+}
+
+static DWORD WINAPI engine_worker_thread(LPVOID udata) {
+    for (;;) {
+        WaitForSingleObject(engine_pool.semaphore, INFINITE);
+        if (engine_pool.quit) { break; }
+        engine_run_job();
+    }
+    return 0;
+}
+
+static void engine_start_pool(void) {
+    if (engine_pool.state == 2) { return; }
+    if (InterlockedCompareExchange(&engine_pool.state, 1, 0) != 0) {
+        while (engine_pool.state != 2) { Sleep(0); }
+        return;
+    }
+
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int n = engine_max((int) info.dwNumberOfProcessors - 1, 1);
+    engine_pool.thread_count = engine_min(n, (int) engine_lengthof(engine_pool.threads));
+
+    InitializeCriticalSection(&engine_pool.lock);
+    engine_pool.semaphore = CreateSemaphore(0, 0, 0x7fffffff, 0);
+    for (int i = 0; i < engine_pool.thread_count; i++) {
+        engine_pool.threads[i] = CreateThread(0, 0, engine_worker_thread, 0, 0, 0);
+    }
+    InterlockedExchange(&engine_pool.state, 2);
+}
+
+static void engine_stop_pool(void) {
+    if (engine_pool.state != 2) { return; }
+    while (engine_run_job()) {}
+    engine_pool.quit = true;
+    ReleaseSemaphore(engine_pool.semaphore, engine_pool.thread_count, 0);
+    for (int i = 0; i < engine_pool.thread_count; i++) {
+        WaitForSingleObject(engine_pool.threads[i], INFINITE);
+        CloseHandle(engine_pool.threads[i]);
+    }
+    CloseHandle(engine_pool.semaphore);
+    DeleteCriticalSection(&engine_pool.lock);
+    engine_pool.quit = false;
+    engine_pool.state = 0;
+}
+
+static void engine_push_job(void (*fn)(void *udata, int index), void *udata, int index) {
+    engine_start_pool();
+    EngineJob *job = engine_alloc(sizeof(EngineJob));
+    job->fn = fn;
+    job->udata = udata;
+    job->index = index;
+
+    EnterCriticalSection(&engine_pool.lock);
+    if (engine_pool.tail) { engine_pool.tail->next = job; } else { engine_pool.head = job; }
+    engine_pool.tail = job;
+    LeaveCriticalSection(&engine_pool.lock);
+
+    ReleaseSemaphore(engine_pool.semaphore, 1, 0);
+}
+
 static double engine_now() {
-    return clock() / 1000.0;
+    static double scale;
+    LARGE_INTEGER t;
+    if (!scale) {
+        QueryPerformanceFrequency(&t);
+        scale = 1.0 / t.QuadPart;
+    }
+    QueryPerformanceCounter(&t);
+    return t.QuadPart * scale;
+}
+
+static bool engine_push_event(EventQueue *q, Event *e) {
+    // recorded before the room check, so a dropped transition can still be recovered
+    if (e->type == ENGINE_EVENT_KEY_DOWN || e->type == ENGINE_EVENT_KEY_UP) {
+        q->keys[e->code & 0xff] = e->type;
+    } else if (e->type == ENGINE_EVENT_MOUSE_DOWN || e->type == ENGINE_EVENT_MOUSE_UP) {
+        q->buttons[e->code & 15] = e->type;
+    } else if (e->type == ENGINE_EVENT_MOUSE_MOVE) {
+        q->mouse_x = e->x;
+        q->mouse_y = e->y;
+        q->moved = true;
+    }
+    LONG head = q->head;
+    if (head - q->tail == ENGINE_EVENT_QUEUE_SIZE) {
+        InterlockedIncrement(&q->dropped);
+        return false;
+    }
+    q->events[head & (ENGINE_EVENT_QUEUE_SIZE - 1)] = *e;
+    MemoryBarrier();
+    q->head = head + 1;
+    return true;
+}
+
+static Event *engine_peek_event(EventQueue *q) {
+    if (!q) { return NULL; }
+    LONG tail = q->tail;
+    if (tail == q->head) { return NULL; }
+    MemoryBarrier();
+    return &q->events[tail & (ENGINE_EVENT_QUEUE_SIZE - 1)];
+}
+
+static void engine_pop_event(EventQueue *q) {
+    MemoryBarrier();
+    q->tail = q->tail + 1;
+}
+
+static void engine_push_window_event(Engine *engine, int type, int code, int x, int y, float scroll) {
+    // messages sit in the queue until the next engine_update(), so stamp
+    // them with the time they were posted rather than when we see them
+    DWORD age = GetTickCount() - (DWORD) GetMessageTime();
+    Event e = { type, code, x, y, scroll, engine_now() - age / 1000.0 };
+    engine_push_event(engine->window_events, &e);
+}
+
+static DWORD WINAPI engine_input_thread(LPVOID udata) {
+    Engine *engine = udata;
+    bool down[256] = { 0 };
+    bool buttons[4] = { 0 };
+    bool focused = false;
+
+    HWND hwnd = CreateWindowEx(0, "STATIC", 0, 0, 0, 0, 0, 0, HWND_MESSAGE, 0, 0, 0);
+    RAWINPUTDEVICE rid[2] = {
+        { 0x01, 0x02, RIDEV_INPUTSINK, hwnd },  // mouse
+        { 0x01, 0x06, RIDEV_INPUTSINK, hwnd }   // keyboard
+    };
+    RegisterRawInputDevices(rid, 2, sizeof(RAWINPUTDEVICE));
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+
+    MSG msg;
+    while (GetMessage(&msg, 0, 0, 0) > 0) {
+        if (msg.message != WM_INPUT) {
+            DispatchMessage(&msg);
+            continue;
+        }
+
+        RAWINPUT raw;
+        UINT size = sizeof(raw);
+        UINT res = GetRawInputData((HRAWINPUT) msg.lParam, RID_INPUT, &raw, &size, sizeof(RAWINPUTHEADER));
+        DispatchMessage(&msg);
+        if (res == (UINT) -1) { continue; }
+
+        Event e = { .time = engine_now() };
+
+        // Held keys and buttons are tracked while another window has focus too. Losing
+        // focus releases everything held and regaining it presses it again, so nothing
+        // that changed in between is left stuck.
+        if (focused != (GetForegroundWindow() == engine->hwnd)) {
+            focused = !focused;
+            Event held = e;
+            for (int i = 0; i < 256; i++) {
+                if (!down[i]) { continue; }
+                held.type = focused ? ENGINE_EVENT_KEY_DOWN : ENGINE_EVENT_KEY_UP;
+                held.code = i;
+                engine_push_event(engine->thread_events, &held);
+            }
+            for (int i = 1; i < 4; i++) {
+                if (!buttons[i]) { continue; }
+                held.type = focused ? ENGINE_EVENT_MOUSE_DOWN : ENGINE_EVENT_MOUSE_UP;
+                held.code = i;
+                engine_push_event(engine->thread_events, &held);
+            }
+        }
+
+        if (raw.header.dwType == RIM_TYPEKEYBOARD) {
+            int key = (uint8_t) raw.data.keyboard.VKey;
+            bool up = raw.data.keyboard.Flags & RI_KEY_BREAK;
+            bool repeat = !up && down[key];
+            down[key] = !up;
+            if (repeat || !focused) { continue; }
+            e.type = up ? ENGINE_EVENT_KEY_UP : ENGINE_EVENT_KEY_DOWN;
+            e.code = key;
+            engine_push_event(engine->thread_events, &e);
+
+        } else if (raw.header.dwType == RIM_TYPEMOUSE) {
+            RAWMOUSE *m = &raw.data.mouse;
+            for (int i = 0; i < 3; i++) {
+                if (m->usButtonFlags & (3 << (i * 2))) { buttons[i + 1] = m->usButtonFlags & (1 << (i * 2)); }
+            }
+            if (!focused) { continue; }
+            if (!(m->usFlags & MOUSE_MOVE_ABSOLUTE) && (m->lLastX || m->lLastY)) {
+                Event e2 = e;
+                e2.type = ENGINE_EVENT_MOUSE_MOTION;
+                e2.x = m->lLastX;
+                e2.y = m->lLastY;
+                engine_push_event(engine->thread_events, &e2);
+            }
+            // RI_MOUSE_BUTTON_n_DOWN/UP are consecutive bit pairs; 1 = left, 2 = right, 3 = middle
+            for (int i = 0; i < 3; i++) {
+                if (!(m->usButtonFlags & (3 << (i * 2)))) { continue; }
+                Event e2 = e;
+                e2.type = m->usButtonFlags & (1 << (i * 2)) ? ENGINE_EVENT_MOUSE_DOWN : ENGINE_EVENT_MOUSE_UP;
+                e2.code = i + 1;
+                engine_push_event(engine->thread_events, &e2);
+            }
+            if (m->usButtonFlags & RI_MOUSE_WHEEL) {
+                e.type = ENGINE_EVENT_MOUSE_SCROLL;
+                e.scroll = (float)(short) m->usButtonData / WHEEL_DELTA;
+                engine_push_event(engine->thread_events, &e);
+            }
+        }
+    }
+
+    DestroyWindow(hwnd);
+    return 0;
+}
+
+// Whether the event has a known type and, for keys and buttons, a code that indexes the
+// input state. Replayed logs come from disk, so nothing about them can be trusted.
+static bool engine_valid_event(Engine *engine, Event *e) {
+    switch (e->type) {
+    case ENGINE_EVENT_KEY_DOWN:
+    case ENGINE_EVENT_KEY_UP:
+        return (unsigned) e->code < engine_lengthof(engine->key_state);
+    case ENGINE_EVENT_MOUSE_DOWN:
+    case ENGINE_EVENT_MOUSE_UP:
+        return (unsigned) e->code < engine_lengthof(engine->mouse_state);
+    default:
+        return e->type >= ENGINE_EVENT_KEY_DOWN && e->type <= ENGINE_EVENT_CHAR;
+    }
+}
+
+static void engine_apply_event(Engine *engine, Event *e) {
+    if (!engine_valid_event(engine, e)) { return; }
+    switch (e->type) {
+    case ENGINE_EVENT_KEY_DOWN:
+        engine->key_state[e->code] |= ENGINE_INPUT_DOWN | ENGINE_INPUT_PRESSED;
+        break;
+    case ENGINE_EVENT_KEY_UP:
+        engine->key_state[e->code] &= ~ENGINE_INPUT_DOWN;
+        engine->key_state[e->code] |= ENGINE_INPUT_RELEASED;
+        break;
+    case ENGINE_EVENT_MOUSE_DOWN:
+        engine->mouse_state[e->code] |= ENGINE_INPUT_DOWN | ENGINE_INPUT_PRESSED;
+        break;
+    case ENGINE_EVENT_MOUSE_UP:
+        engine->mouse_state[e->code] &= ~ENGINE_INPUT_DOWN;
+        engine->mouse_state[e->code] |= ENGINE_INPUT_RELEASED;
+        break;
+    case ENGINE_EVENT_MOUSE_MOVE:
+        engine->mouse_delta.x += e->x - engine->mouse_pos.x;
+        engine->mouse_delta.y += e->y - engine->mouse_pos.y;
+        engine->mouse_pos.x = e->x;
+        engine->mouse_pos.y = e->y;
+        break;
+    case ENGINE_EVENT_MOUSE_SCROLL:
+        engine->mouse_scroll += e->scroll;
+        break;
+    }
+
+    if (engine->event_count == engine->event_capacity) {
+        engine->event_capacity = engine_max(64, engine->event_capacity * 2);
+        engine->events = realloc(engine->events, engine->event_capacity * sizeof(Event));
+        if (!engine->events) { engine_panic("out of memory"); }
+    }
+    engine->events[engine->event_count++] = *e;
+}
+
+// After a drop, emits the transitions needed to bring held keys, buttons and the mouse
+// position in line with what the producer last saw. They go through engine_apply_event
+// like any other event, so recordings replay them too.
+static void engine_resync_events(Engine *engine, EventQueue *q) {
+    if (!q || q->dropped == q->resynced) { return; }
+    q->resynced = q->dropped;
+    MemoryBarrier();
+    Event e = { .time = engine_now() };
+    for (int i = 0; i < 256; i++) {
+        int type = q->keys[i];
+        if (!type || (type == ENGINE_EVENT_KEY_DOWN) == !!(engine->key_state[i] & ENGINE_INPUT_DOWN)) { continue; }
+        e.type = type;
+        e.code = i;
+        engine_apply_event(engine, &e);
+    }
+    for (int i = 0; i < 16; i++) {
+        int type = q->buttons[i];
+        if (!type || (type == ENGINE_EVENT_MOUSE_DOWN) == !!(engine->mouse_state[i] & ENGINE_INPUT_DOWN)) { continue; }
+        e.type = type;
+        e.code = i;
+        engine_apply_event(engine, &e);
+    }
+    if (q->moved && (q->mouse_x != engine->mouse_pos.x || q->mouse_y != engine->mouse_pos.y)) {
+        e.type = ENGINE_EVENT_MOUSE_MOVE;
+        e.code = 0;
+        e.x = q->mouse_x;
+        e.y = q->mouse_y;
+        engine_apply_event(engine, &e);
+    }
+}
+
+static void engine_collect_events(Engine *engine) {
+    // merge the window and input thread queues in timestamp order
+    for (;;) {
+        Event *a = engine_peek_event(engine->window_events);
+        Event *b = engine_peek_event(engine->thread_events);
+        if (!a && !b) { break; }
+        if (a && (!b || a->time <= b->time)) {
+            engine_apply_event(engine, a);
+            engine_pop_event(engine->window_events);
+        } else {
+            engine_apply_event(engine, b);
+            engine_pop_event(engine->thread_events);
+        }
+    }
+    engine_resync_events(engine, engine->window_events);
+    engine_resync_events(engine, engine->thread_events);
+}
+
+static void engine_discard_events(Engine *engine) {
+    while (engine_peek_event(engine->window_events)) { engine_pop_event(engine->window_events); }
+    while (engine_peek_event(engine->thread_events)) { engine_pop_event(engine->thread_events); }
+}
+
+// Input logs are a magic string and the input held when recording started:
+//   i32 mouse x, i32 mouse y, 32 bytes of held keys, 2 bytes of held buttons (one bit each)
+// followed by one record per frame:
+//   f64 dt, u16 event count, then per event
+//   u8 type, u16 code, i16 x, i16 y, f32 scroll, f32 time since frame start
+static const char engine_input_log_magic[8] = "BLNKINP2";
+
+static void engine_write_input_header(Engine *engine, FILE *fp) {
+    uint8_t buf[42] = { 0 };
+    int32_t pos[2] = { engine->mouse_pos.x, engine->mouse_pos.y };
+    memcpy(buf, pos, 8);
+    for (int i = 0; i < 256; i++) {
+        if (engine->key_state[i] & ENGINE_INPUT_DOWN) { buf[8 + i / 8] |= 1 << (i % 8); }
+    }
+    for (int i = 0; i < 16; i++) {
+        if (engine->mouse_state[i] & ENGINE_INPUT_DOWN) { buf[40 + i / 8] |= 1 << (i % 8); }
+    }
+    fwrite(buf, sizeof(buf), 1, fp);
+}
+
+static bool engine_read_input_header(Engine *engine, FILE *fp) {
+    uint8_t buf[42];
+    if (fread(buf, sizeof(buf), 1, fp) != 1) { return false; }
+    int32_t pos[2];
+    memcpy(pos, buf, 8);
+    engine->mouse_pos.x = pos[0];
+    engine->mouse_pos.y = pos[1];
+    engine->mouse_delta.x = engine->mouse_delta.y = 0;
+    for (int i = 0; i < 256; i++) {
+        engine->key_state[i] = buf[8 + i / 8] & (1 << (i % 8)) ? ENGINE_INPUT_DOWN : 0;
+    }
+    for (int i = 0; i < 16; i++) {
+        engine->mouse_state[i] = buf[40 + i / 8] & (1 << (i % 8)) ? ENGINE_INPUT_DOWN : 0;
+    }
+    return true;
+}
+
+static void engine_record_frame(Engine *engine, double dt) {
+    FILE *fp = engine->input_record;
+    int n = engine_min(engine->event_count, 0xffff);
+    uint16_t count = n;
+    fwrite(&dt, 8, 1, fp);
+    fwrite(&count, 2, 1, fp);
+    for (int i = 0; i < n; i++) {
+        Event *e = &engine->events[i];
+        uint8_t buf[15];
+        uint16_t code = e->code;
+        int16_t x = e->x, y = e->y;
+        float time = e->time - engine->prev_time;
+        buf[0] = e->type;
+        memcpy(buf + 1, &code, 2);
+        memcpy(buf + 3, &x, 2);
+        memcpy(buf + 5, &y, 2);
+        memcpy(buf + 7, &e->scroll, 4);
+        memcpy(buf + 11, &time, 4);
+        fwrite(buf, sizeof(buf), 1, fp);
+    }
+}
+
+// Returns false at the end of the log, or on a truncated or corrupt record, which is
+// reported on stderr. Either way the replay stops.
+static bool engine_replay_frame(Engine *engine, double *dt) {
+    FILE *fp = engine->input_replay;
+    uint16_t count;
+    if (fread(dt, 8, 1, fp) != 1) { return false; }
+    if (fread(&count, 2, 1, fp) != 1) {
+        fprintf(stderr, "engine: input log is truncated, replay stopped\n");
+        return false;
+    }
+    engine->prev_time += *dt;
+    for (int i = 0; i < count; i++) {
+        uint8_t buf[15];
+        if (fread(buf, sizeof(buf), 1, fp) != 1) {
+            fprintf(stderr, "engine: input log is truncated, replay stopped\n");
+            return false;
+        }
+        uint16_t code;
+        int16_t x, y;
+        float time;
+        Event e = { .type = buf[0] };
+        memcpy(&code, buf + 1, 2);
+        memcpy(&x, buf + 3, 2);
+        memcpy(&y, buf + 5, 2);
+        memcpy(&e.scroll, buf + 7, 4);
+        memcpy(&time, buf + 11, 4);
+        e.code = code;
+        e.x = x;
+        e.y = y;
+        e.time = engine->prev_time + time;
+        if (!engine_valid_event(engine, &e)) {
+            fprintf(stderr, "engine: bad event in input log (type %d, code %d), replay stopped\n", e.type, e.code);
+            return false;
+        }
+        engine_apply_event(engine, &e);
+    }
+    return true;
 }
 
 static const char *engine_get_file_extension(const char *filename) {
@@ -146,6 +588,283 @@ static const char *engine_get_file_extension(const char *filename) {
     return dot;
 }
 
+static bool engine_asset_before(Asset *a, Asset *b) {
+    return a->priority > b->priority || (a->priority == b->priority && a->seq < b->seq);
+}
+
+static void engine_queue_asset(Engine *engine, Asset *asset) {
+    if (engine->load_count == engine->load_capacity) {
+        engine->load_capacity = engine_max(engine->load_capacity * 2, 64);
+        engine->load_queue = realloc(engine->load_queue, engine->load_capacity * sizeof(Asset*));
+        if (!engine->load_queue) { engine_panic("out of memory"); }
+    }
+    Asset **q = engine->load_queue;
+    int i = engine->load_count++;
+    while (i > 0 && engine_asset_before(asset, q[(i - 1) / 2])) {
+        q[i] = q[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    q[i] = asset;
+}
+
+static Asset *engine_dequeue_asset(Engine *engine) {
+    if (engine->load_count == 0) { return NULL; }
+    Asset **q = engine->load_queue;
+    Asset *top = q[0];
+    Asset *last = q[--engine->load_count];
+    int i = 0;
+    for (;;) {
+        int c = i * 2 + 1;
+        if (c >= engine->load_count) { break; }
+        if (c + 1 < engine->load_count && engine_asset_before(q[c + 1], q[c])) { c++; }
+        if (!engine_asset_before(q[c], last)) { break; }
+        q[i] = q[c];
+        i = c;
+    }
+    q[i] = last;
+    return top;
+}
+
+static void engine_finish_asset(Engine *engine, Asset *asset) {
+    EnterCriticalSection(&engine->loader_lock);
+    if (engine->installs_tail) { engine->installs_tail->next = asset; } else { engine->installs = asset; }
+    engine->installs_tail = asset;
+    LeaveCriticalSection(&engine->loader_lock);
+    InterlockedDecrement(&engine->loads_in_flight);
+}
+
+static void engine_decode_asset(void *udata, int index) {
+    Asset *asset = udata;
+    if (!asset->cancelled) {
+        if (asset->type == ENGINE_ASSET_IMAGE) {
+            asset->image = engine_load_image_mem(asset->data, asset->length);
+        } else {
+            // Without a known extension the sound stays NULL and the asset fails.
+            const char *ext = engine_get_file_extension(asset->filename);
+            if (!ext) { ext = ""; }
+            if (strcmp(ext, ".wav") == 0) {
+                asset->sound = engine_load_sound_mem_wav(asset->data, asset->length);
+            } else if (strcmp(ext, ".ogg") == 0) {
+                asset->sound = engine_load_sound_mem_ogg(asset->data, asset->length);
+            }
+        }
+    }
+    free(asset->data);
+    asset->data = NULL;
+    engine_finish_asset(asset->engine, asset);
+}
+
+// Reads files in priority order and hands decoding to the worker pool, so a
+// slow disk never holds up decoding and a large decode never holds up I/O.
+static DWORD WINAPI engine_loader_thread(LPVOID udata) {
+    Engine *engine = udata;
+    for (;;) {
+        WaitForSingleObject(engine->loader_semaphore, INFINITE);
+        if (!engine->loader_running) { break; }
+
+        EnterCriticalSection(&engine->loader_lock);
+        Asset *asset = engine_dequeue_asset(engine);
+        LeaveCriticalSection(&engine->loader_lock);
+        if (!asset) { continue; }
+
+        if (asset->cancelled) {
+            engine_finish_asset(engine, asset);
+            continue;
+        }
+        InterlockedExchange(&asset->state, ENGINE_ASSET_LOADING);
+        asset->data = engine_read_file(asset->filename, &asset->length);
+        if (asset->data && asset->type != ENGINE_ASSET_FILE) {
+            engine_push_job(engine_decode_asset, asset, 0);
+        } else {
+            engine_finish_asset(engine, asset);
+        }
+    }
+    return 0;
+}
+
+static void engine_free_asset(Asset *asset) {
+    if (InterlockedDecrement(&asset->refs) == 0) { free(asset); }
+}
+
+static void engine_install_asset(Asset *asset) {
+    if (asset->cancelled) {
+        if (asset->image) { engine_destroy_image(asset->image); }
+        if (asset->sound) { engine_destroy_sound(asset->sound); }
+        free(asset->data);
+        asset->image = NULL;
+        asset->sound = NULL;
+        asset->data = NULL;
+        InterlockedExchange(&asset->state, ENGINE_ASSET_CANCELLED);
+    } else {
+        bool ok = asset->image || asset->sound || asset->data;
+        InterlockedExchange(&asset->state, ok ? ENGINE_ASSET_READY : ENGINE_ASSET_FAILED);
+        if (asset->callback) { asset->callback(asset, asset->udata); }
+    }
+    engine_free_asset(asset);
+}
+
+// Installs at least one finished asset, then keeps going while the budget lasts.
+static void engine_install_assets(Engine *engine, double budget) {
+    double start = engine_now();
+    do {
+        EnterCriticalSection(&engine->loader_lock);
+        Asset *asset = engine->installs;
+        if (asset) {
+            engine->installs = asset->next;
+            if (!engine->installs) { engine->installs_tail = NULL; }
+        }
+        LeaveCriticalSection(&engine->loader_lock);
+
+        if (!asset) { break; }
+        engine_install_asset(asset);
+    } while (engine_now() - start < budget);
+}
+
+static void engine_stop_loader(Engine *engine) {
+    engine->loader_running = false;
+    ReleaseSemaphore(engine->loader_semaphore, 1, 0);
+    WaitForSingleObject(engine->loader_thread, INFINITE);
+    CloseHandle(engine->loader_thread);
+    CloseHandle(engine->loader_semaphore);
+
+    Asset *asset;
+    while ((asset = engine_dequeue_asset(engine))) {
+        asset->cancelled = true;
+        engine_finish_asset(engine, asset);
+    }
+    while (engine->loads_in_flight) {
+        if (!engine_run_job()) { Sleep(0); }
+    }
+    for (asset = engine->installs; asset; asset = engine->installs) {
+        engine->installs = asset->next;
+        asset->cancelled = true;
+        engine_install_asset(asset);
+    }
+    DeleteCriticalSection(&engine->loader_lock);
+    free(engine->load_queue);
+}
+
+static void engine_write_png(Image *image, const char *filename, int level) {
+    cp_image_t png = cp_load_blank(image->w, image->h);
+    for (int y = 0; y < png.h; y++) {
+        engine_swap_rb(png.pix + y * png.w, image->pixels + y * image->stride, png.w);
+    }
+
+    cp_save_png_level(filename, &png, level);
+    free(png.pix);
+}
+
+// Raw capture files: "BLNKCAP1", u32 width, u32 height, then BGRA frames.
+// Frames have a fixed size, so encoders write them at their own offset in
+// any order.
+#define ENGINE_CAPTURE_HEADER 16
+
+static const char engine_capture_magic[8] = "BLNKCAP1";
+
+typedef struct {
+    Engine *engine;
+    Image *image;
+    int format;
+    int frame;
+    char filename[];
+} CaptureJob;
+
+// The back buffer, even while a layer is bound in its place.
+static Image *engine_back_buffer(Engine *engine) {
+    return engine->layer_screen ? engine->layer_screen : engine->screen;
+}
+
+static void engine_start_capture_pool(Engine *engine) {
+    if (engine->capture_available) { return; }
+    Image *back = engine_back_buffer(engine);
+    for (int i = 0; i < ENGINE_CAPTURE_BUFFERS; i++) {
+        engine->capture_buffers[i] = engine_create_image(back->w, back->h);
+        engine->capture_free[i] = engine->capture_buffers[i];
+    }
+    engine->capture_free_count = ENGINE_CAPTURE_BUFFERS;
+    InitializeCriticalSection(&engine->capture_lock);
+    engine->capture_available = CreateSemaphore(0, ENGINE_CAPTURE_BUFFERS, ENGINE_CAPTURE_BUFFERS, 0);
+}
+
+static void engine_wait_captures(Engine *engine) {
+    while (engine->captures_in_flight) {
+        if (!engine_run_job()) { Sleep(0); }
+    }
+}
+
+static void engine_encode_capture(void *udata, int index) {
+    CaptureJob *job = udata;
+    Engine *engine = job->engine;
+    Image *img = job->image;
+
+    if (job->format == ENGINE_CAPTURE_RAW) {
+        int64_t size = (int64_t) img->w * img->h * sizeof(Color);
+        EnterCriticalSection(&engine->capture_lock);
+        _fseeki64(engine->capture_file, ENGINE_CAPTURE_HEADER + job->frame * size, SEEK_SET);
+        fwrite(img->pixels, 1, size, engine->capture_file);
+        LeaveCriticalSection(&engine->capture_lock);
+    } else if (job->format == ENGINE_CAPTURE_QOI) {
+        engine_save_image_qoi(img, job->filename);
+    } else {
+        engine_write_png(img, job->filename, 1);
+    }
+
+    EnterCriticalSection(&engine->capture_lock);
+    engine->capture_free[engine->capture_free_count++] = img;
+    LeaveCriticalSection(&engine->capture_lock);
+    ReleaseSemaphore(engine->capture_available, 1, 0);
+    free(job);
+    InterlockedDecrement(&engine->captures_in_flight);
+}
+
+// Copies the back buffer, made opaque, into a free buffer and queues it for encoding. When all
+// buffers are in flight the caller helps encode until one frees up, which
+// bounds memory and slows the game down to what the encoders sustain.
+static void engine_capture(Engine *engine, const char *filename, int format, int frame) {
+    engine_start_capture_pool(engine);
+    while (WaitForSingleObject(engine->capture_available, 0) != WAIT_OBJECT_0) {
+        if (!engine_run_job()) { WaitForSingleObject(engine->capture_available, INFINITE); break; }
+    }
+
+    EnterCriticalSection(&engine->capture_lock);
+    Image *img = engine->capture_free[--engine->capture_free_count];
+    LeaveCriticalSection(&engine->capture_lock);
+    Image *back = engine_back_buffer(engine);
+    for (int y = 0; y < back->h; y++) {
+        engine_copy_opaque(img->pixels + y * img->stride, back->pixels + y * back->stride, back->w);
+    }
+
+    CaptureJob *job = engine_alloc(sizeof(CaptureJob) + (filename ? strlen(filename) : 0) + 1);
+    job->engine = engine;
+    job->image = img;
+    job->format = format;
+    job->frame = frame;
+    if (filename) { strcpy(job->filename, filename); }
+
+    InterlockedIncrement(&engine->captures_in_flight);
+    engine_push_job(engine_encode_capture, job, 0);
+}
+
+static void engine_capture_frame(Engine *engine) {
+    char filename[MAX_PATH];
+    if (engine->capture_format != ENGINE_CAPTURE_RAW) {
+        snprintf(filename, sizeof(filename), engine->capture_path, engine->capture_frame);
+    }
+    engine_capture(engine, engine->capture_format == ENGINE_CAPTURE_RAW ? NULL : filename, engine->capture_format, engine->capture_frame);
+    engine->capture_frame++;
+}
+
+static void engine_stop_capture_pool(Engine *engine) {
+    engine_stop_capture(engine);
+    if (!engine->capture_available) { return; }
+    engine_wait_captures(engine);
+    for (int i = 0; i < ENGINE_CAPTURE_BUFFERS; i++) {
+        engine_destroy_image(engine->capture_buffers[i]);
+    }
+    CloseHandle(engine->capture_available);
+    DeleteCriticalSection(&engine->capture_lock);
+}
+
 static char *engine_utf8_from_wchar(const WCHAR *buf) {
     int len = WideCharToMultiByte(CP_UTF8, 0, buf, -1, NULL, 0, NULL, NULL);
     if (!len) { return NULL; }
@@ -162,27 +881,72 @@ static WCHAR *engine_wchar_from_utf8(const char *buf) {
     return buf2;
 }
 
+static void engine_present(Engine *engine, Image *img) {
+    BITMAPINFO bmi = {
+        .bmiHeader.biSize = sizeof(BITMAPINFOHEADER),
+        .bmiHeader.biBitCount = 32,
+        .bmiHeader.biCompression = BI_RGB,
+        .bmiHeader.biPlanes = 1,
+        .bmiHeader.biWidth = img->w,
+        .bmiHeader.biHeight = -img->h
+    };
+
+    Rect wr = engine_get_adjusted_window_rect(engine);
+
+    StretchDIBits(engine->hdc,
+        wr.x, wr.y, wr.w, wr.h,
+        0, 0, img->w, img->h,
+        img->pixels, &bmi, DIB_RGB_COLORS, SRCCOPY);
+}
+
+// Triple buffering: the game draws into buffers[back_buffer], the present
+// thread owns its own front buffer, and the third sits in present_mailbox.
+// Both sides swap with the mailbox, so neither ever waits on the other.
+#define ENGINE_PRESENT_FRESH 4
+
+static DWORD WINAPI engine_present_thread(LPVOID udata) {
+    Engine *engine = udata;
+    LONG front = 2;
+
+    while (engine->present_running) {
+        WaitForSingleObject(engine->present_event, INFINITE);
+        if (engine->present_mailbox & ENGINE_PRESENT_FRESH) {
+            front = InterlockedExchange(&engine->present_mailbox, front) & 3;
+        }
+        EnterCriticalSection(&engine->present_lock);
+        engine_present(engine, engine->buffers[front]);
+        LeaveCriticalSection(&engine->present_lock);
+    }
+
+    return 0;
+}
+
+static void engine_swap_buffers(Engine *engine) {
+    int prev = engine->back_buffer;
+    LONG old = InterlockedExchange(&engine->present_mailbox, prev | ENGINE_PRESENT_FRESH);
+    engine->back_buffer = old & 3;
+    engine->prev_buffer = prev;
+    SetEvent(engine->present_event);
+
+    // the new back buffer holds a frame from a few updates ago, so games must redraw
+    // all of it unless they asked for the previous frame to be copied over
+    Image *back = engine->buffers[engine->back_buffer];
+    if (engine->preserve_frame) {
+        memcpy(back->pixels, engine->buffers[prev]->pixels, back->stride * back->h * sizeof(Color));
+    }
+    engine->screen = back;
+}
+
 static LRESULT CALLBACK engine_wndproc(HWND hwnd, UINT message, WPARAM wparam, LPARAM lparam) {
     Engine *engine = (Engine*)GetProp(hwnd, "engine");
 
     switch (message) {
     case WM_PAINT:;
-        BITMAPINFO bmi = {
-            .bmiHeader.biSize = sizeof(BITMAPINFOHEADER),
-            .bmiHeader.biBitCount = 32,
-            .bmiHeader.biCompression = BI_RGB,
-            .bmiHeader.biPlanes = 1,
-            .bmiHeader.biWidth = engine->screen->w,
-            .bmiHeader.biHeight = -engine->screen->h
-        };
-
-        Rect wr = engine_get_adjusted_window_rect(engine);
-
-        StretchDIBits(engine->hdc,
-            wr.x, wr.y, wr.w, wr.h,
-            0, 0, engine->screen->w, engine->screen->h,
-            engine->screen->pixels, &bmi, DIB_RGB_COLORS, SRCCOPY);
-
+        if (engine->present_thread) {
+            SetEvent(engine->present_event);
+        } else {
+            engine_present(engine, engine->screen);
+        }
         ValidateRect(hwnd, 0);
         break;
 
@@ -195,25 +959,21 @@ static LRESULT CALLBACK engine_wndproc(HWND hwnd, UINT message, WPARAM wparam, L
 
     case WM_KEYDOWN:
     case WM_SYSKEYDOWN:
-        if (lparam & (1 << 30)) {
-            break;
+        if (lparam & (1 << 30) || engine->input_thread) {
+            goto unhandled;
         }
-        engine->key_state[(uint8_t) wparam] = ENGINE_INPUT_DOWN | ENGINE_INPUT_PRESSED;
+        engine_push_window_event(engine, ENGINE_EVENT_KEY_DOWN, (uint8_t) wparam, 0, 0, 0);
         break;
 
     case WM_KEYUP:
     case WM_SYSKEYUP:
-        engine->key_state[(uint8_t) wparam] &= ~ENGINE_INPUT_DOWN;
-        engine->key_state[(uint8_t) wparam] |= ENGINE_INPUT_RELEASED;
+        if (engine->input_thread) { goto unhandled; }
+        engine_push_window_event(engine, ENGINE_EVENT_KEY_UP, (uint8_t) wparam, 0, 0, 0);
         break;
 
     case WM_CHAR:
         if (wparam < 32) { break; }
-        for (int i = 0; i < engine_lengthof(engine->char_buf); i++) {
-            if (engine->char_buf[i]) { continue; }
-            engine->char_buf[i] = wparam;
-            break;
-        }
+        engine_push_window_event(engine, ENGINE_EVENT_CHAR, wparam, 0, 0, 0);
         break;
 
     case WM_LBUTTONDOWN: case WM_LBUTTONUP:
@@ -221,31 +981,55 @@ static LRESULT CALLBACK engine_wndproc(HWND hwnd, UINT message, WPARAM wparam, L
     case WM_MBUTTONDOWN: case WM_MBUTTONUP:;
         int button = (message == WM_LBUTTONDOWN || message == WM_LBUTTONUP) ? 1 :
                      (message == WM_RBUTTONDOWN || message == WM_RBUTTONUP) ? 2 : 3;
+        Rect wr = engine_get_adjusted_window_rect(engine);
+        int mx = (GET_X_LPARAM(lparam) - wr.x) * engine->screen->w / wr.w;
+        int my = (GET_Y_LPARAM(lparam) - wr.y) * engine->screen->h / wr.h;
+        engine_push_window_event(engine, ENGINE_EVENT_MOUSE_MOVE, 0, mx, my, 0);
         if (message == WM_LBUTTONDOWN || message == WM_RBUTTONDOWN || message == WM_MBUTTONDOWN) {
             SetCapture(hwnd);
-            engine->mouse_state[button] = ENGINE_INPUT_DOWN | ENGINE_INPUT_PRESSED;
+            if (!engine->input_thread) {
+                engine_push_window_event(engine, ENGINE_EVENT_MOUSE_DOWN, button, mx, my, 0);
+            }
         } else {
             ReleaseCapture();
-            engine->mouse_state[button] &= ~ENGINE_INPUT_DOWN;
-            engine->mouse_state[button] |= ENGINE_INPUT_RELEASED;
+            if (!engine->input_thread) {
+                engine_push_window_event(engine, ENGINE_EVENT_MOUSE_UP, button, mx, my, 0);
+            }
         }
+        break;
 
     case WM_MOUSEMOVE:;
         wr = engine_get_adjusted_window_rect(engine);
-        int prevx = engine->mouse_pos.x;
-        int prevy = engine->mouse_pos.y;
-        engine->mouse_pos.x = (GET_X_LPARAM(lparam) - wr.x) * engine->screen->w / wr.w;
-        engine->mouse_pos.y = (GET_Y_LPARAM(lparam) - wr.y) * engine->screen->h / wr.h;
-        engine->mouse_delta.x += engine->mouse_pos.x - prevx;
-        engine->mouse_delta.y += engine->mouse_pos.y - prevy;
+        mx = (GET_X_LPARAM(lparam) - wr.x) * engine->screen->w / wr.w;
+        my = (GET_Y_LPARAM(lparam) - wr.y) * engine->screen->h / wr.h;
+        engine_push_window_event(engine, ENGINE_EVENT_MOUSE_MOVE, 0, mx, my, 0);
         break;
 
+    case WM_KILLFOCUS:
+        // key and button ups go to whichever window has focus, so release whatever the
+        // queue last saw held; the input thread does the same for its own events
+        if (engine->input_thread) { goto unhandled; }
+        for (int i = 0; i < 256; i++) {
+            if (engine->window_events->keys[i] == ENGINE_EVENT_KEY_DOWN) {
+                engine_push_window_event(engine, ENGINE_EVENT_KEY_UP, i, 0, 0, 0);
+            }
+        }
+        for (int i = 1; i < 4; i++) {
+            if (engine->window_events->buttons[i] == ENGINE_EVENT_MOUSE_DOWN) {
+                engine_push_window_event(engine, ENGINE_EVENT_MOUSE_UP, i, engine->mouse_pos.x, engine->mouse_pos.y, 0);
+            }
+        }
+        goto unhandled;
+
     case WM_MOUSEWHEEL:
-        engine->mouse_scroll = (float)GET_WHEEL_DELTA_WPARAM(wparam) / WHEEL_DELTA;
+        if (engine->input_thread) { break; }
+        engine_push_window_event(engine, ENGINE_EVENT_MOUSE_SCROLL, 0, 0, 0,
+            (float)GET_WHEEL_DELTA_WPARAM(wparam) / WHEEL_DELTA);
         break;
 
     case WM_SIZE:
         if (wparam != SIZE_MINIMIZED) {
+            if (engine->present_thread) { EnterCriticalSection(&engine->present_lock); }
             engine->width = LOWORD(lparam);
             engine->height = HIWORD(lparam);
 
@@ -257,6 +1041,7 @@ static LRESULT CALLBACK engine_wndproc(HWND hwnd, UINT message, WPARAM wparam, L
             EndPaint(hwnd, &ps);
 
             RedrawWindow(engine->hwnd, 0, 0, RDW_INVALIDATE | RDW_UPDATENOW);
+            if (engine->present_thread) { LeaveCriticalSection(&engine->present_lock); }
         }
         break;
 
@@ -274,10 +1059,10 @@ unhandled:
 }
 
 static void engine_blit(Image *dst, Image *src, int dx, int dy, int sx, int sy, int w, int h) {
-    Color *ts = &src->pixels[sy * src->w + sx];
-    Color *td = &dst->pixels[dy * dst->w + dx];
-    int st = src->w;
-    int dt = dst->w;
+    Color *ts = &src->pixels[sy * src->stride + sx];
+    Color *td = &dst->pixels[dy * dst->stride + dx];
+    int st = src->stride;
+    int dt = dst->stride;
     do {
         memcpy(td, ts, w * sizeof(Color));
         ts += st;
@@ -287,14 +1072,7 @@ static void engine_blit(Image *dst, Image *src, int dx, int dy, int sx, int sy,
 
 static char font[256][8];
 
-Engine *engine_create(int width, int height, const char *title, int flags) {
-    Engine *engine = engine_alloc(sizeof(Engine));
-
-    engine->hide_cursor = !!(flags & ENGINE_HIDECURSOR);
-    engine->step_time = 1.0 / 60.0;
-    engine->screen = engine_create_image(width, height);
-    engine->clip = engine_rect(0, 0, width, height);
-
+static void engine_create_window(Engine *engine, int width, int height, const char *title, int flags) {
     RegisterClass(&(WNDCLASS) {
         .style = CS_OWNDC | CS_HREDRAW | CS_VREDRAW,
         .lpfnWndProc = engine_wndproc,
@@ -323,6 +1101,43 @@ Engine *engine_create(int width, int height, const char *title, int flags) {
     BOOL dark = TRUE;
     DwmSetWindowAttribute(engine->hwnd, DWMWA_USE_IMMERSIVE_DARK_MODE, &dark, sizeof(dark));
 
+    ShowWindow(engine->hwnd, SW_NORMAL);
+    engine->hdc = GetDC(engine->hwnd);
+
+    if (flags & ENGINE_INPUT_THREAD) {
+        engine->thread_events = engine_alloc(sizeof(EventQueue));
+        engine->input_thread = CreateThread(0, 0, engine_input_thread, engine, 0, &engine->input_thread_id);
+    }
+}
+
+Engine *engine_create(int width, int height, const char *title, int flags) {
+    Engine *engine = engine_alloc(sizeof(Engine));
+
+    engine->hide_cursor = !!(flags & ENGINE_HIDECURSOR);
+    engine->step_time = 1.0 / 60.0;
+    engine->screen = engine_create_image(width, height);
+    engine->clip = engine_rect(0, 0, width, height);
+    engine->window_events = engine_alloc(sizeof(EventQueue));
+    engine->install_budget = 0.002;
+
+    if (!(flags & ENGINE_HEADLESS)) {
+        engine_create_window(engine, width, height, title, flags);
+    }
+
+    if ((flags & ENGINE_PRESENT_THREAD) && engine->hwnd) {
+        for (int i = 0; i < 3; i++) {
+            engine->buffers[i] = i ? engine_create_image(engine->screen->w, engine->screen->h) : engine->screen;
+        }
+        engine->back_buffer = 0;
+        engine->prev_buffer = 1;
+        engine->preserve_frame = !!(flags & ENGINE_PRESERVE_FRAME);
+        engine->present_mailbox = 1;
+        engine->present_running = true;
+        engine->present_event = CreateEvent(0, FALSE, FALSE, 0);
+        InitializeCriticalSection(&engine->present_lock);
+        engine->present_thread = CreateThread(0, 0, engine_present_thread, engine, 0, 0);
+    }
+
     if (flags & ENGINE_CONSOLE) {
         AllocConsole();
         freopen("CONIN$", "r", stdin);
@@ -330,9 +1145,6 @@ Engine *engine_create(int width, int height, const char *title, int flags) {
         freopen("CONOUT$", "w", stderr);
     }
 
-    ShowWindow(engine->hwnd, SW_NORMAL);
-    engine->hdc = GetDC(engine->hwnd);
-
     timeBeginPeriod(1);
 
     Image *font_image = engine_create_image(128, 128);
@@ -365,55 +1177,144 @@ Engine *engine_create(int width, int height, const char *title, int flags) {
     engine->font = engine_load_font_from_image(font_image);
     engine->prev_time = engine_now();
 
-    cs_init(engine->hwnd, 44100, 4096, NULL);
-    cs_spawn_mix_thread();
+    if (engine->hwnd && cs_init(engine->hwnd, 44100, 4096, NULL) == CUTE_SOUND_ERROR_NONE) {
+        cs_set_limiter(true, -0.3f);
+        cs_spawn_mix_thread();
+        engine_audio = true;
+    }
 
     return engine;
 }
 
 void engine_destroy(Engine *engine) {
-    ReleaseDC(engine->hwnd, engine->hdc);
-    DestroyWindow(engine->hwnd);
+    if (engine->present_thread) {
+        engine->present_running = false;
+        SetEvent(engine->present_event);
+        WaitForSingleObject(engine->present_thread, INFINITE);
+        CloseHandle(engine->present_thread);
+        CloseHandle(engine->present_event);
+        DeleteCriticalSection(&engine->present_lock);
+        engine_end_layer(engine);
+        for (int i = 0; i < 3; i++) {
+            if (engine->buffers[i] != engine->screen) { engine_destroy_image(engine->buffers[i]); }
+        }
+    }
+    if (engine->input_thread) {
+        while (!PostThreadMessage(engine->input_thread_id, WM_QUIT, 0, 0)) { Sleep(1); }
+        WaitForSingleObject(engine->input_thread, INFINITE);
+        CloseHandle(engine->input_thread);
+        free(engine->thread_events);
+    }
+    if (engine->hwnd) {
+        ReleaseDC(engine->hwnd, engine->hdc);
+        DestroyWindow(engine->hwnd);
+    }
+    if (engine->input_record) { fclose(engine->input_record); }
+    if (engine->input_replay) { fclose(engine->input_replay); }
+    if (engine->loader_thread) { engine_stop_loader(engine); }
+    engine_stop_capture_pool(engine);
+    engine_end_layer(engine);
+    for (int i = 0; i < engine->layer_count; i++) {
+        engine_destroy_image(engine->layers[i]->image);
+        free(engine->layers[i]);
+    }
+    if (engine->layer_cache) { engine_destroy_image(engine->layer_cache); }
     engine_destroy_image(engine->screen);
     engine_destroy_font(engine->font);
+    free(engine->window_events);
+    free(engine->events);
     free(engine);
-    cs_shutdown();
+    engine_stop_pool();
+    if (engine_audio) {
+        cs_shutdown();
+        engine_audio = false;
+    }
 }
 
 bool engine_update(Engine *engine, double *dt) {
-    RedrawWindow(engine->hwnd, 0, 0, RDW_INVALIDATE | RDW_UPDATENOW);
-
-    double now = engine_now();
-    double wait = (engine->prev_time + engine->step_time) - now;
-    double prev = engine->prev_time;
-    if (wait > 0) {
-        Sleep(wait * 1000);
-        engine->prev_time += engine->step_time;
-    } else {
-        engine->prev_time = now;
+    engine_end_layer(engine);
+    if (engine->capturing) { engine_capture_frame(engine); }
+    if (engine->present_thread) {
+        engine_swap_buffers(engine);
+    } else if (engine->hwnd) {
+        RedrawWindow(engine->hwnd, 0, 0, RDW_INVALIDATE | RDW_UPDATENOW);
+    }
+
+    // replays run as fast as possible; the frame time comes from the log
+    double frame_dt = 0;
+    if (!engine->input_replay) {
+        double now = engine_now();
+        double wait = (engine->prev_time + engine->step_time) - now;
+        double prev = engine->prev_time;
+        if (wait > 0) {
+            Sleep(wait * 1000);
+            engine->prev_time += engine->step_time;
+        } else {
+            engine->prev_time = now;
+        }
+        frame_dt = engine->prev_time - prev;
     }
-    if (dt) { *dt = engine->prev_time - prev; }
 
-    memset(engine->char_buf, 0, sizeof(engine->char_buf));
+    engine->event_count = 0;
+    engine->event_cursor = 0;
+    engine->char_cursor = 0;
     for (int i = 0; i < sizeof(engine->key_state); i++) {
         engine->key_state[i] &= ~(ENGINE_INPUT_PRESSED | ENGINE_INPUT_RELEASED);
     }
     for (int i = 0; i < sizeof(engine->mouse_state); i++) {
         engine->mouse_state[i] &= ~(ENGINE_INPUT_PRESSED | ENGINE_INPUT_RELEASED);
     }
+    engine->mouse_delta.x = 0;
+    engine->mouse_delta.y = 0;
     engine->mouse_scroll = 0;
 
-    cs_update(*dt);
-
     MSG msg;
-    while (PeekMessage(&msg, engine->hwnd, 0, 0, PM_REMOVE)) {
+    while (engine->hwnd && PeekMessage(&msg, engine->hwnd, 0, 0, PM_REMOVE)) {
         TranslateMessage(&msg);
         DispatchMessage(&msg);
     }
 
+    if (engine->input_replay) {
+        engine_discard_events(engine);
+        if (!engine_replay_frame(engine, &frame_dt)) {
+            engine->should_quit = true;
+        }
+    } else {
+        engine_collect_events(engine);
+        if (engine->input_record) { engine_record_frame(engine, frame_dt); }
+    }
+
+    if (dt) { *dt = frame_dt; }
+    if (engine_audio) { cs_update(frame_dt); }
+    if (engine->loader_thread) { engine_install_assets(engine, engine->install_budget); }
+
     return !engine->should_quit;
 }
 
+bool engine_record_input(Engine *engine, const char *filename) {
+    if (engine->input_record) { fclose(engine->input_record); }
+    engine->input_record = fopen(filename, "wb");
+    if (!engine->input_record) { return false; }
+    fwrite(engine_input_log_magic, 1, 8, engine->input_record);
+    engine_write_input_header(engine, engine->input_record);
+    return true;
+}
+
+bool engine_replay_input(Engine *engine, const char *filename) {
+    if (engine->input_replay) { fclose(engine->input_replay); }
+    engine->input_replay = fopen(filename, "rb");
+    if (!engine->input_replay) { return false; }
+    char magic[8];
+    if (fread(magic, 1, 8, engine->input_replay) != 8 || memcmp(magic, engine_input_log_magic, 8) ||
+        !engine_read_input_header(engine, engine->input_replay)) {
+        fclose(engine->input_replay);
+        engine->input_replay = NULL;
+        return false;
+    }
+    engine->prev_time = 0;
+    return true;
+}
+
 void *engine_read_file(const char *filename, int *length) {
     FILE *fp = fopen(filename, "rb");
     if (!fp) { return NULL; }
@@ -427,6 +1328,196 @@ void *engine_read_file(const char *filename, int *length) {
     return buf;
 }
 
+// Pack layout, little endian:
+//   header    "BLNKPAK1", u32 count, u32 align, u64 directory offset, u64 names size
+//   data      each file starts on an align boundary
+//   directory count PackEntry records sorted by (hash, name), then the names
+#define ENGINE_PACK_ALIGN 64
+
+static const char engine_pack_magic[8] = "BLNKPAK1";
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t align;
+    uint64_t directory;
+    uint64_t names_size;
+} PackHeader;
+
+static uint64_t engine_pack_hash(const char *name, int len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (uint8_t) name[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static const char *engine_pack_sort_names;
+
+static int engine_compare_pack_entries(const void *a, const void *b) {
+    const PackEntry *x = a, *y = b;
+    if (x->hash != y->hash) { return x->hash < y->hash ? -1 : 1; }
+    return strcmp(engine_pack_sort_names + x->name_offset, engine_pack_sort_names + y->name_offset);
+}
+
+static bool engine_pack_pad(FILE *fp, uint64_t *pos) {
+    static const char zero[ENGINE_PACK_ALIGN];
+    int n = (ENGINE_PACK_ALIGN - *pos % ENGINE_PACK_ALIGN) % ENGINE_PACK_ALIGN;
+    *pos += n;
+    return fwrite(zero, 1, n, fp) == n;
+}
+
+bool engine_write_pack(const char *filename, const char **files, int count) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) { return false; }
+
+    uint64_t names_size = 0;
+    for (int i = 0; i < count; i++) { names_size += strlen(files[i]) + 1; }
+    if (names_size > UINT32_MAX) { fclose(fp); return false; }
+
+    PackEntry *entries = engine_alloc(count * sizeof(PackEntry) + 1);
+    char *names = engine_alloc(names_size + 1);
+    char *chunk = engine_alloc(1 << 16);
+    bool ok = true;
+
+    PackHeader header = { 0 };
+    uint64_t pos = sizeof(header);
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    uint32_t name_offset = 0;
+    for (int i = 0; ok && i < count; i++) {
+        FILE *src = fopen(files[i], "rb");
+        if (!src) { ok = false; break; }
+
+        ok = engine_pack_pad(fp, &pos);
+        PackEntry *e = &entries[i];
+        int len = strlen(files[i]);
+        e->hash = engine_pack_hash(files[i], len);
+        e->offset = pos;
+        e->name_offset = name_offset;
+        e->name_length = len;
+        memcpy(names + name_offset, files[i], len + 1);
+        name_offset += len + 1;
+
+        size_t n;
+        while (ok && (n = fread(chunk, 1, 1 << 16, src)) > 0) {
+            ok = fwrite(chunk, 1, n, fp) == n;
+            e->size += n;
+        }
+        pos += e->size;
+        fclose(src);
+    }
+
+    if (ok) {
+        engine_pack_sort_names = names;
+        qsort(entries, count, sizeof(PackEntry), engine_compare_pack_entries);
+        ok = engine_pack_pad(fp, &pos);
+        memcpy(header.magic, engine_pack_magic, 8);
+        header.count = count;
+        header.align = ENGINE_PACK_ALIGN;
+        header.directory = pos;
+        header.names_size = names_size;
+        ok = ok && fwrite(entries, sizeof(PackEntry), count, fp) == count;
+        ok = ok && fwrite(names, 1, names_size, fp) == names_size;
+        ok = ok && fseek(fp, 0, SEEK_SET) == 0;
+        ok = ok && fwrite(&header, sizeof(header), 1, fp) == 1;
+    }
+
+    free(chunk);
+    free(names);
+    free(entries);
+    if (fclose(fp) != 0) { ok = false; }
+    if (!ok) { remove(filename); }
+    return ok;
+}
+
+Pack *engine_open_pack(const char *filename) {
+    WCHAR *wfilename = engine_wchar_from_utf8(filename);
+    if (!wfilename) { return NULL; }
+    HANDLE file = CreateFileW(wfilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    free(wfilename);
+    if (file == INVALID_HANDLE_VALUE) { return NULL; }
+
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    const uint8_t *base = NULL;
+    if (GetFileSizeEx(file, &size) && (uint64_t) size.QuadPart >= sizeof(PackHeader) && (uint64_t) size.QuadPart <= SIZE_MAX) {
+        mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mapping) {
+        base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (!base) {
+        if (mapping) { CloseHandle(mapping); }
+        CloseHandle(file);
+        return NULL;
+    }
+
+    // everything is checked once here so lookups can trust the directory
+    uint64_t total = size.QuadPart;
+    const PackHeader *header = (const PackHeader*) base;
+    uint64_t dir_size = (uint64_t) header->count * sizeof(PackEntry);
+    bool ok = memcmp(header->magic, engine_pack_magic, 8) == 0 &&
+        header->count < INT_MAX / sizeof(PackEntry) &&
+        header->directory % 8 == 0 &&
+        header->directory <= total &&
+        dir_size <= total - header->directory &&
+        header->names_size <= total - header->directory - dir_size;
+
+    const PackEntry *entries = (const PackEntry*) (base + header->directory);
+    const char *names = (const char*) (entries + header->count);
+    for (uint32_t i = 0; ok && i < header->count; i++) {
+        const PackEntry *e = &entries[i];
+        ok = e->offset <= total && e->size <= total - e->offset &&
+            (uint64_t) e->name_offset + e->name_length < header->names_size &&
+            names[e->name_offset + e->name_length] == '\0' &&
+            (i == 0 || e->hash >= entries[i - 1].hash);
+    }
+    if (!ok) {
+        UnmapViewOfFile(base);
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return NULL;
+    }
+
+    Pack *pack = engine_alloc(sizeof(Pack));
+    pack->file = file;
+    pack->mapping = mapping;
+    pack->base = base;
+    pack->size = total;
+    pack->entries = entries;
+    pack->names = names;
+    pack->count = header->count;
+    return pack;
+}
+
+void engine_close_pack(Pack *pack) {
+    UnmapViewOfFile(pack->base);
+    CloseHandle(pack->mapping);
+    CloseHandle(pack->file);
+    free(pack);
+}
+
+// Returns a pointer into the mapping, valid until the pack is closed.
+const void *engine_pack_find(Pack *pack, const char *name, uint64_t *size) {
+    int len = strlen(name);
+    uint64_t hash = engine_pack_hash(name, len);
+
+    int lo = 0, hi = pack->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (pack->entries[mid].hash < hash) { lo = mid + 1; } else { hi = mid; }
+    }
+    for (; lo < pack->count && pack->entries[lo].hash == hash; lo++) {
+        const PackEntry *e = &pack->entries[lo];
+        if (e->name_length == len && memcmp(pack->names + e->name_offset, name, len) == 0) {
+            if (size) { *size = e->size; }
+            return pack->base + e->offset;
+        }
+    }
+    return NULL;
+}
+
 const char *engine_read_clipboard(Engine *engine) {
     if (!OpenClipboard(engine->hwnd)) { return NULL; }
     HANDLE h = GetClipboardData(CF_UNICODETEXT);
@@ -477,21 +1568,191 @@ Image *engine_create_image(int width, int height) {
     image->pixels = (Color*) (image + 1);
     image->w = width;
     image->h = height;
+    image->stride = width;
     return image;
 }
 
-Image *engine_load_image_mem(void *data, int length) {
-    cp_image_t png = cp_load_png_mem(data, length);
+// QOI (qoiformat.org): byte oriented and table free, so decoding is one
+// branchy pass with no entropy coding. Pixels are kept as Color, which makes
+// the running index and RGBA chunks land straight in BGRA layout.
+#define ENGINE_QOI_INDEX 0x00
+#define ENGINE_QOI_DIFF 0x40
+#define ENGINE_QOI_LUMA 0x80
+#define ENGINE_QOI_RUN 0xc0
+#define ENGINE_QOI_RGB 0xfe
+#define ENGINE_QOI_RGBA 0xff
+#define ENGINE_QOI_HEADER 14
+#define ENGINE_QOI_PADDING 8
+
+#define engine_qoi_hash(c) (((c).r * 3 + (c).g * 5 + (c).b * 7 + (c).a * 11) & 63)
+
+static uint32_t engine_read_be32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint8_t *engine_write_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static Image *engine_load_qoi(const uint8_t *data, int length) {
+    if (length < ENGINE_QOI_HEADER + ENGINE_QOI_PADDING) { return NULL; }
+    uint32_t w = engine_read_be32(data + 4);
+    uint32_t h = engine_read_be32(data + 8);
+    if (!(w > 0 && h > 0) || (uint64_t) w * h >= INT_MAX / 8 || (data[12] != 3 && data[12] != 4)) { return NULL; }
+
+    Image *img = engine_create_image(w, h);
+    Color *out = img->pixels;
+    Color *stop = out + w * h;
+    Color index[64] = { 0 };
+    Color px = engine_rgba(0, 0, 0, 255);
+
+    // every chunk is at most 5 bytes and the stream ends with 8 bytes of
+    // padding, so starting a chunk before the padding never reads past it
+    const uint8_t *p = data + ENGINE_QOI_HEADER;
+    const uint8_t *end = data + length - ENGINE_QOI_PADDING;
+    while (out < stop) {
+        if (p >= end) {
+            engine_destroy_image(img);
+            return NULL;
+        }
+        int b1 = *p++;
+        if (b1 == ENGINE_QOI_RGB) {
+            px.r = p[0];
+            px.g = p[1];
+            px.b = p[2];
+            p += 3;
+        } else if (b1 == ENGINE_QOI_RGBA) {
+            px.r = p[0];
+            px.g = p[1];
+            px.b = p[2];
+            px.a = p[3];
+            p += 4;
+        } else if (b1 < ENGINE_QOI_DIFF) {
+            px = index[b1];
+            *out++ = px;
+            continue;
+        } else if (b1 < ENGINE_QOI_LUMA) {
+            px.r += ((b1 >> 4) & 3) - 2;
+            px.g += ((b1 >> 2) & 3) - 2;
+            px.b += (b1 & 3) - 2;
+        } else if (b1 < ENGINE_QOI_RUN) {
+            int b2 = *p++;
+            int vg = (b1 & 0x3f) - 32;
+            px.r += vg - 8 + (b2 >> 4);
+            px.g += vg;
+            px.b += vg - 8 + (b2 & 0xf);
+        } else {
+            int run = engine_min((b1 & 0x3f) + 1, (int) (stop - out));
+            index[engine_qoi_hash(px)] = px;
+            for (int i = 0; i < run; i++) { out[i] = px; }
+            out += run;
+            continue;
+        }
+        index[engine_qoi_hash(px)] = px;
+        *out++ = px;
+    }
+    return img;
+}
 
-    Image *img = engine_create_image(png.w, png.h);
-    for (int y = 0; y < png.h; y++) {
-        for (int x = 0; x < png.w; x++) {
-            cp_pixel_t p = png.pix[x + y * png.w];
-            img->pixels[x + y * img->w] = engine_rgba(p.r, p.g, p.b, p.a);
+static uint8_t *engine_encode_qoi(Image *image, int *length) {
+    int count = image->w * image->h;
+    uint8_t *data = engine_alloc(ENGINE_QOI_HEADER + count * 5 + ENGINE_QOI_PADDING);
+    uint8_t *p = data;
+
+    memcpy(p, "qoif", 4);
+    p = engine_write_be32(p + 4, image->w);
+    p = engine_write_be32(p, image->h);
+    *p++ = 4;
+    *p++ = 0;
+
+    Color index[64] = { 0 };
+    Color prev = engine_rgba(0, 0, 0, 255);
+    int run = 0;
+    Color *row = image->pixels;
+    for (int i = 0, x = 0; i < count; i++) {
+        Color px = row[x];
+        if (++x == image->w) {
+            x = 0;
+            row += image->stride;
+        }
+        if (px.w == prev.w) {
+            run++;
+            if (run == 62 || i == count - 1) {
+                *p++ = ENGINE_QOI_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            *p++ = ENGINE_QOI_RUN | (run - 1);
+            run = 0;
+        }
+
+        int h = engine_qoi_hash(px);
+        if (index[h].w == px.w) {
+            *p++ = ENGINE_QOI_INDEX | h;
+        } else {
+            index[h] = px;
+            if (px.a == prev.a) {
+                int8_t vr = px.r - prev.r;
+                int8_t vg = px.g - prev.g;
+                int8_t vb = px.b - prev.b;
+                int8_t vg_r = vr - vg;
+                int8_t vg_b = vb - vg;
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    *p++ = ENGINE_QOI_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                    *p++ = ENGINE_QOI_LUMA | (vg + 32);
+                    *p++ = (vg_r + 8) << 4 | (vg_b + 8);
+                } else {
+                    *p++ = ENGINE_QOI_RGB;
+                    *p++ = px.r;
+                    *p++ = px.g;
+                    *p++ = px.b;
+                }
+            } else {
+                *p++ = ENGINE_QOI_RGBA;
+                *p++ = px.r;
+                *p++ = px.g;
+                *p++ = px.b;
+                *p++ = px.a;
+            }
         }
+        prev = px;
     }
 
-    free(png.pix);
+    memset(p, 0, ENGINE_QOI_PADDING - 1);
+    p[ENGINE_QOI_PADDING - 1] = 1;
+    p += ENGINE_QOI_PADDING;
+    *length = p - data;
+    return data;
+}
+
+Image *engine_load_image_mem(void *data, int length) {
+    if (length >= 4 && memcmp(data, "qoif", 4) == 0) {
+        return engine_load_qoi(data, length);
+    }
+
+    int w, h;
+    cp_load_png_wh(data, length, &w, &h);
+    if (!(w > 0 && h > 0) || (int64_t) w * h >= INT_MAX / 8) { return NULL; }
+
+    // decode straight into the image allocation; the decoder needs a little
+    // scratch space past the pixels, which stays unused afterwards
+    int n = cp_png_decode_size(w, h);
+    Image *img = engine_alloc(sizeof(Image) + n);
+    img->pixels = (Color*) (img + 1);
+    img->w = w;
+    img->h = h;
+    img->stride = w;
+    if (!cp_load_png_mem_to(data, length, img->pixels, n, 1)) {
+        free(img);
+        return NULL;
+    }
     return img;
 }
 
@@ -504,33 +1765,198 @@ Image *engine_load_image_file(const char *filename) {
     return res;
 }
 
+Image *engine_load_image_pack(Pack *pack, const char *name) {
+    uint64_t size;
+    const void *data = engine_pack_find(pack, name, &size);
+    if (!data || size > INT_MAX) { return NULL; }
+    return engine_load_image_mem((void*) data, size);
+}
+
+static void engine_load_batch_image(void *udata, int index) {
+    ImageBatch *batch = udata;
+    batch->images[index] = engine_load_image_file(batch->filenames[index]);
+    InterlockedExchange(&batch->ready[index], 1);
+    if (batch->callback) { batch->callback(batch, index, batch->udata); }
+    InterlockedDecrement(&batch->pending);
+}
+
+ImageBatch *engine_load_images(const char **filenames, int count, void (*callback)(ImageBatch *batch, int index, void *udata), void *udata) {
+    // the batch, its arrays and copies of the filenames share one allocation
+    int n = sizeof(ImageBatch) + count * (sizeof(char*) + sizeof(Image*) + sizeof(LONG));
+    for (int i = 0; i < count; i++) { n += strlen(filenames[i]) + 1; }
+
+    ImageBatch *batch = engine_alloc(n);
+    batch->count = count;
+    batch->filenames = (char**) (batch + 1);
+    batch->images = (Image**) (batch->filenames + count);
+    batch->ready = (LONG*) (batch->images + count);
+    batch->pending = count;
+    batch->callback = callback;
+    batch->udata = udata;
+
+    char *str = (char*) (batch->ready + count);
+    for (int i = 0; i < count; i++) {
+        batch->filenames[i] = strcpy(str, filenames[i]);
+        str += strlen(str) + 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        engine_push_job(engine_load_batch_image, batch, i);
+    }
+    return batch;
+}
+
+bool engine_image_ready(ImageBatch *batch, int index) {
+    if (index < 0 || index >= batch->count) { return false; }
+    return batch->ready[index] != 0;
+}
+
+Image *engine_batch_image(ImageBatch *batch, int index) {
+    if (!engine_image_ready(batch, index)) { return NULL; }
+    MemoryBarrier();
+    return batch->images[index];
+}
+
+bool engine_batch_done(ImageBatch *batch) {
+    return batch->pending == 0;
+}
+
+void engine_wait_batch(ImageBatch *batch) {
+    while (batch->pending) {
+        if (!engine_run_job()) { Sleep(0); }
+    }
+    MemoryBarrier();
+}
+
+void engine_destroy_batch(ImageBatch *batch) {
+    engine_wait_batch(batch);
+    free(batch);
+}
+
+Asset *engine_load_async(Engine *engine, const char *filename, int type, int priority, void (*callback)(Asset *asset, void *udata), void *udata) {
+    if (!engine->loader_thread) {
+        InitializeCriticalSection(&engine->loader_lock);
+        engine->loader_semaphore = CreateSemaphore(0, 0, 0x7fffffff, 0);
+        engine->loader_running = true;
+        engine->loader_thread = CreateThread(0, 0, engine_loader_thread, engine, 0, 0);
+    }
+
+    // one reference for the caller, one for the loader
+    Asset *asset = engine_alloc(sizeof(Asset) + strlen(filename) + 1);
+    asset->type = type;
+    asset->priority = priority;
+    asset->state = ENGINE_ASSET_QUEUED;
+    asset->refs = 2;
+    asset->filename = strcpy((char*) (asset + 1), filename);
+    asset->callback = callback;
+    asset->udata = udata;
+    asset->engine = engine;
+    asset->seq = engine->load_seq++;
+
+    InterlockedIncrement(&engine->loads_in_flight);
+    EnterCriticalSection(&engine->loader_lock);
+    engine_queue_asset(engine, asset);
+    LeaveCriticalSection(&engine->loader_lock);
+    ReleaseSemaphore(engine->loader_semaphore, 1, 0);
+    return asset;
+}
+
+void engine_cancel_asset(Asset *asset) {
+    if (asset->state == ENGINE_ASSET_QUEUED || asset->state == ENGINE_ASSET_LOADING) {
+        asset->cancelled = true;
+    }
+}
+
+// Drops the caller's handle. Loads still in flight are cancelled; the image,
+// sound or data of an asset that already finished now belongs to the caller.
+void engine_release_asset(Asset *asset) {
+    engine_cancel_asset(asset);
+    engine_free_asset(asset);
+}
+
+void engine_set_install_budget(Engine *engine, double seconds) {
+    engine->install_budget = seconds;
+}
+
 Image *engine_screenshot(Engine *engine) {
-    Image *screen = engine_create_image(engine->screen->w, engine->screen->h);
-    for (int y = 0; y < screen->h; y++) {
-        for (int x = 0; x < screen->w; x++) {
-            screen->pixels[x + y * screen->w] = engine->screen->pixels[x + y * engine->screen->w];
-            screen->pixels[x + y * screen->w].a = 255;
-        }
+    Image *back = engine_back_buffer(engine);
+    Image *screen = engine_create_image(back->w, back->h);
+    for (int y = 0; y < back->h; y++) {
+        engine_copy_opaque(&screen->pixels[y * screen->stride], &back->pixels[y * back->stride], back->w);
     }
 
     return screen;
 }
 
 void engine_save_image(Image *image, const char *filename) {
-    cp_image_t png = cp_load_blank(image->w, image->h);
-    for (int y = 0; y < png.h; y++) {
-        for (int x = 0; x < png.w; x++) {
-            cp_pixel_t *p = &png.pix[x + y * png.w];
-            Color c = image->pixels[x + y * image->w];
-            p->r = c.r;
-            p->g = c.g;
-            p->b = c.b;
-            p->a = c.a;
-        }
+    engine_write_png(image, filename, 6);
+}
+
+void engine_save_image_qoi(Image *image, const char *filename) {
+    int length;
+    uint8_t *data = engine_encode_qoi(image, &length);
+    FILE *fp = fopen(filename, "wb");
+    if (fp) {
+        fwrite(data, 1, length, fp);
+        fclose(fp);
     }
+    free(data);
+}
 
-    cp_save_png(filename, &png);
-    free(png.pix);
+void engine_save_screenshot(Engine *engine, const char *filename) {
+    const char *ext = engine_get_file_extension(filename);
+    engine_capture(engine, filename, ext && strcmp(ext, ".qoi") == 0 ? ENGINE_CAPTURE_QOI : ENGINE_CAPTURE_PNG, 0);
+}
+
+// For PNG and QOI, `path` is a printf pattern taking the frame number, such
+// as "frames/%05d.png". Frames are captured by engine_update until stopped.
+bool engine_start_capture(Engine *engine, const char *path, int format) {
+    engine_stop_capture(engine);
+    if (format == ENGINE_CAPTURE_RAW) {
+        engine->capture_file = fopen(path, "wb");
+        if (!engine->capture_file) { return false; }
+        Image *back = engine_back_buffer(engine);
+        uint32_t size[2] = { back->w, back->h };
+        fwrite(engine_capture_magic, 1, 8, engine->capture_file);
+        fwrite(size, sizeof(size), 1, engine->capture_file);
+    }
+    engine->capture_path = engine_alloc(strlen(path) + 1);
+    strcpy(engine->capture_path, path);
+    engine->capture_format = format;
+    engine->capture_frame = 0;
+    engine->capturing = true;
+    return true;
+}
+
+void engine_stop_capture(Engine *engine) {
+    if (!engine->capturing) { return; }
+    engine_wait_captures(engine);
+    if (engine->capture_file) {
+        fclose(engine->capture_file);
+        engine->capture_file = NULL;
+    }
+    free(engine->capture_path);
+    engine->capture_path = NULL;
+    engine->capturing = false;
+}
+
+Image *engine_previous_frame(Engine *engine) {
+    if (!engine->present_thread) { return NULL; }
+    return engine->buffers[engine->prev_buffer];
+}
+
+void engine_premultiply_image(Image *image) {
+    for (int y = 0; y < image->h; y++) {
+        Color *row = image->pixels + y * image->stride;
+        engine_premultiply(row, row, image->w);
+    }
+}
+
+void engine_unpremultiply_image(Image *image) {
+    for (int y = 0; y < image->h; y++) {
+        Color *row = image->pixels + y * image->stride;
+        engine_unpremultiply(row, row, image->w);
+    }
 }
 
 void engine_destroy_image(Image *image) {
@@ -558,12 +1984,16 @@ int engine_text_width(Font *font, const char *text) {
     return x;
 }
 
+bool engine_poll_event(Engine *engine, Event *event) {
+    if (engine->event_cursor >= engine->event_count) { return false; }
+    *event = engine->events[engine->event_cursor++];
+    return true;
+}
+
 int engine_get_char(Engine *engine) {
-    for (int i = 0; i < engine_lengthof(engine->char_buf); i++) {
-        if (!engine->char_buf[i]) { continue; }
-        int res = engine->char_buf[i];
-        engine->char_buf[i] = 0;
-        return res;
+    while (engine->char_cursor < engine->event_count) {
+        Event *e = &engine->events[engine->char_cursor++];
+        if (e->type == ENGINE_EVENT_CHAR) { return e->code; }
     }
     return 0;
 }
@@ -606,6 +2036,13 @@ float engine_mouse_scroll(Engine *engine) {
     return engine->mouse_scroll;
 }
 
+// events lost to a full queue since the engine was created
+int engine_dropped_events(Engine *engine) {
+    int count = engine->window_events->dropped;
+    if (engine->thread_events) { count += engine->thread_events->dropped; }
+    return count;
+}
+
 void engine_clear(Engine *engine, Color color) {
     engine_draw_rect_fill(engine, engine_rect(0, 0, 0xffffff, 0xffffff), color);
 }
@@ -622,7 +2059,7 @@ void engine_draw_point(Engine *engine, int x, int y, Color color) {
     if (x < r.x || y < r.y || x >= r.x + r.w || y >= r.y + r.h ) {
         return;
     }
-    Color *dst = &engine->screen->pixels[x + y * engine->screen->w];
+    Color *dst = &engine->screen->pixels[x + y * engine->screen->stride];
     *dst = engine_blend_pixel(*dst, color);
 }
 
@@ -646,8 +2083,8 @@ void engine_draw_rect(Engine *engine, Rect rect, Color color) {
 void engine_draw_rect_fill(Engine *engine, Rect rect, Color color) {
     if (color.a == 0) { return; }
     rect = engine_intersect_rects(rect, engine->clip);
-    Color *d = &engine->screen->pixels[rect.x + rect.y * engine->screen->w];
-    int dr = engine->screen->w - rect.w;
+    Color *d = &engine->screen->pixels[rect.x + rect.y * engine->screen->stride];
+    int dr = engine->screen->stride - rect.w;
     for (int y = 0; y < rect.h; y++) {
         for (int x = 0; x < rect.w; x++) {
             *d = engine_blend_pixel(*d, color);
@@ -780,8 +2217,8 @@ void engine_draw_image3(Engine *engine, Image *img, Rect dst, Rect src, Color mu
     for (; dy < ey; dy++) {
         if (dy >= cy1 && dy < cy2) {
             int sx = src.x << 10;
-            Color *srow = &img->pixels[(sy >> 10) * img->w];
-            Color *drow = &engine->screen->pixels[dy * engine->screen->w];
+            Color *srow = &img->pixels[(sy >> 10) * img->stride];
+            Color *drow = &engine->screen->pixels[dy * engine->screen->stride];
 
             int dx = dst.x;
             if (dx < cx1) { sx += (cx1 - dx) * stepx; dx = cx1; }
@@ -815,18 +2252,500 @@ int engine_draw_text2(Engine *engine, Font *font, char *text, int x, int y, Colo
     return x;
 }
 
+Emitter *engine_create_emitter(int capacity) {
+    if (capacity <= 0) { engine_panic("invalid emitter capacity"); }
+    // SIMD loops run over whole groups of 4, so every array is padded
+    int cap = (capacity + 3) & ~3;
+    Emitter *emitter = engine_alloc(sizeof(Emitter) + cap * (7 * sizeof(float) + sizeof(Color)));
+    float *p = (float*) (emitter + 1);
+    emitter->x = p; p += cap;
+    emitter->y = p; p += cap;
+    emitter->vx = p; p += cap;
+    emitter->vy = p; p += cap;
+    emitter->alpha = p; p += cap;
+    emitter->fade = p; p += cap;
+    emitter->life = p; p += cap;
+    emitter->color = (Color*) p;
+    emitter->capacity = capacity;
+    return emitter;
+}
+
+void engine_destroy_emitter(Emitter *emitter) {
+    free(emitter);
+}
+
+bool engine_emit_particle(Emitter *emitter, float x, float y, float vx, float vy, float life, Color color) {
+    if (emitter->count >= emitter->capacity || life <= 0) { return false; }
+    int i = emitter->count++;
+    emitter->x[i] = x;
+    emitter->y[i] = y;
+    emitter->vx[i] = vx;
+    emitter->vy[i] = vy;
+    emitter->alpha[i] = color.a;
+    emitter->fade[i] = color.a / life;
+    emitter->life[i] = life;
+    emitter->color[i] = color;
+    return true;
+}
+
+void engine_update_emitter(Emitter *emitter, float dt) {
+    float damp = engine_max(0.0f, 1.0f - emitter->drag * dt);
+    float gx = emitter->gravity_x * dt;
+    float gy = emitter->gravity_y * dt;
+    int i = 0;
+
+#ifdef ENGINE_SSE2
+    __m128 vdt = _mm_set1_ps(dt);
+    __m128 vdamp = _mm_set1_ps(damp);
+    __m128 vgx = _mm_set1_ps(gx);
+    __m128 vgy = _mm_set1_ps(gy);
+    __m128 zero = _mm_setzero_ps();
+    for (; i < emitter->count; i += 4) {
+        __m128 vx = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(emitter->vx + i), vdamp), vgx);
+        __m128 vy = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(emitter->vy + i), vdamp), vgy);
+        __m128 x = _mm_add_ps(_mm_loadu_ps(emitter->x + i), _mm_mul_ps(vx, vdt));
+        __m128 y = _mm_add_ps(_mm_loadu_ps(emitter->y + i), _mm_mul_ps(vy, vdt));
+        __m128 a = _mm_sub_ps(_mm_loadu_ps(emitter->alpha + i), _mm_mul_ps(_mm_loadu_ps(emitter->fade + i), vdt));
+        __m128 l = _mm_sub_ps(_mm_loadu_ps(emitter->life + i), vdt);
+        _mm_storeu_ps(emitter->vx + i, vx);
+        _mm_storeu_ps(emitter->vy + i, vy);
+        _mm_storeu_ps(emitter->x + i, x);
+        _mm_storeu_ps(emitter->y + i, y);
+        _mm_storeu_ps(emitter->alpha + i, _mm_max_ps(a, zero));
+        _mm_storeu_ps(emitter->life + i, l);
+    }
+#endif
+
+    for (; i < emitter->count; i++) {
+        emitter->vx[i] = emitter->vx[i] * damp + gx;
+        emitter->vy[i] = emitter->vy[i] * damp + gy;
+        emitter->x[i] += emitter->vx[i] * dt;
+        emitter->y[i] += emitter->vy[i] * dt;
+        emitter->alpha[i] = engine_max(0.0f, emitter->alpha[i] - emitter->fade[i] * dt);
+        emitter->life[i] -= dt;
+    }
+
+    // remove dead particles by moving the last live one into their slot
+    for (i = 0; i < emitter->count;) {
+        if (emitter->life[i] > 0) { i++; continue; }
+        int j = --emitter->count;
+        emitter->x[i] = emitter->x[j];
+        emitter->y[i] = emitter->y[j];
+        emitter->vx[i] = emitter->vx[j];
+        emitter->vy[i] = emitter->vy[j];
+        emitter->alpha[i] = emitter->alpha[j];
+        emitter->fade[i] = emitter->fade[j];
+        emitter->life[i] = emitter->life[j];
+        emitter->color[i] = emitter->color[j];
+    }
+}
+
+void engine_draw_emitter(Engine *engine, Emitter *emitter) {
+    Rect c = engine->clip;
+    float cx1 = c.x, cy1 = c.y;
+    float cx2 = c.x + c.w, cy2 = c.y + c.h;
+    Color *pixels = engine->screen->pixels;
+    int stride = engine->screen->stride;
+    int i = 0;
+
+#ifdef ENGINE_SSE2
+    __m128 vcx1 = _mm_set1_ps(cx1), vcy1 = _mm_set1_ps(cy1);
+    __m128 vcx2 = _mm_set1_ps(cx2), vcy2 = _mm_set1_ps(cy2);
+    __m128 vstride = _mm_set1_ps(stride);
+    __m128 one = _mm_set1_ps(1.0f);
+    for (; i + 4 <= emitter->count; i += 4) {
+        __m128 x = _mm_loadu_ps(emitter->x + i);
+        __m128 y = _mm_loadu_ps(emitter->y + i);
+        __m128 a = _mm_loadu_ps(emitter->alpha + i);
+        __m128 in = _mm_and_ps(_mm_cmpge_ps(x, vcx1), _mm_cmplt_ps(x, vcx2));
+        in = _mm_and_ps(in, _mm_and_ps(_mm_cmpge_ps(y, vcy1), _mm_cmplt_ps(y, vcy2)));
+        in = _mm_and_ps(in, _mm_cmpge_ps(a, one));
+        int mask = _mm_movemask_ps(in);
+        if (!mask) { continue; }
+
+        // offsets stay exact in float for any screen below 2^24 pixels
+        __m128 xi = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+        __m128 yi = _mm_cvtepi32_ps(_mm_cvttps_epi32(y));
+        int32_t offset[4], alpha[4];
+        _mm_storeu_si128((__m128i*) offset, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(yi, vstride), xi)));
+        _mm_storeu_si128((__m128i*) alpha, _mm_cvttps_epi32(a));
+
+        for (int j = 0; j < 4; j++) {
+            if (!(mask & (1 << j))) { continue; }
+            Color color = emitter->color[i + j];
+            color.a = alpha[j];
+            Color *dst = &pixels[offset[j]];
+            *dst = engine_blend_pixel(*dst, color);
+        }
+    }
+#endif
+
+    for (; i < emitter->count; i++) {
+        float x = emitter->x[i], y = emitter->y[i];
+        if (x < cx1 || y < cy1 || x >= cx2 || y >= cy2) { continue; }
+        Color color = emitter->color[i];
+        color.a = emitter->alpha[i];
+        if (!color.a) { continue; }
+        Color *dst = &pixels[(int) x + (int) y * stride];
+        *dst = engine_blend_pixel(*dst, color);
+    }
+}
+
+static void engine_composite_layer(Image *dst, Layer *layer) {
+    Image *src = layer->image;
+    int alpha = layer->opacity * 255.0f + 0.5f;
+    if (alpha <= 0) { return; }
+    bool copy = layer->opaque && alpha >= 255;
+
+    // layers tile, so a scrolled parallax layer wraps around its own size
+    int ox = layer->scroll_x % src->w; if (ox < 0) { ox += src->w; }
+    int oy = layer->scroll_y % src->h; if (oy < 0) { oy += src->h; }
+
+    for (int y = 0; y < dst->h; y++) {
+        Color *srow = &src->pixels[((y + oy) % src->h) * src->stride];
+        Color *d = &dst->pixels[y * dst->stride];
+        int sx = ox;
+        int x = 0;
+        while (x < dst->w) {
+            int n = engine_min(src->w - sx, dst->w - x);
+            Color *s = &srow[sx];
+            if (copy) {
+                memcpy(d, s, n * sizeof(Color));
+            } else {
+                engine_composite_premultiplied(d, s, n, alpha);
+            }
+            d += n;
+            x += n;
+            sx = 0;
+        }
+    }
+}
+
+Layer *engine_create_layer(Engine *engine, const char *name, int width, int height, bool opaque) {
+    if (engine->layer_count >= engine_lengthof(engine->layers)) { engine_panic("too many layers"); }
+    Layer *layer = engine_alloc(sizeof(Layer));
+    strncpy(layer->name, name, sizeof(layer->name) - 1);
+    layer->image = engine_create_image(width, height);
+    layer->opacity = 1.0f;
+    layer->opaque = opaque;
+    layer->visible = true;
+    layer->dirty = true;
+    engine->layers[engine->layer_count++] = layer;
+    return layer;
+}
+
+Layer *engine_get_layer(Engine *engine, const char *name) {
+    for (int i = 0; i < engine->layer_count; i++) {
+        if (strcmp(engine->layers[i]->name, name) == 0) { return engine->layers[i]; }
+    }
+    return NULL;
+}
+
+void engine_clear_layer(Layer *layer) {
+    memset(layer->image->pixels, 0, layer->image->stride * layer->image->h * sizeof(Color));
+    layer->dirty = true;
+}
+
+void engine_begin_layer(Engine *engine, Layer *layer) {
+    if (!engine->layer_screen) {
+        engine->layer_screen = engine->screen;
+        engine->layer_clip = engine->clip;
+    }
+    engine->screen = layer->image;
+    engine->clip = engine_rect(0, 0, layer->image->w, layer->image->h);
+    layer->dirty = true;
+}
+
+void engine_end_layer(Engine *engine) {
+    if (!engine->layer_screen) { return; }
+    engine->screen = engine->layer_screen;
+    engine->clip = engine->layer_clip;
+    engine->layer_screen = NULL;
+}
+
+void engine_set_layer_scroll(Layer *layer, int x, int y) {
+    if (layer->scroll_x == x && layer->scroll_y == y) { return; }
+    layer->scroll_x = x;
+    layer->scroll_y = y;
+    layer->dirty = true;
+}
+
+void engine_set_layer_opacity(Layer *layer, float opacity) {
+    opacity = engine_max(0.0f, engine_min(1.0f, opacity));
+    if (layer->opacity == opacity) { return; }
+    layer->opacity = opacity;
+    layer->dirty = true;
+}
+
+void engine_set_layer_visible(Layer *layer, bool visible) {
+    if (layer->visible == visible) { return; }
+    layer->visible = visible;
+    layer->dirty = true;
+}
+
+void engine_composite_layers(Engine *engine) {
+    engine_end_layer(engine);
+    Image *screen = engine->screen;
+    int size = screen->w * screen->h * sizeof(Color);
+
+    int first = engine->layer_count;
+    for (int i = 0; i < engine->layer_count; i++) {
+        if (engine->layers[i]->dirty) { first = i; break; }
+    }
+
+    // the cache holds every layer below the lowest changed one, so only
+    // the layers from there upwards are blended again
+    if (engine->layer_cache_depth > first) { engine->layer_cache_depth = 0; }
+    if (engine->layer_cache_depth < first) {
+        if (!engine->layer_cache) { engine->layer_cache = engine_create_image(screen->w, screen->h); }
+        if (engine->layer_cache_depth == 0) { memset(engine->layer_cache->pixels, 0, size); }
+        for (int i = engine->layer_cache_depth; i < first; i++) {
+            if (engine->layers[i]->visible) { engine_composite_layer(engine->layer_cache, engine->layers[i]); }
+        }
+        engine->layer_cache_depth = first;
+    }
+
+    if (engine->layer_cache_depth) {
+        memcpy(screen->pixels, engine->layer_cache->pixels, size);
+    } else {
+        memset(screen->pixels, 0, size);
+    }
+
+    for (int i = first; i < engine->layer_count; i++) {
+        Layer *layer = engine->layers[i];
+        if (layer->visible) { engine_composite_layer(screen, layer); }
+        layer->dirty = false;
+    }
+}
+
+static void engine_reset_atlas_page(Atlas *atlas, AtlasPage *page) {
+    page->skyline_count = 1;
+    page->skyline[0] = (AtlasSkyline) { 0, 0, atlas->page_width };
+}
+
+static void engine_add_atlas_page(Atlas *atlas) {
+    atlas->pages = realloc(atlas->pages, (atlas->page_count + 1) * sizeof(AtlasPage));
+    if (!atlas->pages) { engine_panic("out of memory"); }
+    AtlasPage *page = &atlas->pages[atlas->page_count++];
+    page->image = engine_create_image(atlas->page_width, atlas->page_height);
+    page->skyline_capacity = 16;
+    page->skyline = engine_alloc(page->skyline_capacity * sizeof(AtlasSkyline));
+    engine_reset_atlas_page(atlas, page);
+}
+
+// Bottom-left skyline packing: the rectangle goes wherever its top edge ends
+// up lowest, so rows fill up left to right much like shelves.
+static bool engine_pack_rect(Atlas *atlas, AtlasPage *page, int w, int h, int *out_x, int *out_y) {
+    int best = -1, best_y = INT_MAX, best_w = INT_MAX;
+    for (int i = 0; i < page->skyline_count; i++) {
+        int x = page->skyline[i].x;
+        if (x + w > atlas->page_width) { break; }
+        int y = 0;
+        for (int j = i, left = w; left > 0; j++) {
+            y = engine_max(y, page->skyline[j].y);
+            left -= page->skyline[j].w;
+        }
+        if (y + h <= atlas->page_height && (y < best_y || (y == best_y && page->skyline[i].w < best_w))) {
+            best = i;
+            best_y = y;
+            best_w = page->skyline[i].w;
+        }
+    }
+    if (best < 0) { return false; }
+
+    if (page->skyline_count == page->skyline_capacity) {
+        page->skyline_capacity *= 2;
+        page->skyline = realloc(page->skyline, page->skyline_capacity * sizeof(AtlasSkyline));
+        if (!page->skyline) { engine_panic("out of memory"); }
+    }
+    AtlasSkyline *sky = page->skyline;
+    int x = sky[best].x;
+    memmove(&sky[best + 1], &sky[best], (page->skyline_count - best) * sizeof(AtlasSkyline));
+    sky[best] = (AtlasSkyline) { x, best_y + h, w };
+    page->skyline_count++;
+
+    // trim the segments now covered by the new one, then merge equal heights
+    for (int i = best + 1; i < page->skyline_count;) {
+        int overlap = x + w - sky[i].x;
+        if (overlap <= 0) { break; }
+        sky[i].x += overlap;
+        sky[i].w -= overlap;
+        if (sky[i].w > 0) { break; }
+        memmove(&sky[i], &sky[i + 1], (page->skyline_count - i - 1) * sizeof(AtlasSkyline));
+        page->skyline_count--;
+    }
+    for (int i = 0; i + 1 < page->skyline_count;) {
+        if (sky[i].y == sky[i + 1].y) {
+            sky[i].w += sky[i + 1].w;
+            memmove(&sky[i + 1], &sky[i + 2], (page->skyline_count - i - 2) * sizeof(AtlasSkyline));
+            page->skyline_count--;
+        } else {
+            i++;
+        }
+    }
+
+    *out_x = x;
+    *out_y = best_y;
+    return true;
+}
+
+static void engine_place_sprite(Atlas *atlas, AtlasSprite *sprite) {
+    int w = sprite->image.w, h = sprite->image.h;
+    int page = engine_max(atlas->page_count - 1, 0);
+    for (;; page++) {
+        if (page == atlas->page_count) { engine_add_atlas_page(atlas); }
+        if (engine_pack_rect(atlas, &atlas->pages[page], w, h, &sprite->x, &sprite->y)) { break; }
+    }
+    Image *img = atlas->pages[page].image;
+    sprite->page = page;
+    sprite->image.pixels = &img->pixels[sprite->x + sprite->y * img->stride];
+    sprite->image.stride = img->stride;
+}
+
+Atlas *engine_create_atlas(int page_width, int page_height) {
+    if (!(page_width > 0 && page_height > 0)) { engine_panic("invalid atlas size"); }
+    Atlas *atlas = engine_alloc(sizeof(Atlas));
+    atlas->page_width = page_width;
+    atlas->page_height = page_height;
+    return atlas;
+}
+
+void engine_destroy_atlas(Atlas *atlas) {
+    for (int i = 0; i < atlas->sprite_count; i++) { free(atlas->sprites[i]); }
+    for (int i = 0; i < atlas->page_count; i++) {
+        engine_destroy_image(atlas->pages[i].image);
+        free(atlas->pages[i].skyline);
+    }
+    free(atlas->sprites);
+    free(atlas->pages);
+    free(atlas);
+}
+
+// Copies `image` into the atlas; the caller keeps ownership of `image`. New
+// sprites go on the last page, so insertion order tends to be memory order.
+// Returns NULL if the image is larger than a page.
+Image *engine_atlas_add(Atlas *atlas, Image *image, int group) {
+    if (image->w > atlas->page_width || image->h > atlas->page_height) { return NULL; }
+
+    if (atlas->sprite_count == atlas->sprite_capacity) {
+        atlas->sprite_capacity = engine_max(atlas->sprite_capacity * 2, 64);
+        atlas->sprites = realloc(atlas->sprites, atlas->sprite_capacity * sizeof(AtlasSprite*));
+        if (!atlas->sprites) { engine_panic("out of memory"); }
+    }
+    AtlasSprite *sprite = engine_alloc(sizeof(AtlasSprite));
+    sprite->image.w = image->w;
+    sprite->image.h = image->h;
+    sprite->group = group;
+    sprite->index = atlas->sprite_count;
+    atlas->sprites[atlas->sprite_count++] = sprite;
+
+    engine_place_sprite(atlas, sprite);
+    engine_blit(atlas->pages[sprite->page].image, image, sprite->x, sprite->y, 0, 0, image->w, image->h);
+    return &sprite->image;
+}
+
+// The space is reclaimed by the next repack.
+void engine_atlas_remove(Atlas *atlas, Image *sprite) {
+    AtlasSprite *s = (AtlasSprite*) sprite;
+    AtlasSprite *last = atlas->sprites[--atlas->sprite_count];
+    atlas->sprites[s->index] = last;
+    last->index = s->index;
+    free(s);
+}
+
+static int engine_compare_sprites(const void *a, const void *b) {
+    const AtlasSprite *x = *(AtlasSprite**) a, *y = *(AtlasSprite**) b;
+    if (x->group != y->group) { return x->group < y->group ? -1 : 1; }
+    if (x->image.h != y->image.h) { return y->image.h - x->image.h; }
+    return y->image.w - x->image.w;
+}
+
+// Packs every sprite again into fresh pages, ordered by group and then by
+// height, which reclaims removed space and keeps each group together. Handles
+// stay valid; only the pixels they point at move.
+void engine_repack_atlas(Atlas *atlas) {
+    AtlasPage *old_pages = atlas->pages;
+    int old_count = atlas->page_count;
+    atlas->pages = NULL;
+    atlas->page_count = 0;
+
+    qsort(atlas->sprites, atlas->sprite_count, sizeof(AtlasSprite*), engine_compare_sprites);
+    for (int i = 0; i < atlas->sprite_count; i++) {
+        AtlasSprite *sprite = atlas->sprites[i];
+        Image old = sprite->image;
+        int ox = sprite->x, oy = sprite->y;
+        old.pixels = old_pages[sprite->page].image->pixels;
+        old.w = atlas->page_width;
+        old.h = atlas->page_height;
+        sprite->index = i;
+        engine_place_sprite(atlas, sprite);
+        engine_blit(atlas->pages[sprite->page].image, &old, sprite->x, sprite->y, ox, oy, sprite->image.w, sprite->image.h);
+    }
+
+    for (int i = 0; i < old_count; i++) {
+        engine_destroy_image(old_pages[i].image);
+        free(old_pages[i].skyline);
+    }
+    free(old_pages);
+}
+
 void engine_set_volume(float volume) {
+    if (!engine_audio) { return; }
     cs_set_global_volume(volume);
 }
 
 void engine_set_pan(float pan) {
+    if (!engine_audio) { return; }
     cs_set_global_pan(pan);
 }
 
 void engine_set_pause(bool pause) {
+    if (!engine_audio) { return; }
     cs_set_global_pause(pause);
 }
 
+// Voices past the limit keep their place but are not mixed.
+void engine_set_max_voices(int count) {
+    if (!engine_audio) { return; }
+    cs_set_max_voices(count);
+}
+
+void engine_set_bus_volume(int bus, float volume) {
+    if (!engine_audio) { return; }
+    cs_bus_set_volume((cs_bus_t) bus, volume);
+}
+
+void engine_set_bus_filter(int bus, int filter, float cutoff, float q) {
+    if (!engine_audio) { return; }
+    cs_bus_set_filter((cs_bus_t) bus, (cs_filter_t) filter, cutoff, q);
+}
+
+void engine_set_bus_reverb(int bus, float room_size, float wet) {
+    if (!engine_audio) { return; }
+    cs_bus_set_reverb((cs_bus_t) bus, room_size, wet);
+}
+
+void engine_set_bus_compressor(int bus, float threshold_db, float ratio, float attack_ms, float release_ms) {
+    if (!engine_audio) { return; }
+    cs_bus_set_compressor((cs_bus_t) bus, threshold_db, ratio, attack_ms, release_ms);
+}
+
+// On by default at -0.3 dB.
+void engine_set_limiter(bool enable, float ceiling_db) {
+    if (!engine_audio) { return; }
+    cs_set_limiter(enable, ceiling_db);
+}
+
+void engine_set_listener(float x, float y) {
+    if (!engine_audio) { return; }
+    cs_set_listener_position(x, y);
+}
+
+// Applies to sounds loaded afterwards.
+void engine_set_sound_format(int format) {
+    cs_set_sample_format((cs_sample_format_t) format);
+}
+
 Sound *engine_load_sound_mem_wav(void *data, int length) {
     return cs_read_mem_wav(data, length, NULL);
 }
@@ -847,42 +2766,154 @@ Sound *engine_load_sound_file(const char *filename) {
     return NULL;
 }
 
+Sound *engine_load_sound_pack(Pack *pack, const char *name) {
+    uint64_t size;
+    const void *data = engine_pack_find(pack, name, &size);
+    if (!data || size > INT_MAX) { return NULL; }
+
+    const char *ext = engine_get_file_extension(name);
+    if (!ext) { return NULL; }
+    if (strcmp(ext, ".wav") == 0) {
+        return engine_load_sound_mem_wav((void*) data, size);
+    } else if (strcmp(ext, ".ogg") == 0) {
+        return engine_load_sound_mem_ogg((void*) data, size);
+    }
+    return NULL;
+}
+
+// Music is streamed: only the compressed file stays in memory and it is
+// decoded while playing. Other formats are loaded like sounds.
+Sound *engine_load_music_mem(void *data, int length) {
+    if (length >= 4 && memcmp(data, "OggS", 4) == 0) {
+        return cs_read_mem_ogg_stream(data, length, NULL);
+    }
+    return engine_load_sound_mem_wav(data, length);
+}
+
+Sound *engine_load_music_file(const char *filename) {
+    const char *ext = engine_get_file_extension(filename);
+    if (!ext) { return NULL; }
+    if (strcmp(ext, ".ogg") == 0) {
+        return cs_load_ogg_stream(filename, NULL);
+    }
+    return engine_load_sound_file(filename);
+}
+
+Sound *engine_load_music_pack(Pack *pack, const char *name) {
+    uint64_t size;
+    const void *data = engine_pack_find(pack, name, &size);
+    if (!data || size > INT_MAX) { return NULL; }
+    return engine_load_music_mem((void*) data, size);
+}
+
 void engine_destroy_sound(Sound *sound) {
     cs_free_audio_source(sound);
 }
 
+void engine_set_sound_priority(Sound *sound, int priority) {
+    if (!sound) { return; }
+    cs_audio_set_priority(sound, priority);
+}
+
+void engine_set_sound_max_instances(Sound *sound, int count) {
+    if (!sound) { return; }
+    cs_audio_set_max_instances(sound, count);
+}
+
+void engine_set_sound_bus(Sound *sound, int bus) {
+    if (!sound) { return; }
+    cs_audio_set_bus(sound, (cs_bus_t) bus);
+}
+
+void engine_set_sound_falloff(Sound *sound, int falloff, float min_distance, float max_distance) {
+    if (!sound) { return; }
+    cs_audio_set_falloff(sound, (cs_falloff_t) falloff, min_distance, max_distance);
+}
+
 void engine_play_sound(Sound *sound) {
+    if (!engine_audio) { return; }
     cs_play_sound(sound, cs_sound_params_default());
 }
 
+// Pitch multiplies the playback rate, 1 plays unchanged.
+Voice engine_play_sound_ex(Sound *sound, float volume, float pan, float pitch) {
+    if (!engine_audio) { return 0; }
+    cs_sound_params_t params = cs_sound_params_default();
+    params.volume = volume;
+    params.pan = pan;
+    params.pitch = pitch;
+    return cs_play_sound(sound, params).id;
+}
+
+void engine_set_voice_pitch(Voice voice, float pitch) {
+    if (!engine_audio) { return; }
+    cs_playing_sound_t sound = { voice };
+    cs_sound_set_pitch(sound, pitch);
+}
+
+// Panned and faded against the listener, voices past the sound's max distance are not mixed.
+Voice engine_play_sound_at(Sound *sound, float x, float y, float volume, float pitch) {
+    if (!engine_audio) { return 0; }
+    cs_sound_params_t params = cs_sound_params_default();
+    params.volume = volume;
+    params.pitch = pitch;
+    params.positional = true;
+    params.x = x;
+    params.y = y;
+    return cs_play_sound(sound, params).id;
+}
+
+void engine_set_voice_position(Voice voice, float x, float y) {
+    if (!engine_audio) { return; }
+    cs_playing_sound_t sound = { voice };
+    cs_sound_set_position(sound, x, y);
+}
+
 void engine_play_music(Sound *sound, float fade) {
+    if (!engine_audio) { return; }
     cs_music_play(sound, fade);
 }
 
 void engine_stop_music(float fade) {
+    if (!engine_audio) { return; }
     cs_music_stop(fade);
 }
 
 void engine_pause_music() {
+    if (!engine_audio) { return; }
     cs_music_pause();
 }
 
 void engine_resume_music() {
+    if (!engine_audio) { return; }
     cs_music_resume();
 }
 
 void engine_set_music_volume(float volume) {
+    if (!engine_audio) { return; }
     cs_music_set_volume(volume);
 }
 
+void engine_set_music_pitch(float pitch) {
+    if (!engine_audio) { return; }
+    cs_music_set_pitch(pitch);
+}
+
 void engine_set_music_loop(bool loop) {
+    if (!engine_audio) { return; }
     cs_music_set_loop(loop);
 }
 
 void engine_switch_music(Sound *sound, float fade_out, float fade_in) {
+    if (!engine_audio) { return; }
     cs_music_switch_to(sound, fade_out, fade_in);
 }
 
+void engine_seek_music(float seconds) {
+    if (!engine_audio || !s_ctx->music_playing) { return; }
+    cs_music_set_sample_index((uint64_t) (seconds * s_ctx->music_playing->audio->sample_rate));
+}
+
 // Investigate why the other sound functions don't work...
 
 static char font[256][8] = {
@@ -19,20 +19,215 @@ enum {
     ENGINE_SCALE4X = (1 << 2),
     ENGINE_CONSOLE = (1 << 3),
     ENGINE_RESIZABLE = (1 << 4),
-    ENGINE_HIDECURSOR = (1 << 5)
+    ENGINE_HIDECURSOR = (1 << 5),
+    ENGINE_INPUT_THREAD = (1 << 6),
+    ENGINE_HEADLESS = (1 << 7),
+    ENGINE_PRESENT_THREAD = (1 << 8),
+    ENGINE_PRESERVE_FRAME = (1 << 9)   // with PRESENT_THREAD, keep the screen between frames
+};
+
+enum {
+    ENGINE_EVENT_KEY_DOWN = 1,
+    ENGINE_EVENT_KEY_UP,
+    ENGINE_EVENT_MOUSE_DOWN,
+    ENGINE_EVENT_MOUSE_UP,
+    ENGINE_EVENT_MOUSE_MOVE,
+    ENGINE_EVENT_MOUSE_MOTION,
+    ENGINE_EVENT_MOUSE_SCROLL,
+    ENGINE_EVENT_CHAR
+};
+
+enum {
+    ENGINE_BUS_SFX,
+    ENGINE_BUS_MUSIC,
+    ENGINE_BUS_UI,
+    ENGINE_BUS_VOICE
+};
+
+enum {
+    ENGINE_FILTER_NONE,
+    ENGINE_FILTER_LOWPASS,
+    ENGINE_FILTER_HIGHPASS
+};
+
+enum {
+    ENGINE_FALLOFF_LINEAR,
+    ENGINE_FALLOFF_INVERSE,
+    ENGINE_FALLOFF_INVERSE_SQUARE
+};
+
+enum {
+    ENGINE_SOUND_FLOAT,
+    ENGINE_SOUND_INT16,
+    ENGINE_SOUND_ADPCM
 };
 
 typedef union { struct { uint8_t b, g, r, a; }; uint32_t w; } Color;
 typedef struct { int x, y, w, h; } Rect;
-typedef struct { Color *pixels; int w, h; } Image;
+typedef struct { Color *pixels; int w, h, stride; } Image;
 typedef struct { Rect rect; int xadv; } Glyph;
 typedef struct { Image *image; Glyph glyphs[256]; } Font;
 
+// An atlas sprite is an Image whose pixels point into a shared page, with
+// the page width as stride, so every draw function accepts it as is.
+typedef struct {
+    Image image;    // must stay first, handles are pointers to it
+    int page;
+    int group;      // sprites sharing a group are packed next to each other
+    int x, y;
+    int index;
+} AtlasSprite;
+
+typedef struct { int x, y, w; } AtlasSkyline;
+
+typedef struct {
+    Image *image;
+    AtlasSkyline *skyline;
+    int skyline_count, skyline_capacity;
+} AtlasPage;
+
+typedef struct {
+    int page_width, page_height;
+    AtlasPage *pages;
+    int page_count;
+    AtlasSprite **sprites;
+    int sprite_count, sprite_capacity;
+} Atlas;
+
+typedef struct {
+    float *x, *y, *vx, *vy;
+    float *alpha, *fade, *life;
+    Color *color;
+    int count, capacity;
+    float gravity_x, gravity_y;
+    float drag;
+} Emitter;
+
+typedef struct ImageBatch {
+    int count;
+    char **filenames;
+    Image **images;
+    volatile LONG *ready;
+    volatile LONG pending;
+    void (*callback)(struct ImageBatch *batch, int index, void *udata);
+    void *udata;
+} ImageBatch;
+
+// Layer pixels are premultiplied: a layer starts as transparent black and
+// drawing blends into it, which leaves every color scaled by its alpha.
+// Compositing adds them over what lies below, with `opacity` scaling all
+// four channels.
+typedef struct {
+    char name[32];
+    Image *image;
+    int scroll_x, scroll_y;
+    float opacity;
+    bool opaque;
+    bool visible;
+    bool dirty;
+} Layer;
+
+struct cs_audio_source_t;
+typedef struct cs_audio_source_t Sound;
+typedef uint64_t Voice; // A playing sound, 0 if it never started.
+
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t name_offset;
+    uint32_t name_length;
+} PackEntry;
+
+typedef struct {
+    HANDLE file, mapping;
+    const uint8_t *base;
+    uint64_t size;
+    const PackEntry *entries;   // sorted by hash, then name
+    const char *names;
+    int count;
+} Pack;
+
+enum {
+    ENGINE_CAPTURE_PNG,     // numbered .png files
+    ENGINE_CAPTURE_QOI,     // numbered .qoi files
+    ENGINE_CAPTURE_RAW      // one file of raw BGRA frames
+};
+
+// frames in flight; engine_update blocks once they are all taken
+#define ENGINE_CAPTURE_BUFFERS 4
+
+enum {
+    ENGINE_ASSET_FILE,
+    ENGINE_ASSET_IMAGE,
+    ENGINE_ASSET_SOUND
+};
+
+enum {
+    ENGINE_ASSET_QUEUED,
+    ENGINE_ASSET_LOADING,
+    ENGINE_ASSET_READY,
+    ENGINE_ASSET_FAILED,
+    ENGINE_ASSET_CANCELLED
+};
+
+typedef struct Asset {
+    int type;
+    int priority;           // higher loads first
+    volatile LONG state;
+    volatile LONG refs;
+    volatile bool cancelled;
+    const char *filename;
+    void *data;             // file contents for ENGINE_ASSET_FILE
+    int length;
+    Image *image;
+    Sound *sound;
+    void (*callback)(struct Asset *asset, void *udata);
+    void *udata;
+    void *engine;
+    int seq;
+    struct Asset *next;
+} Asset;
+
+typedef struct {
+    int type;
+    int code;       // key, mouse button or character
+    int x, y;       // mouse position, or raw device motion for MOUSE_MOTION
+    float scroll;
+    double time;    // seconds, same clock as the frame timer
+} Event;
+
+// single producer, single consumer; size must be a power of two
+#define ENGINE_EVENT_QUEUE_SIZE 4096
+
+// Events that find the queue full are dropped and counted. The producer also keeps
+// the last transition of every key and button and the last mouse position, so the
+// consumer can put held state right after a drop.
+typedef struct {
+    volatile LONG head, tail;
+    volatile LONG dropped;
+    LONG resynced;                  // consumer side, drops already accounted for
+    volatile uint8_t keys[256];     // last KEY_DOWN or KEY_UP per key, 0 if none
+    volatile uint8_t buttons[16];   // last MOUSE_DOWN or MOUSE_UP per button
+    volatile LONG mouse_x, mouse_y; // last MOUSE_MOVE, valid once `moved` is set
+    volatile bool moved;
+    Event events[ENGINE_EVENT_QUEUE_SIZE];
+} EventQueue;
+
 typedef struct {
     bool should_quit;
     bool hide_cursor;
 
-    int char_buf[32];
+    EventQueue *window_events;
+    EventQueue *thread_events;
+    HANDLE input_thread;
+    DWORD input_thread_id;
+    Event *events;
+    int event_count, event_capacity;
+    int event_cursor, char_cursor;
+    FILE *input_record;
+    FILE *input_replay;
+
     uint8_t key_state[256];
     uint8_t mouse_state[16];
     struct { int x, y; } mouse_pos;
@@ -46,14 +241,50 @@ typedef struct {
     Image *screen;
     Font *font;
 
+    Image *buffers[3];
+    int back_buffer, prev_buffer;
+    bool preserve_frame;
+    volatile LONG present_mailbox;
+    volatile bool present_running;
+    HANDLE present_thread;
+    HANDLE present_event;
+    CRITICAL_SECTION present_lock;
+
+    HANDLE loader_thread;
+    HANDLE loader_semaphore;
+    CRITICAL_SECTION loader_lock;
+    volatile bool loader_running;
+    Asset **load_queue;     // binary heap, highest priority on top
+    int load_count, load_capacity;
+    Asset *installs, *installs_tail;
+    volatile LONG loads_in_flight;
+    int load_seq;
+    double install_budget;
+
+    Image *capture_buffers[ENGINE_CAPTURE_BUFFERS];
+    Image *capture_free[ENGINE_CAPTURE_BUFFERS];
+    int capture_free_count;
+    CRITICAL_SECTION capture_lock;
+    HANDLE capture_available;
+    volatile LONG captures_in_flight;
+    bool capturing;
+    int capture_format;
+    int capture_frame;
+    char *capture_path;
+    FILE *capture_file;
+
+    Layer *layers[16];
+    int layer_count;
+    int layer_cache_depth;
+    Image *layer_cache;
+    Image *layer_screen;
+    Rect layer_clip;
+
     int width, height;
     HWND hwnd;
     HDC hdc;
 } Engine;
 
-struct cs_audio_source_t;
-typedef struct cs_audio_source_t Sound;
-
 #define engine_max(a, b) ((a) > (b) ? (a) : (b))
 #define engine_min(a, b) ((a) < (b) ? (a) : (b))
 #define engine_lengthof(a) (sizeof(a) / sizeof((a)[0]))
@@ -68,7 +299,13 @@ typedef struct cs_audio_source_t Sound;
 Engine *engine_create(int width, int height, const char *title, int flags);
 void engine_destroy(Engine *engine);
 bool engine_update(Engine *engine, double *dt);
+bool engine_record_input(Engine *engine, const char *filename);
+bool engine_replay_input(Engine *engine, const char *filename);
 void *engine_read_file(const char *filename, int *length);
+bool engine_write_pack(const char *filename, const char **files, int count);
+Pack *engine_open_pack(const char *filename);
+void engine_close_pack(Pack *pack);
+const void *engine_pack_find(Pack *pack, const char *name, uint64_t *size);
 const char *engine_read_clipboard(Engine *engine);
 void engine_write_clipboard(Engine *engine, const char *text);
 void engine_open_url(const char *url);
@@ -77,15 +314,38 @@ void engine_show_message_box(const char *text, const char *title);
 Image *engine_create_image(int width, int height);
 Image *engine_load_image_mem(void *data, int length);
 Image *engine_load_image_file(const char *filename);
+Image *engine_load_image_pack(Pack *pack, const char *name);
 Image *engine_screenshot(Engine *engine);
+Image *engine_previous_frame(Engine *engine);
+void engine_save_screenshot(Engine *engine, const char *filename);
+bool engine_start_capture(Engine *engine, const char *path, int format);
+void engine_stop_capture(Engine *engine);
 void engine_save_image(Image *image, const char *filename);
+void engine_save_image_qoi(Image *image, const char *filename);
+void engine_premultiply_image(Image *image);
+void engine_unpremultiply_image(Image *image);
 void engine_destroy_image(Image *image);
 
+// callbacks run on a worker thread as each image finishes
+ImageBatch *engine_load_images(const char **filenames, int count, void (*callback)(ImageBatch *batch, int index, void *udata), void *udata);
+bool engine_image_ready(ImageBatch *batch, int index);
+Image *engine_batch_image(ImageBatch *batch, int index);
+bool engine_batch_done(ImageBatch *batch);
+void engine_wait_batch(ImageBatch *batch);
+void engine_destroy_batch(ImageBatch *batch);
+
+// finished assets are installed and their callbacks run inside engine_update
+Asset *engine_load_async(Engine *engine, const char *filename, int type, int priority, void (*callback)(Asset *asset, void *udata), void *udata);
+void engine_cancel_asset(Asset *asset);
+void engine_release_asset(Asset *asset);
+void engine_set_install_budget(Engine *engine, double seconds);
+
 Font *engine_load_font_mem(void *data, int length);
 Font *engine_load_font_file(const char *filename);
 void engine_destroy_font(Font *font);
 int engine_text_width(Font *font, const char *text);
 
+bool engine_poll_event(Engine *engine, Event *event);
 int engine_get_char(Engine *engine);
 bool engine_key_down(Engine *engine, int key);
 bool engine_key_pressed(Engine *engine, int key);
@@ -96,6 +356,7 @@ bool engine_mouse_down(Engine *engine, int button);
 bool engine_mouse_pressed(Engine *engine, int button);
 bool engine_mouse_released(Engine *engine, int button);
 float engine_mouse_scroll(Engine *engine);
+int engine_dropped_events(Engine *engine);
 
 void engine_clear(Engine *engine, Color color);
 void engine_set_clip(Engine *engine, Rect rect);
@@ -111,22 +372,66 @@ void engine_draw_image3(Engine *engine, Image *img, Rect dst, Rect src, Color mu
 int engine_draw_text(Engine *engine, char *text, int x, int y, Color color);
 int engine_draw_text2(Engine *engine, Font *font, char *text, int x, int y, Color color);
 
+Emitter *engine_create_emitter(int capacity);
+void engine_destroy_emitter(Emitter *emitter);
+bool engine_emit_particle(Emitter *emitter, float x, float y, float vx, float vy, float life, Color color);
+void engine_update_emitter(Emitter *emitter, float dt);
+void engine_draw_emitter(Engine *engine, Emitter *emitter);
+
+Layer *engine_create_layer(Engine *engine, const char *name, int width, int height, bool opaque);
+Layer *engine_get_layer(Engine *engine, const char *name);
+void engine_clear_layer(Layer *layer);
+void engine_begin_layer(Engine *engine, Layer *layer);
+void engine_end_layer(Engine *engine);
+void engine_set_layer_scroll(Layer *layer, int x, int y);
+void engine_set_layer_opacity(Layer *layer, float opacity);
+void engine_set_layer_visible(Layer *layer, bool visible);
+void engine_composite_layers(Engine *engine);
+
+Atlas *engine_create_atlas(int page_width, int page_height);
+void engine_destroy_atlas(Atlas *atlas);
+Image *engine_atlas_add(Atlas *atlas, Image *image, int group);
+void engine_atlas_remove(Atlas *atlas, Image *sprite);
+void engine_repack_atlas(Atlas *atlas);
+
 void engine_set_volume(float volume);
 void engine_set_pan(float pan);
 void engine_set_pause(bool pause);
+void engine_set_max_voices(int count);
+void engine_set_bus_volume(int bus, float volume);
+void engine_set_bus_filter(int bus, int filter, float cutoff, float q);
+void engine_set_bus_reverb(int bus, float room_size, float wet);
+void engine_set_bus_compressor(int bus, float threshold_db, float ratio, float attack_ms, float release_ms);
+void engine_set_limiter(bool enable, float ceiling_db);
+void engine_set_listener(float x, float y);
+void engine_set_sound_format(int format);
 
 Sound *engine_load_sound_mem_wav(void *data, int length);
 Sound *engine_load_sound_mem_ogg(void *data, int length);
 Sound *engine_load_sound_file(const char *filename);
+Sound *engine_load_sound_pack(Pack *pack, const char *name);
+Sound *engine_load_music_mem(void *data, int length);
+Sound *engine_load_music_file(const char *filename);
+Sound *engine_load_music_pack(Pack *pack, const char *name);
 void engine_destroy_sound(Sound *sound);
+void engine_set_sound_priority(Sound *sound, int priority);
+void engine_set_sound_max_instances(Sound *sound, int count);
+void engine_set_sound_bus(Sound *sound, int bus);
+void engine_set_sound_falloff(Sound *sound, int falloff, float min_distance, float max_distance);
 
 void engine_play_sound(Sound *sound);
+Voice engine_play_sound_ex(Sound *sound, float volume, float pan, float pitch);
+void engine_set_voice_pitch(Voice voice, float pitch);
+Voice engine_play_sound_at(Sound *sound, float x, float y, float volume, float pitch);
+void engine_set_voice_position(Voice voice, float x, float y);
 void engine_play_music(Sound *sound, float fade);
 void engine_stop_music(float fade);
 void engine_pause_music();
 void engine_resume_music();
 void engine_set_music_volume(float volume);
+void engine_set_music_pitch(float pitch);
 void engine_set_music_loop(bool loop);
 void engine_switch_music(Sound *sound, float fade_out, float fade_in);
+void engine_seek_music(float seconds);
 
 #endif
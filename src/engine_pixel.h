@@ -0,0 +1,179 @@
+#ifndef ENGINE_PIXEL_H
+#define ENGINE_PIXEL_H
+
+// Pixel conversion kernels used by engine.c. They live apart from it so that
+// image_check.c can test them without windows.h.
+//
+// Pixels are BGRA packed in a uint32_t, like Color. All kernels work on `n`
+// pixels at a time and allow `dst` to alias `src`. The SIMD ones have a _scalar
+// version that they fall back to for the tail and must match exactly.
+
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define ENGINE_SSE2
+#endif
+
+// Swaps red and blue, turning Color (BGRA) into cp_pixel_t (RGBA) and back.
+static void engine_swap_rb_scalar(void *dst, const void *src, int n) {
+    const uint32_t *s = src;
+    uint32_t *d = dst;
+    for (int i = 0; i < n; i++) {
+        uint32_t v = s[i];
+        d[i] = (v & 0xff00ff00) | ((v >> 16) & 0xff) | ((v & 0xff) << 16);
+    }
+}
+
+static void engine_swap_rb(void *dst, const void *src, int n) {
+    const uint32_t *s = src;
+    uint32_t *d = dst;
+    int i = 0;
+#ifdef ENGINE_SSE2
+    __m128i ga_mask = _mm_set1_epi32((int) 0xff00ff00);
+    __m128i rb_mask = _mm_set1_epi32(0x00ff00ff);
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i rb = _mm_and_si128(v, rb_mask);
+        rb = _mm_or_si128(_mm_srli_epi32(rb, 16), _mm_slli_epi32(rb, 16));
+        _mm_storeu_si128((__m128i*) (d + i), _mm_or_si128(_mm_and_si128(v, ga_mask), rb));
+    }
+#endif
+    engine_swap_rb_scalar(d + i, s + i, n - i);
+}
+
+static void engine_copy_opaque_scalar(void *dst, const void *src, int n) {
+    const uint32_t *s = src;
+    uint32_t *d = dst;
+    for (int i = 0; i < n; i++) { d[i] = s[i] | 0xff000000; }
+}
+
+static void engine_copy_opaque(void *dst, const void *src, int n) {
+    const uint32_t *s = src;
+    uint32_t *d = dst;
+    int i = 0;
+#ifdef ENGINE_SSE2
+    __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        _mm_storeu_si128((__m128i*) (d + i), _mm_or_si128(v, alpha));
+    }
+#endif
+    engine_copy_opaque_scalar(d + i, s + i, n - i);
+}
+
+// c * a / 255, rounded
+static inline int engine_mul_div255(int c, int a) {
+    int t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static void engine_premultiply_scalar(void *dst, const void *src, int n) {
+    const uint32_t *s = src;
+    uint32_t *d = dst;
+    for (int i = 0; i < n; i++) {
+        uint32_t v = s[i];
+        int a = v >> 24;
+        int b = engine_mul_div255(v & 0xff, a);
+        int g = engine_mul_div255((v >> 8) & 0xff, a);
+        int r = engine_mul_div255((v >> 16) & 0xff, a);
+        d[i] = (v & 0xff000000) | (uint32_t) r << 16 | (uint32_t) g << 8 | (uint32_t) b;
+    }
+}
+
+// Fully transparent pixels come out as transparent black.
+static void engine_unpremultiply_scalar(void *dst, const void *src, int n) {
+    const uint32_t *s = src;
+    uint32_t *d = dst;
+    for (int i = 0; i < n; i++) {
+        uint32_t v = s[i];
+        int a = v >> 24;
+        uint32_t res = v & 0xff000000;
+        if (a) {
+            for (int shift = 0; shift < 24; shift += 8) {
+                int c = ((v >> shift) & 0xff) * 255 + a / 2;
+                res |= (uint32_t) (c / a < 255 ? c / a : 255) << shift;
+            }
+        }
+        d[i] = res;
+    }
+}
+
+// Adds premultiplied `src` over `dst`, d = s * opacity + d * (255 - sa * opacity), with
+// `opacity` from 0 to 255 and the products rounded like engine_mul_div255. This one has no
+// SIMD version, a layer mostly holds transparent pixels, which are skipped.
+static void engine_composite_premultiplied(void *dst, const void *src, int n, int opacity) {
+    const uint32_t *s = src;
+    uint32_t *d = dst;
+    for (int i = 0; i < n; i++) {
+        uint32_t sv = s[i], dv = d[i], res = 0;
+        if (!sv) { continue; }
+        int ia = 255 - engine_mul_div255(sv >> 24, opacity);
+        for (int shift = 0; shift < 32; shift += 8) {
+            int c = engine_mul_div255((sv >> shift) & 0xff, opacity) + engine_mul_div255((dv >> shift) & 0xff, ia);
+            res |= (uint32_t) (c < 255 ? c : 255) << shift;
+        }
+        d[i] = res;
+    }
+}
+
+#ifdef ENGINE_SSE2
+static inline __m128i engine_premultiply_sse2(__m128i x) {
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xff), 0xff);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, a), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// (c * 255 + a / 2) / a like the scalar loop. The numerator fits a float exactly and the
+// division is correctly rounded, so truncating gives the same integer quotient.
+static inline __m128i engine_unpremultiply_sse2(__m128i x) {
+    __m128i ai = _mm_shuffle_epi32(x, 0xff);
+    __m128i num = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(x, 8), x), _mm_srli_epi32(ai, 1));
+    __m128 a = _mm_cvtepi32_ps(ai);
+    __m128i q = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(num), a));
+    return _mm_and_si128(q, _mm_castps_si128(_mm_cmpgt_ps(a, _mm_setzero_ps())));
+}
+#endif
+
+static void engine_premultiply(void *dst, const void *src, int n) {
+    const uint32_t *s = src;
+    uint32_t *d = dst;
+    int i = 0;
+#ifdef ENGINE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i lo = engine_premultiply_sse2(_mm_unpacklo_epi8(v, zero));
+        __m128i hi = engine_premultiply_sse2(_mm_unpackhi_epi8(v, zero));
+        __m128i res = _mm_andnot_si128(alpha, _mm_packus_epi16(lo, hi));
+        _mm_storeu_si128((__m128i*) (d + i), _mm_or_si128(res, _mm_and_si128(v, alpha)));
+    }
+#endif
+    engine_premultiply_scalar(d + i, s + i, n - i);
+}
+
+static void engine_unpremultiply(void *dst, const void *src, int n) {
+    const uint32_t *s = src;
+    uint32_t *d = dst;
+    int i = 0;
+#ifdef ENGINE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i p0 = engine_unpremultiply_sse2(_mm_unpacklo_epi16(lo, zero));
+        __m128i p1 = engine_unpremultiply_sse2(_mm_unpackhi_epi16(lo, zero));
+        __m128i p2 = engine_unpremultiply_sse2(_mm_unpacklo_epi16(hi, zero));
+        __m128i p3 = engine_unpremultiply_sse2(_mm_unpackhi_epi16(hi, zero));
+        __m128i res = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+        res = _mm_andnot_si128(alpha, res);
+        _mm_storeu_si128((__m128i*) (d + i), _mm_or_si128(res, _mm_and_si128(v, alpha)));
+    }
+#endif
+    engine_unpremultiply_scalar(d + i, s + i, n - i);
+}
+
+#endif
@@ -0,0 +1,258 @@
+// Checks that the SIMD image kernels give exactly what their plain C versions give.
+//
+//   gcc src/image_check.c -o image_check -std=c99 -O2 -lm
+//   image_check
+//
+// Covers the pixel conversions in engine_pixel.h against their _scalar versions, over every
+// (alpha, channel) pair and every length around the vector width, and cute_png with its SSE2
+// paths on and off: the same encoded bytes at every level, the same decoded pixels for every
+// color type, filter and width, and a lossless round trip. Prints each failure and returns 1
+// if there were any. QOI has no SIMD path, so it isn't covered here. Also checks that layers
+// composite as premultiplied color.
+
+#define CUTE_PNG_IMPLEMENTATION
+#include "cute_png.h"
+#include "engine_pixel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures;
+
+static void fail(const char *what, int a, int b) {
+    if (++failures <= 20) { printf("FAIL %s (%d, %d)\n", what, a, b); }
+}
+
+static uint32_t rng = 0x12345678;
+
+static uint32_t next_random(void) {
+    rng = rng * 1664525u + 1013904223u;
+    return rng >> 8;
+}
+
+typedef void (*PixelKernel)(void *dst, const void *src, int n);
+
+// Runs both versions on every length from 0 to 19 at every offset into `src`, out of
+// place and in place, so both the vector loop and every tail length are exercised.
+static void check_kernel(const char *name, PixelKernel simd, PixelKernel scalar, const uint32_t *src, int count) {
+    uint32_t a[32], b[32];
+    for (int start = 0; start + 19 <= count; start += 7) {
+        for (int n = 0; n <= 19; n++) {
+            memset(a, 0xcd, sizeof(a));
+            memset(b, 0xcd, sizeof(b));
+            simd(a, src + start, n);
+            scalar(b, src + start, n);
+            if (memcmp(a, b, sizeof(a))) { fail(name, start, n); return; }
+            memcpy(a, src + start, n * 4);
+            simd(a, a, n);
+            if (memcmp(a, b, n * 4)) { fail(name, start, -n); return; }
+        }
+    }
+}
+
+static void check_pixels(void) {
+    // every (alpha, value) pair, with the value in each channel
+    int count = 256 * 256;
+    uint32_t *src = malloc(count * sizeof(uint32_t));
+    for (int a = 0; a < 256; a++) {
+        for (int c = 0; c < 256; c++) {
+            src[a * 256 + c] = (uint32_t) a << 24 | (uint32_t) c << 16 | (uint32_t) (255 - c) << 8 | (uint32_t) (c ^ 0x5a);
+        }
+    }
+    check_kernel("swap_rb", engine_swap_rb, engine_swap_rb_scalar, src, count);
+    check_kernel("copy_opaque", engine_copy_opaque, engine_copy_opaque_scalar, src, count);
+    check_kernel("premultiply", engine_premultiply, engine_premultiply_scalar, src, count);
+    check_kernel("unpremultiply", engine_unpremultiply, engine_unpremultiply_scalar, src, count);
+
+    // long rows too, in one call
+    uint32_t *a = malloc(count * sizeof(uint32_t));
+    uint32_t *b = malloc(count * sizeof(uint32_t));
+    engine_unpremultiply(a, src, count);
+    engine_unpremultiply_scalar(b, src, count);
+    if (memcmp(a, b, count * 4)) { fail("unpremultiply row", 0, count); }
+    engine_premultiply(a, src, count);
+    engine_premultiply_scalar(b, src, count);
+    if (memcmp(a, b, count * 4)) { fail("premultiply row", 0, count); }
+    free(a);
+    free(b);
+    free(src);
+    printf("pixel kernels checked\n");
+}
+
+// Layers are premultiplied, so 50% white over white must stay white, not darken towards gray.
+static void check_layers(void) {
+    struct { uint32_t dst, src; int opacity; uint32_t want; } cases[] = {
+        { 0xffffffff, 0x80808080, 255, 0xffffffff },  // 50% white over white
+        { 0xff000000, 0x80808080, 255, 0xff808080 },  // 50% white over black
+        { 0xff000000, 0xffffffff, 128, 0xff808080 },  // white at 50% opacity over black
+        { 0x00000000, 0x80808080, 255, 0x80808080 },  // onto a clear layer, unchanged
+        { 0xff204060, 0x00000000, 255, 0xff204060 },  // transparent leaves dst alone
+        { 0xff204060, 0xffffffff, 0, 0xff204060 },    // and so does zero opacity
+    };
+    for (int i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        uint32_t d = cases[i].dst;
+        engine_composite_premultiplied(&d, &cases[i].src, 1, cases[i].opacity);
+        if (d != cases[i].want) { fail("composite", i, (int) d); }
+    }
+    printf("layer compositing checked\n");
+}
+
+// A PNG with the given raw scanlines, each already led by its filter byte, stored in
+// uncompressed deflate blocks so every filter and color type can be fed to the decoder.
+static uint8_t *make_png(int w, int h, int color_type, const uint8_t *raw, int raw_size, int *size) {
+    int blocks = raw_size / 65535 + 1;
+    int idat = 2 + raw_size + blocks * 5 + 4;
+    *size = 8 + 25 + 12 + idat + 12;
+    uint8_t *png = malloc(*size), *p = png;
+    static const uint8_t sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    memcpy(p, sig, 8); p += 8;
+
+    uint8_t ihdr[13] = { w >> 24, w >> 16, w >> 8, w, h >> 24, h >> 16, h >> 8, h, 8, color_type, 0, 0, 0 };
+    uint8_t *chunks[2];
+    int lengths[2] = { 13, idat };
+    const char *names[2] = { "IHDR", "IDAT" };
+    for (int c = 0; c < 2; c++) {
+        int n = lengths[c];
+        p[0] = n >> 24; p[1] = n >> 16; p[2] = n >> 8; p[3] = n;
+        memcpy(p + 4, names[c], 4);
+        chunks[c] = p + 4;
+        p += 8 + n + 4;
+    }
+    memcpy(chunks[0] + 4, ihdr, 13);
+
+    uint8_t *d = chunks[1] + 4;
+    *d++ = 0x78; *d++ = 0x01;
+    for (int i = 0; i < blocks; i++) {
+        int n = raw_size - i * 65535 < 65535 ? raw_size - i * 65535 : 65535;
+        d[0] = i == blocks - 1; d[1] = n; d[2] = n >> 8; d[3] = ~n; d[4] = ~n >> 8;
+        memcpy(d + 5, raw + i * 65535, n);
+        d += 5 + n;
+    }
+    uint32_t s1 = 1, s2 = 0;
+    for (int i = 0; i < raw_size; i++) { s1 = (s1 + raw[i]) % 65521; s2 = (s2 + s1) % 65521; }
+    uint32_t adler = s2 << 16 | s1;
+    d[0] = adler >> 24; d[1] = adler >> 16; d[2] = adler >> 8; d[3] = adler;
+
+    memcpy(p, "\0\0\0\0IEND", 8); p += 12;
+    for (int c = 0; c < 3; c++) {
+        uint8_t *start = c < 2 ? chunks[c] : p - 8;
+        int n = (c < 2 ? lengths[c] : 0) + 4;
+        uint32_t crc = 0xFFFFFFFF;
+        for (int i = 0; i < n; i++) {
+            crc ^= start[i];
+            for (int k = 0; k < 8; k++) { crc = crc >> 1 ^ (0xEDB88320 & -(crc & 1)); }
+        }
+        crc = ~crc;
+        start[n] = crc >> 24; start[n + 1] = crc >> 16; start[n + 2] = crc >> 8; start[n + 3] = crc;
+    }
+    return png;
+}
+
+static void check_decode(void) {
+    static const int color_types[] = { 0, 4, 2, 6 };
+    for (int t = 0; t < 4; t++) {
+        int bpp = t + 1;
+        for (int w = 1; w <= 41; w += w < 20 ? 1 : 7) {
+            int h = 6;
+            int raw_size = (w * bpp + 1) * h;
+            uint8_t *raw = malloc(raw_size);
+            for (int i = 0; i < raw_size; i++) { raw[i] = (uint8_t) next_random(); }
+            // one row per filter, the last one filtered twice in a row
+            for (int y = 0; y < h; y++) { raw[y * (w * bpp + 1)] = (uint8_t) (y < 5 ? y : 4); }
+            int size;
+            uint8_t *png = make_png(w, h, color_types[t], raw, raw_size, &size);
+
+            int bytes = cp_png_decode_size(w, h);
+            uint8_t *a = malloc(bytes), *b = malloc(bytes);
+            for (int bgra = 0; bgra < 2; bgra++) {
+                cp_set_simd(1);
+                int ok_a = cp_load_png_mem_to(png, size, a, bytes, bgra);
+                cp_set_simd(0);
+                int ok_b = cp_load_png_mem_to(png, size, b, bytes, bgra);
+                cp_set_simd(1);
+                if (!ok_a || !ok_b) { fail(cp_error_reason ? cp_error_reason : "decode", color_types[t], w); }
+                else if (memcmp(a, b, w * h * 4)) { fail("decode differs", color_types[t], w * 2 + bgra); }
+            }
+            free(a);
+            free(b);
+            free(png);
+            free(raw);
+        }
+    }
+    printf("png decode checked\n");
+}
+
+// The filter step on its own, since the encoder only keeps a filter's output when it scores
+// best. Small values make the Paeth predictor hit its ties often.
+static void check_filter(void) {
+    uint8_t prev[256], cur[256], a[256], b[256];
+    for (int bpp = 3; bpp <= 4; bpp++) {
+        for (int len = bpp; len <= 200; len += bpp) {
+            for (int range = 4; range <= 256; range *= 8) {
+                for (int i = 0; i < len; i++) {
+                    prev[i] = (uint8_t) (next_random() % range);
+                    cur[i] = (uint8_t) (next_random() % range);
+                }
+                for (int f = 1; f <= 4; f++) {
+                    cp_set_simd(1);
+                    uint32_t sum_a = cp_filter_row(f, cur, prev, bpp, len, a);
+                    cp_set_simd(0);
+                    uint32_t sum_b = cp_filter_row(f, cur, prev, bpp, len, b);
+                    cp_set_simd(1);
+                    if (sum_a != sum_b || memcmp(a, b, len)) { fail("filter differs", f, len); }
+                }
+            }
+        }
+    }
+    printf("png filters checked\n");
+}
+
+static void check_encode(void) {
+    for (int w = 1; w <= 70; w += w < 20 ? 1 : 9) {
+        for (int opaque = 0; opaque < 2; opaque++) {
+            int h = 9;
+            cp_image_t img = cp_load_blank(w, h);
+            for (int i = 0; i < w * h; i++) {
+                // smooth areas and noise, so every filter wins somewhere
+                int x = i % w, y = i / w;
+                uint32_t n = next_random();
+                cp_pixel_t p = { (uint8_t) (x * 5 + y), (uint8_t) (y & 2 ? (int) n : x * y), (uint8_t) (n >> 8), (uint8_t) (opaque ? 255 : x * 11 + (n & 3)) };
+                img.pix[i] = p;
+            }
+            for (int level = 0; level <= 9; level += 3) {
+                cp_set_simd(1);
+                cp_saved_png_t a = cp_save_png_to_memory_level(&img, level);
+                cp_set_simd(0);
+                cp_saved_png_t b = cp_save_png_to_memory_level(&img, level);
+                cp_set_simd(1);
+                if (!a.data || !b.data || a.size != b.size || memcmp(a.data, b.data, a.size)) {
+                    fail("encode differs", w, level);
+                } else {
+                    cp_image_t back = cp_load_png_mem(a.data, a.size);
+                    if (!back.pix || back.w != w || back.h != h || memcmp(back.pix, img.pix, w * h * 4)) {
+                        fail("round trip", w, level);
+                    }
+                    cp_free_png(&back);
+                }
+                CUTE_PNG_FREE(a.data);
+                CUTE_PNG_FREE(b.data);
+            }
+            cp_free_png(&img);
+        }
+    }
+    printf("png encode checked\n");
+}
+
+int main(void) {
+#ifndef ENGINE_SSE2
+    printf("note: built without SSE2, both sides are the plain C code\n");
+#endif
+    check_pixels();
+    check_layers();
+    check_decode();
+    check_filter();
+    check_encode();
+    printf(failures ? "%d FAILURES\n" : "all match\n", failures);
+    return failures ? 1 : 0;
+}